@@ -0,0 +1,142 @@
+-- lcorehttp_bench scenarios
+--
+-- usage: lcorehttp_bench [filter] [scale]
+--   filter - only run scenarios whose name contains this string
+--   scale  - multiplier for iteration counts (default 1)
+
+local corehttp = require "corehttp"
+
+local filter = arg[1]
+local scale = tonumber(arg[2]) or 1
+
+local MB = 1024 * 1024
+
+-- options understood by lua-simple-socket; the loopback server uses a generated self-signed certificate
+local TLS_OPTIONS = { ca_file = bench.ca_file, verify = false }
+
+local scenarios = {
+    { name = "small-get",          path = "/small",                            iterations = 2000 },
+    { name = "small-get-prepared", path = "/small", prepared = true,           iterations = 2000 },
+    { name = "content-length",     path = "/bytes/" .. (16 * MB),              iterations = 20 },
+    { name = "chunked",            path = "/chunked/" .. (16 * MB),            iterations = 20 },
+    { name = "gzip",               path = "/gzip/" .. (16 * MB),               iterations = 20 },
+    { name = "upload",             path = "/upload", method = "POST", body = string.rep("u", 4 * MB), iterations = 50 },
+}
+
+-- client options of the native connector, compared against lua-simple-socket on the http endpoint
+local SOCKET_VARIANTS = {
+    { name = "native",     options = { happy_eyeballs = true } },
+    { name = "nodelay",    options = { tcp_nodelay = true } },
+    { name = "buffers-4m", options = { recv_buffer = 4 * MB, send_buffer = 4 * MB } },
+    { name = "keepalive",  options = { tcp_keepalive = true, tcp_keepalive_idle = 30 } },
+    { name = "quickack",   options = { tcp_quickack = true } },
+    { name = "fast-open",  options = { tcp_fast_open = true } },
+}
+
+local function merge(...)
+    local result = {}
+    for _, t in ipairs({ ... }) do
+        for k, v in pairs(t) do
+            result[k] = v
+        end
+    end
+    return result
+end
+
+local function percentile(sorted, p)
+    if #sorted == 0 then
+        return 0
+    end
+    local idx = math.max(1, math.ceil(#sorted * p))
+    return sorted[idx]
+end
+
+local function run_scenario(protocol, port, scenario, extra_options, client_options)
+    local client = corehttp.new_client(protocol, "127.0.0.1", port, client_options)
+    local options = merge(protocol == "https" and TLS_OPTIONS or {}, extra_options or {})
+    if scenario.body then
+        options.body = scenario.body
+    end
+    local method = scenario.method or "GET"
+    local iterations = math.max(1, math.floor(scenario.iterations * scale))
+    local prepared = scenario.prepared and client:prepare(scenario.path, method, options)
+    local send = function()
+        if prepared then
+            return prepared:send()
+        end
+        return client:request(scenario.path, method, options)
+    end
+
+    local latencies = {}
+    local bytes = 0
+    local sink = function(data)
+        bytes = bytes + #data
+    end
+
+    collectgarbage("collect")
+    local lua_allocs0, heap_allocs0 = bench.allocs()
+    local started = bench.now_us()
+    for i = 1, iterations do
+        local t0 = bench.now_us()
+        local response <close>, _, err = send()
+        if not response then
+            error(string.format("%s %s: request failed: %s", protocol, scenario.name, tostring(err)))
+        end
+        if response:http_status_code() ~= 200 then
+            error(string.format("%s %s: unexpected status %d", protocol, scenario.name, response:http_status_code()))
+        end
+        local headers = response:headers()
+        local transfer_encoding = headers["Transfer-Encoding"]
+        if transfer_encoding and transfer_encoding:lower():find("chunked") then
+            response:read_chunked_content(sink)
+        else
+            response:read_content(sink)
+        end
+        latencies[i] = bench.now_us() - t0
+        if scenario.body then
+            bytes = bytes + #scenario.body
+        end
+    end
+    local elapsed = bench.now_us() - started
+    local lua_allocs1, heap_allocs1 = bench.allocs()
+
+    table.sort(latencies)
+    local seconds = elapsed / 1e6
+    return {
+        requests_per_second = iterations / seconds,
+        mb_per_second = bytes / MB / seconds,
+        p50_us = percentile(latencies, 0.50),
+        p99_us = percentile(latencies, 0.99),
+        lua_allocs_per_request = (lua_allocs1 - lua_allocs0) / iterations,
+        heap_allocs_per_request = (heap_allocs1 - heap_allocs0) / iterations,
+    }
+end
+
+local function report_header()
+    print(string.format("%-8s %-28s %12s %10s %10s %10s %12s %12s", "proto", "scenario", "req/s", "MB/s", "p50 us",
+        "p99 us", "lua alloc/rq", "heap alloc/rq"))
+end
+
+local function report(protocol, name, r)
+    print(string.format("%-8s %-28s %12.1f %10.2f %10d %10d %12.1f %12.1f", protocol, name, r.requests_per_second,
+        r.mb_per_second, r.p50_us, r.p99_us, r.lua_allocs_per_request, r.heap_allocs_per_request))
+end
+
+report_header()
+for _, endpoint in ipairs({ { "http", bench.http_port }, { "https", bench.https_port } }) do
+    local protocol, port = endpoint[1], endpoint[2]
+    for _, scenario in ipairs(scenarios) do
+        if not filter or scenario.name:find(filter, 1, true) then
+            report(protocol, scenario.name, run_scenario(protocol, port, scenario))
+        end
+    end
+end
+
+for _, scenario in ipairs(scenarios) do
+    for _, variant in ipairs(SOCKET_VARIANTS) do
+        local name = scenario.name .. "+" .. variant.name
+        if not filter or name:find(filter, 1, true) then
+            report("http", name, run_scenario("http", bench.http_port, scenario, nil, variant.options))
+        end
+    end
+end
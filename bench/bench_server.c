@@ -0,0 +1,1010 @@
+#include "bench_server.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "mbedtls/base64.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+#include "psa/crypto.h"
+#endif
+
+#define BENCH_IO_BUFFER_SIZE    65536
+#define BENCH_MAX_HEAD_SIZE     8192
+#define BENCH_CHUNK_SIZE        16384
+#define BENCH_SMALL_BODY        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+#define BENCH_GZIP_CACHE_SLOTS  4
+#define BENCH_CERT_PEM_CAPACITY 4096
+#define BENCH_MAX_KEPT_BODY     (1 << 20)
+#define BENCH_WS_GUID           "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+typedef struct bench_conn {
+    int fd;
+    int tls;
+    int port; // of the server that accepted the connection
+    mbedtls_ssl_context* ssl;
+    size_t len;
+    size_t off;
+    uint8_t buf[BENCH_IO_BUFFER_SIZE];
+} bench_conn;
+
+// request body of the routes that answer with it, other bodies are discarded while they are read
+typedef struct bench_body {
+    uint8_t* data;
+    size_t len;
+    size_t capacity;
+} bench_body;
+
+typedef struct bench_gzip_entry {
+    size_t plainLen;
+    size_t len;
+    uint8_t* data;
+} bench_gzip_entry;
+
+static struct {
+    int initialized;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    pthread_mutex_t drbgLock;
+    mbedtls_pk_context key;
+    mbedtls_x509_crt cert;
+    mbedtls_ssl_config conf;
+} bench_tls;
+
+static uint8_t bench_pattern[BENCH_IO_BUFFER_SIZE];
+static bench_gzip_entry bench_gzip_cache[BENCH_GZIP_CACHE_SLOTS];
+static pthread_mutex_t bench_gzip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the DRBG is shared by all server threads, mbedTLS does not lock it for us
+static int
+bench_tls_random(void* ctx, unsigned char* out, size_t len) {
+    pthread_mutex_lock(&bench_tls.drbgLock);
+    int ret = mbedtls_ctr_drbg_random(ctx, out, len);
+    pthread_mutex_unlock(&bench_tls.drbgLock);
+    return ret;
+}
+
+int
+bench_tls_init(const char* caPath) {
+    int ret = 0;
+    unsigned char pem[BENCH_CERT_PEM_CAPACITY];
+    unsigned char serial[] = {0x01};
+    mbedtls_x509write_cert writer;
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if (psa_crypto_init() != PSA_SUCCESS) {
+        return -1;
+    }
+#endif
+    pthread_mutex_init(&bench_tls.drbgLock, NULL);
+    mbedtls_entropy_init(&bench_tls.entropy);
+    mbedtls_ctr_drbg_init(&bench_tls.drbg);
+    mbedtls_pk_init(&bench_tls.key);
+    mbedtls_x509_crt_init(&bench_tls.cert);
+    mbedtls_ssl_config_init(&bench_tls.conf);
+    mbedtls_x509write_crt_init(&writer);
+    bench_tls.initialized = 1;
+
+    if ((ret = mbedtls_ctr_drbg_seed(&bench_tls.drbg, mbedtls_entropy_func, &bench_tls.entropy,
+                                     (const unsigned char*)"lcorehttp_bench", 15))
+        != 0) {
+        goto cleanup;
+    }
+    if ((ret = mbedtls_pk_setup(&bench_tls.key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY))) != 0) {
+        goto cleanup;
+    }
+    if ((ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(bench_tls.key), bench_tls_random,
+                                   &bench_tls.drbg))
+        != 0) {
+        goto cleanup;
+    }
+
+    mbedtls_x509write_crt_set_version(&writer, MBEDTLS_X509_CRT_VERSION_3);
+    mbedtls_x509write_crt_set_md_alg(&writer, MBEDTLS_MD_SHA256);
+    mbedtls_x509write_crt_set_subject_key(&writer, &bench_tls.key);
+    mbedtls_x509write_crt_set_issuer_key(&writer, &bench_tls.key);
+    if ((ret = mbedtls_x509write_crt_set_serial_raw(&writer, serial, sizeof(serial))) != 0
+        || (ret = mbedtls_x509write_crt_set_subject_name(&writer, "CN=127.0.0.1,O=lcorehttp_bench")) != 0
+        || (ret = mbedtls_x509write_crt_set_issuer_name(&writer, "CN=127.0.0.1,O=lcorehttp_bench")) != 0
+        || (ret = mbedtls_x509write_crt_set_validity(&writer, "20240101000000", "20991231235959")) != 0
+        || (ret = mbedtls_x509write_crt_set_basic_constraints(&writer, 1, -1)) != 0) {
+        goto cleanup;
+    }
+    if ((ret = mbedtls_x509write_crt_pem(&writer, pem, sizeof(pem), bench_tls_random, &bench_tls.drbg)) != 0) {
+        goto cleanup;
+    }
+    if ((ret = mbedtls_x509_crt_parse(&bench_tls.cert, pem, strlen((const char*)pem) + 1)) != 0) {
+        goto cleanup;
+    }
+
+    if (caPath != NULL) {
+        FILE* f = fopen(caPath, "wb");
+        if (f == NULL) {
+            ret = -1;
+            goto cleanup;
+        }
+        fwrite(pem, 1, strlen((const char*)pem), f);
+        fclose(f);
+    }
+
+    if ((ret = mbedtls_ssl_config_defaults(&bench_tls.conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT))
+        != 0) {
+        goto cleanup;
+    }
+    mbedtls_ssl_conf_rng(&bench_tls.conf, bench_tls_random, &bench_tls.drbg);
+    ret = mbedtls_ssl_conf_own_cert(&bench_tls.conf, &bench_tls.cert, &bench_tls.key);
+
+cleanup:
+    mbedtls_x509write_crt_free(&writer);
+    return ret;
+}
+
+void
+bench_tls_free(void) {
+    if (!bench_tls.initialized) {
+        return;
+    }
+    mbedtls_ssl_config_free(&bench_tls.conf);
+    mbedtls_x509_crt_free(&bench_tls.cert);
+    mbedtls_pk_free(&bench_tls.key);
+    mbedtls_ctr_drbg_free(&bench_tls.drbg);
+    mbedtls_entropy_free(&bench_tls.entropy);
+    pthread_mutex_destroy(&bench_tls.drbgLock);
+    bench_tls.initialized = 0;
+}
+
+static int
+bench_tls_bio_send(void* ctx, const unsigned char* buf, size_t len) {
+    ssize_t n = send(*(int*)ctx, buf, len, MSG_NOSIGNAL);
+    if (n < 0) {
+        return (errno == EINTR) ? MBEDTLS_ERR_SSL_WANT_WRITE : -1;
+    }
+    return (int)n;
+}
+
+static int
+bench_tls_bio_recv(void* ctx, unsigned char* buf, size_t len) {
+    ssize_t n = recv(*(int*)ctx, buf, len, 0);
+    if (n < 0) {
+        return (errno == EINTR) ? MBEDTLS_ERR_SSL_WANT_READ : -1;
+    }
+    return (int)n;
+}
+
+static ssize_t
+bench_conn_raw_read(bench_conn* conn, uint8_t* dst, size_t cap) {
+    if (conn->ssl == NULL) {
+        return recv(conn->fd, dst, cap, 0);
+    }
+    while (1) {
+        int n = mbedtls_ssl_read(conn->ssl, dst, cap);
+        if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE
+            || n == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+            continue;
+        }
+        if (n == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            return 0;
+        }
+        return n;
+    }
+}
+
+static int
+bench_conn_write(bench_conn* conn, const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = 0;
+        if (conn->ssl == NULL) {
+            n = send(conn->fd, p, len, MSG_NOSIGNAL);
+        } else {
+            n = mbedtls_ssl_write(conn->ssl, p, len);
+            if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                continue;
+            }
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// fills the connection buffer, compacting consumed bytes first
+static int
+bench_conn_fill(bench_conn* conn) {
+    if (conn->off > 0) {
+        memmove(conn->buf, conn->buf + conn->off, conn->len - conn->off);
+        conn->len -= conn->off;
+        conn->off = 0;
+    }
+    if (conn->len == sizeof(conn->buf)) {
+        return -1;
+    }
+    ssize_t n = bench_conn_raw_read(conn, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+    if (n <= 0) {
+        return -1;
+    }
+    conn->len += (size_t)n;
+    return 0;
+}
+
+// returns a NUL terminated line (without CRLF) or NULL on EOF/overflow
+static char*
+bench_conn_read_line(bench_conn* conn) {
+    while (1) {
+        uint8_t* start = conn->buf + conn->off;
+        uint8_t* lf = memchr(start, '\n', conn->len - conn->off);
+        if (lf != NULL) {
+            size_t lineLen = (size_t)(lf - start);
+            if (lineLen > 0 && start[lineLen - 1] == '\r') {
+                start[lineLen - 1] = 0;
+            }
+            *lf = 0;
+            conn->off += lineLen + 1;
+            return (char*)start;
+        }
+        if (conn->len - conn->off >= BENCH_MAX_HEAD_SIZE || bench_conn_fill(conn) != 0) {
+            return NULL;
+        }
+    }
+}
+
+static int
+bench_body_append(bench_body* body, const uint8_t* data, size_t len) {
+    if (body->len + len > BENCH_MAX_KEPT_BODY) {
+        return -1;
+    }
+    if (body->len + len > body->capacity) {
+        size_t capacity = (body->capacity > 0) ? body->capacity : 4096;
+        while (capacity < body->len + len) {
+            capacity *= 2;
+        }
+        uint8_t* grown = realloc(body->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        body->data = grown;
+        body->capacity = capacity;
+    }
+    memcpy(body->data + body->len, data, len);
+    body->len += len;
+    return 0;
+}
+
+// reads len body bytes, appending them to kept when given
+static int
+bench_conn_discard(bench_conn* conn, size_t len, bench_body* kept) {
+    while (len > 0) {
+        size_t available = conn->len - conn->off;
+        if (available == 0) {
+            conn->off = conn->len = 0;
+            if (bench_conn_fill(conn) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t take = (available < len) ? available : len;
+        if (kept != NULL && bench_body_append(kept, conn->buf + conn->off, take) != 0) {
+            return -1;
+        }
+        conn->off += take;
+        len -= take;
+    }
+    return 0;
+}
+
+static int
+bench_conn_discard_chunked(bench_conn* conn, size_t* total, bench_body* kept) {
+    while (1) {
+        char* line = bench_conn_read_line(conn);
+        if (line == NULL) {
+            return -1;
+        }
+        size_t size = strtoul(line, NULL, 16);
+        if (size == 0) {
+            // trailers until the empty line
+            while ((line = bench_conn_read_line(conn)) != NULL && line[0] != 0) {
+            }
+            return (line == NULL) ? -1 : 0;
+        }
+        if (bench_conn_discard(conn, size, kept) != 0 || bench_conn_discard(conn, 2, NULL) != 0) {
+            return -1;
+        }
+        *total += size;
+    }
+}
+
+static int
+bench_conn_read_exact(bench_conn* conn, uint8_t* dst, size_t len) {
+    while (len > 0) {
+        size_t available = conn->len - conn->off;
+        if (available == 0) {
+            conn->off = conn->len = 0;
+            if (bench_conn_fill(conn) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t take = (available < len) ? available : len;
+        memcpy(dst, conn->buf + conn->off, take);
+        conn->off += take;
+        dst += take;
+        len -= take;
+    }
+    return 0;
+}
+
+// raw inflate (windowBits < 0), zlib (15) or gzip (31) data into out, returns 1 when the stream ended, -1 on errors
+static int
+bench_inflate(const uint8_t* data, size_t len, int windowBits, bench_body* out) {
+    z_stream strm = {0};
+    if (inflateInit2(&strm, windowBits) != Z_OK) {
+        return -1;
+    }
+    uint8_t chunk[4096];
+    int ret = 0;
+    strm.next_in = (Bytef*)data;
+    strm.avail_in = (uInt)len;
+    do {
+        strm.next_out = chunk;
+        strm.avail_out = sizeof(chunk);
+        int zRet = inflate(&strm, Z_SYNC_FLUSH);
+        size_t have = sizeof(chunk) - strm.avail_out;
+        if ((zRet != Z_OK && zRet != Z_BUF_ERROR && zRet != Z_STREAM_END)
+            || (have > 0 && bench_body_append(out, chunk, have) != 0)) {
+            ret = -1;
+            break;
+        }
+        if (zRet == Z_STREAM_END) {
+            ret = strm.avail_in == 0 ? 1 : -1; // nothing may follow the end of the stream
+            break;
+        }
+    } while (strm.avail_out == 0);
+    inflateEnd(&strm);
+    return ret;
+}
+
+static const bench_gzip_entry*
+bench_gzip_get(size_t plainLen) {
+    pthread_mutex_lock(&bench_gzip_lock);
+    for (int i = 0; i < BENCH_GZIP_CACHE_SLOTS; i++) {
+        if (bench_gzip_cache[i].data != NULL && bench_gzip_cache[i].plainLen == plainLen) {
+            pthread_mutex_unlock(&bench_gzip_lock);
+            return &bench_gzip_cache[i];
+        }
+    }
+
+    bench_gzip_entry* slot = &bench_gzip_cache[plainLen % BENCH_GZIP_CACHE_SLOTS];
+    free(slot->data);
+    memset(slot, 0, sizeof(*slot));
+
+    z_stream strm = {0};
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        pthread_mutex_unlock(&bench_gzip_lock);
+        return NULL;
+    }
+    size_t capacity = deflateBound(&strm, plainLen);
+    slot->data = malloc(capacity);
+    strm.next_out = slot->data;
+    strm.avail_out = capacity;
+    size_t remaining = plainLen;
+    int zRet = Z_OK;
+    while (zRet != Z_STREAM_END) {
+        size_t take = (remaining < sizeof(bench_pattern)) ? remaining : sizeof(bench_pattern);
+        strm.next_in = bench_pattern;
+        strm.avail_in = take;
+        remaining -= take;
+        zRet = deflate(&strm, remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if (zRet == Z_STREAM_ERROR) {
+            break;
+        }
+    }
+    slot->len = capacity - strm.avail_out;
+    slot->plainLen = plainLen;
+    deflateEnd(&strm);
+    pthread_mutex_unlock(&bench_gzip_lock);
+    return (zRet == Z_STREAM_END) ? slot : NULL;
+}
+
+// reason phrase of the statuses the routes answer with, empty for any other
+static const char*
+bench_reason(int status) {
+    switch (status) {
+        case 101: return "Switching Protocols";
+        case 200: return "OK";
+        case 302: return "Found";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 500: return "Internal Server Error";
+        default: return "";
+    }
+}
+
+static int
+bench_send_head(bench_conn* conn, int status, const char* extraHeaders, long long contentLength, int keepAlive) {
+    char head[512];
+    int len = 0;
+    if (contentLength >= 0) {
+        len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 %d %s\r\nServer: lcorehttp_bench\r\nContent-Length: %lld\r\nConnection: %s\r\n%s\r\n",
+                       status, bench_reason(status), contentLength, keepAlive ? "keep-alive" : "close", extraHeaders);
+    } else {
+        len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 %d %s\r\nServer: lcorehttp_bench\r\nTransfer-Encoding: chunked\r\nConnection: "
+                       "%s\r\n%s\r\n",
+                       status, bench_reason(status), keepAlive ? "keep-alive" : "close", extraHeaders);
+    }
+    return bench_conn_write(conn, head, (size_t)len);
+}
+
+static int
+bench_send_pattern(bench_conn* conn, size_t len) {
+    while (len > 0) {
+        size_t take = (len < sizeof(bench_pattern)) ? len : sizeof(bench_pattern);
+        if (bench_conn_write(conn, bench_pattern, take) != 0) {
+            return -1;
+        }
+        len -= take;
+    }
+    return 0;
+}
+
+static int
+bench_send_chunked_pattern(bench_conn* conn, size_t len) {
+    char header[32];
+    while (len > 0) {
+        size_t take = (len < BENCH_CHUNK_SIZE) ? len : BENCH_CHUNK_SIZE;
+        int headerLen = snprintf(header, sizeof(header), "%zx\r\n", take);
+        if (bench_conn_write(conn, header, (size_t)headerLen) != 0 || bench_conn_write(conn, bench_pattern, take) != 0
+            || bench_conn_write(conn, "\r\n", 2) != 0) {
+            return -1;
+        }
+        len -= take;
+    }
+    return bench_conn_write(conn, "0\r\n\r\n", 5);
+}
+
+// sends data as chunks of at most piece bytes (0: one chunk), pausing between them so that every chunk arrives in
+// a read of its own
+static int
+bench_send_pieces(bench_conn* conn, const uint8_t* data, size_t len, size_t piece) {
+    char header[32];
+    while (len > 0) {
+        size_t take = (piece > 0 && piece < len) ? piece : len;
+        int headerLen = snprintf(header, sizeof(header), "%zx\r\n", take);
+        if (bench_conn_write(conn, header, (size_t)headerLen) != 0 || bench_conn_write(conn, data, take) != 0
+            || bench_conn_write(conn, "\r\n", 2) != 0) {
+            return -1;
+        }
+        data += take;
+        len -= take;
+        if (len > 0) {
+            struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return bench_conn_write(conn, "0\r\n\r\n", 5);
+}
+
+// appends a line with its CRLF to the head copy, lines that do not fit are dropped
+static void
+bench_head_append(char* head, size_t* headLen, const char* line) {
+    size_t len = strlen(line);
+    if (*headLen + len + 2 <= BENCH_MAX_HEAD_SIZE) {
+        memcpy(head + *headLen, line, len);
+        memcpy(head + *headLen + len, "\r\n", 2);
+        *headLen += len + 2;
+    }
+}
+
+static int
+bench_ws_send(bench_conn* conn, int opcode, int fin, int rsv1, const uint8_t* payload, size_t len) {
+    uint8_t header[10];
+    size_t headerLen = 2;
+    header[0] = (uint8_t)((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+    if (len < 126) {
+        header[1] = (uint8_t)len;
+    } else if (len <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = (uint8_t)(len >> 8);
+        header[3] = (uint8_t)len;
+        headerLen = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+        }
+        headerLen = 10;
+    }
+    if (bench_conn_write(conn, header, headerLen) != 0 || (len > 0 && bench_conn_write(conn, payload, len) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads a masked client frame, data frames are appended to message and control frames replace control
+static int
+bench_ws_read_frame(bench_conn* conn, uint8_t* first, bench_body* message, bench_body* control) {
+    uint8_t header[14];
+    if (bench_conn_read_exact(conn, header, 2) != 0 || (header[1] & 0x80) == 0) {
+        return -1; // client frames are always masked
+    }
+    uint64_t len = header[1] & 0x7F;
+    size_t extended = (len == 126) ? 2 : (len == 127) ? 8 : 0;
+    if (bench_conn_read_exact(conn, header + 2, extended + 4) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < extended; i++) {
+        len = (i == 0 ? 0 : len << 8) | header[2 + i];
+    }
+    const uint8_t* key = header + 2 + extended;
+    int opcode = header[0] & 0x0F;
+    bench_body* payload = (opcode >= 0x8) ? control : message;
+    if (opcode >= 0x8 || opcode == 0x1 || opcode == 0x2) {
+        payload->len = 0;
+    }
+    size_t start = payload->len;
+    if (len > BENCH_MAX_KEPT_BODY || bench_conn_discard(conn, (size_t)len, payload) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        payload->data[start + i] ^= key[i & 3];
+    }
+    *first = header[0];
+    return 0;
+}
+
+// sends a message in frames of at most fragment bytes (0: one frame) and pings between the first two frames
+static int
+bench_ws_send_message(bench_conn* conn, int opcode, int rsv1, const uint8_t* data, size_t len, size_t fragment) {
+    size_t offset = 0;
+    do {
+        size_t take = (fragment > 0 && len - offset > fragment) ? fragment : len - offset;
+        int fin = offset + take == len;
+        if (bench_ws_send(conn, offset == 0 ? opcode : 0x0, fin, offset == 0 && rsv1, data + offset, take) != 0
+            || (offset == 0 && !fin && bench_ws_send(conn, 0x9, 1, 0, (const uint8_t*)"mid", 3) != 0)) {
+            return -1;
+        }
+        offset += take;
+    } while (offset < len);
+    return 0;
+}
+
+// the echo of a compressed message is compressed again, each message with a fresh context
+static int
+bench_ws_deflate(const bench_body* in, bench_body* out) {
+    z_stream strm = {0};
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    uint8_t chunk[4096];
+    int ret = 0;
+    strm.next_in = in->data;
+    strm.avail_in = (uInt)in->len;
+    do {
+        strm.next_out = chunk;
+        strm.avail_out = sizeof(chunk);
+        size_t have = 0;
+        if (deflate(&strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR
+            || ((have = sizeof(chunk) - strm.avail_out) > 0 && bench_body_append(out, chunk, have) != 0)) {
+            ret = -1;
+            break;
+        }
+    } while (strm.avail_out == 0);
+    deflateEnd(&strm);
+    if (ret == 0 && out->len >= 4) {
+        out->len -= 4; // the sync flush ends with 00 00 ff ff, the receiver appends it again
+    }
+    return ret;
+}
+
+static int
+bench_ws_close(bench_conn* conn, int code, const char* reason) {
+    uint8_t payload[125];
+    size_t reasonLen = strlen(reason);
+    if (reasonLen > sizeof(payload) - 2) {
+        reasonLen = sizeof(payload) - 2;
+    }
+    payload[0] = (uint8_t)(code >> 8);
+    payload[1] = (uint8_t)code;
+    memcpy(payload + 2, reason, reasonLen);
+    return bench_ws_send(conn, 0x8, 1, 0, payload, 2 + reasonLen);
+}
+
+/*
+ * Echoes every message with its opcode until the client closes. Binary messages starting with a command drive the
+ * server instead:
+ *  "!ping <data>"          - pings with data, answers "pong <data of the pong>" once the pong arrived
+ *  "!close <code> <reason>" - closes with code and reason
+ *  "!text <bytes>"          - sends bytes as a text message without checking them
+ */
+static int
+bench_ws_echo(bench_conn* conn, size_t fragment) {
+    bench_body message = {0};
+    bench_body control = {0};
+    bench_body plain = {0};
+    bench_body deflated = {0};
+    static const uint8_t deflateTail[4] = {0x00, 0x00, 0xFF, 0xFF};
+    int ret = 0;
+    int compressed = 0;
+    int opcode = 0;
+    int closeSent = 0;
+    while (ret == 0) {
+        uint8_t first = 0;
+        if (bench_ws_read_frame(conn, &first, &message, &control) != 0) {
+            ret = -1;
+            break;
+        }
+        int frameOpcode = first & 0x0F;
+        if (frameOpcode == 0x8) { // echo the status code, without reason, unless this answers a "!close"
+            ret = closeSent ? 0 : bench_ws_send(conn, 0x8, 1, 0, control.data, control.len >= 2 ? 2 : 0);
+            break;
+        }
+        if (frameOpcode == 0x9) {
+            ret = bench_ws_send(conn, 0xA, 1, 0, control.data, control.len);
+            continue;
+        }
+        if (frameOpcode == 0xA) {
+            if (control.len != 3 || memcmp(control.data, "mid", 3) != 0) { // answer to a "!ping"
+                plain.len = 0;
+                ret = bench_body_append(&plain, (const uint8_t*)"pong ", 5)
+                      || (control.len > 0 && bench_body_append(&plain, control.data, control.len) != 0)
+                      || bench_ws_send_message(conn, 0x1, 0, plain.data, plain.len, 0);
+            }
+            continue;
+        }
+        if (frameOpcode != 0x0) {
+            opcode = frameOpcode;
+            compressed = (first & 0x40) != 0;
+        }
+        if ((first & 0x80) == 0) {
+            continue; // more fragments follow
+        }
+
+        plain.len = 0;
+        if (compressed) {
+            if (bench_body_append(&message, deflateTail, sizeof(deflateTail)) != 0
+                || bench_inflate(message.data, message.len, -15, &plain) < 0) {
+                ret = -1;
+                break;
+            }
+        } else if (message.len > 0 && bench_body_append(&plain, message.data, message.len) != 0) {
+            ret = -1;
+            break;
+        }
+        const char* text = (const char*)plain.data;
+        if (opcode == 0x2 && plain.len >= 6 && memcmp(text, "!ping ", 6) == 0) {
+            ret = bench_ws_send(conn, 0x9, 1, 0, plain.data + 6, plain.len - 6 > 125 ? 125 : plain.len - 6);
+        } else if (opcode == 0x2 && plain.len >= 7 && memcmp(text, "!close ", 7) == 0) {
+            char command[160];
+            snprintf(command, sizeof(command), "%.*s", (int)plain.len, text);
+            char* reason = NULL;
+            int code = (int)strtol(command + 7, &reason, 10);
+            ret = bench_ws_close(conn, code, *reason == ' ' ? reason + 1 : reason);
+            closeSent = 1;
+        } else if (opcode == 0x2 && plain.len >= 6 && memcmp(text, "!text ", 6) == 0) {
+            ret = bench_ws_send_message(conn, 0x1, 0, plain.data + 6, plain.len - 6, 0);
+        } else if (compressed) {
+            deflated.len = 0;
+            ret = bench_ws_deflate(&plain, &deflated)
+                  || bench_ws_send_message(conn, opcode, 1, deflated.data, deflated.len, fragment);
+        } else {
+            ret = bench_ws_send_message(conn, opcode, 0, plain.data, plain.len, fragment);
+        }
+    }
+    free(message.data);
+    free(control.data);
+    free(plain.data);
+    free(deflated.data);
+    return ret;
+}
+
+// 101 response for the key of the upgrade request, permessage-deflate without context takeover when offered
+static int
+bench_ws_accept(bench_conn* conn, const char* key, const char* protocol, int deflate) {
+    char keyed[128];
+    unsigned char digest[20];
+    unsigned char accept[32];
+    size_t acceptLen = 0;
+    int keyedLen = snprintf(keyed, sizeof(keyed), "%s%s", key, BENCH_WS_GUID);
+    if (keyedLen < 0 || (size_t)keyedLen >= sizeof(keyed)
+        || mbedtls_sha1((const unsigned char*)keyed, (size_t)keyedLen, digest) != 0
+        || mbedtls_base64_encode(accept, sizeof(accept), &acceptLen, digest, sizeof(digest)) != 0) {
+        return -1;
+    }
+    char head[512];
+    int headLen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 101 %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: %.*s\r\n%s%s%s%s\r\n",
+                           bench_reason(101), (int)acceptLen, accept,
+                           protocol[0] != 0 ? "Sec-WebSocket-Protocol: " : "", protocol, protocol[0] != 0 ? "\r\n" : "",
+                           deflate ? "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                                     "client_no_context_takeover\r\n"
+                                   : "");
+    return bench_conn_write(conn, head, (size_t)headLen);
+}
+
+// serves one request, returns 1 to keep the connection open
+static int
+bench_serve_request(bench_conn* conn) {
+    char method[16] = {0};
+    char path[256] = {0};
+    char head[BENCH_MAX_HEAD_SIZE]; // request line and fields as received, for /echo/head
+    size_t headLen = 0;
+    char* line = bench_conn_read_line(conn);
+    if (line == NULL || sscanf(line, "%15s %255s", method, path) != 2) {
+        return 0;
+    }
+    bench_head_append(head, &headLen, line);
+
+    long long contentLength = -1;
+    int chunked = 0;
+    int keepAlive = 1;
+    char wsKey[64] = {0};
+    char wsProtocol[64] = {0};
+    int wsDeflate = 0;
+    int encodingBits = 0; // zlib windowBits of the Content-Encoding, 0 for identity
+    while ((line = bench_conn_read_line(conn)) != NULL && line[0] != 0) {
+        bench_head_append(head, &headLen, line);
+        if (strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+            snprintf(wsKey, sizeof(wsKey), "%s", line + 18 + strspn(line + 18, " "));
+        } else if (strncasecmp(line, "Sec-WebSocket-Protocol:", 23) == 0) { // the first one offered is chosen
+            const char* offered = line + 23 + strspn(line + 23, " ");
+            snprintf(wsProtocol, sizeof(wsProtocol), "%.*s", (int)strcspn(offered, ", "), offered);
+        } else if (strncasecmp(line, "Sec-WebSocket-Extensions:", 25) == 0) {
+            wsDeflate = strstr(line + 25, "permessage-deflate") != NULL;
+        } else if (strncasecmp(line, "Content-Encoding:", 17) == 0) {
+            encodingBits = strstr(line + 17, "gzip") != NULL ? 31 : strstr(line + 17, "deflate") != NULL ? 15 : 0;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            contentLength = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line + 18, "chunked") != NULL) {
+            chunked = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close") != NULL) {
+            keepAlive = 0;
+        }
+    }
+    if (line == NULL) {
+        return 0;
+    }
+
+    size_t received = 0;
+    bench_body kept = {0};
+    bench_body* keep = (strncmp(path, "/echo/body/", 11) == 0) ? &kept : NULL;
+    if (chunked) {
+        if (bench_conn_discard_chunked(conn, &received, keep) != 0) {
+            free(kept.data);
+            return 0;
+        }
+    } else if (contentLength > 0) {
+        if (bench_conn_discard(conn, (size_t)contentLength, keep) != 0) {
+            free(kept.data);
+            return 0;
+        }
+        received = (size_t)contentLength;
+    }
+
+    int ret = 0;
+    if (strcmp(path, "/small") == 0) {
+        ret = bench_send_head(conn, 200, "", sizeof(BENCH_SMALL_BODY) - 1, keepAlive)
+              || bench_conn_write(conn, BENCH_SMALL_BODY, sizeof(BENCH_SMALL_BODY) - 1);
+    } else if (strncmp(path, "/bytes/", 7) == 0) {
+        size_t len = strtoull(path + 7, NULL, 10);
+        ret = bench_send_head(conn, 200, "", (long long)len, keepAlive) || bench_send_pattern(conn, len);
+    } else if (strncmp(path, "/chunked/", 9) == 0) {
+        size_t len = strtoull(path + 9, NULL, 10);
+        ret = bench_send_head(conn, 200, "", -1, keepAlive) || bench_send_chunked_pattern(conn, len);
+    } else if (strncmp(path, "/gzip/", 6) == 0) {
+        const bench_gzip_entry* entry = bench_gzip_get(strtoull(path + 6, NULL, 10));
+        if (entry == NULL) {
+            ret = bench_send_head(conn, 500, "", 0, 0);
+            keepAlive = 0;
+        } else {
+            ret = bench_send_head(conn, 200, "Content-Encoding: gzip\r\n", (long long)entry->len, keepAlive)
+                  || bench_conn_write(conn, entry->data, entry->len);
+        }
+    } else if (strncmp(path, "/redirect/", 10) == 0) {
+        // /redirect/<port>/<path>: 302 to the same path on another loopback port, a cross-origin hop
+        char* rest = NULL;
+        unsigned long port = strtoul(path + 10, &rest, 10);
+        char location[320];
+        snprintf(location, sizeof(location), "Location: http://127.0.0.1:%lu%s\r\n", port, rest);
+        ret = bench_send_head(conn, 302, location, 0, keepAlive);
+    } else if (strncmp(path, "/delay/", 7) == 0) {
+        char* rest = NULL;
+        long port = strtol(path + 7, &rest, 10);
+        long ms = (*rest == '/') ? strtol(rest + 1, NULL, 10) : 0;
+        if (port == conn->port && ms > 0) { // only the named server is slow, for hedging against another one
+            struct timespec delay = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+            nanosleep(&delay, NULL);
+        }
+        char servedBy[32];
+        snprintf(servedBy, sizeof(servedBy), "X-Served-By: %d\r\n", conn->port);
+        ret = bench_send_head(conn, 200, servedBy, sizeof(BENCH_SMALL_BODY) - 1, keepAlive)
+              || bench_conn_write(conn, BENCH_SMALL_BODY, sizeof(BENCH_SMALL_BODY) - 1);
+    } else if (strcmp(path, "/echo/head") == 0) {
+        ret = bench_send_head(conn, 200, "", (long long)headLen, keepAlive) || bench_conn_write(conn, head, headLen);
+    } else if (strncmp(path, "/echo/body/", 11) == 0) {
+        size_t piece = strtoull(path + 11, NULL, 10);
+        bench_body decoded = {0};
+        char extra[64];
+        snprintf(extra, sizeof(extra), "X-Received-Length: %zu\r\n", received);
+        const bench_body* echoed = (encodingBits != 0) ? &decoded : &kept;
+        if (encodingBits != 0 && bench_inflate(kept.data, kept.len, encodingBits, &decoded) != 1) {
+            ret = bench_send_head(conn, 400, extra, 0, keepAlive);
+        } else {
+            ret = bench_send_head(conn, 200, extra, -1, keepAlive)
+                  || bench_send_pieces(conn, echoed->data, echoed->len, piece);
+        }
+        free(decoded.data);
+    } else if (strncmp(path, "/ws/echo/", 9) == 0) {
+        if (wsKey[0] == 0) {
+            ret = bench_send_head(conn, 400, "", 0, keepAlive);
+        } else {
+            ret = bench_ws_accept(conn, wsKey, wsProtocol, wsDeflate)
+                  || bench_ws_echo(conn, strtoull(path + 9, NULL, 10));
+            keepAlive = 0;
+        }
+    } else if (strcmp(path, "/upload") == 0) {
+        char body[32];
+        int bodyLen = snprintf(body, sizeof(body), "%zu", received);
+        ret = bench_send_head(conn, 200, "", bodyLen, keepAlive) || bench_conn_write(conn, body, (size_t)bodyLen);
+    } else {
+        ret = bench_send_head(conn, 404, "", 0, keepAlive);
+    }
+    free(kept.data);
+    return (ret == 0) && keepAlive;
+}
+
+static void*
+bench_connection_thread(void* arg) {
+    bench_conn* conn = arg;
+    mbedtls_ssl_context ssl;
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (conn->tls) {
+        mbedtls_ssl_init(&ssl);
+        conn->ssl = &ssl;
+        if (mbedtls_ssl_setup(&ssl, &bench_tls.conf) != 0) {
+            goto done;
+        }
+        mbedtls_ssl_set_bio(&ssl, &conn->fd, bench_tls_bio_send, bench_tls_bio_recv, NULL);
+        int ret = 0;
+        while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+            if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+                goto done;
+            }
+        }
+    }
+
+    while (bench_serve_request(conn)) {
+    }
+
+    if (conn->ssl != NULL) {
+        mbedtls_ssl_close_notify(conn->ssl);
+    }
+done:
+    if (conn->ssl != NULL) {
+        mbedtls_ssl_free(&ssl);
+    }
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static void*
+bench_accept_thread(void* arg) {
+    bench_server* server = arg;
+    while (server->running) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        bench_conn* conn = calloc(1, sizeof(bench_conn));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->tls = server->tls;
+        conn->port = server->port;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bench_connection_thread, conn) != 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+int
+bench_server_start(bench_server* server, int tls) {
+    return bench_server_start_on(server, tls, AF_INET, 0);
+}
+
+int
+bench_server_start_on(bench_server* server, int tls, int family, int port) {
+    struct sockaddr_storage addr = {0};
+    socklen_t addrLen = family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    int one = 1;
+
+    for (size_t i = 0; i < sizeof(bench_pattern); i++) {
+        bench_pattern[i] = (uint8_t)('a' + (i % 26));
+    }
+
+    memset(server, 0, sizeof(*server));
+    server->tls = tls;
+    server->listen_fd = socket(family, SOCK_STREAM, 0);
+    if (server->listen_fd < 0) {
+        return -1;
+    }
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (family == AF_INET6) { // ::1 and 127.0.0.1 may be served by different servers on the same port
+        setsockopt(server->listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    }
+#ifdef TCP_FASTOPEN
+    // lets the tcp_fast_open client scenarios put the request into the SYN
+    int fastOpenQueue = 128;
+    setsockopt(server->listen_fd, IPPROTO_TCP, TCP_FASTOPEN, &fastOpenQueue, sizeof(fastOpenQueue));
+#endif
+
+    if (family == AF_INET6) {
+        struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_loopback;
+        addr6->sin6_port = htons((uint16_t)port);
+    } else {
+        struct sockaddr_in* addr4 = (struct sockaddr_in*)&addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr4->sin_port = htons((uint16_t)port);
+    }
+    if (bind(server->listen_fd, (struct sockaddr*)&addr, addrLen) != 0 || listen(server->listen_fd, 128) != 0
+        || getsockname(server->listen_fd, (struct sockaddr*)&addr, &addrLen) != 0) {
+        close(server->listen_fd);
+        return -1;
+    }
+    server->port = ntohs(family == AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port
+                                            : ((struct sockaddr_in*)&addr)->sin_port);
+    server->running = 1;
+    if (pthread_create(&server->thread, NULL, bench_accept_thread, server) != 0) {
+        close(server->listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void
+bench_server_stop(bench_server* server) {
+    if (!server->running) {
+        return;
+    }
+    server->running = 0;
+    shutdown(server->listen_fd, SHUT_RDWR);
+    close(server->listen_fd);
+    pthread_join(server->thread, NULL);
+}
@@ -0,0 +1,48 @@
+#ifndef LCOREHTTP_BENCH_SERVER_H
+#define LCOREHTTP_BENCH_SERVER_H
+
+#include <pthread.h>
+
+typedef struct bench_server {
+    int listen_fd;
+    int port;
+    int tls;
+    volatile int running;
+    pthread_t thread;
+} bench_server;
+
+/**
+ * @brief Generate the self-signed certificate used by TLS servers and write it to caPath (PEM).
+ *
+ * @return 0 on success, mbedTLS error code otherwise.
+ */
+int bench_tls_init(const char* caPath);
+void bench_tls_free(void);
+
+/**
+ * @brief Start a loopback HTTP(S) server on 127.0.0.1 with an ephemeral port.
+ *
+ * Routes:
+ *  GET  /small          - 64 byte body with Content-Length
+ *  GET  /bytes/<n>      - n byte body with Content-Length
+ *  GET  /chunked/<n>    - n byte body with Transfer-Encoding: chunked
+ *  GET  /gzip/<n>       - gzip compressed n byte body with Content-Length
+ *  GET  /redirect/<port>/<path> - 302 to http://127.0.0.1:<port>/<path>, another loopback server
+ *  POST /upload         - consumes the request body (Content-Length or chunked) and replies with its size
+ *  ANY  /echo/head      - replies with the request line and fields as received
+ *  POST /echo/body/<n>  - replies with the request body (up to 1MB), chunked into pieces of at most n bytes
+ *                         (0: one piece) that are sent a millisecond apart; a gzip or deflate Content-Encoding
+ *                         is undone first (400 when it does not decode), X-Received-Length is the encoded length
+ *  GET  /ws/echo/<n>    - websocket upgrade (permessage-deflate when offered, the first protocol offered),
+ *                         echoes messages in frames of at most n bytes (0: one frame), see bench_ws_echo
+ *  GET  /delay/<port>/<ms> - 64 byte body with X-Served-By: <port of this server>, the server on <port> waits
+ *                         ms milliseconds before answering
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int bench_server_start(bench_server* server, int tls);
+// same on the loopback address of family (AF_INET or AF_INET6) and port, 0 for an ephemeral one
+int bench_server_start_on(bench_server* server, int tls, int family, int port);
+void bench_server_stop(bench_server* server);
+
+#endif /* LCOREHTTP_BENCH_SERVER_H */
@@ -0,0 +1,149 @@
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench_server.h"
+#include "lcorehttp.h"
+
+#ifndef LCOREHTTP_BENCH_SCRIPT
+#define LCOREHTTP_BENCH_SCRIPT "bench/bench.lua"
+#endif
+
+static uint64_t bench_lua_allocs = 0;
+static uint64_t bench_lua_bytes = 0;
+
+#if defined(__GLIBC__)
+// Count every heap allocation (Lua's included) made by the benchmark thread only; the loopback
+// servers run in the same process and must not pollute the numbers.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static __thread int bench_count_heap_allocs = 0;
+static uint64_t bench_heap_allocs = 0;
+
+void*
+malloc(size_t size) {
+    if (bench_count_heap_allocs) {
+        bench_heap_allocs++;
+    }
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t nmemb, size_t size) {
+    if (bench_count_heap_allocs) {
+        bench_heap_allocs++;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void*
+realloc(void* ptr, size_t size) {
+    if (bench_count_heap_allocs) {
+        bench_heap_allocs++;
+    }
+    return __libc_realloc(ptr, size);
+}
+#else
+static int bench_count_heap_allocs = 0;
+static uint64_t bench_heap_allocs = 0;
+#endif
+
+static void*
+bench_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    (void)ud;
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (ptr == NULL || nsize > osize) {
+        bench_lua_allocs++;
+        bench_lua_bytes += (ptr == NULL) ? nsize : nsize - osize;
+    }
+    return realloc(ptr, nsize);
+}
+
+static int
+l_bench_now_us(lua_State* L) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushinteger(L, (lua_Integer)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    return 1;
+}
+
+static int
+l_bench_allocs(lua_State* L) {
+    lua_pushinteger(L, (lua_Integer)bench_lua_allocs);
+    lua_pushinteger(L, (lua_Integer)bench_heap_allocs);
+    lua_pushinteger(L, (lua_Integer)bench_lua_bytes);
+    return 3;
+}
+
+static const struct luaL_Reg lua_bench[] = {
+    {"now_us", l_bench_now_us},
+    {"allocs", l_bench_allocs},
+    {NULL, NULL}};
+
+int
+main(int argc, char** argv) {
+    bench_server httpServer;
+    bench_server httpsServer;
+    char caPath[] = "/tmp/lcorehttp_bench_ca_XXXXXX";
+    int caFd = mkstemp(caPath);
+    if (caFd < 0) {
+        fprintf(stderr, "failed to create certificate file\n");
+        return 1;
+    }
+    close(caFd);
+
+    if (bench_tls_init(caPath) != 0) {
+        fprintf(stderr, "failed to generate self-signed certificate\n");
+        return 1;
+    }
+    if (bench_server_start(&httpServer, 0) != 0 || bench_server_start(&httpsServer, 1) != 0) {
+        fprintf(stderr, "failed to start loopback servers\n");
+        return 1;
+    }
+
+    lua_State* L = lua_newstate(bench_lua_alloc, NULL);
+    luaL_openlibs(L);
+    luaL_requiref(L, "corehttp", luaopen_lua_corehttp, 0);
+    lua_pop(L, 1);
+
+    luaL_newlib(L, lua_bench);
+    lua_pushinteger(L, httpServer.port);
+    lua_setfield(L, -2, "http_port");
+    lua_pushinteger(L, httpsServer.port);
+    lua_setfield(L, -2, "https_port");
+    lua_pushstring(L, caPath);
+    lua_setfield(L, -2, "ca_file");
+    lua_setglobal(L, "bench");
+
+    lua_newtable(L);
+    for (int i = 1; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setglobal(L, "arg");
+
+    int result = 0;
+    bench_count_heap_allocs = 1;
+    if (luaL_dofile(L, LCOREHTTP_BENCH_SCRIPT) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        result = 1;
+    }
+    bench_count_heap_allocs = 0;
+
+    lua_close(L);
+    bench_server_stop(&httpServer);
+    bench_server_stop(&httpsServer);
+    bench_tls_free();
+    unlink(caPath);
+    return result;
+}
@@ -1,51 +1,119 @@
-
-#include <lauxlib.h>
-#include <lua.h>
-#include <lualib.h>
-
-#include "lcorehttp_client.h"
-#include "lcorehttp_preresponse.h"
-#include "lcorehttp_response.h"
-#include "lss.h"
-
-static const struct luaL_Reg lua_corehttp[] = {
-    /*
-    ---#DES 'is_tty.is_stdin_tty'
-    ---
-    ---Returns true if stdin is tty
-    ---@return boolean
-    */
-    {"new_client", l_corehttp_newclient},
-    {NULL, NULL}};
-
-int
-luaopen_lua_corehttp(lua_State* L) {
-    int results = lua_init_simple_socket(L);
-    if (results != 0) {
-        return results;
-    }
-    l_corehttp_client_create_meta(L);
-    l_corehttp_response_create_meta(L);
-    l_corehttp_preresponse_create_meta(L);
-
-    lua_newtable(L);
-    luaL_setfuncs(L, lua_corehttp, 0);
-
-    // register statuses
-    int statusCode = 0;
-    const char* statusStr = NULL;
-    while (1) {
-        statusStr = HTTPClient_strerror(statusCode);
-        if (statusStr == NULL) {
-            break;
-        }
-        lua_pushinteger(L, statusCode);
-        lua_setfield(L, -2, statusStr);
-        statusCode++;
-    }
-
-    l_corehttp_response_headers_create_meta(L);
-    lua_setfield(L, -2, "HEADERS_METATABLE");
-
-    return 1;
-}
+
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+
+#include "lcorehttp_async.h"
+#include "lcorehttp_body.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_json.h"
+#include "lcorehttp_limits.h"
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_multipart.h"
+#include "lcorehttp_prepared.h"
+#include "lcorehttp_preresponse.h"
+#include "lcorehttp_records.h"
+#include "lcorehttp_response.h"
+#include "lcorehttp_shaping.h"
+#include "lcorehttp_spill.h"
+#include "lcorehttp_tls.h"
+#include "lcorehttp_websocket.h"
+#include "lss.h"
+
+static const struct luaL_Reg lua_corehttp[] = {
+    /*
+    ---#DES 'is_tty.is_stdin_tty'
+    ---
+    ---Returns true if stdin is tty
+    ---@return boolean
+    */
+    {"new_client", l_corehttp_newclient},
+    /*
+    ---#DES 'corehttp.metrics'
+    ---
+    ---Returns library-wide counters and latency histograms
+    ---@return table?, string?
+    */
+    {"metrics", l_corehttp_metrics},
+    /*
+    ---#DES 'corehttp.metrics_prometheus'
+    ---
+    ---Returns library-wide metrics in the Prometheus text exposition format
+    ---@return string?, string?
+    */
+    {"metrics_prometheus", l_corehttp_metrics_prometheus},
+    /*
+    ---#DES 'corehttp.set_async_workers'
+    ---
+    ---Sets the number of native worker threads used by client:request_async (before its first use)
+    ---@param count integer
+    ---@return boolean?, string?
+    */
+    {"set_async_workers", l_corehttp_set_async_workers},
+    /*
+    ---#DES 'corehttp.set_rate_limit'
+    ---
+    ---Sets process-wide download/upload limits in bytes per second shared by all transfers (0 or nil: unlimited)
+    ---@param limits { download: integer?, upload: integer?, burst: integer? }
+    ---@return boolean
+    */
+    {"set_rate_limit", l_corehttp_set_rate_limit},
+    /*
+    ---#DES 'corehttp.tls_config'
+    ---
+    ---Parses certificates, key and cipher list once into a TLS configuration shared by clients and requests
+    ---@param options table? ca_file/ca, cert_file/cert, key_file/key, key_password, ciphers, verify, early_data, ktls
+    ---@return userdata?, string?
+    */
+    {"tls_config", l_corehttp_tls_config},
+    {NULL, NULL}};
+
+int
+luaopen_lua_corehttp(lua_State* L) {
+    int results = lua_init_simple_socket(L);
+    if (results != 0) {
+        return results;
+    }
+    l_corehttp_client_create_meta(L);
+    l_corehttp_response_create_meta(L);
+    l_corehttp_preresponse_create_meta(L);
+    l_corehttp_future_create_meta(L);
+    l_corehttp_prepared_create_meta(L);
+    l_corehttp_body_reader_create_meta(L);
+    l_corehttp_json_parser_create_meta(L);
+    l_corehttp_record_reader_create_meta(L);
+    l_corehttp_websocket_create_meta(L);
+    l_corehttp_multipart_create_meta(L);
+    l_corehttp_tls_config_create_meta(L);
+    l_corehttp_body_meter_create_meta(L);
+    l_corehttp_mapped_body_create_meta(L);
+
+    lua_newtable(L);
+    luaL_setfuncs(L, lua_corehttp, 0);
+
+    // register statuses
+    int statusCode = 0;
+    const char* statusStr = NULL;
+    while (1) {
+        statusStr = HTTPClient_strerror(statusCode);
+        if (statusStr == NULL) {
+            break;
+        }
+        lua_pushinteger(L, statusCode);
+        lua_setfield(L, -2, statusStr);
+        statusCode++;
+    }
+
+    l_corehttp_response_headers_create_meta(L);
+    lua_setfield(L, -2, "HEADERS_METATABLE");
+
+    /*
+    ---#DES 'corehttp.json_null'
+    ---
+    ---Value response:read_json uses for JSON null unless options.null is given
+    */
+    lua_pushlightuserdata(L, NULL);
+    lua_setfield(L, -2, "json_null");
+
+    return 1;
+}
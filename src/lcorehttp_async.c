@@ -0,0 +1,1020 @@
+#include "lcorehttp_async.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core_http_client.h"
+#include "extended_core_http_client.h"
+#include "lcorehttp_body.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_pool.h"
+#include "lcorehttp_probes.h"
+#include "lcorehttp_response.h"
+#include "lcorehttp_time.h"
+#include "lerror.h"
+#include "lss_options.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define ASYNC_READ_BUFFER_SIZE 16384
+
+typedef enum lcorehttp_async_state {
+    ASYNC_JOB_QUEUED,
+    ASYNC_JOB_RUNNING,
+    ASYNC_JOB_DONE,
+} lcorehttp_async_state;
+
+typedef struct lcorehttp_async_job {
+    struct lcorehttp_async_job* next;
+    lcorehttp_async_state state; // guarded by poolLock
+    int abandoned;               // future was collected before the job finished, guarded by poolLock
+    int headersOnly;             // stop after the response headers, the Lua thread streams the body
+    int optionsRef;              // registry reference keeping the options table (and loaded options) alive
+    const void* registry;        // identifies the Lua state that owns optionsRef
+
+    lcorehttp_client client; // private copy, the hostname is owned by the job
+    lcorehttp_client_connection_options options;
+    HTTPRequestHeaders_t requestHeaders;
+    uint32_t requestFlags;
+    uint8_t* body;
+    size_t bodyLen;
+    char* outputPath;
+
+    lcorehttp_response response;
+    lcorehttp_header_context headerContext;
+    HTTPClient_ResponseHeaderParsingCallback_t headerParsingCallback;
+    uint8_t* download;
+    size_t downloadLen;
+    size_t downloadCapacity;
+    lcorehttp_body_meter meter; // limits of the download, in-memory ones count against the client's budget
+    const char* error; // failures that do not map to an HTTPStatus_t
+} lcorehttp_async_job;
+
+typedef struct lcorehttp_future {
+    lcorehttp_async_job* job;
+} lcorehttp_future;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static lcorehttp_async_job* queueHead = NULL;
+static lcorehttp_async_job* queueTail = NULL;
+static lcorehttp_async_job* reapHead = NULL; // abandoned jobs finished by workers, released on a Lua thread
+static int workerCount = LCOREHTTP_ASYNC_DEFAULT_WORKERS;
+static int workersStarted = 0;
+
+static void
+async_job_free_options(lcorehttp_async_job* job) {
+    switch (job->client.kind) {
+        case LSS_CONNECTION_KIND_PLAINTEXT: lss_free_plain_connection_options(job->options.plaintext); break;
+        case LSS_CONNECTION_KIND_TLS: lss_free_tls_connection_options(job->options.tls); break;
+    }
+    memset(&job->options, 0, sizeof(job->options));
+}
+
+static void async_job_close_transport(lcorehttp_async_job* job);
+
+static void
+async_job_free(lcorehttp_async_job* job) {
+    async_job_close_transport(job); // headers-only jobs that lost a hedge
+    async_job_free_options(job);
+    free((void*)job->client.hostname);
+    free((void*)job->client.unixPath);
+    lcorehttp_shaping_release(&job->client.shaping);
+    lcorehttp_tls_config_release(job->client.tls);
+    lcorehttp_body_meter_release(&job->meter);
+    lcorehttp_memory_budget_release(job->client.budget);
+    free(job->requestHeaders.pBuffer);
+    free(job->body);
+    free(job->outputPath);
+    free(job->download);
+    free(job);
+}
+
+static void
+async_job_release(lua_State* L, lcorehttp_async_job* job) {
+    luaL_unref(L, LUA_REGISTRYINDEX, job->optionsRef);
+    async_job_free(job);
+}
+
+// releases the abandoned jobs of this Lua state that workers finished meanwhile
+static void
+async_reap(lua_State* L) {
+    const void* registry = lua_topointer(L, LUA_REGISTRYINDEX);
+    lcorehttp_async_job* reaped = NULL;
+    pthread_mutex_lock(&poolLock);
+    lcorehttp_async_job** link = &reapHead;
+    while (*link != NULL) {
+        lcorehttp_async_job* job = *link;
+        if (job->registry == registry) {
+            *link = job->next;
+            job->next = reaped;
+            reaped = job;
+        } else {
+            link = &job->next;
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+    while (reaped != NULL) {
+        lcorehttp_async_job* next = reaped->next;
+        async_job_release(L, reaped);
+        reaped = next;
+    }
+}
+
+static const char*
+async_sink(lcorehttp_async_job* job, FILE* file, const uint8_t* data, size_t len) {
+    if (len == 0) {
+        return NULL;
+    }
+    const char* limitError = lcorehttp_body_meter_decoded(&job->meter, len, 0);
+    if (limitError != NULL) {
+        return limitError;
+    }
+    if (file != NULL) {
+        return fwrite(data, 1, len, file) == len ? NULL : "failed to store response body";
+    }
+    if (job->downloadLen + len > job->downloadCapacity) {
+        size_t capacity = job->downloadCapacity > 0 ? job->downloadCapacity : ASYNC_READ_BUFFER_SIZE;
+        while (capacity < job->downloadLen + len) {
+            capacity *= 2;
+        }
+        limitError = lcorehttp_body_meter_charge(&job->meter, capacity - job->downloadCapacity);
+        if (limitError != NULL) {
+            return limitError;
+        }
+        uint8_t* download = realloc(job->download, capacity);
+        if (download == NULL) {
+            return "failed to store response body";
+        }
+        job->download = download;
+        job->downloadCapacity = capacity;
+    }
+    memcpy(job->download + job->downloadLen, data, len);
+    job->downloadLen += len;
+    return NULL;
+}
+
+static const char*
+async_job_download(lcorehttp_async_job* job) {
+    lcorehttp_response* response = &job->response;
+    const char* limitError =
+        lcorehttp_body_meter_expect(&job->meter, response->isChunked ? (size_t)-1 : response->contentLength);
+    if (limitError != NULL) {
+        return limitError;
+    }
+    FILE* file = NULL;
+    if (job->outputPath != NULL) {
+        file = fopen(job->outputPath, "wb");
+        if (file == NULL) {
+            return "failed to open output file";
+        }
+    }
+    uint8_t* buffer = malloc(ASYNC_READ_BUFFER_SIZE);
+    if (buffer == NULL) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        return "failed to allocate buffer";
+    }
+
+    const char* error = NULL;
+    size_t contentLength = response->contentLength;
+    size_t totalBytesRead = 0;
+    lcorehttp_dechunker dechunker = LCOREHTTP_DECHUNKER_INIT;
+    while (1) {
+        size_t toRead = ASYNC_READ_BUFFER_SIZE;
+        if (!response->isChunked && contentLength != (size_t)-1) {
+            size_t remaining = contentLength - totalBytesRead;
+            if (remaining == 0) {
+                break;
+            }
+            if (remaining < toRead) {
+                toRead = remaining;
+            }
+        }
+
+        size_t bytesRead = 0;
+        if (l_corehttp_response_read_internal(response, buffer, toRead, &bytesRead) != 0) {
+            error = "network error";
+            break;
+        }
+        if (bytesRead == 0) {
+            if (response->isChunked || (contentLength != (size_t)-1 && totalBytesRead < contentLength)) {
+                error = "unexpected EOF";
+            }
+            break;
+        }
+        totalBytesRead += bytesRead;
+        error = lcorehttp_body_meter_received(&job->meter, bytesRead);
+        if (error != NULL) {
+            break;
+        }
+
+        if (response->isChunked) {
+            size_t payload = lcorehttp_dechunk(&dechunker, buffer, bytesRead);
+            if (payload == (size_t)-1) {
+                error = "invalid chunked encoding";
+                break;
+            }
+            error = async_sink(job, file, buffer, payload);
+            if (error != NULL || dechunker.state == DECHUNK_DONE) {
+                break;
+            }
+        } else {
+            error = async_sink(job, file, buffer, bytesRead);
+            if (error != NULL) {
+                break;
+            }
+        }
+    }
+
+    free(buffer);
+    if (file != NULL && fclose(file) != 0 && error == NULL) {
+        error = "failed to store response body";
+    }
+    return error;
+}
+
+static void
+async_job_close_transport(lcorehttp_async_job* job) {
+    lcorehttp_response* response = &job->response;
+    if (response->transport == NULL) {
+        return;
+    }
+    lcorehttp_transport_close(&job->client, response->transport, response->bodyBytesRead);
+    response->transport = NULL;
+}
+
+static int
+async_job_abandoned(lcorehttp_async_job* job) {
+    pthread_mutex_lock(&poolLock);
+    int abandoned = job->abandoned;
+    pthread_mutex_unlock(&poolLock);
+    return abandoned;
+}
+
+// mirrors l_corehttp_client_request without the lua_State, then drains the body
+static void
+async_job_run(lcorehttp_async_job* job) {
+    lcorehttp_response* response = &job->response;
+    uint64_t requestStart = l_corehttp_get_time_us();
+
+    TransportInterface_t* transportInterface = malloc(sizeof(TransportInterface_t));
+    if (transportInterface == NULL) {
+        job->error = "failed to allocate transport";
+        return;
+    }
+    const char* error = corehttp_client_connect(&job->client, transportInterface, job->options, &response->timings);
+    async_job_free_options(job);
+    if (error != NULL) {
+        free(transportInterface);
+        job->error = error;
+        return;
+    }
+
+    response->client = &job->client;
+    response->transport = transportInterface;
+    if (job->headersOnly && async_job_abandoned(job)) { // the hedge was won while connecting, nothing to send
+        async_job_close_transport(job);
+        return;
+    }
+    response->response.pBuffer = job->requestHeaders.pBuffer; // reuse buffer for response
+    response->response.bufferLen = job->requestHeaders.bufferLen;
+    response->response.respOptionFlags = HTTP_RESPONSE_DO_NOT_PARSE_BODY_FLAG;
+    job->headerContext.L = NULL;
+    job->headerContext.client = &job->client;
+    job->headerContext.timings = &response->timings;
+    job->headerParsingCallback.pContext = &job->headerContext;
+    job->headerParsingCallback.onHeaderCallback = preloadHeader;
+    response->response.pHeaderParsingCallback = &job->headerParsingCallback;
+
+    response->status =
+        HTTPClient_Validate(transportInterface, &job->requestHeaders, job->body, job->bodyLen, &response->response);
+    uint64_t sendStart = l_corehttp_get_time_us();
+    if (response->status == HTTPSuccess) {
+        response->status = HTTPClient_SendHttpHeaders(transportInterface, response->response.getTime,
+                                                      &job->requestHeaders, job->bodyLen, 0);
+    }
+    if (response->status == HTTPSuccess) {
+        lcorehttp_metrics_bytes_sent(job->requestHeaders.headersLen);
+        LCOREHTTP_PROBE4(headers__sent, job->client.hostname, job->client.portno, job->requestHeaders.headersLen,
+                         job->bodyLen);
+        if (job->bodyLen > 0) {
+            response->status =
+                HTTPClient_Write(transportInterface, response->response.getTime, job->body, job->bodyLen,
+                                 &job->client.shaping);
+        }
+    }
+    if (response->status != HTTPSuccess) {
+        lcorehttp_metrics_error(response->status);
+        async_job_close_transport(job);
+        return;
+    }
+    uint64_t sendEnd = l_corehttp_get_time_us();
+    response->timings.send = (int64_t)(sendEnd - sendStart);
+    job->headerContext.sentAt = sendEnd;
+
+    HTTPStatus_t received =
+        corehttp_client_receive_response(&job->client, response, &job->requestHeaders, requestStart, sendEnd);
+    if (job->headersOnly) {
+        if (received != HTTPSuccess) {
+            async_job_close_transport(job);
+        }
+        return; // connection stays open for the body
+    }
+    if (received == HTTPSuccess) {
+        job->error = async_job_download(job);
+    }
+    async_job_close_transport(job);
+    response->response.pHeaderParsingCallback = NULL;
+
+    // the response replays the collected payload from its body cache
+    response->response.pBody = (job->outputPath == NULL) ? job->download : NULL;
+    response->response.bodyLen = (job->outputPath == NULL) ? job->downloadLen : 0;
+    response->contentLength = response->response.bodyLen;
+    response->cachedBodyRead = 0;
+    response->isChunked = 0;
+}
+
+// runs a job on the calling thread, expects poolLock to be held and releases it
+static void
+async_job_execute(lcorehttp_async_job* job) {
+    int abandoned = job->abandoned;
+    job->state = ASYNC_JOB_RUNNING;
+    pthread_mutex_unlock(&poolLock);
+
+    if (!abandoned) {
+        async_job_run(job);
+    }
+
+    pthread_mutex_lock(&poolLock);
+    while (job->abandoned && job->response.transport != NULL) {
+        // a hedge that lost while it ran, its connection is closed now rather than when the job is reaped
+        pthread_mutex_unlock(&poolLock);
+        async_job_close_transport(job);
+        pthread_mutex_lock(&poolLock);
+    }
+    job->state = ASYNC_JOB_DONE;
+    abandoned = job->abandoned;
+    if (abandoned && job->optionsRef != LUA_NOREF) { // the reference can only be dropped by its Lua state
+        job->next = reapHead;
+        reapHead = job;
+    }
+    pthread_cond_broadcast(&doneCond);
+    pthread_mutex_unlock(&poolLock);
+    if (abandoned && job->optionsRef == LUA_NOREF) {
+        async_job_free(job);
+    }
+}
+
+static void*
+async_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&poolLock);
+        while (queueHead == NULL) {
+            pthread_cond_wait(&queueCond, &poolLock);
+        }
+        lcorehttp_async_job* job = queueHead;
+        queueHead = job->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+        async_job_execute(job);
+    }
+    return NULL;
+}
+
+static void*
+async_hedge_thread(void* arg) {
+    pthread_mutex_lock(&poolLock);
+    async_job_execute(arg);
+    return NULL;
+}
+
+// expects poolLock to be held
+static int
+async_start_workers(void) {
+    if (workersStarted > 0) {
+        return 0;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, async_worker, NULL) != 0) {
+            break;
+        }
+        workersStarted++;
+    }
+    pthread_attr_destroy(&attr);
+    return workersStarted > 0 ? 0 : -1;
+}
+
+int
+l_corehttp_set_async_workers(lua_State* L) {
+    lua_Integer count = luaL_checkinteger(L, 1);
+    if (count < 1 || count > LCOREHTTP_ASYNC_MAXIMUM_WORKERS) {
+        return luaL_error(L, "worker count must be between 1 and %d", LCOREHTTP_ASYNC_MAXIMUM_WORKERS);
+    }
+    pthread_mutex_lock(&poolLock);
+    int started = workersStarted;
+    if (!started) {
+        workerCount = (int)count;
+    }
+    pthread_mutex_unlock(&poolLock);
+    if (started) {
+        return push_error(L, "async workers are already running");
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// expects poolLock to be held
+static int
+async_enqueue(lcorehttp_async_job* job) {
+    if (async_start_workers() != 0) {
+        return -1;
+    }
+    job->state = ASYNC_JOB_QUEUED;
+    job->next = NULL;
+    if (queueTail != NULL) {
+        queueTail->next = job;
+    } else {
+        queueHead = job;
+    }
+    queueTail = job;
+    pthread_cond_signal(&queueCond);
+    return 0;
+}
+
+/*
+ * Expects poolLock to be held. Every hedged attempt gets a thread of its own: queued behind background downloads
+ * that occupy the worker pool, a duplicate would only start once a worker is free, long after after_ms.
+ */
+static int
+async_dispatch_hedge(lcorehttp_async_job* job) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    job->state = ASYNC_JOB_QUEUED;
+    job->next = NULL;
+    pthread_t thread;
+    int ret = pthread_create(&thread, &attr, async_hedge_thread, job);
+    pthread_attr_destroy(&attr);
+    return ret == 0 ? 0 : -1;
+}
+
+// builds a job from the request arguments (client, path, method, options) at 1..4, NULL with pushed error values
+static lcorehttp_async_job*
+async_job_create(lua_State* L, lcorehttp_client* client, const uint8_t* body, size_t bodyLen,
+                 const char* outputPath, int* resultCount) {
+    lcorehttp_tls_config* tlsConfig = NULL;
+    if (lua_istable(L, 4) && client->kind == LSS_CONNECTION_KIND_TLS
+        && lcorehttp_tls_config_option(L, 4, &tlsConfig) != 0) {
+        *resultCount = push_error(L, "invalid tls_config");
+        return NULL;
+    }
+    lcorehttp_async_job* job = calloc(1, sizeof(lcorehttp_async_job));
+    if (job == NULL) {
+        *resultCount = push_error(L, "failed to allocate request");
+        return NULL;
+    }
+    job->optionsRef = LUA_NOREF;
+    job->client = *client;
+    if (tlsConfig != NULL) {
+        job->client.tls = tlsConfig;
+    }
+    lcorehttp_shaping_retain(&job->client.shaping); // rate limits outlive the client while the job runs
+    lcorehttp_tls_config_retain(job->client.tls);
+    lcorehttp_memory_budget_retain(job->client.budget);
+    job->client.hostname = strdup(client->hostname);
+    job->client.unixPath = client->unixPath != NULL ? strdup(client->unixPath) : NULL;
+    memset(&job->client.pool, 0, sizeof(job->client.pool)); // workers always use a fresh connection
+    job->client.h2 = NULL;
+    job->body = bodyLen > 0 ? malloc(bodyLen) : NULL;
+    job->outputPath = outputPath != NULL ? strdup(outputPath) : NULL;
+    if (job->client.hostname == NULL || (client->unixPath != NULL && job->client.unixPath == NULL)
+        || (bodyLen > 0 && job->body == NULL)
+        || (outputPath != NULL && job->outputPath == NULL)) {
+        async_job_free(job);
+        *resultCount = push_error(L, "failed to allocate request");
+        return NULL;
+    }
+    if (bodyLen > 0) {
+        memcpy(job->body, body, bodyLen);
+        job->bodyLen = bodyLen;
+    }
+
+    *resultCount = initializeRequestHeaders(L, client, &job->requestHeaders, &job->requestFlags);
+    if (*resultCount != 0) {
+        async_job_free(job);
+        return NULL;
+    }
+    if (job->client.tls == NULL) { // the native TLS connector has its configuration already
+        job->options = load_corehttp_client_connection_options(L, client->kind, 4);
+    }
+    if (lua_istable(L, 4)) { // loaded connection options may point into the options table
+        lua_pushvalue(L, 4);
+        job->optionsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        job->registry = lua_topointer(L, LUA_REGISTRYINDEX);
+    }
+
+    memset(&job->response, 0, sizeof(lcorehttp_response));
+    job->response.response.getTime = l_corehttp_get_time_ms;
+    job->response.contentLength = -1;
+    l_corehttp_timings_init(&job->response.timings);
+    job->response.limits = client->limits;
+    if (lua_istable(L, 4) && lcorehttp_body_limits_load(L, 4, &job->response.limits) != 0) {
+        async_job_release(L, job); // drops the options reference taken above
+        *resultCount = push_error(L, "invalid body limit options");
+        return NULL;
+    }
+    lcorehttp_body_meter_init(&job->meter, &job->response.limits, outputPath == NULL ? job->client.budget : NULL);
+    return job;
+}
+
+int
+l_corehttp_client_request_async(lua_State* L) {
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    if (client->closed) {
+        return push_error(L, "client is closed");
+    }
+    async_reap(L);
+
+    const uint8_t* body = NULL;
+    size_t bodyLen = 0;
+    const char* outputPath = NULL;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "write_body_hook");
+        int hasHook = lua_isfunction(L, -1);
+        lua_pop(L, 1);
+        if (hasHook) {
+            return push_error(L, "write_body_hook is not supported by request_async");
+        }
+        lua_getfield(L, 4, "compress_body");
+        int compressed = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (compressed) {
+            return push_error(L, "compress_body is not supported by request_async");
+        }
+        lua_getfield(L, 4, "body");
+        if (lua_isstring(L, -1)) {
+            body = (const uint8_t*)lua_tolstring(L, -1, &bodyLen);
+        }
+        lua_pop(L, 1); // the string stays referenced by the options table
+        lua_getfield(L, 4, "output_file");
+        if (lua_isstring(L, -1)) {
+            outputPath = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+
+    int resultCount = 0;
+    lcorehttp_async_job* job = async_job_create(L, client, body, bodyLen, outputPath, &resultCount);
+    if (job == NULL) {
+        return resultCount;
+    }
+
+    lcorehttp_future* future = lua_newuserdatauv(L, sizeof(lcorehttp_future), 2);
+    future->job = NULL;
+    luaL_getmetatable(L, LCOREHTTP_FUTURE_METATABLE);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1); // the response produced by result() keeps the client
+
+    pthread_mutex_lock(&poolLock);
+    if (async_enqueue(job) != 0) {
+        pthread_mutex_unlock(&poolLock);
+        async_job_release(L, job);
+        return push_error(L, "failed to start async workers");
+    }
+    future->job = job;
+    pthread_mutex_unlock(&poolLock);
+    return 1;
+}
+
+static int
+async_job_is_done(lcorehttp_async_job* job) {
+    pthread_mutex_lock(&poolLock);
+    int done = job->state == ASYNC_JOB_DONE;
+    pthread_mutex_unlock(&poolLock);
+    return done;
+}
+
+// absolute CLOCK_REALTIME time for pthread_cond_timedwait
+static void
+async_deadline(struct timespec* deadline, lua_Integer timeoutMs) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += (time_t)(timeoutMs / 1000);
+    deadline->tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// timeoutMs < 0 waits forever
+static int
+async_job_wait(lcorehttp_async_job* job, lua_Integer timeoutMs) {
+    struct timespec deadline;
+    if (timeoutMs >= 0) {
+        async_deadline(&deadline, timeoutMs);
+    }
+    pthread_mutex_lock(&poolLock);
+    while (job->state != ASYNC_JOB_DONE) {
+        if (timeoutMs < 0) {
+            pthread_cond_wait(&doneCond, &poolLock);
+        } else if (pthread_cond_timedwait(&doneCond, &poolLock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int done = job->state == ASYNC_JOB_DONE;
+    pthread_mutex_unlock(&poolLock);
+    return done;
+}
+
+static void
+async_push_headers(lua_State* L, const HTTPResponse_t* response) {
+    lua_newtable(L);
+    const char* p = (const char*)response->pHeaders;
+    const char* end = p + (p != NULL ? response->headersLen : 0);
+    while (p < end) {
+        const char* lineEnd = memchr(p, '\n', (size_t)(end - p));
+        if (lineEnd == NULL) {
+            lineEnd = end;
+        }
+        const char* valueEnd = (lineEnd > p && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+        if (valueEnd == p) { // empty line terminates the header block
+            break;
+        }
+        const char* colon = memchr(p, ':', (size_t)(valueEnd - p));
+        if (colon != NULL && colon > p) {
+            const char* value = colon + 1;
+            while (value < valueEnd && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char* trimmed = valueEnd;
+            while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) {
+                trimmed--;
+            }
+            lua_pushlstring(L, p, (size_t)(colon - p));
+            lua_pushlstring(L, value, (size_t)(trimmed - value));
+            lua_settable(L, -3);
+        }
+        p = lineEnd + 1;
+    }
+    luaL_getmetatable(L, LCOREHTTP_HEADERS_METATABLE);
+    lua_setmetatable(L, -2);
+}
+
+static lcorehttp_future*
+check_future(lua_State* L) {
+    lcorehttp_future* future = luaL_checkudata(L, 1, LCOREHTTP_FUTURE_METATABLE);
+    if (future->job == NULL) {
+        lua_getiuservalue(L, 1, 2);
+        int hasResult = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (!hasResult) {
+            luaL_error(L, "future is closed");
+        }
+    }
+    return future;
+}
+
+int
+l_corehttp_future_ready(lua_State* L) {
+    lcorehttp_future* future = check_future(L);
+    lua_pushboolean(L, future->job == NULL || async_job_is_done(future->job));
+    return 1;
+}
+
+// wait(timeout_ms?) -> boolean
+int
+l_corehttp_future_wait(lua_State* L) {
+    lcorehttp_future* future = check_future(L);
+    lua_Integer timeoutMs = luaL_optinteger(L, 2, -1);
+    lua_pushboolean(L, future->job == NULL || async_job_wait(future->job, timeoutMs));
+    return 1;
+}
+
+// result() -> response | nil, status_code, error; blocks until the request finished
+int
+l_corehttp_future_result(lua_State* L) {
+    lcorehttp_future* future = check_future(L);
+    if (future->job == NULL) {
+        lua_getiuservalue(L, 1, 2);
+        if (lua_istable(L, -1)) { // failed request, replay the error
+            int errorIdx = lua_gettop(L);
+            int count = (int)lua_rawlen(L, errorIdx);
+            for (int i = 1; i <= count; i++) {
+                lua_geti(L, errorIdx, i);
+            }
+            return count;
+        }
+        return 1;
+    }
+    lcorehttp_async_job* job = future->job;
+    async_job_wait(job, -1);
+
+    int resultCount = 0;
+    if (job->error != NULL && job->response.status == HTTPSuccess) {
+        resultCount = push_error(L, job->error);
+    } else if (job->response.status != HTTPSuccess) {
+        lua_pushnil(L);
+        lua_pushinteger(L, job->response.status);
+        lua_pushstring(L, HTTPClient_strerror(job->response.status));
+        resultCount = 3;
+    }
+    if (resultCount > 0) {
+        lua_createtable(L, resultCount, 0);
+        for (int i = 1; i <= resultCount; i++) {
+            lua_pushvalue(L, -1 - resultCount + (i - 1));
+            lua_rawseti(L, -2, i);
+        }
+        lua_setiuservalue(L, 1, 2);
+        future->job = NULL;
+        async_job_release(L, job);
+        return resultCount;
+    }
+
+    lcorehttp_response* response = l_corehttp_new_response(L);
+    if (response == NULL) {
+        return push_error(L, "failed to create response");
+    }
+    *response = job->response;
+    lua_getiuservalue(L, 1, 1);
+    response->client = lua_touserdata(L, -1);
+    lua_setiuservalue(L, -2, 2);
+    response->ownedBuffer = job->requestHeaders.pBuffer;
+    response->ownedBody = job->download;
+    job->requestHeaders.pBuffer = NULL;
+    job->download = NULL;
+
+    async_push_headers(L, &response->response);
+    lua_setiuservalue(L, -2, 1);
+
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, 1, 2);
+    future->job = NULL;
+    async_job_release(L, job);
+    return 1;
+}
+
+int
+l_corehttp_future_gc(lua_State* L) {
+    lcorehttp_future* future = luaL_checkudata(L, 1, LCOREHTTP_FUTURE_METATABLE);
+    lcorehttp_async_job* job = future->job;
+    if (job == NULL) {
+        return 0;
+    }
+    future->job = NULL;
+    pthread_mutex_lock(&poolLock);
+    int done = job->state == ASYNC_JOB_DONE;
+    job->abandoned = 1; // a queued job is skipped, a running one is reaped after its worker finished
+    pthread_mutex_unlock(&poolLock);
+    if (done) {
+        async_job_release(L, job);
+    }
+    return 0;
+}
+
+static int
+async_job_succeeded(const lcorehttp_async_job* job) {
+    return job->error == NULL && job->response.status == HTTPSuccess;
+}
+
+// waits for the first attempt with response headers, sending the next duplicate every afterMs
+static int
+async_hedge_wait(lcorehttp_async_job** jobs, size_t attempts, uint32_t afterMs, size_t* launched) {
+    int winner = -1;
+    uint32_t nextLaunchAt = l_corehttp_get_time_ms() + afterMs;
+    pthread_mutex_lock(&poolLock);
+    while (winner < 0) {
+        size_t pending = 0;
+        for (size_t i = 0; i < *launched; i++) {
+            if (jobs[i]->state != ASYNC_JOB_DONE) {
+                pending++;
+            } else if (async_job_succeeded(jobs[i])) {
+                winner = (int)i;
+                break;
+            }
+        }
+        if (winner >= 0) {
+            break;
+        }
+        uint32_t now = l_corehttp_get_time_ms();
+        int32_t untilLaunch = (int32_t)(nextLaunchAt - now);
+        if (*launched < attempts && (untilLaunch <= 0 || pending == 0)) { // slow or failed, send a duplicate
+            if (async_dispatch_hedge(jobs[*launched]) != 0) {
+                break;
+            }
+            (*launched)++;
+            lcorehttp_metrics_hedge_sent();
+            nextLaunchAt = now + afterMs;
+            continue;
+        }
+        if (pending == 0) {
+            break; // every attempt failed
+        }
+        if (*launched < attempts) {
+            struct timespec deadline;
+            async_deadline(&deadline, untilLaunch);
+            pthread_cond_timedwait(&doneCond, &poolLock, &deadline);
+        } else {
+            pthread_cond_wait(&doneCond, &poolLock);
+        }
+    }
+    // losers still in flight close their connection in their thread and are reaped later, finished ones are
+    // released below
+    for (size_t i = 0; i < *launched; i++) {
+        if ((int)i != winner && jobs[i]->state != ASYNC_JOB_DONE) {
+            jobs[i]->abandoned = 1;
+            jobs[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+    return winner;
+}
+
+int
+corehttp_client_request_hedged(lua_State* L) {
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    const char* method = luaL_checkstring(L, 3);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_settop(L, 4);
+    async_reap(L);
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        return push_error(L, "hedge requires an idempotent GET or HEAD request");
+    }
+    lua_getfield(L, 4, "body");
+    lua_getfield(L, 4, "write_body_hook");
+    int hasBody = !lua_isnil(L, -2) || !lua_isnil(L, -1);
+    lua_pop(L, 2);
+    if (hasBody) {
+        return push_error(L, "hedge does not support request bodies");
+    }
+
+    lua_getfield(L, 4, "hedge");
+    int hedgeIdx = lua_gettop(L);
+    lua_Integer afterMs = LCOREHTTP_HEDGE_DEFAULT_AFTER_MS;
+    lua_Integer hedges = 1;
+    lua_getfield(L, hedgeIdx, "after_ms");
+    if (lua_isinteger(L, -1)) {
+        afterMs = lua_tointeger(L, -1);
+    }
+    lua_getfield(L, hedgeIdx, "max");
+    if (lua_isinteger(L, -1)) {
+        hedges = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 2);
+    if (afterMs < 0 || afterMs > INT32_MAX || hedges < 1 || hedges > LCOREHTTP_HEDGE_MAXIMUM) {
+        return luaL_error(L, "hedge needs after_ms >= 0 and max between 1 and %d", LCOREHTTP_HEDGE_MAXIMUM);
+    }
+    lua_getfield(L, hedgeIdx, "client"); // alternate endpoint for the duplicates (index 6)
+    lcorehttp_client* alternate = lua_isnil(L, -1) ? NULL : luaL_checkudata(L, -1, LCOREHTTP_CLIENT_METATABLE);
+    if (alternate == NULL) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, 1);
+        alternate = client;
+    }
+    if (client->closed || alternate->closed) {
+        return push_error(L, "client is closed");
+    }
+
+    lcorehttp_async_job* jobs[LCOREHTTP_HEDGE_MAXIMUM + 1] = {NULL};
+    size_t attempts = (size_t)hedges + 1;
+    int resultCount = 0;
+    for (size_t i = 0; i < attempts; i++) {
+        jobs[i] = async_job_create(L, i == 0 ? client : alternate, NULL, 0, NULL, &resultCount);
+        if (jobs[i] == NULL) {
+            for (size_t j = 0; j < i; j++) {
+                async_job_release(L, jobs[j]);
+            }
+            return resultCount;
+        }
+        jobs[i]->headersOnly = 1;
+    }
+
+    size_t launched = 0;
+    pthread_mutex_lock(&poolLock);
+    if (async_dispatch_hedge(jobs[0]) == 0) {
+        launched = 1;
+    }
+    pthread_mutex_unlock(&poolLock);
+    int winner = launched > 0 ? async_hedge_wait(jobs, attempts, (uint32_t)afterMs, &launched) : -1;
+
+    if (winner < 0) {
+        lcorehttp_async_job* failed = jobs[0]; // report the original request
+        if (launched == 0) {
+            resultCount = push_error(L, "failed to start hedged request");
+        } else if (failed == NULL) {
+            resultCount = push_error(L, "hedged request failed");
+        } else if (failed->error != NULL) {
+            resultCount = push_error(L, failed->error);
+        } else {
+            resultCount = push_error_status(L, failed->response.status);
+        }
+    } else {
+        lcorehttp_async_job* job = jobs[winner];
+        lcorehttp_response* response = l_corehttp_new_response(L);
+        if (response == NULL) {
+            resultCount = push_error(L, "failed to create response");
+        } else {
+            *response = job->response;
+            response->response.pHeaderParsingCallback = NULL;
+            response->client = winner == 0 ? client : alternate;
+            response->keepAlive = (job->requestFlags & HTTP_REQUEST_KEEP_ALIVE_FLAG) != 0;
+            response->ownedBuffer = job->requestHeaders.pBuffer;
+            job->requestHeaders.pBuffer = NULL;
+            job->response.transport = NULL; // the body is streamed from the winning connection
+            lua_pushvalue(L, winner == 0 ? 1 : 6);
+            lua_setiuservalue(L, -2, 2);
+            async_push_headers(L, &response->response);
+            lua_setiuservalue(L, -2, 1);
+            if (winner > 0) {
+                lcorehttp_metrics_hedge_won();
+            }
+            resultCount = 1;
+        }
+    }
+    for (size_t i = 0; i < attempts; i++) {
+        if (jobs[i] != NULL) {
+            async_job_release(L, jobs[i]);
+        }
+    }
+    return resultCount;
+}
+
+#else
+
+int
+l_corehttp_set_async_workers(lua_State* L) {
+    return push_error(L, "request_async is not supported on this platform");
+}
+
+int
+l_corehttp_client_request_async(lua_State* L) {
+    return push_error(L, "request_async is not supported on this platform");
+}
+
+int
+l_corehttp_future_ready(lua_State* L) {
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int
+l_corehttp_future_wait(lua_State* L) {
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int
+l_corehttp_future_result(lua_State* L) {
+    return push_error(L, "request_async is not supported on this platform");
+}
+
+int
+l_corehttp_future_gc(lua_State* L) {
+    return 0;
+}
+
+int
+corehttp_client_request_hedged(lua_State* L) {
+    return push_error(L, "hedge is not supported on this platform");
+}
+
+#endif
+
+int
+l_corehttp_future_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_FUTURE_METATABLE);
+    /* Metamethods */
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_future_ready);
+    lua_setfield(L, -2, "ready");
+    lua_pushcfunction(L, l_corehttp_future_wait);
+    lua_setfield(L, -2, "wait");
+    lua_pushcfunction(L, l_corehttp_future_result);
+    lua_setfield(L, -2, "result");
+    lua_pushstring(L, LCOREHTTP_FUTURE_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_future_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_future_gc);
+    lua_setfield(L, -2, "__close");
+    return 0;
+}
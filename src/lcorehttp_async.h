@@ -0,0 +1,40 @@
+#ifndef LCOREHTTP_ASYNC_H
+#define LCOREHTTP_ASYNC_H
+
+#include "lua.h"
+
+#define LCOREHTTP_FUTURE_METATABLE     "COREHTTP_FUTURE"
+
+#define LCOREHTTP_ASYNC_DEFAULT_WORKERS 4
+#define LCOREHTTP_ASYNC_MAXIMUM_WORKERS 64
+
+#define LCOREHTTP_HEDGE_DEFAULT_AFTER_MS 50
+#define LCOREHTTP_HEDGE_MAXIMUM          4
+
+/**
+ * client:request_async(path, method, options?) -> future
+ *
+ * Runs connect, send, receive and the whole body download on a native worker thread. Workers never touch
+ * the lua_State; the body is collected into a C buffer (or written to options.output_file) and replayed by
+ * the response returned from future:result().
+ */
+int l_corehttp_client_request_async(lua_State* L);
+
+/**
+ * client:request(path, method, { hedge = { after_ms?, max?, client? } })
+ *
+ * Sends the request (GET or HEAD without body) from a thread of its own and, while no response headers arrived,
+ * one more duplicate every after_ms up to max, to hedge.client when given. Attempts do not wait for the
+ * request_async worker pool, which may be busy with downloads. The first attempt with headers wins; its
+ * connection becomes the returned response, which streams the body on the calling thread. Losing attempts that
+ * already finished are closed right away, the others by their thread as soon as it returns (an attempt still
+ * connecting sends nothing).
+ */
+int corehttp_client_request_hedged(lua_State* L);
+
+// set_async_workers(count) - size of the worker pool, only before the first request_async
+int l_corehttp_set_async_workers(lua_State* L);
+
+int l_corehttp_future_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_ASYNC_H */
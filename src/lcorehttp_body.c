@@ -0,0 +1,322 @@
+#include "lcorehttp_body.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_response.h"
+
+#define MINIMUM_BODY_READER_BUFFER_SIZE 512
+
+int
+lcorehttp_bytes_reserve(lcorehttp_bytes* bytes, size_t extra) {
+    if (bytes->len + extra <= bytes->capacity) {
+        return 0;
+    }
+    size_t capacity = bytes->capacity == 0 ? 256 : bytes->capacity;
+    while (capacity < bytes->len + extra) {
+        capacity *= 2;
+    }
+    uint8_t* grown = realloc(bytes->data, capacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    bytes->data = grown;
+    bytes->capacity = capacity;
+    return 0;
+}
+
+int
+lcorehttp_bytes_append(lcorehttp_bytes* bytes, const void* data, size_t len) {
+    if (lcorehttp_bytes_reserve(bytes, len) != 0) {
+        return -1;
+    }
+    if (len > 0) {
+        memcpy(bytes->data + bytes->len, data, len);
+        bytes->len += len;
+    }
+    return 0;
+}
+
+void
+lcorehttp_bytes_free(lcorehttp_bytes* bytes) {
+    free(bytes->data);
+    bytes->data = NULL;
+    bytes->len = 0;
+    bytes->capacity = 0;
+}
+
+static int
+hex_value(uint8_t c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+size_t
+lcorehttp_dechunk(lcorehttp_dechunker* dechunker, uint8_t* data, size_t len) {
+    size_t i = 0;
+    size_t out = 0; // payload is compacted to the front, it never overtakes the input position
+    while (i < len && dechunker->state != DECHUNK_DONE) {
+        uint8_t c = data[i];
+        switch (dechunker->state) {
+            case DECHUNK_SIZE: {
+                int digit = hex_value(c);
+                if (digit >= 0) {
+                    if (dechunker->remaining > (SIZE_MAX >> 4)) {
+                        return (size_t)-1;
+                    }
+                    dechunker->remaining = (dechunker->remaining << 4) | (size_t)digit;
+                    dechunker->hasDigits = 1;
+                    i++;
+                    break;
+                }
+                if (!dechunker->hasDigits) {
+                    return (size_t)-1;
+                }
+                if (c == '\n') {
+                    dechunker->state = dechunker->remaining == 0 ? DECHUNK_TRAILER : DECHUNK_DATA;
+                } else {
+                    dechunker->state = (c == '\r') ? DECHUNK_SIZE_LF : DECHUNK_EXTENSION;
+                }
+                i++;
+                break;
+            }
+            case DECHUNK_EXTENSION:
+                if (c == '\n') {
+                    dechunker->state = dechunker->remaining == 0 ? DECHUNK_TRAILER : DECHUNK_DATA;
+                }
+                i++;
+                break;
+            case DECHUNK_SIZE_LF:
+                if (c != '\n') {
+                    return (size_t)-1;
+                }
+                dechunker->state = dechunker->remaining == 0 ? DECHUNK_TRAILER : DECHUNK_DATA;
+                i++;
+                break;
+            case DECHUNK_DATA: {
+                size_t available = len - i;
+                size_t toCopy = available < dechunker->remaining ? available : dechunker->remaining;
+                if (out != i) {
+                    memmove(data + out, data + i, toCopy);
+                }
+                out += toCopy;
+                i += toCopy;
+                dechunker->remaining -= toCopy;
+                if (dechunker->remaining == 0) {
+                    dechunker->state = DECHUNK_DATA_CR;
+                }
+                break;
+            }
+            case DECHUNK_DATA_CR:
+                if (c == '\n') {
+                    dechunker->state = DECHUNK_SIZE;
+                } else if (c == '\r') {
+                    dechunker->state = DECHUNK_DATA_LF;
+                } else {
+                    return (size_t)-1;
+                }
+                dechunker->hasDigits = 0;
+                i++;
+                break;
+            case DECHUNK_DATA_LF:
+                if (c != '\n') {
+                    return (size_t)-1;
+                }
+                dechunker->state = DECHUNK_SIZE;
+                i++;
+                break;
+            case DECHUNK_TRAILER: // at the start of a trailer line, an empty line ends the body
+                dechunker->state = (c == '\r') ? DECHUNK_TRAILER_LF : (c == '\n') ? DECHUNK_DONE : DECHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case DECHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    dechunker->state = DECHUNK_TRAILER;
+                }
+                i++;
+                break;
+            case DECHUNK_TRAILER_LF:
+                if (c != '\n') {
+                    return (size_t)-1;
+                }
+                dechunker->state = DECHUNK_DONE;
+                i++;
+                break;
+            case DECHUNK_DONE: break;
+        }
+    }
+    dechunker->excess = len - i;
+    return out;
+}
+
+static int
+l_corehttp_body_reader_gc(lua_State* L) {
+    lcorehttp_body_reader* reader = luaL_checkudata(L, 1, LCOREHTTP_BODY_READER_METATABLE);
+    if (reader->inflateReady) {
+        inflateEnd(&reader->strm);
+        reader->inflateReady = 0;
+    }
+    free(reader->raw);
+    reader->raw = NULL;
+    free(reader->out);
+    reader->out = NULL;
+    return 0;
+}
+
+lcorehttp_body_reader*
+l_corehttp_new_body_reader(lua_State* L, int responseIdx, size_t bufferSize) {
+    responseIdx = lua_absindex(L, responseIdx);
+    lcorehttp_response* response = luaL_checkudata(L, responseIdx, LCOREHTTP_RESPONSE_METATABLE);
+    int inflateMode = l_corehttp_get_encoding_mode(L, responseIdx);
+    if (bufferSize < MINIMUM_BODY_READER_BUFFER_SIZE) {
+        bufferSize = MINIMUM_BODY_READER_BUFFER_SIZE;
+    }
+
+    lcorehttp_body_reader* reader = lua_newuserdatauv(L, sizeof(lcorehttp_body_reader), 0);
+    memset(reader, 0, sizeof(lcorehttp_body_reader));
+    luaL_getmetatable(L, LCOREHTTP_BODY_READER_METATABLE);
+    lua_setmetatable(L, -2);
+    reader->response = response;
+    reader->dechunker = (lcorehttp_dechunker)LCOREHTTP_DECHUNKER_INIT;
+    reader->remaining = response->isChunked ? (size_t)-1 : response->contentLength;
+    reader->eof = !response->isChunked && response->contentLength == 0;
+    reader->capacity = bufferSize;
+    lcorehttp_body_meter_init(&reader->meter, &response->limits, NULL);
+    const char* limitError = lcorehttp_body_meter_expect(&reader->meter, reader->remaining);
+    if (limitError != NULL) {
+        luaL_error(L, "%s", limitError);
+        return NULL;
+    }
+    reader->raw = malloc(bufferSize);
+    if (reader->raw == NULL) {
+        luaL_error(L, "failed to allocate body buffer");
+        return NULL;
+    }
+    if (inflateMode) {
+        reader->out = malloc(bufferSize);
+        if (reader->out == NULL || inflateInit2(&reader->strm, (inflateMode == 1) ? 31 : 15) != Z_OK) {
+            luaL_error(L, "failed to initialize zlib");
+            return NULL;
+        }
+        reader->inflateMode = inflateMode;
+        reader->inflateReady = 1;
+    }
+    return reader;
+}
+
+// next block of the body with transfer framing removed
+static const char*
+body_reader_next_raw(lcorehttp_body_reader* reader, uint8_t** data, size_t* len) {
+    lcorehttp_response* response = reader->response;
+    *len = 0;
+    while (!reader->eof) {
+        size_t toRead = reader->capacity;
+        if (reader->remaining != (size_t)-1 && reader->remaining < toRead) {
+            toRead = reader->remaining;
+        }
+        size_t bytesRead = 0;
+        if (l_corehttp_response_read_internal(response, reader->raw, toRead, &bytesRead) != 0) {
+            return "network error";
+        }
+        if (bytesRead == 0) {
+            if (response->isChunked || reader->remaining != (size_t)-1) {
+                return "unexpected EOF";
+            }
+            reader->eof = 1; // body delimited by the end of the connection
+            break;
+        }
+        const char* limitError = lcorehttp_body_meter_received(&reader->meter, bytesRead);
+        if (limitError != NULL) {
+            return limitError;
+        }
+        size_t payload = bytesRead;
+        if (response->isChunked) {
+            payload = lcorehttp_dechunk(&reader->dechunker, reader->raw, bytesRead);
+            if (payload == (size_t)-1) {
+                return "invalid chunked encoding";
+            }
+            reader->eof = reader->dechunker.state == DECHUNK_DONE;
+            // the terminating chunk and the trailer section were consumed, the next response starts right after
+            response->bodyComplete = reader->eof && reader->dechunker.excess == 0
+                                     && response->cachedBodyRead >= response->response.bodyLen;
+        } else if (reader->remaining != (size_t)-1) {
+            reader->remaining -= bytesRead;
+            reader->eof = reader->remaining == 0;
+        }
+        if (payload > 0) {
+            *data = reader->raw;
+            *len = payload;
+            break;
+        }
+    }
+    return NULL;
+}
+
+const char*
+lcorehttp_body_reader_next(lcorehttp_body_reader* reader, const uint8_t** data, size_t* len) {
+    *len = 0;
+    if (!reader->inflateMode) {
+        uint8_t* raw = NULL;
+        const char* error = body_reader_next_raw(reader, &raw, len);
+        *data = raw;
+        lcorehttp_metrics_bytes_decoded(*len);
+        if (error == NULL) {
+            error = lcorehttp_body_meter_decoded(&reader->meter, *len, 0);
+        }
+        return error;
+    }
+
+    z_stream* strm = &reader->strm;
+    while (!reader->inflateEnded) {
+        if (strm->avail_in == 0) { // the previous input is used up, only then the raw buffer may be refilled
+            uint8_t* raw = NULL;
+            size_t rawLen = 0;
+            const char* error = body_reader_next_raw(reader, &raw, &rawLen);
+            if (error != NULL) {
+                return error;
+            }
+            if (rawLen == 0) {
+                return reader->eof ? NULL : "unexpected EOF";
+            }
+            strm->next_in = raw;
+            strm->avail_in = (uInt)rawLen;
+        }
+        strm->next_out = reader->out;
+        strm->avail_out = (uInt)reader->capacity;
+        int zRet = inflate(strm, Z_NO_FLUSH);
+        if (zRet == Z_STREAM_END) {
+            reader->inflateEnded = 1;
+        } else if (zRet != Z_OK && zRet != Z_BUF_ERROR) {
+            return "inflate error";
+        }
+        size_t have = reader->capacity - strm->avail_out;
+        if (have > 0) {
+            *data = reader->out;
+            *len = have;
+            lcorehttp_metrics_bytes_decoded(have);
+            return lcorehttp_body_meter_decoded(&reader->meter, have, 1);
+        }
+    }
+    return NULL;
+}
+
+int
+l_corehttp_body_reader_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_BODY_READER_METATABLE);
+    lua_pushcfunction(L, l_corehttp_body_reader_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_body_reader_gc);
+    lua_setfield(L, -2, "__close");
+    lua_pushstring(L, LCOREHTTP_BODY_READER_METATABLE);
+    lua_setfield(L, -2, "__type");
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef LCOREHTTP_BODY_H
+#define LCOREHTTP_BODY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "lcorehttp_limits.h"
+#include "lua.h"
+
+struct lcorehttp_response;
+
+// growable byte buffer for data that has to outlive a single read block
+typedef struct lcorehttp_bytes {
+    uint8_t* data;
+    size_t len;
+    size_t capacity;
+} lcorehttp_bytes;
+
+// makes room for extra more bytes after len, returns -1 when out of memory
+int lcorehttp_bytes_reserve(lcorehttp_bytes* bytes, size_t extra);
+int lcorehttp_bytes_append(lcorehttp_bytes* bytes, const void* data, size_t len);
+void lcorehttp_bytes_free(lcorehttp_bytes* bytes);
+
+// chunked transfer framing, only the chunk payload is kept
+typedef enum lcorehttp_dechunk_state {
+    DECHUNK_SIZE,
+    DECHUNK_EXTENSION,
+    DECHUNK_SIZE_LF,
+    DECHUNK_DATA,
+    DECHUNK_DATA_CR,
+    DECHUNK_DATA_LF,
+    DECHUNK_TRAILER,
+    DECHUNK_TRAILER_LINE,
+    DECHUNK_TRAILER_LF,
+    DECHUNK_DONE,
+} lcorehttp_dechunk_state;
+
+typedef struct lcorehttp_dechunker {
+    lcorehttp_dechunk_state state;
+    size_t remaining;
+    int hasDigits;
+    size_t excess; // input left over behind the last chunk by the call that reached DECHUNK_DONE
+} lcorehttp_dechunker;
+
+#define LCOREHTTP_DECHUNKER_INIT {.state = DECHUNK_SIZE, .remaining = 0, .hasDigits = 0, .excess = 0}
+
+/**
+ * @brief Strip chunked framing from data in place, input may be split at any byte.
+ *
+ * @return Number of payload bytes now at the start of data, (size_t)-1 on a framing error.
+ */
+size_t lcorehttp_dechunk(lcorehttp_dechunker* dechunker, uint8_t* data, size_t len);
+
+/*
+ * Pull reader over the decoded body of a response: chunked framing and gzip/deflate Content-Encoding are
+ * removed, every call hands out the next block of payload. Used by the C consumers (read_json, lines, events)
+ * that parse the body without materializing it as a Lua string.
+ */
+typedef struct lcorehttp_body_reader {
+    struct lcorehttp_response* response;
+    lcorehttp_dechunker dechunker;
+    size_t remaining; // Content-Length bytes left, (size_t)-1 when the body is delimited otherwise
+    int eof;
+    int inflateMode; // 0: none, 1: gzip, 2: deflate
+    int inflateReady;
+    int inflateEnded;
+    z_stream strm;
+    uint8_t* raw;
+    uint8_t* out;
+    size_t capacity;
+    lcorehttp_body_meter meter; // limits of the response, without memory budget
+} lcorehttp_body_reader;
+
+#define LCOREHTTP_BODY_READER_METATABLE "COREHTTP_BODY_READER"
+
+/**
+ * @brief Push a body reader userdata (closed by __gc) for the response at responseIdx.
+ *
+ * The response has to stay alive as long as the reader is used.
+ */
+lcorehttp_body_reader* l_corehttp_new_body_reader(lua_State* L, int responseIdx, size_t bufferSize);
+
+/**
+ * @brief Next block of decoded payload in *data (valid until the next call), *len is 0 at the end of the body.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* lcorehttp_body_reader_next(lcorehttp_body_reader* reader, const uint8_t** data, size_t* len);
+
+int l_corehttp_body_reader_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_BODY_H */
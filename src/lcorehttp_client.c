@@ -1,438 +1,1154 @@
-#include "lcorehttp_client.h"
-#include <lauxlib.h>
-#include <lua.h>
-#include <lualib.h>
-#include <stdlib.h>
-#include <string.h>
-#include "core_http_client.h"
-#include "extended_core_http_client.h"
-#include "lerror.h"
-#include "lss_options.h"
-#include "socket.h"
-#include "socket_mbedtls.h"
-#include "transport_mbedtls.h"
-#include "transport_plaintext.h"
-
-int
-push_error_status(lua_State* L, int httpStatus) {
-    lua_pushnil(L);
-    lua_pushinteger(L, httpStatus);
-    lua_pushstring(L, HTTPClient_strerror(httpStatus));
-    return 3;
-}
-
-lcorehttp_client_connection_options
-load_corehttp_client_connection_options(lua_State* L, lss_connection_kind kind, int idx) {
-    lcorehttp_client_connection_options options = {0};
-    if (!lua_istable(L, idx)) {
-        return options;
-    }
-
-    // push to top
-    lua_pushvalue(L, idx);
-
-    switch (kind) {
-        case LSS_CONNECTION_KIND_PLAINTEXT: options.plaintext = lss_load_plaintext_connection_options(L); break;
-        case LSS_CONNECTION_KIND_TLS: options.tls = lss_load_tls_connection_options(L); break;
-    }
-
-    // cleanup
-    lua_pop(L, 1);
-    return options;
-}
-
-int
-l_corehttp_newclient(lua_State* L) {
-    int nargs = lua_gettop(L);
-    lcorehttp_client* client = (lcorehttp_client*)lua_newuserdata(L, sizeof(lcorehttp_client));
-    client->portno = -1;
-    client->closed = 0;
-
-    if (lua_istable(L, nargs) || lua_isnil(L, nargs)) { // right now there are no options
-        // last are options, substract nargs by 1
-        nargs--;
-    }
-
-    const char* protocol = "https";
-
-    if (nargs == 1) {
-        client->hostname = strdup(luaL_checklstring(L, 1, &client->hostname_len));
-    } else if (nargs == 2) {
-        if (lua_type(L, 1) == LUA_TSTRING) {
-            protocol = strdup(lua_tostring(L, 1));
-        }
-        client->hostname = strdup(luaL_checklstring(L, 2, &client->hostname_len));
-    } else if (nargs == 3) {
-        if (lua_type(L, 1) == LUA_TSTRING) {
-            protocol = strdup(lua_tostring(L, 1));
-        }
-        client->hostname = strdup(luaL_checklstring(L, 2, &client->hostname_len));
-        if (lua_type(L, 3) == LUA_TNUMBER) { // port number (optional)
-            client->portno = lua_tointeger(L, 3);
-        }
-    } else {
-        return luaL_error(L, "invalid number of arguments");
-    }
-
-    if (strcmp(protocol, "http") == 0) {
-        client->kind = LSS_CONNECTION_KIND_PLAINTEXT;
-    } else if (strcmp(protocol, "https") == 0) {
-        client->kind = LSS_CONNECTION_KIND_TLS;
-    } else {
-        return luaL_error(L, "invalid protocol");
-    }
-
-    if (client->portno == -1) {
-        if (strcmp(protocol, "https") == 0) {
-            client->portno = HTTPS_PORT;
-        } else if (strcmp(protocol, "http") == 0) {
-            client->portno = HTTP_PORT;
-        }
-    }
-
-    if (client->portno < 0 || client->portno > 65535) {
-        return luaL_error(L, "invalid port number");
-    }
-
-    if (client->hostname_len == 0) {
-        return luaL_error(L, "invalid hostname");
-    }
-
-    luaL_getmetatable(L, LCOREHTTP_CLIENT_METATABLE);
-    lua_setmetatable(L, -2);
-
-    return 1; // return the userdata to Lua
-}
-
-int
-corehttp_client_create_transport(lua_State* L, const lcorehttp_client* client,
-                                 TransportInterface_t* const pTransportInterface,
-                                 lcorehttp_client_connection_options options) {
-    NetworkContext_t* networkContext = NULL;
-    switch (client->kind) {
-        case LSS_CONNECTION_KIND_PLAINTEXT: {
-            lss_connection_result connectionResult =
-                lss_open_connection(client->hostname, client->portno, options.plaintext);
-            if (connectionResult.error_num != 0) {
-                return push_error(L, "failed to open plaintext connection");
-            }
-            networkContext = malloc(sizeof(NetworkContext_t));
-            networkContext->kind = LSS_PLAINTEXT_CONTEXT_KIND;
-            networkContext->context.plaintext = connectionResult.context;
-            break;
-        }
-        case LSS_CONNECTION_KIND_TLS: {
-            // options have to be on top of the stack
-            lss_tls_connection_result connectionResult =
-                lss_open_tls_connection(client->hostname, client->portno, options.tls);
-            if (connectionResult.error_num != 0) {
-                return push_error(L, "failed to open tls connection");
-            }
-            networkContext = malloc(sizeof(NetworkContext_t));
-            networkContext->kind = LSS_TLS_CONTEXT_KIND;
-            networkContext->context.tls = connectionResult.context;
-        }
-    }
-    pTransportInterface->recv = lss_recv;
-    pTransportInterface->send = lss_send;
-    pTransportInterface->pNetworkContext = networkContext;
-    return 0;
-}
-
-int
-l_corehttp_client_gc(lua_State* L) {
-    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
-    if (client->closed) {
-        return 0;
-    }
-    free((void*)client->hostname);
-    client->closed = 1;
-    return 0;
-}
-
-int
-l_corehttp_client_tostring(lua_State* L) {
-    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
-    const char* protocol = NULL;
-    switch (client->kind) {
-        case LSS_CONNECTION_KIND_PLAINTEXT: protocol = "http"; break;
-        case LSS_CONNECTION_KIND_TLS: protocol = "https"; break;
-    }
-    lua_pushfstring(L, "lcorehttp_client (%s://%s:%d)", protocol, client->hostname, client->portno);
-    return 1;
-}
-
-int
-l_corehttp_client_endpoint(lua_State* L) {
-    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
-    const char* protocol = NULL;
-    switch (client->kind) {
-        case LSS_CONNECTION_KIND_PLAINTEXT: protocol = "http"; break;
-        case LSS_CONNECTION_KIND_TLS: protocol = "https"; break;
-    }
-    lua_pushfstring(L, "%s://%s:%d", protocol, client->hostname, client->portno);
-    return 1;
-}
-
-int
-initializeRequestHeaders(lua_State* L, lcorehttp_client* client, HTTPRequestHeaders_t* requestHeaders) {
-    HTTPRequestInfo_t requestInfo = {0};
-    size_t buffer_size = DEFAULT_COREHTTP_BUFFER_SIZE;
-    // get path from second argument
-    requestInfo.pPath = luaL_checklstring(L, 2, &requestInfo.pathLen);
-    // get method from third argument
-    requestInfo.pMethod = luaL_checklstring(L, 3, &requestInfo.methodLen);
-    requestInfo.reqFlags = 0; // TODO: do we want HTTP_REQUEST_KEEP_ALIVE_FLAG ?
-    if (lua_istable(L, 4)) {
-        // get request flags
-        lua_getfield(L, 4, "requestFlags");
-        if (lua_isinteger(L, -1)) {
-            requestInfo.reqFlags = lua_tointeger(L, -1);
-        }
-        lua_pop(L, 1);
-
-        // get buffer size
-        lua_getfield(L, 4, "buffer_size");
-        if (lua_isinteger(L, -1)) {
-            buffer_size = lua_tointeger(L, -1);
-            if (buffer_size < MINIMUM_COREHTTP_BUFFER_SIZE) {
-                buffer_size = MINIMUM_COREHTTP_BUFFER_SIZE;
-            } else if (buffer_size > MAXIMUM_COREHTTP_BUFFER_SIZE) {
-                buffer_size = MAXIMUM_COREHTTP_BUFFER_SIZE;
-            }
-        }
-        lua_pop(L, 1);
-
-        // keep alive
-        lua_getfield(L, 4, "keepAlive");
-        if (!lua_isboolean(L, -1) || lua_toboolean(L, -1)) { // default is true
-            requestInfo.reqFlags |= HTTP_REQUEST_KEEP_ALIVE_FLAG;
-        }
-        lua_pop(L, 1);
-    }
-    requestInfo.pHost = client->hostname;
-    requestInfo.hostLen = client->hostname_len;
-    requestHeaders->pBuffer = malloc(buffer_size);
-    if (requestHeaders->pBuffer == NULL) {
-        return push_error(L, "failed to allocate buffer");
-    }
-    requestHeaders->bufferLen = buffer_size;
-
-    // initialize request headers
-    HTTPStatus_t httpStatus = HTTPClient_InitializeRequestHeaders(requestHeaders, &requestInfo);
-    if (httpStatus != HTTPSuccess) {
-        return push_error_status(L, httpStatus);
-    }
-
-    if (lua_istable(L, 4)) {
-        // headers
-        lua_getfield(L, 4, "headers");
-        if (lua_istable(L, -1)) {
-            // iterate over headers
-            lua_pushnil(L);
-            while (lua_next(L, -2) != 0) {
-                // key is at -2, value is at -1
-                size_t header_len = 0;
-                const char* header = lua_tolstring(L, -2, &header_len);
-                size_t value_len = 0;
-                const char* value = lua_tolstring(L, -1, &value_len);
-                if (header_len > 0) {
-                    HTTPStatus_t httpStatus =
-                        HTTPClient_AddHeader(requestHeaders, header, header_len, value, value_len);
-                    if (httpStatus != HTTPSuccess) {
-                        return push_error_status(L, httpStatus);
-                    }
-                }
-                lua_pop(L, 1); // remove value, keep key for next iteration
-            }
-        }
-        lua_pop(L, 1);
-
-        // range header
-        int rangeStart = -1;
-        int hasRangeStart = 0;
-        lua_getfield(L, 4, "rangeStart");
-        if (lua_isinteger(L, -1)) {
-            rangeStart = lua_tointeger(L, -1);
-            hasRangeStart = 1;
-        }
-        lua_pop(L, 1);
-        int rangeEnd = -1;
-        int hasRangeEnd = 0;
-        lua_getfield(L, 4, "rangeEnd");
-        if (lua_isinteger(L, -1)) {
-            rangeEnd = lua_tointeger(L, -1);
-            hasRangeEnd = 1;
-        }
-        lua_pop(L, 1);
-        if (rangeStart >= 0 && rangeEnd >= 0) {
-            HTTPStatus_t httpStatus = HTTPClient_AddRangeHeader(requestHeaders, rangeStart, rangeEnd);
-            if (httpStatus != HTTPSuccess) {
-                return push_error_status(L, httpStatus);
-            }
-        } else if ((hasRangeStart && !hasRangeEnd) || (!hasRangeStart && hasRangeEnd)) {
-            return push_error(L, "rangeStart and rangeEnd must be specified together");
-        } else if (hasRangeStart || hasRangeEnd) {
-            return push_error(L, "rangeStart and rangeEnd must be positive integers");
-        }
-    }
-    return 0;
-}
-
-void
-preloadHeader(void* pContext, const char* fieldLoc, size_t fieldLen, const char* valueLoc, size_t valueLen,
-              uint16_t statusCode) {
-    lua_State* L = (lua_State*)pContext;
-
-    // Add the field and value to the Lua table
-    lua_pushlstring(L, fieldLoc, fieldLen); // Push field as key
-    lua_pushlstring(L, valueLoc, valueLen); // Push value as value
-    lua_settable(L, -3);                    // Set key-value pair in table
-}
-
-int
-l_corehttp_client_request(lua_State* L) {
-    HTTPRequestHeaders_t requestHeaders = {0};
-    HTTPStatus_t httpStatus = HTTPSuccess;
-    HTTPClient_ResponseHeaderParsingCallback_t headerParsingCallback = {.pContext = L,
-                                                                        .onHeaderCallback = preloadHeader};
-    uint32_t sendFlags = 0;
-    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
-    if (client->closed) {
-        return push_error(L, "client is closed");
-    }
-    int resultCount = 0;
-    if ((resultCount = initializeRequestHeaders(L, client, &requestHeaders)) != 0) {
-        return resultCount;
-    }
-
-    size_t body_len = 0;
-    const uint8_t* body = NULL;
-
-    // fourth on the stack may be options table
-    if (lua_istable(L, 4)) {
-        // get body
-        lua_getfield(L, 4, "body");
-        if (lua_isstring(L, -1)) {
-            body = (const uint8_t*)lua_tolstring(L, -1, &body_len);
-        }
-        lua_pop(L, 1);
-        // write_body_hook
-        lua_getfield(L, 4, "write_body_hook");
-        if (lua_isfunction(L, -1)) {
-            sendFlags |= HTTP_SEND_DISABLE_CONTENT_LENGTH_FLAG;
-            body_len = 0;
-        }
-        lua_pop(L, 1);
-    }
-
-    lcorehttp_client_connection_options options =
-        load_corehttp_client_connection_options(L, client->kind, 4); // options are -2, client is -1
-
-    TransportInterface_t* transportInterface = malloc(sizeof(TransportInterface_t));
-    resultCount = corehttp_client_create_transport(L, client, transportInterface, options);
-    switch (client->kind) {
-        case LSS_CONNECTION_KIND_PLAINTEXT: lss_free_plain_connection_options(options.plaintext); break;
-        case LSS_CONNECTION_KIND_TLS: lss_free_tls_connection_options(options.tls); break;
-    }
-
-    if (resultCount != 0) {
-        free(requestHeaders.pBuffer);
-        free(transportInterface);
-        return resultCount;
-    }
-
-    lcorehttp_response* response = l_corehttp_new_response(L);
-    if (response == NULL) {
-        return push_error(L, "failed to create response");
-    }
-    response->transport = transportInterface;
-    response->response.pBuffer = requestHeaders.pBuffer; // reuse buffer for response
-    response->response.bufferLen = requestHeaders.bufferLen;
-    response->response.respOptionFlags = HTTP_RESPONSE_DO_NOT_PARSE_BODY_FLAG;
-
-    lua_newtable(L); // for headers
-    response->response.pHeaderParsingCallback = &headerParsingCallback;
-
-    response->status = HTTPClient_Validate(transportInterface, &requestHeaders, body, body_len, &response->response);
-    if (response->status != HTTPSuccess) {
-        return push_error_status(L, response->status);
-    }
-
-    response->status = HTTPClient_SendHttpHeaders(transportInterface, response->response.getTime, &requestHeaders,
-                                                  body_len, sendFlags);
-    if (response->status != HTTPSuccess) {
-        return push_error_status(L, response->status);
-    }
-
-    if (body_len > 0) { // entire body passed to this function, no hook
-        response->status = HTTPClient_Write(transportInterface, response->response.getTime, body, body_len);
-        if (response->status != HTTPSuccess) {
-            return push_error_status(L, response->status);
-        }
-    } else if (lua_istable(L, 4)) {
-        lua_getfield(L, 4, "write_body_hook");
-        if (lua_isfunction(L, -1)) {
-            lua_pushvalue(L, -1);
-            lcorehttp_preresponse* preresponse = l_corehttp_new_preresponse(L);
-            if (preresponse == NULL) {
-                return push_error(L, "failed to create preresponse");
-            }
-            preresponse->transport = transportInterface;
-            preresponse->response = &response->response;
-            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
-                return push_error(L, lua_tostring(L, -1));
-            }
-        }
-        lua_pop(L, 1);
-    }
-
-    response->status = HTTPClient_ReceiveAndParseHttpResponse(transportInterface, &response->response, &requestHeaders);
-    if ((response->status == HTTPInsufficientMemory || response->status == HTTPPartialResponse)
-        && response->response.areHeadersComplete) { // headers are complete, we can read the body later
-        response->status = HTTPSuccess;
-    }
-    response->strStatus = HTTPClient_strerror(response->status);
-    response->contentLength = response->response.contentLength;
-
-    const char* transferEncodingHeaderValue = NULL;
-    size_t transferEncodingHeaderValueLen = 0;
-    HTTPStatus_t status =
-        HTTPClient_ReadHeader(&response->response, TRANSFER_ENCODING_HEADER, strlen(TRANSFER_ENCODING_HEADER),
-                              &transferEncodingHeaderValue, &transferEncodingHeaderValueLen);
-    if (status == HTTPSuccess) {
-        if (strncmp(transferEncodingHeaderValue, "chunked", transferEncodingHeaderValueLen) == 0) {
-            response->contentLength = -1;
-            response->isChunked = 1;
-        }
-    }
-
-    luaL_getmetatable(L, LCOREHTTP_HEADERS_METATABLE);
-    lua_setmetatable(L, -2);
-    lua_setiuservalue(L, -2, 1);
-
-    return 1;
-}
-
-int
-l_corehttp_client_create_meta(lua_State* L) {
-    luaL_newmetatable(L, LCOREHTTP_CLIENT_METATABLE);
-    /* Metamethods */
-    lua_newtable(L);
-    lua_pushcfunction(L, l_corehttp_client_tostring);
-    lua_setfield(L, -2, "__tostring");
-    lua_pushcfunction(L, l_corehttp_client_request);
-    lua_setfield(L, -2, "request");
-    lua_pushcfunction(L, l_corehttp_client_endpoint);
-    lua_setfield(L, -2, "endpoint");
-    lua_pushstring(L, LCOREHTTP_CLIENT_METATABLE);
-    lua_setfield(L, -2, "__type");
-    /* Metamethods */
-    lua_setfield(L, -2, "__index");
-
-    lua_pushcfunction(L, l_corehttp_client_gc);
-    lua_setfield(L, -2, "__gc");
-    lua_pushcfunction(L, l_corehttp_client_gc);
-    lua_setfield(L, -2, "__close");
-    return 1;
+#include "lcorehttp_client.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core_http_client.h"
+#include "extended_core_http_client.h"
+#include "lcorehttp_async.h"
+#include "lcorehttp_h2.h"
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_multipart.h"
+#include "lcorehttp_pool.h"
+#include "lcorehttp_prepared.h"
+#include "lcorehttp_probes.h"
+#include "lcorehttp_redirect.h"
+#include "lcorehttp_time.h"
+#include "lcorehttp_websocket.h"
+#include "lerror.h"
+#include "lss_options.h"
+#include "socket.h"
+#include "socket_mbedtls.h"
+#include "transport_mbedtls.h"
+#include "transport_plaintext.h"
+
+int
+push_error_status(lua_State* L, int httpStatus) {
+    lcorehttp_metrics_error(httpStatus);
+    lua_pushnil(L);
+    lua_pushinteger(L, httpStatus);
+    lua_pushstring(L, HTTPClient_strerror(httpStatus));
+    return 3;
+}
+
+lcorehttp_client_connection_options
+load_corehttp_client_connection_options(lua_State* L, lss_connection_kind kind, int idx) {
+    lcorehttp_client_connection_options options = {0};
+    if (!lua_istable(L, idx)) {
+        return options;
+    }
+
+    // push to top
+    lua_pushvalue(L, idx);
+
+    switch (kind) {
+        case LSS_CONNECTION_KIND_PLAINTEXT: options.plaintext = lss_load_plaintext_connection_options(L); break;
+        case LSS_CONNECTION_KIND_TLS: options.tls = lss_load_tls_connection_options(L); break;
+    }
+
+    // cleanup
+    lua_pop(L, 1);
+    return options;
+}
+
+int
+l_corehttp_newclient(lua_State* L) {
+    int nargs = lua_gettop(L);
+    lcorehttp_client* client = (lcorehttp_client*)lua_newuserdata(L, sizeof(lcorehttp_client));
+    client->portno = -1;
+    client->closed = 0;
+    client->hostname = NULL;
+    client->hostname_len = 0;
+    client->unixPath = NULL;
+    lcorehttp_pool_init(&client->pool, 0, LCOREHTTP_POOL_DEFAULT_IDLE_TIMEOUT_MS);
+    lcorehttp_socket_options_init(&client->socketOptions);
+    client->shaping.download = NULL;
+    client->shaping.upload = NULL;
+    client->tls = NULL;
+    client->h2 = NULL;
+    memset(&client->limits, 0, sizeof(client->limits));
+    client->budget = NULL;
+    // from here on __gc frees whatever was allocated when an invalid argument or option raises below
+    luaL_getmetatable(L, LCOREHTTP_CLIENT_METATABLE);
+    lua_setmetatable(L, -2);
+
+    int optionsIdx = 0;
+    if (lua_istable(L, nargs) || lua_isnil(L, nargs)) {
+        // last are options, substract nargs by 1
+        optionsIdx = lua_istable(L, nargs) ? nargs : 0;
+        nargs--;
+    }
+
+    const char* protocol = "https";
+
+    if (nargs == 1) {
+        client->hostname = strdup(luaL_checklstring(L, 1, &client->hostname_len));
+    } else if (nargs == 2) {
+        if (lua_type(L, 1) == LUA_TSTRING) {
+            protocol = lua_tostring(L, 1);
+        }
+        client->hostname = strdup(luaL_checklstring(L, 2, &client->hostname_len));
+    } else if (nargs == 3) {
+        if (lua_type(L, 1) == LUA_TSTRING) {
+            protocol = lua_tostring(L, 1);
+        }
+        client->hostname = strdup(luaL_checklstring(L, 2, &client->hostname_len));
+        if (lua_type(L, 3) == LUA_TNUMBER) { // port number (optional)
+            client->portno = lua_tointeger(L, 3);
+        }
+    } else {
+        return luaL_error(L, "invalid number of arguments");
+    }
+    if (client->hostname == NULL) {
+        return luaL_error(L, "failed to allocate hostname");
+    }
+
+    int unixSocket = strcmp(protocol, "http+unix") == 0;
+    if (strcmp(protocol, "http") == 0 || unixSocket) {
+        client->kind = LSS_CONNECTION_KIND_PLAINTEXT;
+    } else if (strcmp(protocol, "https") == 0) {
+        client->kind = LSS_CONNECTION_KIND_TLS;
+    } else {
+        return luaL_error(L, "invalid protocol");
+    }
+
+    if (unixSocket) {
+        if (client->portno != -1) {
+            return luaL_error(L, "http+unix clients take no port");
+        }
+        client->portno = 0;
+    } else if (client->portno == -1) {
+        if (strcmp(protocol, "https") == 0) {
+            client->portno = HTTPS_PORT;
+        } else if (strcmp(protocol, "http") == 0) {
+            client->portno = HTTP_PORT;
+        }
+    }
+
+    if (client->portno < 0 || client->portno > 65535) {
+        return luaL_error(L, "invalid port number");
+    }
+
+    if (client->hostname_len == 0) {
+        return luaL_error(L, "invalid hostname");
+    }
+
+    if (unixSocket) { // the second argument is the socket path
+        client->unixPath = client->hostname;
+        client->hostname = strdup("localhost");
+        if (client->hostname == NULL) {
+            return luaL_error(L, "failed to allocate hostname");
+        }
+        client->hostname_len = strlen("localhost");
+    }
+
+    if (optionsIdx != 0) {
+        // keep-alive connection reuse, disabled unless max_idle_connections > 0
+        lua_Integer maxIdle = 0;
+        lua_Integer idleTimeout = LCOREHTTP_POOL_DEFAULT_IDLE_TIMEOUT_MS;
+        lua_getfield(L, optionsIdx, "max_idle_connections");
+        if (lua_isinteger(L, -1)) {
+            maxIdle = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "idle_timeout");
+        if (lua_isinteger(L, -1)) {
+            idleTimeout = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        if (maxIdle < 0 || idleTimeout <= 0 || idleTimeout > UINT32_MAX) {
+            return luaL_error(L, "invalid connection pool options");
+        }
+        if (lcorehttp_pool_init(&client->pool, (size_t)maxIdle, (uint32_t)idleTimeout) != 0) {
+            return luaL_error(L, "failed to allocate connection pool");
+        }
+
+        // native connector with Happy Eyeballs (RFC 8305)
+        lua_getfield(L, optionsIdx, "happy_eyeballs");
+        client->socketOptions.happyEyeballs = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_Integer connectTimeout = LCOREHTTP_SOCKET_DEFAULT_CONNECT_TIMEOUT_MS;
+        lua_Integer attemptDelay = LCOREHTTP_SOCKET_DEFAULT_ATTEMPT_DELAY_MS;
+        lua_Integer ioTimeout = LCOREHTTP_SOCKET_DEFAULT_IO_TIMEOUT_MS;
+        lua_getfield(L, optionsIdx, "connect_timeout");
+        if (lua_isinteger(L, -1)) {
+            connectTimeout = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "connection_attempt_delay");
+        if (lua_isinteger(L, -1)) {
+            attemptDelay = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "io_timeout");
+        if (lua_isinteger(L, -1)) {
+            ioTimeout = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        if (connectTimeout <= 0 || connectTimeout > INT32_MAX || attemptDelay < 0 || attemptDelay > INT32_MAX ||
+            ioTimeout <= 0 || ioTimeout > INT32_MAX) {
+            return luaL_error(L, "invalid connect options");
+        }
+        if (attemptDelay < LCOREHTTP_SOCKET_MINIMUM_ATTEMPT_DELAY_MS) {
+            attemptDelay = LCOREHTTP_SOCKET_MINIMUM_ATTEMPT_DELAY_MS;
+        }
+        client->socketOptions.connectTimeoutMs = (uint32_t)connectTimeout;
+        client->socketOptions.attemptDelayMs = (uint32_t)attemptDelay;
+        client->socketOptions.ioTimeoutMs = (uint32_t)ioTimeout;
+
+        // socket tuning, applied by the native connector
+        lcorehttp_socket_options* socketOptions = &client->socketOptions;
+        lua_getfield(L, optionsIdx, "tcp_nodelay");
+        socketOptions->noDelay = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "tcp_quickack");
+        socketOptions->quickAck = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "tcp_fast_open");
+        socketOptions->fastOpen = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "tcp_keepalive");
+        socketOptions->keepAlive = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, optionsIdx, "io_uring");
+        socketOptions->ioUring = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (socketOptions->ioUring && client->kind != LSS_CONNECTION_KIND_PLAINTEXT) {
+            return luaL_error(L, "io_uring is only supported for http clients");
+        }
+        const char* sizeOptions[] = {"recv_buffer", "send_buffer", "tcp_keepalive_idle", "tcp_keepalive_interval",
+                                     "tcp_keepalive_count"};
+        int* sizeValues[] = {&socketOptions->recvBuffer, &socketOptions->sendBuffer, &socketOptions->keepAliveIdle,
+                             &socketOptions->keepAliveInterval, &socketOptions->keepAliveCount};
+        for (size_t i = 0; i < sizeof(sizeOptions) / sizeof(sizeOptions[0]); i++) {
+            lua_getfield(L, optionsIdx, sizeOptions[i]);
+            if (lua_isinteger(L, -1)) {
+                lua_Integer value = lua_tointeger(L, -1);
+                if (value <= 0 || value > INT32_MAX) {
+                    return luaL_error(L, "invalid %s", sizeOptions[i]);
+                }
+                *sizeValues[i] = (int)value;
+            }
+            lua_pop(L, 1);
+        }
+        // the native TLS connector (shared tls_config, TLS 1.3 early data or HTTP/2) also takes the socket options
+        lcorehttp_tls_config* tlsConfig = NULL;
+        if (lcorehttp_tls_config_option(L, optionsIdx, &tlsConfig) != 0) {
+            return luaL_error(L, "invalid tls_config");
+        }
+        lua_getfield(L, optionsIdx, "tls_early_data");
+        int earlyData = lua_toboolean(L, -1);
+        lua_getfield(L, optionsIdx, "http2");
+        int http2 = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+        int nativeTls = earlyData || http2 || tlsConfig != NULL;
+        if (nativeTls && client->kind != LSS_CONNECTION_KIND_TLS) {
+            return luaL_error(L, "tls options are only supported for https clients");
+        }
+        if (earlyData && tlsConfig != NULL) {
+            return luaL_error(L, "tls_early_data cannot be combined with tls_config, use its early_data option");
+        }
+        if (http2 && tlsConfig != NULL) {
+            return luaL_error(L, "http2 cannot be combined with tls_config, use its http2 option");
+        }
+        if (http2 && earlyData) {
+            return luaL_error(L, "http2 cannot be combined with tls_early_data");
+        }
+        if ((socketOptions->happyEyeballs || lcorehttp_socket_options_tuned(socketOptions))
+            && client->kind != LSS_CONNECTION_KIND_PLAINTEXT && !nativeTls) {
+            return luaL_error(L, "socket options are only supported for http clients");
+        }
+        lcorehttp_tls_options tlsOptions = {.verify = 1, .earlyData = earlyData, .http2 = http2};
+        lua_getfield(L, optionsIdx, "tls_verify");
+        if (!lua_isnil(L, -1)) {
+            tlsOptions.verify = lua_toboolean(L, -1);
+        }
+        lua_getfield(L, optionsIdx, "tls_ca_file"); // the string stays referenced by the options table
+        tlsOptions.caFile = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+        lua_pop(L, 2);
+
+        // body size limits and the memory budget of bodies buffered at the same time
+        if (lcorehttp_body_limits_load(L, optionsIdx, &client->limits) != 0) {
+            return luaL_error(L, "invalid body limit options");
+        }
+        lua_Integer memoryBudget = 0;
+        lua_getfield(L, optionsIdx, "memory_budget");
+        if (lua_isinteger(L, -1)) {
+            memoryBudget = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        if (memoryBudget < 0) {
+            return luaL_error(L, "invalid memory_budget");
+        }
+
+        // bandwidth shaping, on top of the process-wide limits of corehttp.set_rate_limit
+        lua_Integer rates[3] = {0, 0, 0};
+        const char* rateOptions[] = {"max_download_rate", "max_upload_rate", "rate_burst"};
+        for (int i = 0; i < 3; i++) {
+            lua_getfield(L, optionsIdx, rateOptions[i]);
+            if (!lua_isnil(L, -1)) {
+                rates[i] = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : -1;
+            }
+            lua_pop(L, 1);
+            if (rates[i] < 0) {
+                return luaL_error(L, "%s must be a non-negative integer", rateOptions[i]);
+            }
+        }
+        int failed = 0;
+        client->shaping.download = lcorehttp_rate_limit_new((uint64_t)rates[0], (uint64_t)rates[2], &failed);
+        if (!failed) {
+            client->shaping.upload = lcorehttp_rate_limit_new((uint64_t)rates[1], (uint64_t)rates[2], &failed);
+        }
+        if (failed) {
+            return luaL_error(L, "failed to allocate rate limits");
+        }
+        client->budget = lcorehttp_memory_budget_new((uint64_t)memoryBudget, &failed);
+        if (failed) {
+            return luaL_error(L, "failed to allocate memory budget");
+        }
+
+        if (tlsConfig != NULL) {
+            lcorehttp_tls_config_retain(tlsConfig);
+            client->tls = tlsConfig;
+        } else if (earlyData || http2) {
+            const char* error = lcorehttp_tls_config_new(&tlsOptions, &client->tls);
+            if (error != NULL) {
+                return luaL_error(L, "%s", error);
+            }
+        }
+    }
+
+    return 1; // return the userdata to Lua
+}
+
+const char*
+corehttp_client_connect(const lcorehttp_client* client, TransportInterface_t* const pTransportInterface,
+                        lcorehttp_client_connection_options options, lcorehttp_timings* timings) {
+    NetworkContext_t* networkContext = NULL;
+    uint64_t connectStart = l_corehttp_get_time_us();
+    LCOREHTTP_PROBE3(connect__start, client->hostname, client->portno, client->kind == LSS_CONNECTION_KIND_TLS);
+    if (client->unixPath != NULL) {
+        lcorehttp_socket* socket = NULL;
+        const char* error = lcorehttp_socket_connect_unix(client->unixPath, &client->socketOptions, timings, &socket);
+        if (error != NULL) {
+            lcorehttp_metrics_connect_error();
+            LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, -1,
+                             l_corehttp_get_time_us() - connectStart);
+            return error;
+        }
+        lcorehttp_metrics_connection_opened(0);
+        LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, 0, timings->connect);
+        pTransportInterface->recv = lcorehttp_socket_recv;
+        pTransportInterface->send = lcorehttp_socket_send;
+        pTransportInterface->pNetworkContext = (NetworkContext_t*)socket;
+        return NULL;
+    }
+    if (client->tls != NULL) {
+        lcorehttp_tls* tls = NULL;
+        const char* error = lcorehttp_tls_connect(client->hostname, client->portno, &client->socketOptions,
+                                                  client->tls, timings, &tls);
+        if (error != NULL) {
+            lcorehttp_metrics_connect_error();
+            LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, -1,
+                             l_corehttp_get_time_us() - connectStart);
+            return error;
+        }
+        lcorehttp_metrics_connection_opened(1);
+        LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, 0, timings->connect);
+        if (tls->handshakeDone) { // a deferred handshake completes with the first send
+            LCOREHTTP_PROBE4(handshake__end, client->hostname, client->portno, 0, timings->tlsHandshake);
+        }
+        TransportInterface_t connection = {.recv = lcorehttp_tls_recv,
+                                           .send = lcorehttp_tls_send,
+                                           .pNetworkContext = (NetworkContext_t*)tls};
+        if (lcorehttp_tls_http2(tls)) { // the server picked h2, the request becomes the first stream
+            return lcorehttp_h2_connect(client->hostname, client->portno, client->socketOptions.ioTimeoutMs,
+                                        &connection, pTransportInterface);
+        }
+        *pTransportInterface = connection;
+        return NULL;
+    }
+    switch (client->kind) {
+        case LSS_CONNECTION_KIND_PLAINTEXT: {
+            if (client->socketOptions.happyEyeballs || lcorehttp_socket_options_tuned(&client->socketOptions)) {
+                lcorehttp_socket* socket = NULL;
+                const char* error = lcorehttp_socket_connect(client->hostname, client->portno, &client->socketOptions,
+                                                             timings, &socket);
+                if (error != NULL) {
+                    lcorehttp_metrics_connect_error();
+                    LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, -1,
+                                     l_corehttp_get_time_us() - connectStart);
+                    return error;
+                }
+                lcorehttp_metrics_connection_opened(0);
+                LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, 0, timings->connect);
+                pTransportInterface->recv = lcorehttp_socket_recv;
+                pTransportInterface->send = lcorehttp_socket_send;
+                pTransportInterface->pNetworkContext = (NetworkContext_t*)socket;
+                return NULL;
+            }
+            lss_connection_result connectionResult =
+                lss_open_connection(client->hostname, client->portno, options.plaintext);
+            if (connectionResult.error_num != 0) {
+                lcorehttp_metrics_connect_error();
+                LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, connectionResult.error_num,
+                                 l_corehttp_get_time_us() - connectStart);
+                return "failed to open plaintext connection";
+            }
+            networkContext = malloc(sizeof(NetworkContext_t));
+            networkContext->kind = LSS_PLAINTEXT_CONTEXT_KIND;
+            networkContext->context.plaintext = connectionResult.context;
+            break;
+        }
+        case LSS_CONNECTION_KIND_TLS: {
+            // options have to be on top of the stack
+            lss_tls_connection_result connectionResult =
+                lss_open_tls_connection(client->hostname, client->portno, options.tls);
+            if (connectionResult.error_num != 0) {
+                lcorehttp_metrics_connect_error();
+                LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, connectionResult.error_num,
+                                 l_corehttp_get_time_us() - connectStart);
+                return "failed to open tls connection";
+            }
+            networkContext = malloc(sizeof(NetworkContext_t));
+            networkContext->kind = LSS_TLS_CONTEXT_KIND;
+            networkContext->context.tls = connectionResult.context;
+        }
+    }
+    // lss resolves, connects and handshakes in a single call
+    timings->connect = (int64_t)(l_corehttp_get_time_us() - connectStart);
+    lcorehttp_metrics_connection_opened(client->kind == LSS_CONNECTION_KIND_TLS);
+    LCOREHTTP_PROBE4(connect__end, client->hostname, client->portno, 0, timings->connect);
+    if (client->kind == LSS_CONNECTION_KIND_TLS) {
+        LCOREHTTP_PROBE4(handshake__end, client->hostname, client->portno, 0, timings->connect);
+    }
+    pTransportInterface->recv = lss_recv;
+    pTransportInterface->send = lss_send;
+    pTransportInterface->pNetworkContext = networkContext;
+    return NULL;
+}
+
+int
+corehttp_client_create_transport(lua_State* L, const lcorehttp_client* client,
+                                 TransportInterface_t* const pTransportInterface,
+                                 lcorehttp_client_connection_options options, lcorehttp_timings* timings) {
+    const char* error = corehttp_client_connect(client, pTransportInterface, options, timings);
+    if (error != NULL) {
+        return push_error(L, error);
+    }
+    return 0;
+}
+
+int
+l_corehttp_client_gc(lua_State* L) {
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    if (client->closed) {
+        return 0;
+    }
+    lcorehttp_pool_close(client);
+    lcorehttp_shaping_release(&client->shaping);
+    lcorehttp_h2_release(client->h2); // open streams keep the connection until they are done
+    client->h2 = NULL;
+    lcorehttp_tls_config_release(client->tls);
+    client->tls = NULL;
+    lcorehttp_memory_budget_release(client->budget);
+    client->budget = NULL;
+    free((void*)client->hostname);
+    free((void*)client->unixPath);
+    client->closed = 1;
+    return 0;
+}
+
+int
+l_corehttp_client_tostring(lua_State* L) {
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    const char* protocol = NULL;
+    switch (client->kind) {
+        case LSS_CONNECTION_KIND_PLAINTEXT: protocol = "http"; break;
+        case LSS_CONNECTION_KIND_TLS: protocol = "https"; break;
+    }
+    if (client->unixPath != NULL) {
+        lua_pushfstring(L, "lcorehttp_client (http+unix://%s)", client->unixPath);
+        return 1;
+    }
+    lua_pushfstring(L, "lcorehttp_client (%s://%s:%d)", protocol, client->hostname, client->portno);
+    return 1;
+}
+
+int
+l_corehttp_client_endpoint(lua_State* L) {
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    const char* protocol = NULL;
+    switch (client->kind) {
+        case LSS_CONNECTION_KIND_PLAINTEXT: protocol = "http"; break;
+        case LSS_CONNECTION_KIND_TLS: protocol = "https"; break;
+    }
+    if (client->unixPath != NULL) {
+        lua_pushfstring(L, "http+unix://%s", client->unixPath);
+        return 1;
+    }
+    lua_pushfstring(L, "%s://%s:%d", protocol, client->hostname, client->portno);
+    return 1;
+}
+
+int
+initializeRequestHeaders(lua_State* L, lcorehttp_client* client, HTTPRequestHeaders_t* requestHeaders,
+                         uint32_t* requestFlags) {
+    HTTPRequestInfo_t requestInfo = {0};
+    size_t buffer_size = DEFAULT_COREHTTP_BUFFER_SIZE;
+    // get path from second argument
+    requestInfo.pPath = luaL_checklstring(L, 2, &requestInfo.pathLen);
+    // get method from third argument
+    requestInfo.pMethod = luaL_checklstring(L, 3, &requestInfo.methodLen);
+    requestInfo.reqFlags = 0; // TODO: do we want HTTP_REQUEST_KEEP_ALIVE_FLAG ?
+    if (lua_istable(L, 4)) {
+        // get request flags
+        lua_getfield(L, 4, "requestFlags");
+        if (lua_isinteger(L, -1)) {
+            requestInfo.reqFlags = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+
+        // get buffer size
+        lua_getfield(L, 4, "buffer_size");
+        if (lua_isinteger(L, -1)) {
+            buffer_size = lua_tointeger(L, -1);
+            if (buffer_size < MINIMUM_COREHTTP_BUFFER_SIZE) {
+                buffer_size = MINIMUM_COREHTTP_BUFFER_SIZE;
+            } else if (buffer_size > MAXIMUM_COREHTTP_BUFFER_SIZE) {
+                buffer_size = MAXIMUM_COREHTTP_BUFFER_SIZE;
+            }
+        }
+        lua_pop(L, 1);
+
+        // keep alive
+        lua_getfield(L, 4, "keepAlive");
+        if (!lua_isboolean(L, -1) || lua_toboolean(L, -1)) { // default is true
+            requestInfo.reqFlags |= HTTP_REQUEST_KEEP_ALIVE_FLAG;
+        }
+        lua_pop(L, 1);
+    }
+    requestInfo.pHost = client->hostname;
+    requestInfo.hostLen = client->hostname_len;
+    requestHeaders->pBuffer = malloc(buffer_size);
+    if (requestHeaders->pBuffer == NULL) {
+        return push_error(L, "failed to allocate buffer");
+    }
+    requestHeaders->bufferLen = buffer_size;
+    if (requestFlags != NULL) {
+        *requestFlags = requestInfo.reqFlags;
+    }
+
+    // initialize request headers
+    HTTPStatus_t httpStatus = HTTPClient_InitializeRequestHeaders(requestHeaders, &requestInfo);
+    if (httpStatus != HTTPSuccess) {
+        return push_error_status(L, httpStatus);
+    }
+
+    if (lua_istable(L, 4)) {
+        // headers
+        lua_getfield(L, 4, "headers");
+        if (lua_istable(L, -1)) {
+            // iterate over headers
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0) {
+                // key is at -2, value is at -1
+                size_t header_len = 0;
+                const char* header = lua_tolstring(L, -2, &header_len);
+                size_t value_len = 0;
+                const char* value = lua_tolstring(L, -1, &value_len);
+                if (header_len > 0) {
+                    HTTPStatus_t httpStatus =
+                        HTTPClient_AddHeader(requestHeaders, header, header_len, value, value_len);
+                    if (httpStatus != HTTPSuccess) {
+                        return push_error_status(L, httpStatus);
+                    }
+                }
+                lua_pop(L, 1); // remove value, keep key for next iteration
+            }
+        }
+        lua_pop(L, 1);
+
+        // range header
+        int rangeStart = -1;
+        int hasRangeStart = 0;
+        lua_getfield(L, 4, "rangeStart");
+        if (lua_isinteger(L, -1)) {
+            rangeStart = lua_tointeger(L, -1);
+            hasRangeStart = 1;
+        }
+        lua_pop(L, 1);
+        int rangeEnd = -1;
+        int hasRangeEnd = 0;
+        lua_getfield(L, 4, "rangeEnd");
+        if (lua_isinteger(L, -1)) {
+            rangeEnd = lua_tointeger(L, -1);
+            hasRangeEnd = 1;
+        }
+        lua_pop(L, 1);
+        if (rangeStart >= 0 && rangeEnd >= 0) {
+            HTTPStatus_t httpStatus = HTTPClient_AddRangeHeader(requestHeaders, rangeStart, rangeEnd);
+            if (httpStatus != HTTPSuccess) {
+                return push_error_status(L, httpStatus);
+            }
+        } else if ((hasRangeStart && !hasRangeEnd) || (!hasRangeStart && hasRangeEnd)) {
+            return push_error(L, "rangeStart and rangeEnd must be specified together");
+        } else if (hasRangeStart || hasRangeEnd) {
+            return push_error(L, "rangeStart and rangeEnd must be positive integers");
+        }
+    }
+    return 0;
+}
+
+void
+preloadHeader(void* pContext, const char* fieldLoc, size_t fieldLen, const char* valueLoc, size_t valueLen,
+              uint16_t statusCode) {
+    lcorehttp_header_context* context = (lcorehttp_header_context*)pContext;
+    lua_State* L = context->L;
+    // headers are parsed as soon as the first received bytes hit the buffer
+    if (context->timings->firstByteAt == 0) {
+        context->timings->firstByteAt = l_corehttp_get_time_us();
+        LCOREHTTP_PROBE3(first__byte, context->client->hostname, context->client->portno,
+                         context->timings->firstByteAt - context->sentAt);
+    }
+    if (L == NULL) { // background request, headers are collected from the response buffer later
+        return;
+    }
+
+    // Add the field and value to the Lua table
+    lua_pushlstring(L, fieldLoc, fieldLen); // Push field as key
+    lua_pushlstring(L, valueLoc, valueLen); // Push value as value
+    lua_settable(L, -3);                    // Set key-value pair in table
+}
+
+// receives and parses the response headers, shared by request and the request_async workers (no lua_State access)
+HTTPStatus_t
+corehttp_client_receive_response(const lcorehttp_client* client, lcorehttp_response* response,
+                                 const HTTPRequestHeaders_t* requestHeaders, uint64_t requestStart, uint64_t sendEnd) {
+    response->status = HTTPClient_ReceiveAndParseHttpResponse(response->transport, &response->response, requestHeaders);
+    uint64_t headersEnd = l_corehttp_get_time_us();
+    if (response->timings.firstByteAt == 0) {
+        response->timings.firstByteAt = headersEnd;
+    }
+    response->timings.firstByte = (int64_t)(response->timings.firstByteAt - sendEnd);
+    response->timings.headerParse = (int64_t)(headersEnd - response->timings.firstByteAt);
+    if ((response->status == HTTPInsufficientMemory || response->status == HTTPPartialResponse)
+        && response->response.areHeadersComplete) { // headers are complete, we can read the body later
+        response->status = HTTPSuccess;
+    }
+    response->strStatus = HTTPClient_strerror(response->status);
+    response->contentLength = response->response.contentLength;
+    LCOREHTTP_PROBE5(headers__parsed, client->hostname, client->portno, response->response.statusCode,
+                     response->status, response->response.contentLength);
+    if (response->status == HTTPSuccess) {
+        lcorehttp_metrics_bytes_received(
+            (response->response.pBody != NULL)
+                ? (size_t)(response->response.pBody - response->response.pBuffer) + response->response.bodyLen
+                : response->response.headersLen);
+        lcorehttp_metrics_request(client->hostname, client->portno, response->response.statusCode,
+                                  headersEnd - requestStart);
+    } else {
+        lcorehttp_metrics_error(response->status);
+    }
+
+    const char* transferEncodingHeaderValue = NULL;
+    size_t transferEncodingHeaderValueLen = 0;
+    HTTPStatus_t status =
+        HTTPClient_ReadHeader(&response->response, TRANSFER_ENCODING_HEADER, strlen(TRANSFER_ENCODING_HEADER),
+                              &transferEncodingHeaderValue, &transferEncodingHeaderValueLen);
+    if (status == HTTPSuccess) {
+        if (strncmp(transferEncodingHeaderValue, "chunked", transferEncodingHeaderValueLen) == 0) {
+            response->contentLength = -1;
+            response->isChunked = 1;
+        }
+    }
+    if (!response->isChunked && response->contentLength == 0) {
+        response->bodyComplete = 1;
+    }
+    return response->status;
+}
+
+// a reused connection may have been closed by the server while idle, such request is retried once
+#define EXCHANGE_STALE_CONNECTION -1
+
+// pushes a preresponse writing the request body to the transport of response, NULL when it cannot be set up
+static lcorehttp_preresponse*
+corehttp_client_body_writer(lua_State* L, lcorehttp_client* client, lcorehttp_response* response, size_t chunkSize,
+                            int windowBits) {
+    lcorehttp_preresponse* preresponse = l_corehttp_new_preresponse(L);
+    if (preresponse == NULL) {
+        return NULL;
+    }
+    preresponse->transport = response->transport;
+    preresponse->response = &response->response;
+    preresponse->shaping = &client->shaping;
+    if (chunkSize > 0 && lcorehttp_preresponse_start_chunked(preresponse, chunkSize) != 0) {
+        return NULL;
+    }
+    if (windowBits != 0 && lcorehttp_preresponse_start_deflate(preresponse, windowBits) != 0) {
+        return NULL;
+    }
+    return preresponse;
+}
+
+// sends the request on response->transport and receives the response headers, optionsIdx is 0 without options
+// chunkSize > 0 frames the writes of write_body_hook as Transfer-Encoding: chunked, windowBits != 0 compresses the
+// body or the writes of the hook (compress_body, always chunked)
+// returns 0, EXCHANGE_STALE_CONNECTION (nothing pushed) or the number of pushed error values
+static int
+corehttp_client_exchange(lua_State* L, lcorehttp_client* client, lcorehttp_response* response,
+                         HTTPRequestHeaders_t* requestHeaders, const uint8_t* body, size_t body_len,
+                         uint32_t sendFlags, size_t chunkSize, int windowBits, int optionsIdx,
+                         lcorehttp_header_context* headerContext, uint64_t requestStart, int canRetry) {
+    const TransportInterface_t* transportInterface = response->transport;
+    response->status = HTTPClient_Validate(transportInterface, requestHeaders, body, body_len, &response->response);
+    if (response->status != HTTPSuccess) {
+        return push_error_status(L, response->status);
+    }
+
+    uint64_t sendStart = l_corehttp_get_time_us();
+    response->status = HTTPClient_SendHttpHeaders(transportInterface, response->response.getTime, requestHeaders,
+                                                  body_len, sendFlags);
+    if (response->status != HTTPSuccess) {
+        return canRetry ? EXCHANGE_STALE_CONNECTION : push_error_status(L, response->status);
+    }
+    lcorehttp_metrics_bytes_sent(requestHeaders->headersLen);
+    LCOREHTTP_PROBE4(headers__sent, client->hostname, client->portno, requestHeaders->headersLen, body_len);
+
+    if (body_len > 0 && windowBits == 0) { // entire body passed to this function, no hook
+        response->status =
+            HTTPClient_Write(transportInterface, response->response.getTime, body, body_len, &client->shaping);
+        if (response->status != HTTPSuccess) {
+            return canRetry ? EXCHANGE_STALE_CONNECTION : push_error_status(L, response->status);
+        }
+    } else if (body_len > 0) { // compressed on the way, in chunks like the writes of a hook
+        lcorehttp_preresponse* preresponse = corehttp_client_body_writer(L, client, response, chunkSize, windowBits);
+        if (preresponse == NULL) {
+            return push_error(L, "failed to create preresponse");
+        }
+        response->status = lcorehttp_preresponse_write(preresponse, body, body_len);
+        if (response->status == HTTPSuccess) {
+            response->status = lcorehttp_preresponse_finish(L, preresponse, 0);
+        }
+        preresponse->transport = NULL;
+        lua_pop(L, 1);
+        if (response->status != HTTPSuccess) {
+            return canRetry ? EXCHANGE_STALE_CONNECTION : push_error_status(L, response->status);
+        }
+    } else if (optionsIdx != 0) {
+        lua_getfield(L, optionsIdx, "write_body_hook");
+        if (lua_isfunction(L, -1)) {
+            lcorehttp_preresponse* preresponse =
+                corehttp_client_body_writer(L, client, response, chunkSize, windowBits);
+            if (preresponse == NULL) {
+                return push_error(L, "failed to create preresponse");
+            }
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2); // the preresponse stays referenced below the call
+            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+                return push_error(L, lua_tostring(L, -1));
+            }
+            if (!preresponse->finished) { // a chunked body ends with the hook unless it called finish
+                response->status = lcorehttp_preresponse_finish(L, preresponse, 0);
+                if (response->status != HTTPSuccess) {
+                    return push_error_status(L, response->status);
+                }
+            }
+            preresponse->transport = NULL;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    uint64_t sendEnd = l_corehttp_get_time_us();
+    response->timings.send = (int64_t)(sendEnd - sendStart);
+    headerContext->sentAt = sendEnd;
+
+    corehttp_client_receive_response(client, response, requestHeaders, requestStart, sendEnd);
+    if (canRetry && (response->status == HTTPNoResponse || response->status == HTTPNetworkError)
+        && response->timings.firstByteAt == 0) {
+        return EXCHANGE_STALE_CONNECTION;
+    }
+    return 0;
+}
+
+// chunk_size of a chunked request (chunked = true or compressed), 0 when the body is written as is
+static size_t
+corehttp_client_chunk_size(lua_State* L, int optionsIdx, int compressed) {
+    if (optionsIdx == 0) {
+        return 0;
+    }
+    lua_getfield(L, optionsIdx, "chunked");
+    int chunked = lua_toboolean(L, -1);
+    lua_getfield(L, optionsIdx, "chunk_size");
+    lua_Integer chunkSize = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : LCOREHTTP_PRERESPONSE_CHUNK_SIZE;
+    lua_pop(L, 2);
+    if (!chunked && !compressed) {
+        return 0;
+    }
+    if (chunkSize < MINIMUM_COREHTTP_BUFFER_SIZE) {
+        chunkSize = MINIMUM_COREHTTP_BUFFER_SIZE;
+    } else if (chunkSize > MAXIMUM_COREHTTP_BUFFER_SIZE) {
+        chunkSize = MAXIMUM_COREHTTP_BUFFER_SIZE;
+    }
+    return (size_t)chunkSize;
+}
+
+// zlib windowBits of the compress_body encoding: 31 for gzip, 15 for deflate (zlib format, RFC 9110), 0 without
+// compression, -1 when the encoding is not supported
+static int
+corehttp_client_body_encoding(lua_State* L, int optionsIdx, const char** encoding) {
+    *encoding = NULL;
+    if (optionsIdx == 0) {
+        return 0;
+    }
+    lua_getfield(L, optionsIdx, "compress_body");
+    const char* name = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+    int windowBits = lua_isnil(L, -1) ? 0 : -1;
+    if (name != NULL && strcmp(name, "gzip") == 0) {
+        *encoding = "gzip";
+        windowBits = 31;
+    } else if (name != NULL && strcmp(name, "deflate") == 0) {
+        *encoding = "deflate";
+        windowBits = 15;
+    }
+    lua_pop(L, 1);
+    return windowBits;
+}
+
+static int
+corehttp_client_open_transport(lua_State* L, lcorehttp_client* client, int optionsIdx,
+                               TransportInterface_t** pTransportInterface, lcorehttp_timings* timings) {
+    // a tls_config of the request replaces the one of the client for the connections it opens
+    lcorehttp_client connecting = *client;
+    if (optionsIdx != 0 && client->kind == LSS_CONNECTION_KIND_TLS) {
+        lcorehttp_tls_config* tlsConfig = NULL;
+        if (lcorehttp_tls_config_option(L, optionsIdx, &tlsConfig) != 0) {
+            return push_error(L, "invalid tls_config");
+        }
+        if (tlsConfig != NULL) {
+            connecting.tls = tlsConfig;
+        }
+    }
+    lcorehttp_client_connection_options options = {0};
+    if (optionsIdx != 0 && connecting.tls == NULL) {
+        options = load_corehttp_client_connection_options(L, client->kind, optionsIdx);
+    }
+
+    TransportInterface_t* transportInterface = malloc(sizeof(TransportInterface_t));
+    if (transportInterface == NULL) {
+        return push_error(L, "failed to allocate transport");
+    }
+    int resultCount = corehttp_client_create_transport(L, &connecting, transportInterface, options, timings);
+    switch (client->kind) {
+        case LSS_CONNECTION_KIND_PLAINTEXT: lss_free_plain_connection_options(options.plaintext); break;
+        case LSS_CONNECTION_KIND_TLS: lss_free_tls_connection_options(options.tls); break;
+    }
+    if (resultCount != 0) {
+        free(transportInterface);
+        return resultCount;
+    }
+    // later requests of the client are multiplexed onto its newest HTTP/2 connection
+    lcorehttp_h2* h2 = lcorehttp_h2_of(transportInterface);
+    if (h2 != NULL && connecting.tls == client->tls) {
+        lcorehttp_h2_retain(h2);
+        lcorehttp_h2_release(client->h2);
+        client->h2 = h2;
+    }
+    *pTransportInterface = transportInterface;
+    return 0;
+}
+
+// a new stream on the HTTP/2 connection of the client, NULL when there is none that takes it
+static TransportInterface_t*
+corehttp_client_h2_stream(lua_State* L, lcorehttp_client* client, int optionsIdx) {
+    if (client->h2 == NULL) {
+        return NULL;
+    }
+    if (!lcorehttp_h2_alive(client->h2, client->pool.idleTimeoutMs)) {
+        lcorehttp_h2_release(client->h2);
+        client->h2 = NULL;
+        return NULL;
+    }
+    lcorehttp_tls_config* tlsConfig = NULL;
+    if (optionsIdx != 0 && (lcorehttp_tls_config_option(L, optionsIdx, &tlsConfig) != 0 || tlsConfig != NULL)) {
+        return NULL; // the request connects with its own tls_config
+    }
+    TransportInterface_t* transport = malloc(sizeof(TransportInterface_t));
+    if (transport != NULL && lcorehttp_h2_open_stream(client->h2, transport) != 0) {
+        free(transport);
+        transport = NULL;
+    }
+    return transport;
+}
+
+int
+corehttp_client_perform(lua_State* L, lcorehttp_client* client, int clientIdx, int optionsIdx,
+                        HTTPRequestHeaders_t requestHeaders, uint32_t requestFlags, const uint8_t* body,
+                        size_t body_len, int hasBodyHook, uint64_t requestStart, TransportInterface_t* transport) {
+    lcorehttp_timings timings;
+    l_corehttp_timings_init(&timings);
+    lcorehttp_header_context headerContext = {.L = L, .client = client, .timings = NULL, .sentAt = 0};
+    HTTPClient_ResponseHeaderParsingCallback_t headerParsingCallback = {.pContext = &headerContext,
+                                                                        .onHeaderCallback = preloadHeader};
+    uint32_t sendFlags = 0;
+    clientIdx = lua_absindex(L, clientIdx);
+    optionsIdx = lua_istable(L, optionsIdx) ? lua_absindex(L, optionsIdx) : 0;
+    size_t chunkSize = 0;
+    const char* encoding = NULL;
+    int windowBits = corehttp_client_body_encoding(L, optionsIdx, &encoding);
+    if (windowBits < 0) {
+        free(requestHeaders.pBuffer);
+        if (transport != NULL) {
+            lcorehttp_transport_close(client, transport, 0);
+        }
+        return push_error(L, "compress_body must be \"gzip\" or \"deflate\"");
+    }
+    if (!hasBodyHook && body_len == 0) {
+        windowBits = 0; // nothing to compress
+    }
+    if (hasBodyHook || windowBits != 0) {
+        sendFlags |= HTTP_SEND_DISABLE_CONTENT_LENGTH_FLAG;
+        body_len = hasBodyHook ? 0 : body_len;
+        // the compressed length is not known before the body is sent
+        chunkSize = corehttp_client_chunk_size(L, optionsIdx, windowBits != 0);
+        HTTPStatus_t status = chunkSize > 0 ? HTTPClient_AddHeader(&requestHeaders, "Transfer-Encoding",
+                                                                   strlen("Transfer-Encoding"), "chunked",
+                                                                   strlen("chunked"))
+                                            : HTTPSuccess;
+        if (status == HTTPSuccess && windowBits != 0) {
+            status = HTTPClient_AddHeader(&requestHeaders, "Content-Encoding", strlen("Content-Encoding"), encoding,
+                                          strlen(encoding));
+        }
+        if (status != HTTPSuccess) {
+            free(requestHeaders.pBuffer);
+            if (transport != NULL) {
+                lcorehttp_transport_close(client, transport, 0);
+            }
+            return push_error_status(L, status);
+        }
+    }
+
+    lcorehttp_body_limits limits = client->limits;
+    if (optionsIdx != 0 && lcorehttp_body_limits_load(L, optionsIdx, &limits) != 0) {
+        free(requestHeaders.pBuffer);
+        if (transport != NULL) {
+            lcorehttp_transport_close(client, transport, 0);
+        }
+        return push_error(L, "invalid body limit options");
+    }
+
+    int resultCount = 0;
+    TransportInterface_t* transportInterface = transport;
+    if (transportInterface == NULL) {
+        transportInterface = corehttp_client_h2_stream(L, client, optionsIdx);
+    }
+    if (transportInterface == NULL) {
+        transportInterface = lcorehttp_pool_acquire(client);
+    }
+    int reused = transportInterface != NULL;
+    if (reused) {
+        timings.connect = 0;
+    } else if ((resultCount = corehttp_client_open_transport(L, client, optionsIdx, &transportInterface, &timings))
+               != 0) {
+        free(requestHeaders.pBuffer);
+        return resultCount;
+    }
+
+    lcorehttp_response* response = l_corehttp_new_response(L);
+    if (response == NULL) {
+        free(requestHeaders.pBuffer);
+        lcorehttp_transport_close(client, transportInterface, 0); // passed in, pooled or just opened
+        return push_error(L, "failed to create response");
+    }
+    lua_pushvalue(L, clientIdx);
+    lua_setiuservalue(L, -2, 2); // keep client (and its hostname) alive as long as the response
+    response->client = client;
+    response->transport = transportInterface;
+    response->reused = reused;
+    // HTTP/1.1 connections are persistent unless keepAlive = false was requested
+    response->keepAlive = optionsIdx == 0 || (requestFlags & HTTP_REQUEST_KEEP_ALIVE_FLAG) != 0;
+    response->timings = timings;
+    response->limits = limits;
+    headerContext.timings = &response->timings;
+    response->response.pBuffer = requestHeaders.pBuffer; // reuse buffer for response
+    response->ownedBuffer = requestHeaders.pBuffer;
+    response->response.bufferLen = requestHeaders.bufferLen;
+    response->response.respOptionFlags = HTTP_RESPONSE_DO_NOT_PARSE_BODY_FLAG;
+
+    lua_newtable(L); // for headers
+    response->response.pHeaderParsingCallback = &headerParsingCallback;
+
+    // idempotent requests without a body may go out as TLS 1.3 early data on a resumed session (RFC 8470)
+    int earlyData = 0;
+    if (!reused && !hasBodyHook && body_len == 0
+        && (strncmp((const char*)requestHeaders.pBuffer, "GET ", 4) == 0
+            || strncmp((const char*)requestHeaders.pBuffer, "HEAD ", 5) == 0)) {
+        earlyData = lcorehttp_tls_allow_early_data(transportInterface);
+    }
+
+    // sending mutates the header block (Content-Length) and receiving overwrites it, keep a copy for the retry
+    uint8_t* requestSnapshot = NULL;
+    size_t requestSnapshotLen = requestHeaders.headersLen;
+    if ((reused || earlyData) && !hasBodyHook) {
+        requestSnapshot = malloc(requestSnapshotLen);
+        if (requestSnapshot != NULL) {
+            memcpy(requestSnapshot, requestHeaders.pBuffer, requestSnapshotLen);
+        }
+    }
+
+    resultCount = corehttp_client_exchange(L, client, response, &requestHeaders, body, body_len, sendFlags, chunkSize,
+                                           windowBits, optionsIdx, &headerContext, requestStart,
+                                           reused && requestSnapshot != NULL);
+    // 425 Too Early: the server did not want to process the early data, send it again once the handshake is done
+    int tooEarly = resultCount == 0 && requestSnapshot != NULL && response->response.statusCode == 425
+                   && lcorehttp_tls_early_data_accepted(response->transport);
+    if (tooEarly) {
+        lua_pop(L, 1);
+        lua_newtable(L); // headers of the retried response
+    }
+    if (resultCount == EXCHANGE_STALE_CONNECTION || tooEarly) {
+        lcorehttp_pool_release(client, response->transport, 0, 0);
+        response->transport = NULL;
+        memcpy(requestHeaders.pBuffer, requestSnapshot, requestSnapshotLen);
+        requestHeaders.headersLen = requestSnapshotLen;
+        HTTPResponse_t freshResponse = {.pBuffer = response->response.pBuffer,
+                                        .bufferLen = response->response.bufferLen,
+                                        .pHeaderParsingCallback = response->response.pHeaderParsingCallback,
+                                        .getTime = response->response.getTime,
+                                        .respOptionFlags = response->response.respOptionFlags};
+        response->response = freshResponse;
+        response->reused = 0;
+        l_corehttp_timings_init(&response->timings);
+        resultCount =
+            corehttp_client_open_transport(L, client, optionsIdx, &transportInterface, &response->timings);
+        if (resultCount == 0) {
+            response->transport = transportInterface;
+            resultCount = corehttp_client_exchange(L, client, response, &requestHeaders, body, body_len, sendFlags,
+                                                   chunkSize, windowBits, optionsIdx, &headerContext, requestStart,
+                                                   0);
+        }
+    }
+    free(requestSnapshot);
+    if (resultCount != 0) {
+        return resultCount;
+    }
+
+    luaL_getmetatable(L, LCOREHTTP_HEADERS_METATABLE);
+    lua_setmetatable(L, -2);
+    lua_setiuservalue(L, -2, 1);
+
+    return 1;
+}
+
+int
+l_corehttp_client_request(lua_State* L) {
+    HTTPRequestHeaders_t requestHeaders = {0};
+    uint32_t requestFlags = 0;
+    uint64_t requestStart = l_corehttp_get_time_us();
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    if (client->closed) {
+        return push_error(L, "client is closed");
+    }
+    size_t body_len = 0;
+    const uint8_t* body = NULL;
+    int hasBodyHook = 0;
+    int hedged = 0;
+    lua_Integer maxRedirects = 0;
+    const lcorehttp_multipart* multipart = NULL;
+
+    // fourth on the stack may be options table
+    if (lua_istable(L, 4)) {
+        // get body
+        lua_getfield(L, 4, "body");
+        if (lua_isstring(L, -1)) {
+            body = (const uint8_t*)lua_tolstring(L, -1, &body_len);
+        }
+        lua_pop(L, 1);
+        // write_body_hook
+        lua_getfield(L, 4, "write_body_hook");
+        hasBodyHook = lua_isfunction(L, -1);
+        lua_pop(L, 1);
+        // follow_redirects
+        lua_getfield(L, 4, "follow_redirects");
+        if (lua_isinteger(L, -1)) {
+            maxRedirects = lua_tointeger(L, -1);
+            if (maxRedirects < 0 || maxRedirects > LCOREHTTP_REDIRECT_MAXIMUM) {
+                return luaL_error(L, "follow_redirects must be between 0 and %d", LCOREHTTP_REDIRECT_MAXIMUM);
+            }
+        }
+        lua_pop(L, 1);
+        // hedge
+        lua_getfield(L, 4, "hedge");
+        hedged = lua_istable(L, -1);
+        lua_pop(L, 1);
+        // multipart
+        lua_getfield(L, 4, "multipart");
+        int hasMultipart = lua_istable(L, -1);
+        lua_getfield(L, 4, "compress_body");
+        int compressed = !lua_isnil(L, -1);
+        lua_pop(L, 2);
+        lua_settop(L, 4); // redirects replace the request arguments in place
+        if (hasMultipart) {
+            if (body != NULL || hasBodyHook) {
+                return luaL_error(L, "multipart cannot be combined with body or write_body_hook");
+            }
+            if (compressed) { // the multipart writer frames the body itself
+                return luaL_error(L, "multipart cannot be combined with compress_body");
+            }
+            multipart = lcorehttp_multipart_prepare(L, 4);
+            if (multipart == NULL) {
+                return push_error(L, lua_tostring(L, -1));
+            }
+            hasBodyHook = 1;
+        }
+    }
+
+    int resultCount = 0;
+    if (hedged) {
+        resultCount = corehttp_client_request_hedged(L);
+    } else if ((resultCount = initializeRequestHeaders(L, client, &requestHeaders, &requestFlags)) == 0) {
+        HTTPStatus_t status = multipart != NULL ? lcorehttp_multipart_add_headers(multipart, &requestHeaders)
+                                                : HTTPSuccess;
+        if (status != HTTPSuccess) {
+            free(requestHeaders.pBuffer);
+            return push_error_status(L, status);
+        }
+        resultCount = corehttp_client_perform(L, client, 1, 4, requestHeaders, requestFlags, body, body_len,
+                                              hasBodyHook, requestStart, NULL);
+    }
+    if (resultCount == 1 && maxRedirects > 0) {
+        return corehttp_client_follow_redirects(L, (int)maxRedirects, requestStart);
+    }
+    return resultCount;
+}
+
+int
+l_corehttp_client_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_CLIENT_METATABLE);
+    /* Metamethods */
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_client_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, l_corehttp_client_request);
+    lua_setfield(L, -2, "request");
+    lua_pushcfunction(L, l_corehttp_client_request_async);
+    lua_setfield(L, -2, "request_async");
+    lua_pushcfunction(L, l_corehttp_client_prepare);
+    lua_setfield(L, -2, "prepare");
+    lua_pushcfunction(L, l_corehttp_client_endpoint);
+    lua_setfield(L, -2, "endpoint");
+    lua_pushcfunction(L, l_corehttp_client_websocket);
+    lua_setfield(L, -2, "websocket");
+    lua_pushstring(L, LCOREHTTP_CLIENT_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_client_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_client_gc);
+    lua_setfield(L, -2, "__close");
+    return 1;
 }
\ No newline at end of file
@@ -1,38 +1,94 @@
-#ifndef LCOREHTTP_CLIENT_H
-#define LCOREHTTP_CLIENT_H
-
-#include "lcorehttp_preresponse.h"
-#include "lcorehttp_response.h"
-#include "lss_transport.h"
-#include "lua.h"
-
-#define HTTP_PORT                    80
-#define HTTPS_PORT                   443
-
-#define DEFAULT_COREHTTP_BUFFER_SIZE 16384   /* 16KB */
-#define MINIMUM_COREHTTP_BUFFER_SIZE 1024    /* 1KB */
-#define MAXIMUM_COREHTTP_BUFFER_SIZE 1048576 /* 1MB */
-
-#define TRANSFER_ENCODING_HEADER     "transfer-encoding"
-
-typedef lss_connection NetworkContext;
-
-typedef union lcorehttp_client_connection_options {
-    lss_open_tls_connection_options* tls;
-    lss_open_connection_options* plaintext;
-} lcorehttp_client_connection_options;
-
-typedef struct lcorehttp_client {
-    int closed;
-    int portno;
-    size_t hostname_len;
-    const char* hostname;
-    lss_connection_kind kind;
-} lcorehttp_client;
-
-#define LCOREHTTP_CLIENT_METATABLE "COREHTTP_CLIENT"
-
-int l_corehttp_newclient(lua_State* L);
-
-int l_corehttp_client_create_meta(lua_State* L);
-#endif /* LSS_TRANSPORT_MBEDTLS_H */
+#ifndef LCOREHTTP_CLIENT_H
+#define LCOREHTTP_CLIENT_H
+
+#include "lcorehttp_limits.h"
+#include "lcorehttp_pool.h"
+#include "lcorehttp_preresponse.h"
+#include "lcorehttp_response.h"
+#include "lcorehttp_shaping.h"
+#include "lcorehttp_socket.h"
+#include "lcorehttp_tls.h"
+#include "lss_transport.h"
+#include "lua.h"
+
+#define HTTP_PORT                    80
+#define HTTPS_PORT                   443
+
+#define DEFAULT_COREHTTP_BUFFER_SIZE 16384   /* 16KB */
+#define MINIMUM_COREHTTP_BUFFER_SIZE 1024    /* 1KB */
+#define MAXIMUM_COREHTTP_BUFFER_SIZE 1048576 /* 1MB */
+
+#define TRANSFER_ENCODING_HEADER     "transfer-encoding"
+
+typedef lss_connection NetworkContext;
+
+struct lcorehttp_h2;
+struct lcorehttp_response;
+struct lcorehttp_timings;
+
+typedef union lcorehttp_client_connection_options {
+    lss_open_tls_connection_options* tls;
+    lss_open_connection_options* plaintext;
+} lcorehttp_client_connection_options;
+
+typedef struct lcorehttp_client {
+    int closed;
+    int portno;
+    size_t hostname_len;
+    const char* hostname;
+    lss_connection_kind kind;
+    const char* unixPath; // http+unix: socket path, connected natively; hostname is "localhost" for Host
+    lcorehttp_pool pool;
+    lcorehttp_socket_options socketOptions;
+    lcorehttp_shaping shaping;
+    lcorehttp_tls_config* tls; // native TLS connector (tls_early_data, http2), NULL: lua-simple-socket TLS
+    struct lcorehttp_h2* h2;   // HTTP/2 connection new requests are multiplexed onto, NULL: none (yet)
+    lcorehttp_body_limits limits; // defaults of the responses, request options override them
+    lcorehttp_memory_budget* budget;
+} lcorehttp_client;
+
+typedef struct lcorehttp_header_context {
+    lua_State* L; // NULL when the request runs on a worker thread
+    const lcorehttp_client* client;
+    struct lcorehttp_timings* timings;
+    uint64_t sentAt;
+} lcorehttp_header_context;
+
+#define LCOREHTTP_CLIENT_METATABLE "COREHTTP_CLIENT"
+
+int l_corehttp_newclient(lua_State* L);
+
+// pushes nil, status code and status message
+int push_error_status(lua_State* L, int httpStatus);
+
+lcorehttp_client_connection_options load_corehttp_client_connection_options(lua_State* L, lss_connection_kind kind,
+                                                                            int idx);
+int initializeRequestHeaders(lua_State* L, lcorehttp_client* client, HTTPRequestHeaders_t* requestHeaders,
+                             uint32_t* requestFlags);
+void preloadHeader(void* pContext, const char* fieldLoc, size_t fieldLen, const char* valueLoc, size_t valueLen,
+                   uint16_t statusCode);
+/**
+ * @brief Open the transport for client without touching any lua_State.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* corehttp_client_connect(const lcorehttp_client* client, TransportInterface_t* const pTransportInterface,
+                                    lcorehttp_client_connection_options options, struct lcorehttp_timings* timings);
+/**
+ * @brief Send a request whose header block is already serialized and push the response (or error values).
+ *
+ * Takes ownership of requestHeaders.pBuffer, it becomes the response buffer. optionsIdx may point to a non-table
+ * value when there are no options; body is ignored when hasBodyHook is set. A non-NULL transport (an open
+ * connection at a message boundary) is used instead of the pool and owned from then on.
+ *
+ * @return Number of values pushed on the stack.
+ */
+int corehttp_client_perform(lua_State* L, lcorehttp_client* client, int clientIdx, int optionsIdx,
+                            HTTPRequestHeaders_t requestHeaders, uint32_t requestFlags, const uint8_t* body,
+                            size_t body_len, int hasBodyHook, uint64_t requestStart, TransportInterface_t* transport);
+HTTPStatus_t corehttp_client_receive_response(const lcorehttp_client* client, struct lcorehttp_response* response,
+                                              const HTTPRequestHeaders_t* requestHeaders, uint64_t requestStart,
+                                              uint64_t sendEnd);
+
+int l_corehttp_client_create_meta(lua_State* L);
+#endif /* LSS_TRANSPORT_MBEDTLS_H */
@@ -0,0 +1,1078 @@
+#include "lcorehttp_h2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lcorehttp_pool.h"
+#include "lcorehttp_socket.h"
+#include "lcorehttp_time.h"
+
+#define H2_FRAME_HEADER 9
+
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+#define H2_FLAG_PRIORITY    0x20
+
+#define H2_NO_ERROR          0x0
+#define H2_PROTOCOL_ERROR    0x1
+#define H2_INTERNAL_ERROR    0x2
+#define H2_FLOW_CONTROL      0x3
+#define H2_STREAM_CLOSED     0x5
+#define H2_FRAME_SIZE_ERROR  0x6
+#define H2_CANCEL            0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE      0x1
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+
+#define H2_DEFAULT_WINDOW      65535
+#define H2_DEFAULT_MAX_STREAMS 100 /* assumed until the SETTINGS of the server arrive */
+#define H2_MAXIMUM_WINDOW      2147483647
+#define H2_MAXIMUM_STREAM_ID   2147483647u
+#define H2_MAXIMUM_FRAME_SIZE  16777215
+#define H2_FLUSH_THRESHOLD     65536
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static void
+h2_put32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static uint32_t
+h2_get32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int
+h2_queue(lcorehttp_h2* conn, uint8_t type, uint8_t flags, uint32_t id, const void* payload, size_t len) {
+    if (lcorehttp_bytes_reserve(&conn->out, H2_FRAME_HEADER + len) != 0) {
+        conn->failed = 1;
+        return -1;
+    }
+    uint8_t* p = conn->out.data + conn->out.len;
+    p[0] = (uint8_t)(len >> 16);
+    p[1] = (uint8_t)(len >> 8);
+    p[2] = (uint8_t)len;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(p + 5, id);
+    if (len > 0) {
+        memcpy(p + H2_FRAME_HEADER, payload, len);
+    }
+    conn->out.len += H2_FRAME_HEADER + len;
+    return 0;
+}
+
+static int
+h2_queue_u32(lcorehttp_h2* conn, uint8_t type, uint32_t id, uint32_t value) {
+    uint8_t payload[4];
+    h2_put32(payload, value);
+    return h2_queue(conn, type, 0, id, payload, sizeof(payload));
+}
+
+static int
+h2_flush(lcorehttp_h2* conn) {
+    uint64_t deadline = l_corehttp_get_time_us() + (uint64_t)conn->ioTimeoutMs * 1000;
+    size_t sent = 0;
+    while (sent < conn->out.len) {
+        int32_t n = conn->transport.send(conn->transport.pNetworkContext, conn->out.data + sent, conn->out.len - sent);
+        if (n < 0 || (n == 0 && l_corehttp_get_time_us() >= deadline)) {
+            conn->out.len = 0;
+            conn->failed = 1;
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    conn->out.len = 0;
+    return 0;
+}
+
+// GOAWAY with the error, every stream fails from now on
+static int
+h2_fail(lcorehttp_h2* conn, uint32_t code) {
+    if (!conn->failed) {
+        uint8_t payload[8];
+        h2_put32(payload, 0); // the server cannot open streams, none was processed
+        h2_put32(payload + 4, code);
+        if (h2_queue(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload)) == 0) {
+            h2_flush(conn); // best effort
+        }
+        conn->failed = 1;
+    }
+    return -1;
+}
+
+static void
+h2_stream_error(lcorehttp_h2_stream* stream, uint32_t code) {
+    if (!stream->reset && stream->id != 0) {
+        h2_queue_u32(stream->conn, H2_RST_STREAM, stream->id, code);
+    }
+    stream->reset = 1;
+}
+
+static lcorehttp_h2_stream*
+h2_find_stream(const lcorehttp_h2* conn, uint32_t id) {
+    for (lcorehttp_h2_stream* stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// streams counting against SETTINGS_MAX_CONCURRENT_STREAMS, including the ones whose HEADERS did not go out yet
+static uint32_t
+h2_active_streams(const lcorehttp_h2* conn) {
+    uint32_t count = 0;
+    for (const lcorehttp_h2_stream* stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (!stream->reset && !(stream->localEnded && stream->remoteEnded)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// connection-specific fields, not allowed in HTTP/2 (RFC 9113 section 8.2.2)
+static int
+h2_connection_specific(const char* name, size_t nameLen) {
+    static const char* const names[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding",
+                                        "upgrade", NULL};
+    for (size_t i = 0; names[i] != NULL; i++) {
+        if (strlen(names[i]) == nameLen && memcmp(names[i], name, nameLen) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+h2_valid_field(const char* name, size_t nameLen, const char* value, size_t valueLen) {
+    if (nameLen == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < nameLen; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if ((c >= 'A' && c <= 'Z') || c <= 0x20 || c == 0x7f || (c == ':' && i > 0)) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < valueLen; i++) {
+        if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct h2_header_context {
+    lcorehttp_h2_stream* stream; // NULL: the block is only decoded to keep the HPACK table in sync
+    size_t mark;                 // length of the stream input before the block
+    int trailers;
+    int status;
+    int informational;
+    int regular; // a regular field was seen, no pseudo-header may follow
+    int contentLength;
+    int malformed;
+} h2_header_context;
+
+// appends the fields of a response header block to the stream input as HTTP/1.1
+static void
+h2_on_field(void* pContext, const char* name, size_t nameLen, const char* value, size_t valueLen) {
+    h2_header_context* context = pContext;
+    lcorehttp_h2_stream* stream = context->stream;
+    if (stream == NULL || context->malformed) {
+        return;
+    }
+    if (!h2_valid_field(name, nameLen, value, valueLen)) {
+        context->malformed = 1;
+        return;
+    }
+    if (name[0] == ':') {
+        if (context->trailers || context->regular || context->status != 0 || nameLen != 7
+            || memcmp(name, ":status", 7) != 0 || valueLen != 3 || value[0] < '1' || value[0] > '9'
+            || value[1] < '0' || value[1] > '9' || value[2] < '0' || value[2] > '9') {
+            context->malformed = 1;
+            return;
+        }
+        context->status = (value[0] - '0') * 100 + (value[1] - '0') * 10 + (value[2] - '0');
+        context->informational = context->status < 200;
+        if (!context->informational) {
+            char line[32];
+            int len = snprintf(line, sizeof(line), "HTTP/1.1 %d \r\n", context->status);
+            context->malformed = lcorehttp_bytes_append(&stream->in, line, (size_t)len) != 0;
+        }
+        return;
+    }
+    context->regular = 1;
+    if (!context->trailers && context->status == 0) {
+        context->malformed = 1;
+        return;
+    }
+    if (context->informational || h2_connection_specific(name, nameLen) || (context->trailers && !stream->chunked)) {
+        return; // trailers of a body with content-length have no HTTP/1.1 representation
+    }
+    if (nameLen == 14 && memcmp(name, "content-length", 14) == 0) {
+        context->contentLength = 1;
+    }
+    if (lcorehttp_bytes_reserve(&stream->in, nameLen + valueLen + 4) != 0) {
+        context->malformed = 1;
+        return;
+    }
+    lcorehttp_bytes_append(&stream->in, name, nameLen);
+    lcorehttp_bytes_append(&stream->in, ": ", 2);
+    lcorehttp_bytes_append(&stream->in, value, valueLen);
+    lcorehttp_bytes_append(&stream->in, "\r\n", 2);
+}
+
+static void
+h2_stream_headers_done(lcorehttp_h2_stream* stream, h2_header_context* context, int endStream) {
+    int malformed = context->malformed || (context->trailers && !endStream)
+                    || (!context->trailers && (context->status == 0 || (context->informational && endStream)));
+    if (malformed) {
+        stream->in.len = context->mark;
+        h2_stream_error(stream, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (context->informational) { // 1xx responses are not handed out, the final one follows
+        return;
+    }
+    int failed = 0;
+    if (context->trailers) {
+        failed = stream->chunked && lcorehttp_bytes_append(&stream->in, "\r\n", 2) != 0;
+    } else {
+        // without content-length the body is delimited by END_STREAM, framed as chunks for the HTTP/1.1 parser
+        stream->chunked = !context->contentLength && !endStream;
+        const char* framing = context->contentLength ? ""
+                              : endStream            ? "content-length: 0\r\n"
+                                                     : "transfer-encoding: chunked\r\n";
+        failed = lcorehttp_bytes_append(&stream->in, framing, strlen(framing)) != 0
+                 || lcorehttp_bytes_append(&stream->in, "\r\n", 2) != 0;
+        stream->started = 1;
+    }
+    if (failed) {
+        stream->in.len = context->mark;
+        h2_stream_error(stream, H2_INTERNAL_ERROR);
+        return;
+    }
+    stream->remoteEnded = endStream;
+}
+
+static int
+h2_on_header_block(lcorehttp_h2* conn, uint32_t id, int endStream, const uint8_t* block, size_t len) {
+    lcorehttp_h2_stream* stream = h2_find_stream(conn, id);
+    if (stream == NULL && id >= conn->nextStreamId) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR); // servers cannot open streams
+    }
+    h2_header_context context = {0};
+    if (stream != NULL && !stream->reset) {
+        if (stream->started && stream->remoteEnded) {
+            h2_stream_error(stream, H2_STREAM_CLOSED);
+        } else {
+            context.stream = stream;
+            context.mark = stream->in.len;
+            context.trailers = stream->started;
+            if (context.trailers && stream->chunked && lcorehttp_bytes_append(&stream->in, "0\r\n", 3) != 0) {
+                context.malformed = 1;
+            }
+        }
+    }
+    if (lcorehttp_hpack_decode(&conn->decoder, block, len, h2_on_field, &context) != 0) {
+        return h2_fail(conn, H2_COMPRESSION_ERROR);
+    }
+    if (context.stream != NULL) {
+        h2_stream_headers_done(stream, &context, endStream);
+    }
+    return 0;
+}
+
+// strips the padding of DATA and HEADERS, -1 when it does not fit into the frame
+static int
+h2_unpad(uint8_t flags, const uint8_t** payload, size_t* len) {
+    if ((flags & H2_FLAG_PADDED) == 0) {
+        return 0;
+    }
+    if (*len == 0 || (*payload)[0] >= *len) {
+        return -1;
+    }
+    *len -= 1 + (*payload)[0];
+    *payload += 1;
+    return 0;
+}
+
+static int
+h2_on_data(lcorehttp_h2* conn, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (id == 0) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR);
+    }
+    // the connection window is returned right away, the per stream windows bound what is buffered
+    conn->recvDebt += len;
+    if (conn->recvDebt >= LCOREHTTP_H2_CONNECTION_WINDOW / 2) {
+        h2_queue_u32(conn, H2_WINDOW_UPDATE, 0, (uint32_t)conn->recvDebt);
+        conn->recvDebt = 0;
+    }
+    size_t frameLen = len;
+    if (h2_unpad(flags, &payload, &len) != 0) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR);
+    }
+    lcorehttp_h2_stream* stream = h2_find_stream(conn, id);
+    if (stream == NULL) {
+        return id >= conn->nextStreamId ? h2_fail(conn, H2_PROTOCOL_ERROR) : 0;
+    }
+    if (stream->reset) {
+        return 0;
+    }
+    stream->recvDebt += frameLen;
+    if (!stream->started || stream->remoteEnded) {
+        h2_stream_error(stream, stream->remoteEnded ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    if (stream->recvDebt > LCOREHTTP_H2_STREAM_WINDOW) {
+        h2_stream_error(stream, H2_FLOW_CONTROL);
+        return 0;
+    }
+    int failed = 0;
+    if (stream->chunked && len > 0) {
+        char size[24];
+        int sizeLen = snprintf(size, sizeof(size), "%zx\r\n", len);
+        failed = lcorehttp_bytes_reserve(&stream->in, (size_t)sizeLen + len + 2) != 0;
+        if (!failed) {
+            lcorehttp_bytes_append(&stream->in, size, (size_t)sizeLen);
+            lcorehttp_bytes_append(&stream->in, payload, len);
+            lcorehttp_bytes_append(&stream->in, "\r\n", 2);
+        }
+    } else {
+        failed = lcorehttp_bytes_append(&stream->in, payload, len) != 0;
+    }
+    if (!failed && (flags & H2_FLAG_END_STREAM)) {
+        stream->remoteEnded = 1;
+        failed = stream->chunked && lcorehttp_bytes_append(&stream->in, "0\r\n\r\n", 5) != 0;
+    }
+    if (failed) {
+        h2_stream_error(stream, H2_INTERNAL_ERROR);
+    }
+    return 0;
+}
+
+static int
+h2_on_headers(lcorehttp_h2* conn, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (id == 0 || h2_unpad(flags, &payload, &len) != 0) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR);
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) {
+            return h2_fail(conn, H2_FRAME_SIZE_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if ((flags & H2_FLAG_END_HEADERS) == 0) { // the block continues in CONTINUATION frames
+        conn->headerBlock.len = 0;
+        if (lcorehttp_bytes_append(&conn->headerBlock, payload, len) != 0) {
+            return h2_fail(conn, H2_INTERNAL_ERROR);
+        }
+        conn->headerStream = id;
+        conn->headerFlags = flags;
+        return 0;
+    }
+    return h2_on_header_block(conn, id, flags & H2_FLAG_END_STREAM, payload, len);
+}
+
+static int
+h2_on_continuation(lcorehttp_h2* conn, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (conn->headerStream == 0 || id != conn->headerStream) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR);
+    }
+    if (conn->headerBlock.len + len > LCOREHTTP_H2_MAXIMUM_HEADER_BLOCK
+        || lcorehttp_bytes_append(&conn->headerBlock, payload, len) != 0) {
+        return h2_fail(conn, H2_INTERNAL_ERROR);
+    }
+    if ((flags & H2_FLAG_END_HEADERS) == 0) {
+        return 0;
+    }
+    conn->headerStream = 0;
+    return h2_on_header_block(conn, id, conn->headerFlags & H2_FLAG_END_STREAM, conn->headerBlock.data,
+                              conn->headerBlock.len);
+}
+
+static int
+h2_on_settings(lcorehttp_h2* conn, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (id != 0) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR);
+    }
+    if (flags & H2_FLAG_ACK) {
+        return len == 0 ? 0 : h2_fail(conn, H2_FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0) {
+        return h2_fail(conn, H2_FRAME_SIZE_ERROR);
+    }
+    for (size_t pos = 0; pos < len; pos += 6) {
+        uint16_t setting = (uint16_t)((payload[pos] << 8) | payload[pos + 1]);
+        uint32_t value = h2_get32(payload + pos + 2);
+        switch (setting) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE: lcorehttp_hpack_set_limit(&conn->encoder, value); break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return h2_fail(conn, H2_PROTOCOL_ERROR);
+                }
+                break;
+            case H2_SETTINGS_MAX_CONCURRENT_STREAMS: conn->maxStreams = value; break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAXIMUM_WINDOW) {
+                    return h2_fail(conn, H2_FLOW_CONTROL);
+                }
+                // applies to the windows of the open streams as well (section 6.9.2)
+                int64_t delta = (int64_t)value - conn->initialWindow;
+                for (lcorehttp_h2_stream* stream = conn->streams; stream != NULL; stream = stream->next) {
+                    if (stream->id != 0) {
+                        stream->sendWindow += delta;
+                    }
+                }
+                conn->initialWindow = value;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < LCOREHTTP_H2_FRAME_SIZE || value > H2_MAXIMUM_FRAME_SIZE) {
+                    return h2_fail(conn, H2_PROTOCOL_ERROR);
+                }
+                conn->maxFrameSize = value;
+                break;
+            default: break; // unknown settings are ignored
+        }
+    }
+    return h2_queue(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static int
+h2_on_goaway(lcorehttp_h2* conn, uint32_t id, const uint8_t* payload, size_t len) {
+    if (id != 0) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR);
+    }
+    if (len < 8) {
+        return h2_fail(conn, H2_FRAME_SIZE_ERROR);
+    }
+    // streams above the last one were not processed, their requests may be sent again on a new connection
+    uint32_t lastStreamId = h2_get32(payload) & 0x7fffffff;
+    conn->goaway = 1;
+    for (lcorehttp_h2_stream* stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (stream->id > lastStreamId) {
+            stream->reset = 1;
+        }
+    }
+    return 0;
+}
+
+static int
+h2_on_window_update(lcorehttp_h2* conn, uint32_t id, const uint8_t* payload, size_t len) {
+    if (len != 4) {
+        return h2_fail(conn, H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = h2_get32(payload) & 0x7fffffff;
+    if (id == 0) {
+        conn->sendWindow += increment;
+        return increment == 0 || conn->sendWindow > H2_MAXIMUM_WINDOW
+                   ? h2_fail(conn, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL)
+                   : 0;
+    }
+    lcorehttp_h2_stream* stream = h2_find_stream(conn, id);
+    if (stream == NULL || stream->reset) {
+        return 0;
+    }
+    stream->sendWindow += increment;
+    if (increment == 0 || stream->sendWindow > H2_MAXIMUM_WINDOW) {
+        h2_stream_error(stream, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL);
+    }
+    return 0;
+}
+
+// -1 after a connection error
+static int
+h2_on_frame(lcorehttp_h2* conn, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (conn->headerStream != 0 && type != H2_CONTINUATION) {
+        return h2_fail(conn, H2_PROTOCOL_ERROR); // header blocks cannot be interleaved
+    }
+    switch (type) {
+        case H2_DATA: return h2_on_data(conn, flags, id, payload, len);
+        case H2_HEADERS: return h2_on_headers(conn, flags, id, payload, len);
+        case H2_CONTINUATION: return h2_on_continuation(conn, flags, id, payload, len);
+        case H2_RST_STREAM: {
+            if (id == 0) {
+                return h2_fail(conn, H2_PROTOCOL_ERROR);
+            }
+            if (len != 4) {
+                return h2_fail(conn, H2_FRAME_SIZE_ERROR);
+            }
+            lcorehttp_h2_stream* stream = h2_find_stream(conn, id);
+            if (stream != NULL) {
+                stream->reset = 1;
+            }
+            return 0;
+        }
+        case H2_SETTINGS: return h2_on_settings(conn, flags, id, payload, len);
+        case H2_PUSH_PROMISE: return h2_fail(conn, H2_PROTOCOL_ERROR); // disabled by SETTINGS_ENABLE_PUSH
+        case H2_PING:
+            if (id != 0) {
+                return h2_fail(conn, H2_PROTOCOL_ERROR);
+            }
+            if (len != 8) {
+                return h2_fail(conn, H2_FRAME_SIZE_ERROR);
+            }
+            return (flags & H2_FLAG_ACK) ? 0 : h2_queue(conn, H2_PING, H2_FLAG_ACK, 0, payload, len);
+        case H2_GOAWAY: return h2_on_goaway(conn, id, payload, len);
+        case H2_WINDOW_UPDATE: return h2_on_window_update(conn, id, payload, len);
+        default: return 0; // PRIORITY and unknown frame types are ignored
+    }
+}
+
+// one receive on the connection, complete frames are dispatched to their streams
+// returns the number of bytes received, 0 when nothing arrived within the timeout, -1 once the connection failed
+static int32_t
+h2_pump(lcorehttp_h2* conn) {
+    if (conn->failed || (conn->out.len > 0 && h2_flush(conn) != 0)) {
+        return -1;
+    }
+    if (conn->inPos > 0) {
+        memmove(conn->in.data, conn->in.data + conn->inPos, conn->in.len - conn->inPos);
+        conn->in.len -= conn->inPos;
+        conn->inPos = 0;
+    }
+    if (lcorehttp_bytes_reserve(&conn->in, H2_FRAME_HEADER + LCOREHTTP_H2_FRAME_SIZE) != 0) {
+        conn->failed = 1;
+        return -1;
+    }
+    size_t room = conn->in.capacity - conn->in.len;
+    int32_t received = conn->transport.recv(conn->transport.pNetworkContext, conn->in.data + conn->in.len,
+                                            room > INT32_MAX ? INT32_MAX : room);
+    if (received <= 0) {
+        lcorehttp_socket* socket = lcorehttp_transport_socket(&conn->transport);
+        if (received < 0 || (socket != NULL && socket->peerClosed)) {
+            conn->failed = 1;
+            return -1;
+        }
+        return 0;
+    }
+    conn->in.len += (size_t)received;
+    conn->bytesReceived += (size_t)received;
+    while (conn->in.len - conn->inPos >= H2_FRAME_HEADER) {
+        const uint8_t* frame = conn->in.data + conn->inPos;
+        size_t len = ((size_t)frame[0] << 16) | ((size_t)frame[1] << 8) | frame[2];
+        if (len > LCOREHTTP_H2_FRAME_SIZE) {
+            h2_fail(conn, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+        if (conn->in.len - conn->inPos < H2_FRAME_HEADER + len) {
+            break;
+        }
+        conn->inPos += H2_FRAME_HEADER + len;
+        if (h2_on_frame(conn, frame[3], frame[4], h2_get32(frame + 5) & 0x7fffffff, frame + H2_FRAME_HEADER, len)
+            != 0) {
+            return -1;
+        }
+    }
+    if (conn->out.len > 0 && h2_flush(conn) != 0) { // SETTINGS and PING acknowledgements, window updates
+        return -1;
+    }
+    return received;
+}
+
+static int
+h2_encode_field(lcorehttp_h2* conn, lcorehttp_bytes* block, const char* name, const uint8_t* head,
+                const lcorehttp_h2_field* field) {
+    return lcorehttp_hpack_encode(&conn->encoder, block, name, strlen(name), (const char*)head + field->value,
+                                  field->valueLen);
+}
+
+static int
+h2_encode_request(lcorehttp_h2_stream* stream, lcorehttp_bytes* block) {
+    lcorehttp_h2* conn = stream->conn;
+    const uint8_t* head = stream->head.data;
+    if (lcorehttp_hpack_begin_block(&conn->encoder, block) != 0
+        || h2_encode_field(conn, block, ":method", head, &stream->fields[0]) != 0
+        || lcorehttp_hpack_encode(&conn->encoder, block, ":scheme", 7, "https", 5) != 0
+        || h2_encode_field(conn, block, ":authority", head, &stream->fields[2]) != 0
+        || h2_encode_field(conn, block, ":path", head, &stream->fields[1]) != 0) {
+        return -1;
+    }
+    for (size_t i = 3; i < stream->fieldCount; i++) {
+        const lcorehttp_h2_field* field = &stream->fields[i];
+        if (field->nameLen > 0
+            && lcorehttp_hpack_encode(&conn->encoder, block, (const char*)head + field->name, field->nameLen,
+                                      (const char*)head + field->value, field->valueLen)
+                   != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// assigns the stream id and writes the request header block as HEADERS and CONTINUATION frames
+static int
+h2_stream_send_headers(lcorehttp_h2_stream* stream, int endStream) {
+    lcorehttp_h2* conn = stream->conn;
+    if (conn->failed || conn->goaway || conn->nextStreamId > H2_MAXIMUM_STREAM_ID) {
+        stream->reset = 1;
+        return -1;
+    }
+    // blocks are encoded in the order they are sent, the dynamic table of the server follows that order
+    lcorehttp_bytes block = {0};
+    if (h2_encode_request(stream, &block) != 0) {
+        lcorehttp_bytes_free(&block);
+        stream->reset = 1;
+        return h2_fail(conn, H2_INTERNAL_ERROR); // the encoder table may be ahead of the one of the server
+    }
+    stream->id = conn->nextStreamId;
+    conn->nextStreamId += 2;
+    stream->sendWindow = conn->initialWindow;
+    size_t pos = 0;
+    uint8_t type = H2_HEADERS;
+    int failed = 0;
+    do {
+        size_t len = block.len - pos < conn->maxFrameSize ? block.len - pos : conn->maxFrameSize;
+        uint8_t flags = (uint8_t)((pos + len == block.len ? H2_FLAG_END_HEADERS : 0)
+                                  | (type == H2_HEADERS && endStream ? H2_FLAG_END_STREAM : 0));
+        failed = h2_queue(conn, type, flags, stream->id, block.data + pos, len) != 0;
+        pos += len;
+        type = H2_CONTINUATION;
+    } while (!failed && pos < block.len);
+    lcorehttp_bytes_free(&block);
+    lcorehttp_bytes_free(&stream->head);
+    free(stream->fields);
+    stream->fields = NULL;
+    stream->localEnded = endStream;
+    return failed ? -1 : 0;
+}
+
+// queues payload as DATA within the flow control windows, waiting for WINDOW_UPDATE while they are exhausted
+static int
+h2_stream_send_data(lcorehttp_h2_stream* stream, const uint8_t* data, size_t len, int endStream) {
+    lcorehttp_h2* conn = stream->conn;
+    if (stream->id == 0) {
+        if (h2_stream_send_headers(stream, endStream && len == 0) != 0) {
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+    }
+    uint64_t deadline = l_corehttp_get_time_us() + (uint64_t)conn->ioTimeoutMs * 1000;
+    while (len > 0 || endStream) {
+        if (conn->failed) {
+            return -1;
+        }
+        if (stream->reset) { // a server that answered already may reset the stream to stop the upload
+            stream->localEnded = 1;
+            return stream->remoteEnded ? 0 : -1;
+        }
+        int64_t window = conn->sendWindow < stream->sendWindow ? conn->sendWindow : stream->sendWindow;
+        size_t chunk = len < conn->maxFrameSize ? len : conn->maxFrameSize;
+        if (window < (int64_t)chunk) {
+            chunk = window > 0 ? (size_t)window : 0;
+        }
+        if (len > 0 && chunk == 0) {
+            if (h2_pump(conn) < 0) {
+                return -1;
+            }
+            if (l_corehttp_get_time_us() >= deadline) {
+                h2_stream_error(stream, H2_CANCEL);
+                return -1;
+            }
+            continue;
+        }
+        int last = endStream && chunk == len;
+        if (h2_queue(conn, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, data, chunk) != 0) {
+            return -1;
+        }
+        conn->sendWindow -= (int64_t)chunk;
+        stream->sendWindow -= (int64_t)chunk;
+        data += chunk;
+        len -= chunk;
+        if (last) {
+            stream->localEnded = 1;
+            break;
+        }
+        if (conn->out.len >= H2_FLUSH_THRESHOLD && h2_flush(conn) != 0) {
+            return -1;
+        }
+        deadline = l_corehttp_get_time_us() + (uint64_t)conn->ioTimeoutMs * 1000;
+    }
+    return 0;
+}
+
+// ends the request with its last frame; a request without a body length ends with the first recv
+static int
+h2_stream_end(lcorehttp_h2_stream* stream) {
+    if (stream->localEnded) {
+        return 0;
+    }
+    if (!stream->headComplete || (stream->bodyMode == 1 && stream->bodyRemaining > 0)
+        || (stream->bodyMode == 2 && stream->dechunker.state != DECHUNK_DONE)) {
+        h2_stream_error(stream, H2_CANCEL); // the request was cut short
+        return -1;
+    }
+    return h2_stream_send_data(stream, NULL, 0, 1);
+}
+
+static size_t
+h2_trim(const uint8_t* data, size_t start, size_t* end) {
+    while (start < *end && (data[start] == ' ' || data[start] == '\t')) {
+        start++;
+    }
+    while (*end > start && (data[*end - 1] == ' ' || data[*end - 1] == '\t')) {
+        (*end)--;
+    }
+    return start;
+}
+
+static int
+h2_field_is(const uint8_t* head, const lcorehttp_h2_field* field, const char* name) {
+    return field->nameLen == strlen(name) && memcmp(head + field->name, name, field->nameLen) == 0;
+}
+
+// splits the HTTP/1.1 request head into pseudo-header and regular fields and picks the body framing
+static int
+h2_stream_parse_request(lcorehttp_h2_stream* stream) {
+    uint8_t* head = stream->head.data;
+    size_t len = stream->head.len; // ends with the blank line
+    size_t lines = 0;
+    for (size_t i = 0; i < len; i++) {
+        lines += head[i] == '\n';
+    }
+    stream->fields = calloc(lines + 3, sizeof(lcorehttp_h2_field));
+    if (stream->fields == NULL) {
+        return -1;
+    }
+    const uint8_t* lineEnd = memchr(head, '\r', len);
+    const uint8_t* methodEnd = memchr(head, ' ', (size_t)(lineEnd - head));
+    const uint8_t* pathEnd = methodEnd != NULL ? memchr(methodEnd + 1, ' ', (size_t)(lineEnd - methodEnd - 1)) : NULL;
+    if (pathEnd == NULL || methodEnd == head || pathEnd == methodEnd + 1) {
+        return -1;
+    }
+    stream->fields[0].valueLen = (size_t)(methodEnd - head);
+    stream->fields[1].value = (size_t)(methodEnd + 1 - head);
+    stream->fields[1].valueLen = (size_t)(pathEnd - methodEnd - 1);
+    stream->fieldCount = 3;
+
+    int hasHost = 0;
+    int chunked = 0;
+    lcorehttp_h2_field* contentLength = NULL;
+    size_t pos = (size_t)(lineEnd - head) + 2;
+    while (pos + 2 < len) {
+        size_t end = pos;
+        while (head[end] != '\r') {
+            end++;
+        }
+        const uint8_t* colon = memchr(head + pos, ':', end - pos);
+        if (colon == NULL || colon == head + pos || head[pos] == ' ' || head[pos] == '\t') {
+            return -1; // no name or obsolete line folding
+        }
+        lcorehttp_h2_field* field = &stream->fields[stream->fieldCount++];
+        field->name = pos;
+        field->nameLen = (size_t)(colon - head) - pos;
+        for (size_t i = pos; i < pos + field->nameLen; i++) {
+            if (head[i] >= 'A' && head[i] <= 'Z') {
+                head[i] = (uint8_t)(head[i] - 'A' + 'a');
+            }
+        }
+        size_t valueEnd = end;
+        field->value = h2_trim(head, (size_t)(colon - head) + 1, &valueEnd);
+        field->valueLen = valueEnd - field->value;
+        pos = end + 2;
+
+        if (h2_field_is(head, field, "host")) {
+            stream->fields[2].value = field->value;
+            stream->fields[2].valueLen = field->valueLen;
+            hasHost = 1;
+        } else if (h2_field_is(head, field, "transfer-encoding")) {
+            chunked = field->valueLen >= 7 && memcmp(head + field->value + field->valueLen - 7, "chunked", 7) == 0;
+        } else if (h2_field_is(head, field, "content-length")) {
+            contentLength = field;
+            continue;
+        } else if (h2_field_is(head, field, "te")) {
+            if (field->valueLen == 8 && memcmp(head + field->value, "trailers", 8) == 0) {
+                continue; // the only value allowed in HTTP/2
+            }
+        } else if (!h2_connection_specific((const char*)head + field->name, field->nameLen)) {
+            continue;
+        }
+        field->nameLen = 0; // not sent
+    }
+    if (!hasHost) {
+        return -1;
+    }
+    if (chunked) {
+        stream->bodyMode = 2;
+        if (contentLength != NULL) {
+            contentLength->nameLen = 0;
+        }
+    } else if (contentLength != NULL) {
+        size_t value = 0;
+        for (size_t i = 0; i < contentLength->valueLen; i++) {
+            uint8_t c = head[contentLength->value + i];
+            if (c < '0' || c > '9' || value > (SIZE_MAX - 9) / 10) {
+                return -1;
+            }
+            value = value * 10 + (c - '0');
+        }
+        stream->bodyMode = 1;
+        stream->bodyRemaining = value;
+    }
+    stream->headComplete = 1;
+    return 0;
+}
+
+int32_t
+lcorehttp_h2_stream_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend) {
+    lcorehttp_h2_stream* stream = (lcorehttp_h2_stream*)pNetworkContext;
+    lcorehttp_h2* conn = stream->conn;
+    if (conn->failed || stream->reset || stream->localEnded) {
+        return -1;
+    }
+    const uint8_t* data = pBuffer;
+    size_t len = bytesToSend > INT32_MAX ? INT32_MAX : bytesToSend;
+    int32_t result = (int32_t)len;
+    if (!stream->headComplete) {
+        size_t searchFrom = stream->head.len > 3 ? stream->head.len - 3 : 0;
+        if (lcorehttp_bytes_append(&stream->head, data, len) != 0) {
+            return -1;
+        }
+        size_t end = 0;
+        for (size_t i = searchFrom; i + 4 <= stream->head.len && end == 0; i++) {
+            if (memcmp(stream->head.data + i, "\r\n\r\n", 4) == 0) {
+                end = i + 4;
+            }
+        }
+        if (end == 0) {
+            return result;
+        }
+        size_t excess = stream->head.len - end;
+        stream->head.len = end;
+        if (h2_stream_parse_request(stream) != 0) {
+            stream->reset = 1;
+            return -1;
+        }
+        data += len - excess;
+        len = excess;
+        if (stream->bodyMode == 1 && stream->bodyRemaining == 0) {
+            return h2_stream_end(stream) == 0 && h2_flush(conn) == 0 ? result : -1;
+        }
+    }
+    int ret = 0;
+    if (stream->bodyMode == 2) { // chunked framing is HTTP/1.1 only, the payload goes out as DATA
+        stream->body.len = 0;
+        if (lcorehttp_bytes_append(&stream->body, data, len) != 0) {
+            return -1;
+        }
+        size_t payload = lcorehttp_dechunk(&stream->dechunker, stream->body.data, len);
+        if (payload == (size_t)-1) {
+            h2_stream_error(stream, H2_CANCEL);
+            return -1;
+        }
+        ret = h2_stream_send_data(stream, stream->body.data, payload, stream->dechunker.state == DECHUNK_DONE);
+    } else if (stream->bodyMode == 1) {
+        if (len > stream->bodyRemaining) {
+            h2_stream_error(stream, H2_CANCEL); // more than content-length
+            return -1;
+        }
+        stream->bodyRemaining -= len;
+        ret = len > 0 ? h2_stream_send_data(stream, data, len, stream->bodyRemaining == 0) : 0;
+    } else if (len > 0) {
+        ret = h2_stream_send_data(stream, data, len, 0);
+    }
+    return ret == 0 && h2_flush(conn) == 0 ? result : -1;
+}
+
+// returns the receive window of the data handed out, once the stream buffer was drained
+static void
+h2_stream_credit(lcorehttp_h2_stream* stream) {
+    if (stream->remoteEnded || stream->reset || stream->recvDebt < LCOREHTTP_H2_STREAM_WINDOW / 2) {
+        return;
+    }
+    if (h2_queue_u32(stream->conn, H2_WINDOW_UPDATE, stream->id, (uint32_t)stream->recvDebt) == 0) {
+        stream->recvDebt = 0;
+        h2_flush(stream->conn); // a failure shows with the next receive
+    }
+}
+
+int32_t
+lcorehttp_h2_stream_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv) {
+    lcorehttp_h2_stream* stream = (lcorehttp_h2_stream*)pNetworkContext;
+    lcorehttp_h2* conn = stream->conn;
+    if (!stream->localEnded && !stream->reset && (h2_stream_end(stream) != 0 || h2_flush(conn) != 0)) {
+        return -1;
+    }
+    while (stream->inPos == stream->in.len && !stream->remoteEnded && !stream->reset && !conn->failed) {
+        if (h2_pump(conn) <= 0) {
+            break;
+        }
+    }
+    conn->lastUsed = l_corehttp_get_time_ms();
+    size_t available = stream->in.len - stream->inPos;
+    if (available > 0) {
+        size_t len = available < bytesToRecv ? available : bytesToRecv;
+        len = len > INT32_MAX ? INT32_MAX : len;
+        memcpy(pBuffer, stream->in.data + stream->inPos, len);
+        stream->inPos += len;
+        if (stream->inPos == stream->in.len) {
+            stream->in.len = 0;
+            stream->inPos = 0;
+            h2_stream_credit(stream);
+        }
+        return (int32_t)len;
+    }
+    if (stream->remoteEnded) {
+        return 0; // like a socket the peer closed
+    }
+    return stream->reset || conn->failed ? -1 : 0;
+}
+
+static int
+h2_attach_stream(lcorehttp_h2* conn, TransportInterface_t* transport) {
+    lcorehttp_h2_stream* stream = calloc(1, sizeof(lcorehttp_h2_stream));
+    if (stream == NULL) {
+        return -1;
+    }
+    lcorehttp_dechunker dechunker = LCOREHTTP_DECHUNKER_INIT;
+    stream->dechunker = dechunker;
+    stream->conn = conn;
+    stream->next = conn->streams;
+    conn->streams = stream;
+    conn->refs++;
+    conn->lastUsed = l_corehttp_get_time_ms();
+    transport->recv = lcorehttp_h2_stream_recv;
+    transport->send = lcorehttp_h2_stream_send;
+    transport->pNetworkContext = (NetworkContext_t*)stream;
+    return 0;
+}
+
+static void
+h2_free(lcorehttp_h2* conn) {
+    lcorehttp_connection_close(conn->host, conn->port, &conn->transport, conn->bytesReceived);
+    lcorehttp_hpack_free(&conn->encoder);
+    lcorehttp_hpack_free(&conn->decoder);
+    lcorehttp_bytes_free(&conn->in);
+    lcorehttp_bytes_free(&conn->out);
+    lcorehttp_bytes_free(&conn->headerBlock);
+    free(conn);
+}
+
+const char*
+lcorehttp_h2_connect(const char* host, int port, uint32_t ioTimeoutMs, const TransportInterface_t* connection,
+                     TransportInterface_t* transport) {
+    lcorehttp_h2* conn = calloc(1, sizeof(lcorehttp_h2));
+    if (conn == NULL) {
+        lcorehttp_connection_close(host, port, connection, 0);
+        return "failed to allocate http2 connection";
+    }
+    conn->transport = *connection;
+    snprintf(conn->host, sizeof(conn->host), "%s", host);
+    conn->port = port;
+    conn->ioTimeoutMs = ioTimeoutMs;
+    conn->nextStreamId = 1;
+    conn->maxStreams = H2_DEFAULT_MAX_STREAMS;
+    conn->maxFrameSize = LCOREHTTP_H2_FRAME_SIZE;
+    conn->initialWindow = H2_DEFAULT_WINDOW;
+    conn->sendWindow = H2_DEFAULT_WINDOW;
+    if (lcorehttp_hpack_init(&conn->encoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) != 0
+        || lcorehttp_hpack_init(&conn->decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) != 0) {
+        h2_free(conn);
+        return "failed to allocate http2 connection";
+    }
+
+    // connection preface: no server push, larger receive windows than the 64KB default
+    uint8_t settings[12] = {0, H2_SETTINGS_ENABLE_PUSH, 0, 0, 0, 0, 0, H2_SETTINGS_INITIAL_WINDOW_SIZE};
+    h2_put32(settings + 8, LCOREHTTP_H2_STREAM_WINDOW);
+    if (lcorehttp_bytes_append(&conn->out, preface, sizeof(preface) - 1) != 0
+        || h2_queue(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings)) != 0
+        || h2_queue_u32(conn, H2_WINDOW_UPDATE, 0, LCOREHTTP_H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW) != 0
+        || h2_flush(conn) != 0) {
+        h2_free(conn);
+        return "failed to start http2 connection";
+    }
+    if (h2_attach_stream(conn, transport) != 0) {
+        h2_free(conn);
+        return "failed to allocate http2 stream";
+    }
+    return NULL;
+}
+
+int
+lcorehttp_h2_open_stream(lcorehttp_h2* conn, TransportInterface_t* transport) {
+    if (!lcorehttp_h2_alive(conn, UINT32_MAX) || h2_active_streams(conn) >= conn->maxStreams) {
+        return -1;
+    }
+    return h2_attach_stream(conn, transport);
+}
+
+int
+lcorehttp_h2_alive(const lcorehttp_h2* conn, uint32_t idleTimeoutMs) {
+    if (conn->failed || conn->goaway || conn->nextStreamId > H2_MAXIMUM_STREAM_ID) {
+        return 0;
+    }
+    // a connection nobody used for a while may have been closed by the server, like the idle ones of the pool
+    return conn->streams != NULL || l_corehttp_get_time_ms() - conn->lastUsed < idleTimeoutMs;
+}
+
+void
+lcorehttp_h2_retain(lcorehttp_h2* conn) {
+    conn->refs++;
+}
+
+void
+lcorehttp_h2_release(lcorehttp_h2* conn) {
+    if (conn == NULL || --conn->refs > 0) {
+        return;
+    }
+    if (!conn->failed) {
+        h2_fail(conn, H2_NO_ERROR); // GOAWAY, best effort
+    }
+    h2_free(conn);
+}
+
+void
+lcorehttp_h2_stream_close(NetworkContext_t* pNetworkContext) {
+    lcorehttp_h2_stream* stream = (lcorehttp_h2_stream*)pNetworkContext;
+    lcorehttp_h2* conn = stream->conn;
+    if (!conn->failed && !(stream->localEnded && stream->remoteEnded)) {
+        h2_stream_error(stream, H2_CANCEL);
+        h2_flush(conn);
+    }
+    for (lcorehttp_h2_stream** link = &conn->streams; *link != NULL; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            break;
+        }
+    }
+    lcorehttp_bytes_free(&stream->head);
+    free(stream->fields);
+    lcorehttp_bytes_free(&stream->body);
+    lcorehttp_bytes_free(&stream->in);
+    free(stream);
+    conn->lastUsed = l_corehttp_get_time_ms();
+    lcorehttp_h2_release(conn);
+}
+
+lcorehttp_h2*
+lcorehttp_h2_of(const TransportInterface_t* transport) {
+    if (transport == NULL || transport->recv != lcorehttp_h2_stream_recv) {
+        return NULL;
+    }
+    return ((lcorehttp_h2_stream*)transport->pNetworkContext)->conn;
+}
@@ -0,0 +1,114 @@
+#ifndef LCOREHTTP_H2_H
+#define LCOREHTTP_H2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lcorehttp_body.h"
+#include "lcorehttp_hpack.h"
+#include "lcorehttp_tls.h"
+#include "transport_interface.h"
+
+#define LCOREHTTP_H2_STREAM_WINDOW        262144   /* SETTINGS_INITIAL_WINDOW_SIZE announced to the server */
+#define LCOREHTTP_H2_CONNECTION_WINDOW    16777216 /* receive window shared by all streams */
+#define LCOREHTTP_H2_FRAME_SIZE           16384    /* SETTINGS_MAX_FRAME_SIZE default, never raised */
+#define LCOREHTTP_H2_MAXIMUM_HEADER_BLOCK 1048576
+
+struct lcorehttp_h2;
+
+// request field of a stream, offsets into its request head
+typedef struct lcorehttp_h2_field {
+    size_t name;
+    size_t nameLen;
+    size_t value;
+    size_t valueLen;
+} lcorehttp_h2_field;
+
+/*
+ * One request/response exchange multiplexed on an HTTP/2 connection. It is handed to coreHTTP as the
+ * NetworkContext_t of an ordinary transport: send takes the HTTP/1.1 request coreHTTP serializes and turns it into
+ * HEADERS and DATA frames, recv hands out the response as HTTP/1.1 (status line, fields, then the DATA payload,
+ * chunked when the server sent no content-length) so responses are read exactly like the ones of a socket.
+ */
+typedef struct lcorehttp_h2_stream {
+    struct lcorehttp_h2* conn; // retained by the stream
+    struct lcorehttp_h2_stream* next;
+    uint32_t id; // assigned when HEADERS go out, stream ids have to be used in increasing order
+    int localEnded;  // END_STREAM sent
+    int remoteEnded; // END_STREAM received
+    int reset;       // RST_STREAM sent or received, or refused by GOAWAY
+    int64_t sendWindow;
+    size_t recvDebt; // DATA bytes received since the last WINDOW_UPDATE
+    // request
+    lcorehttp_bytes head; // HTTP/1.1 request line and fields, until the blank line
+    int headComplete;
+    lcorehttp_h2_field* fields; // [0] method, [1] path, [2] authority, regular fields after them
+    size_t fieldCount;
+    int bodyMode;         // 0: ends with the first recv, 1: content-length, 2: chunked
+    size_t bodyRemaining; // content-length bytes still to send
+    lcorehttp_dechunker dechunker;
+    lcorehttp_bytes body; // chunked body being unframed
+    // response, as HTTP/1.1
+    lcorehttp_bytes in;
+    size_t inPos;
+    int started; // final response header block received
+    int chunked; // DATA is framed as chunks, no content-length
+} lcorehttp_h2_stream;
+
+/*
+ * HTTP/2 connection (RFC 9113) over a native TLS connection that negotiated "h2" with ALPN. Shared by the
+ * streams open on it and by the client that multiplexes its requests onto it, hence reference counted; it is
+ * owned by a single thread (the Lua thread of the client, or the worker of an async request).
+ */
+typedef struct lcorehttp_h2 {
+    int refs;
+    TransportInterface_t transport; // TLS connection below
+    char host[LCOREHTTP_TLS_MAXIMUM_HOST + 1];
+    int port;
+    uint32_t ioTimeoutMs;
+    uint32_t lastUsed; // l_corehttp_get_time_ms()
+    int failed;        // connection error or transport failure, every stream fails
+    int goaway;        // no new streams
+    uint32_t nextStreamId;
+    lcorehttp_h2_stream* streams;
+    // peer settings
+    uint32_t maxStreams;
+    uint32_t maxFrameSize;
+    int64_t initialWindow;
+    int64_t sendWindow;
+    size_t recvDebt;
+    lcorehttp_hpack encoder;
+    lcorehttp_hpack decoder;
+    lcorehttp_bytes in; // received, not yet dispatched
+    size_t inPos;
+    lcorehttp_bytes out; // frames not yet written
+    lcorehttp_bytes headerBlock; // HEADERS waiting for its CONTINUATION frames
+    uint32_t headerStream;
+    uint8_t headerFlags;
+    size_t bytesReceived;
+} lcorehttp_h2;
+
+/**
+ * @brief Start HTTP/2 on a TLS connection that negotiated h2 and open its first stream into *transport.
+ *
+ * Ownership of connection moves to the HTTP/2 connection, it is closed on failure as well.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* lcorehttp_h2_connect(const char* host, int port, uint32_t ioTimeoutMs,
+                                 const TransportInterface_t* connection, TransportInterface_t* transport);
+// opens a new stream into *transport, -1 when the connection takes no more streams right now
+int lcorehttp_h2_open_stream(lcorehttp_h2* conn, TransportInterface_t* transport);
+// the connection may take new streams now or later, 0 once it failed, went away or idled out
+int lcorehttp_h2_alive(const lcorehttp_h2* conn, uint32_t idleTimeoutMs);
+void lcorehttp_h2_retain(lcorehttp_h2* conn);
+void lcorehttp_h2_release(lcorehttp_h2* conn);
+
+int32_t lcorehttp_h2_stream_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv);
+int32_t lcorehttp_h2_stream_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend);
+// resets the stream unless the exchange completed and releases its connection
+void lcorehttp_h2_stream_close(NetworkContext_t* pNetworkContext);
+
+// connection of a stream transport, NULL for any other transport
+lcorehttp_h2* lcorehttp_h2_of(const TransportInterface_t* transport);
+
+#endif /* LCOREHTTP_H2_H */
@@ -0,0 +1,449 @@
+#include "lcorehttp_hpack.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_COUNT   61
+
+typedef struct hpack_static_entry {
+    const char* name;
+    const char* value;
+} hpack_static_entry;
+
+// RFC 7541 appendix A
+static const hpack_static_entry staticTable[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/*
+ * The Huffman code of appendix B is canonical: codes of the same length are consecutive in symbol order, so the
+ * number of codes per length and the symbols ordered by code are enough to decode it. 256 is EOS.
+ */
+static const uint8_t huffmanCounts[31] = {0,  0,  0, 0, 0, 10, 26, 32, 6,  0,  5,  3,  2, 6,  2, 3,
+                                          0,  0,  0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+
+static const uint16_t huffmanSymbols[257] = {
+    48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,  51,  52,  53,  54,  55,  56,  57,
+    61,  65,  95,  98,  100, 102, 103, 104, 108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,
+    73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,  106, 107, 113, 118, 119, 120,
+    121, 122, 38,  42,  44,  59,  88,  90,  33,  34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,
+    93,  126, 94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172,
+    176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139, 140, 141, 143, 147,
+    149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213,
+    218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250,
+    251, 252, 253, 254, 2,   3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,  21,  23,
+    24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,  22,  256,
+};
+
+static int
+hpack_table_init(lcorehttp_hpack_table* table, size_t maxSize) {
+    table->slots = maxSize / HPACK_ENTRY_OVERHEAD + 1;
+    table->entries = calloc(table->slots, sizeof(lcorehttp_hpack_entry*));
+    table->count = 0;
+    table->head = 0;
+    table->size = 0;
+    table->maxSize = maxSize;
+    return table->entries != NULL ? 0 : -1;
+}
+
+// index 1 is the most recent entry
+static lcorehttp_hpack_entry*
+hpack_table_get(const lcorehttp_hpack_table* table, size_t index) {
+    return table->entries[(table->head + table->slots - (index - 1)) % table->slots];
+}
+
+static void
+hpack_table_evict(lcorehttp_hpack_table* table, size_t maxSize) {
+    while (table->count > 0 && table->size > maxSize) {
+        size_t oldest = (table->head + table->slots - (table->count - 1)) % table->slots;
+        lcorehttp_hpack_entry* entry = table->entries[oldest];
+        table->size -= entry->nameLen + entry->valueLen + HPACK_ENTRY_OVERHEAD;
+        free(entry);
+        table->entries[oldest] = NULL;
+        table->count--;
+    }
+}
+
+// name and value may point into an entry that gets evicted, they are copied first
+static int
+hpack_table_add(lcorehttp_hpack_table* table, const char* name, size_t nameLen, const char* value, size_t valueLen) {
+    size_t entrySize = nameLen + valueLen + HPACK_ENTRY_OVERHEAD;
+    if (entrySize > table->maxSize) { // a too large entry empties the table (section 4.4)
+        hpack_table_evict(table, 0);
+        return 0;
+    }
+    lcorehttp_hpack_entry* entry = malloc(sizeof(lcorehttp_hpack_entry) + nameLen + valueLen);
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->nameLen = nameLen;
+    entry->valueLen = valueLen;
+    memcpy(entry->data, name, nameLen);
+    memcpy(entry->data + nameLen, value, valueLen);
+    hpack_table_evict(table, table->maxSize - entrySize);
+    table->head = (table->head + 1) % table->slots;
+    table->entries[table->head] = entry;
+    table->count++;
+    table->size += entrySize;
+    return 0;
+}
+
+static void
+hpack_table_free(lcorehttp_hpack_table* table) {
+    if (table->entries != NULL) {
+        hpack_table_evict(table, 0);
+        free(table->entries);
+        table->entries = NULL;
+    }
+}
+
+int
+lcorehttp_hpack_init(lcorehttp_hpack* hpack, size_t limit) {
+    memset(hpack, 0, sizeof(lcorehttp_hpack));
+    hpack->limit = limit;
+    hpack->smallestUpdate = limit;
+    return hpack_table_init(&hpack->table, limit);
+}
+
+void
+lcorehttp_hpack_free(lcorehttp_hpack* hpack) {
+    hpack_table_free(&hpack->table);
+    lcorehttp_bytes_free(&hpack->scratch);
+}
+
+// integer with an N-bit prefix (section 5.1), -1 when truncated or too large
+static int
+hpack_read_integer(const uint8_t* block, size_t len, size_t* pos, int prefixBits, size_t* value) {
+    size_t mask = ((size_t)1 << prefixBits) - 1;
+    *value = block[*pos] & mask;
+    (*pos)++;
+    if (*value < mask) {
+        return 0;
+    }
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*pos >= len) {
+            return -1;
+        }
+        uint8_t b = block[(*pos)++];
+        *value += (size_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int
+hpack_huffman_decode(const uint8_t* data, size_t len, lcorehttp_bytes* out) {
+    if (lcorehttp_bytes_reserve(out, len * 8 / 5 + 1) != 0) {
+        return -1;
+    }
+    uint32_t code = 0;
+    uint32_t first = 0;
+    uint32_t index = 0;
+    int bits = 0; // length of the code read so far
+    int ones = 1; // the pending bits are all 1
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            uint32_t bit = (data[i] >> b) & 1;
+            code |= bit;
+            ones &= (int)bit;
+            bits++;
+            uint32_t count = huffmanCounts[bits];
+            if (code - first < count) {
+                uint16_t symbol = huffmanSymbols[index + code - first];
+                if (symbol == 256) {
+                    return -1; // EOS must not appear in a string
+                }
+                out->data[out->len++] = (uint8_t)symbol;
+                code = first = index = 0;
+                bits = 0;
+                ones = 1;
+                continue;
+            }
+            if (bits == 30) {
+                return -1;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    // padding is the most significant bits of EOS, shorter than a byte (section 5.2)
+    return bits < 8 && ones ? 0 : -1;
+}
+
+// string literal (section 5.2) appended to the scratch buffer
+static int
+hpack_read_string(lcorehttp_hpack* hpack, const uint8_t* block, size_t len, size_t* pos) {
+    if (*pos >= len) {
+        return -1;
+    }
+    int huffman = (block[*pos] & 0x80) != 0;
+    size_t stringLen = 0;
+    if (hpack_read_integer(block, len, pos, 7, &stringLen) != 0 || stringLen > len - *pos) {
+        return -1;
+    }
+    const uint8_t* data = block + *pos;
+    *pos += stringLen;
+    if (huffman) {
+        return hpack_huffman_decode(data, stringLen, &hpack->scratch);
+    }
+    return lcorehttp_bytes_append(&hpack->scratch, data, stringLen);
+}
+
+// name of a static or dynamic table index, -1 when the index is out of range
+static int
+hpack_lookup(const lcorehttp_hpack* hpack, size_t index, const char** name, size_t* nameLen, const char** value,
+             size_t* valueLen) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = staticTable[index - 1].name;
+        *nameLen = strlen(*name);
+        *value = staticTable[index - 1].value;
+        *valueLen = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT;
+    if (index > hpack->table.count) {
+        return -1;
+    }
+    lcorehttp_hpack_entry* entry = hpack_table_get(&hpack->table, index);
+    *name = entry->data;
+    *nameLen = entry->nameLen;
+    *value = entry->data + entry->nameLen;
+    *valueLen = entry->valueLen;
+    return 0;
+}
+
+int
+lcorehttp_hpack_decode(lcorehttp_hpack* hpack, const uint8_t* block, size_t len, lcorehttp_hpack_header_fn onHeader,
+                       void* context) {
+    size_t pos = 0;
+    int fields = 0;
+    while (pos < len) {
+        uint8_t b = block[pos];
+        const char* name = NULL;
+        const char* value = NULL;
+        size_t nameLen = 0;
+        size_t valueLen = 0;
+        size_t index = 0;
+        if (b & 0x80) { // indexed field
+            if (hpack_read_integer(block, len, &pos, 7, &index) != 0
+                || hpack_lookup(hpack, index, &name, &nameLen, &value, &valueLen) != 0) {
+                return -1;
+            }
+            onHeader(context, name, nameLen, value, valueLen);
+            fields++;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) { // dynamic table size update, only before the first field
+            size_t maxSize = 0;
+            if (fields > 0 || hpack_read_integer(block, len, &pos, 5, &maxSize) != 0 || maxSize > hpack->limit) {
+                return -1;
+            }
+            hpack->table.maxSize = maxSize;
+            hpack_table_evict(&hpack->table, maxSize);
+            continue;
+        }
+        int indexing = (b & 0xc0) == 0x40;
+        if (hpack_read_integer(block, len, &pos, indexing ? 6 : 4, &index) != 0) {
+            return -1;
+        }
+        hpack->scratch.len = 0;
+        if (index > 0) {
+            if (hpack_lookup(hpack, index, &name, &nameLen, &value, &valueLen) != 0) {
+                return -1;
+            }
+        } else {
+            if (hpack_read_string(hpack, block, len, &pos) != 0) {
+                return -1;
+            }
+            nameLen = hpack->scratch.len;
+        }
+        size_t valueStart = hpack->scratch.len;
+        if (hpack_read_string(hpack, block, len, &pos) != 0) {
+            return -1;
+        }
+        // the scratch buffer may have moved while the value was decoded
+        if (index == 0) {
+            name = (const char*)hpack->scratch.data;
+        }
+        value = hpack->scratch.len > valueStart ? (const char*)hpack->scratch.data + valueStart : "";
+        valueLen = hpack->scratch.len - valueStart;
+        onHeader(context, name != NULL ? name : "", nameLen, value, valueLen);
+        fields++;
+        if (indexing && hpack_table_add(&hpack->table, name != NULL ? name : "", nameLen, value, valueLen) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+lcorehttp_hpack_set_limit(lcorehttp_hpack* hpack, size_t limit) {
+    // the table allocated at init is the largest this side uses, whatever the peer would allow
+    size_t maxSize = limit < hpack->limit ? limit : hpack->limit;
+    if (maxSize == hpack->table.maxSize) {
+        return;
+    }
+    hpack->table.maxSize = maxSize;
+    hpack_table_evict(&hpack->table, maxSize);
+    if (!hpack->pendingSizeUpdate || maxSize < hpack->smallestUpdate) {
+        hpack->smallestUpdate = maxSize;
+    }
+    hpack->pendingSizeUpdate = 1;
+}
+
+static int
+hpack_write_integer(lcorehttp_bytes* out, uint8_t flags, int prefixBits, size_t value) {
+    if (lcorehttp_bytes_reserve(out, 10) != 0) {
+        return -1;
+    }
+    size_t mask = ((size_t)1 << prefixBits) - 1;
+    if (value < mask) {
+        out->data[out->len++] = (uint8_t)(flags | value);
+        return 0;
+    }
+    out->data[out->len++] = (uint8_t)(flags | mask);
+    value -= mask;
+    while (value >= 0x80) {
+        out->data[out->len++] = (uint8_t)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out->data[out->len++] = (uint8_t)value;
+    return 0;
+}
+
+static int
+hpack_write_string(lcorehttp_bytes* out, const char* data, size_t len) {
+    if (hpack_write_integer(out, 0, 7, len) != 0) {
+        return -1;
+    }
+    return lcorehttp_bytes_append(out, data, len);
+}
+
+int
+lcorehttp_hpack_begin_block(lcorehttp_hpack* hpack, lcorehttp_bytes* out) {
+    if (!hpack->pendingSizeUpdate) {
+        return 0;
+    }
+    hpack->pendingSizeUpdate = 0;
+    // a shrink followed by a growth has to be signalled as both (section 4.2)
+    if (hpack->smallestUpdate < hpack->table.maxSize && hpack_write_integer(out, 0x20, 5, hpack->smallestUpdate) != 0) {
+        return -1;
+    }
+    return hpack_write_integer(out, 0x20, 5, hpack->table.maxSize);
+}
+
+static int
+hpack_sensitive(const char* name, size_t nameLen) {
+    return (nameLen == 13 && memcmp(name, "authorization", 13) == 0)
+           || (nameLen == 19 && memcmp(name, "proxy-authorization", 19) == 0)
+           || (nameLen == 6 && memcmp(name, "cookie", 6) == 0);
+}
+
+int
+lcorehttp_hpack_encode(lcorehttp_hpack* hpack, lcorehttp_bytes* out, const char* name, size_t nameLen,
+                       const char* value, size_t valueLen) {
+    size_t nameIndex = 0;
+    for (size_t i = 0; i < HPACK_STATIC_COUNT; i++) {
+        const hpack_static_entry* entry = &staticTable[i];
+        if (strlen(entry->name) != nameLen || memcmp(entry->name, name, nameLen) != 0) {
+            continue;
+        }
+        if (strlen(entry->value) == valueLen && memcmp(entry->value, value, valueLen) == 0) {
+            return hpack_write_integer(out, 0x80, 7, i + 1);
+        }
+        if (nameIndex == 0) {
+            nameIndex = i + 1;
+        }
+    }
+    int sensitive = hpack_sensitive(name, nameLen);
+    for (size_t i = 1; i <= hpack->table.count; i++) {
+        const lcorehttp_hpack_entry* entry = hpack_table_get(&hpack->table, i);
+        if (entry->nameLen != nameLen || memcmp(entry->data, name, nameLen) != 0) {
+            continue;
+        }
+        if (!sensitive && entry->valueLen == valueLen && memcmp(entry->data + nameLen, value, valueLen) == 0) {
+            return hpack_write_integer(out, 0x80, 7, HPACK_STATIC_COUNT + i);
+        }
+        if (nameIndex == 0) {
+            nameIndex = HPACK_STATIC_COUNT + i;
+        }
+    }
+
+    int indexing = !sensitive && nameLen + valueLen + HPACK_ENTRY_OVERHEAD <= hpack->table.maxSize;
+    int ret = indexing    ? hpack_write_integer(out, 0x40, 6, nameIndex)
+              : sensitive ? hpack_write_integer(out, 0x10, 4, nameIndex)
+                          : hpack_write_integer(out, 0x00, 4, nameIndex);
+    if (ret != 0 || (nameIndex == 0 && hpack_write_string(out, name, nameLen) != 0)
+        || hpack_write_string(out, value, valueLen) != 0) {
+        return -1;
+    }
+    return indexing ? hpack_table_add(&hpack->table, name, nameLen, value, valueLen) : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef LCOREHTTP_HPACK_H
+#define LCOREHTTP_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lcorehttp_body.h"
+
+#define LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct lcorehttp_hpack_entry {
+    size_t nameLen;
+    size_t valueLen;
+    char data[]; // name followed by value
+} lcorehttp_hpack_entry;
+
+/*
+ * HPACK dynamic table (RFC 7541 section 2.3.2): a ring of entries, index 1 is the most recent one. Sizes are
+ * accounted the RFC way (name + value + 32), entries are evicted from the oldest end.
+ */
+typedef struct lcorehttp_hpack_table {
+    lcorehttp_hpack_entry** entries;
+    size_t slots; // maxSize / 32, no table of maxSize can hold more
+    size_t count;
+    size_t head; // slot of the most recent entry
+    size_t size;
+    size_t maxSize;
+} lcorehttp_hpack_table;
+
+// one HPACK context per direction of a connection
+typedef struct lcorehttp_hpack {
+    lcorehttp_hpack_table table;
+    size_t limit;          // decoder: size the peer may set at most, encoder: size the peer allows
+    int pendingSizeUpdate; // encoder: the next block starts with a dynamic table size update
+    size_t smallestUpdate; // encoder: smallest size set since the last block
+    lcorehttp_bytes scratch;
+} lcorehttp_hpack;
+
+typedef void (*lcorehttp_hpack_header_fn)(void* context, const char* name, size_t nameLen, const char* value,
+                                          size_t valueLen);
+
+// -1 when out of memory
+int lcorehttp_hpack_init(lcorehttp_hpack* hpack, size_t limit);
+void lcorehttp_hpack_free(lcorehttp_hpack* hpack);
+
+/**
+ * @brief Decode a complete header block, onHeader is called for every field in order.
+ *
+ * The dynamic table is updated even when the caller is not interested in the fields, it has to stay in sync with
+ * the encoder of the peer.
+ *
+ * @return 0 on success, -1 on a compression error (the connection cannot be used any more).
+ */
+int lcorehttp_hpack_decode(lcorehttp_hpack* hpack, const uint8_t* block, size_t len,
+                           lcorehttp_hpack_header_fn onHeader, void* context);
+
+// encoder: the peer changed SETTINGS_HEADER_TABLE_SIZE
+void lcorehttp_hpack_set_limit(lcorehttp_hpack* hpack, size_t limit);
+// encoder: appends the size update owed to the peer, call once at the start of every header block
+int lcorehttp_hpack_begin_block(lcorehttp_hpack* hpack, lcorehttp_bytes* out);
+
+/**
+ * @brief Append one field to a header block, name has to be lowercase already.
+ *
+ * Fields are indexed for later blocks unless they carry credentials (authorization, cookie), those are sent as
+ * never-indexed literals. Strings are not Huffman coded.
+ *
+ * @return -1 when out of memory.
+ */
+int lcorehttp_hpack_encode(lcorehttp_hpack* hpack, lcorehttp_bytes* out, const char* name, size_t nameLen,
+                           const char* value, size_t valueLen);
+
+#endif /* LCOREHTTP_HPACK_H */
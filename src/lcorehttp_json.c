@@ -0,0 +1,475 @@
+#include "lcorehttp_json.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lcorehttp_body.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_response.h"
+#include "lerror.h"
+
+typedef enum lcorehttp_json_state {
+    JSON_VALUE,
+    JSON_VALUE_OR_END, // first element of an array
+    JSON_KEY,
+    JSON_KEY_OR_END, // first member of an object
+    JSON_COLON,
+    JSON_AFTER_VALUE,
+    JSON_STRING,
+    JSON_STRING_ESCAPE,
+    JSON_STRING_UNICODE,
+    JSON_NUMBER,
+    JSON_LITERAL,
+    JSON_DONE,
+} lcorehttp_json_state;
+
+static const char*
+json_error(lcorehttp_json_parser* parser, const char* message, size_t position) {
+    snprintf(parser->error, sizeof(parser->error), "%s at byte %zu", message, position);
+    return parser->error;
+}
+
+static int
+json_append(lcorehttp_json_parser* parser, const void* data, size_t len) {
+    if (parser->tokenLen + len + 1 > parser->tokenCapacity) { // keeps room for the terminator of numbers
+        size_t capacity = parser->tokenCapacity;
+        while (capacity < parser->tokenLen + len + 1) {
+            capacity *= 2;
+        }
+        char* token = realloc(parser->token, capacity);
+        if (token == NULL) {
+            return -1;
+        }
+        parser->token = token;
+        parser->tokenCapacity = capacity;
+    }
+    memcpy(parser->token + parser->tokenLen, data, len);
+    parser->tokenLen += len;
+    return 0;
+}
+
+static int
+json_append_utf8(lcorehttp_json_parser* parser, uint32_t codepoint) {
+    uint8_t utf8[4];
+    size_t len = 0;
+    if (codepoint < 0x80) {
+        utf8[len++] = (uint8_t)codepoint;
+    } else if (codepoint < 0x800) {
+        utf8[len++] = (uint8_t)(0xC0 | (codepoint >> 6));
+        utf8[len++] = (uint8_t)(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        utf8[len++] = (uint8_t)(0xE0 | (codepoint >> 12));
+        utf8[len++] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+        utf8[len++] = (uint8_t)(0x80 | (codepoint & 0x3F));
+    } else {
+        utf8[len++] = (uint8_t)(0xF0 | (codepoint >> 18));
+        utf8[len++] = (uint8_t)(0x80 | ((codepoint >> 12) & 0x3F));
+        utf8[len++] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+        utf8[len++] = (uint8_t)(0x80 | (codepoint & 0x3F));
+    }
+    return json_append(parser, utf8, len);
+}
+
+// a high surrogate that is not followed by a low one becomes U+FFFD
+static int
+json_flush_surrogate(lcorehttp_json_parser* parser) {
+    if (parser->highSurrogate == 0) {
+        return 0;
+    }
+    parser->highSurrogate = 0;
+    return json_append_utf8(parser, 0xFFFD);
+}
+
+static int
+json_append_codepoint(lcorehttp_json_parser* parser, uint32_t codepoint) {
+    if (parser->highSurrogate != 0 && codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+        codepoint = 0x10000 + ((parser->highSurrogate - 0xD800) << 10) + (codepoint - 0xDC00);
+        parser->highSurrogate = 0;
+        return json_append_utf8(parser, codepoint);
+    }
+    if (json_flush_surrogate(parser) != 0) {
+        return -1;
+    }
+    if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+        parser->highSurrogate = codepoint;
+        return 0;
+    }
+    return json_append_utf8(parser, (codepoint >= 0xDC00 && codepoint <= 0xDFFF) ? 0xFFFD : codepoint);
+}
+
+// stores the value on top of the stack into the open container
+static void
+json_value_done(lua_State* L, lcorehttp_json_parser* parser) {
+    if (parser->depth == 0) {
+        parser->state = JSON_DONE;
+        return;
+    }
+    lcorehttp_json_frame* frame = &parser->frames[parser->depth - 1];
+    parser->state = JSON_AFTER_VALUE;
+    if (frame->isObject) {
+        lua_rawset(L, -3);
+        return;
+    }
+    frame->count++;
+    if (parser->depth == 1 && parser->callbackIdx != 0) {
+        lua_pushvalue(L, parser->callbackIdx);
+        lua_insert(L, -2);
+        lua_pushinteger(L, frame->count);
+        lua_call(L, 2, 0);
+        parser->emitted++;
+        return;
+    }
+    lua_rawseti(L, -2, frame->count);
+}
+
+static const char*
+json_open(lua_State* L, lcorehttp_json_parser* parser, int isObject, size_t position) {
+    if (parser->depth == LCOREHTTP_JSON_MAXIMUM_DEPTH) {
+        return json_error(parser, "JSON nested too deeply", position);
+    }
+    luaL_checkstack(L, 4, "JSON nested too deeply");
+    if (parser->depth == 0) {
+        parser->rootIsArray = !isObject;
+    }
+    lua_newtable(L);
+    parser->frames[parser->depth].isObject = isObject;
+    parser->frames[parser->depth].count = 0;
+    parser->depth++;
+    parser->state = isObject ? JSON_KEY_OR_END : JSON_VALUE_OR_END;
+    return NULL;
+}
+
+static const char*
+json_close(lua_State* L, lcorehttp_json_parser* parser, int isObject, size_t position) {
+    if (parser->depth == 0 || parser->frames[parser->depth - 1].isObject != isObject) {
+        return json_error(parser, "mismatched bracket", position);
+    }
+    parser->depth--;
+    json_value_done(L, parser);
+    return NULL;
+}
+
+static const char*
+json_finish_number(lua_State* L, lcorehttp_json_parser* parser, size_t position) {
+    parser->token[parser->tokenLen] = '\0';
+    if (lua_stringtonumber(L, parser->token) != parser->tokenLen + 1) {
+        return json_error(parser, "invalid number", position);
+    }
+    json_value_done(L, parser);
+    return NULL;
+}
+
+static void
+json_push_null(lua_State* L, const lcorehttp_json_parser* parser) {
+    if (parser->nullIdx != 0) {
+        lua_pushvalue(L, parser->nullIdx);
+    } else {
+        lua_pushlightuserdata(L, NULL);
+    }
+}
+
+static const char*
+json_begin_value(lua_State* L, lcorehttp_json_parser* parser, uint8_t c, size_t position) {
+    switch (c) {
+        case '{': return json_open(L, parser, 1, position);
+        case '[': return json_open(L, parser, 0, position);
+        case '"':
+            parser->state = JSON_STRING;
+            parser->stringIsKey = 0;
+            parser->tokenLen = 0;
+            return NULL;
+        case 't': parser->literal = "true"; break;
+        case 'f': parser->literal = "false"; break;
+        case 'n': parser->literal = "null"; break;
+        default:
+            if (c == '-' || (c >= '0' && c <= '9')) {
+                parser->state = JSON_NUMBER;
+                parser->tokenLen = 0;
+                return json_append(parser, &c, 1) == 0 ? NULL : json_error(parser, "out of memory", position);
+            }
+            return json_error(parser, "unexpected character", position);
+    }
+    parser->state = JSON_LITERAL;
+    parser->literalPos = 1;
+    return NULL;
+}
+
+static int
+json_hex(uint8_t c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+const char*
+lcorehttp_json_feed(lua_State* L, lcorehttp_json_parser* parser, const uint8_t* data, size_t len) {
+    const char* error = NULL;
+    size_t i = 0;
+    while (i < len && error == NULL) {
+        uint8_t c = data[i];
+        size_t position = parser->offset + i;
+        switch (parser->state) {
+            case JSON_STRING: {
+                size_t start = i;
+                while (i < len && data[i] != '"' && data[i] != '\\' && data[i] >= 0x20) {
+                    i++;
+                }
+                if (i > start && (json_flush_surrogate(parser) != 0 || json_append(parser, data + start, i - start))) {
+                    return json_error(parser, "out of memory", position);
+                }
+                if (i == len) {
+                    break;
+                }
+                c = data[i++];
+                if (c == '\\') {
+                    parser->state = JSON_STRING_ESCAPE;
+                } else if (c != '"') {
+                    error = json_error(parser, "control character in string", parser->offset + i - 1);
+                } else if (json_flush_surrogate(parser) != 0) {
+                    error = json_error(parser, "out of memory", position);
+                } else if (parser->stringIsKey) {
+                    lua_pushlstring(L, parser->token, parser->tokenLen);
+                    parser->state = JSON_COLON;
+                } else {
+                    lua_pushlstring(L, parser->token, parser->tokenLen);
+                    json_value_done(L, parser);
+                }
+                break;
+            }
+            case JSON_STRING_ESCAPE: {
+                char unescaped = 0;
+                switch (c) {
+                    case '"': unescaped = '"'; break;
+                    case '\\': unescaped = '\\'; break;
+                    case '/': unescaped = '/'; break;
+                    case 'b': unescaped = '\b'; break;
+                    case 'f': unescaped = '\f'; break;
+                    case 'n': unescaped = '\n'; break;
+                    case 'r': unescaped = '\r'; break;
+                    case 't': unescaped = '\t'; break;
+                    case 'u':
+                        parser->state = JSON_STRING_UNICODE;
+                        parser->unicode = 0;
+                        parser->unicodeDigits = 0;
+                        i++;
+                        continue;
+                    default: return json_error(parser, "invalid escape", position);
+                }
+                if (json_flush_surrogate(parser) != 0 || json_append(parser, &unescaped, 1) != 0) {
+                    return json_error(parser, "out of memory", position);
+                }
+                parser->state = JSON_STRING;
+                i++;
+                break;
+            }
+            case JSON_STRING_UNICODE: {
+                int digit = json_hex(c);
+                if (digit < 0) {
+                    return json_error(parser, "invalid unicode escape", position);
+                }
+                parser->unicode = (parser->unicode << 4) | (uint32_t)digit;
+                if (++parser->unicodeDigits == 4) {
+                    if (json_append_codepoint(parser, parser->unicode) != 0) {
+                        return json_error(parser, "out of memory", position);
+                    }
+                    parser->state = JSON_STRING;
+                }
+                i++;
+                break;
+            }
+            case JSON_NUMBER:
+                if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+                    if (json_append(parser, &c, 1) != 0) {
+                        return json_error(parser, "out of memory", position);
+                    }
+                    i++;
+                } else {
+                    error = json_finish_number(L, parser, position); // c is looked at again after the value
+                }
+                break;
+            case JSON_LITERAL:
+                if (c != (uint8_t)parser->literal[parser->literalPos]) {
+                    return json_error(parser, "invalid literal", position);
+                }
+                i++;
+                if (parser->literal[++parser->literalPos] == '\0') {
+                    if (parser->literal[0] == 'n') {
+                        json_push_null(L, parser);
+                    } else {
+                        lua_pushboolean(L, parser->literal[0] == 't');
+                    }
+                    json_value_done(L, parser);
+                }
+                break;
+            default:
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                    i++;
+                    break;
+                }
+                i++;
+                switch (parser->state) {
+                    case JSON_VALUE_OR_END:
+                        if (c == ']') {
+                            error = json_close(L, parser, 0, position);
+                            break;
+                        }
+                        error = json_begin_value(L, parser, c, position);
+                        break;
+                    case JSON_VALUE: error = json_begin_value(L, parser, c, position); break;
+                    case JSON_KEY_OR_END:
+                        if (c == '}') {
+                            error = json_close(L, parser, 1, position);
+                            break;
+                        }
+                        // fallthrough
+                    case JSON_KEY:
+                        if (c != '"') {
+                            error = json_error(parser, "expected object key", position);
+                            break;
+                        }
+                        parser->state = JSON_STRING;
+                        parser->stringIsKey = 1;
+                        parser->tokenLen = 0;
+                        break;
+                    case JSON_COLON:
+                        if (c != ':') {
+                            error = json_error(parser, "expected ':'", position);
+                            break;
+                        }
+                        parser->state = JSON_VALUE;
+                        break;
+                    case JSON_AFTER_VALUE:
+                        if (c == ',') {
+                            parser->state = parser->frames[parser->depth - 1].isObject ? JSON_KEY : JSON_VALUE;
+                        } else if (c == ']' || c == '}') {
+                            error = json_close(L, parser, c == '}', position);
+                        } else {
+                            error = json_error(parser, "expected ',' or closing bracket", position);
+                        }
+                        break;
+                    default: error = json_error(parser, "trailing characters after JSON value", position); break;
+                }
+                break;
+        }
+    }
+    parser->offset += len;
+    return error;
+}
+
+const char*
+lcorehttp_json_finish(lua_State* L, lcorehttp_json_parser* parser) {
+    if (parser->state == JSON_NUMBER && parser->depth == 0) {
+        const char* error = json_finish_number(L, parser, parser->offset);
+        if (error != NULL) {
+            return error;
+        }
+    }
+    if (parser->state != JSON_DONE) {
+        return json_error(parser, "unexpected end of JSON", parser->offset);
+    }
+    return NULL;
+}
+
+void
+lcorehttp_json_reset(lcorehttp_json_parser* parser) {
+    parser->state = JSON_VALUE;
+    parser->highSurrogate = 0;
+    parser->tokenLen = 0;
+    parser->rootIsArray = 0;
+    parser->emitted = 0;
+    parser->offset = 0;
+    parser->depth = 0;
+}
+
+static int
+l_corehttp_json_parser_gc(lua_State* L) {
+    lcorehttp_json_parser* parser = luaL_checkudata(L, 1, LCOREHTTP_JSON_PARSER_METATABLE);
+    free(parser->token);
+    parser->token = NULL;
+    return 0;
+}
+
+lcorehttp_json_parser*
+l_corehttp_new_json_parser(lua_State* L, int nullIdx, int callbackIdx) {
+    lcorehttp_json_parser* parser = lua_newuserdatauv(L, sizeof(lcorehttp_json_parser), 0);
+    memset(parser, 0, sizeof(lcorehttp_json_parser));
+    luaL_getmetatable(L, LCOREHTTP_JSON_PARSER_METATABLE);
+    lua_setmetatable(L, -2);
+    parser->token = malloc(LCOREHTTP_JSON_DEFAULT_TOKEN_SIZE);
+    if (parser->token == NULL) {
+        luaL_error(L, "failed to allocate JSON parser");
+        return NULL;
+    }
+    parser->tokenCapacity = LCOREHTTP_JSON_DEFAULT_TOKEN_SIZE;
+    parser->nullIdx = nullIdx != 0 ? lua_absindex(L, nullIdx) : 0;
+    parser->callbackIdx = callbackIdx != 0 ? lua_absindex(L, callbackIdx) : 0;
+    lcorehttp_json_reset(parser);
+    return parser;
+}
+
+// read_json(options?) - options: on_element(value, index), null, buffer_size
+// malformed JSON returns nil, error like read(); failures to read the body (limits included) raise
+int
+l_corehttp_response_read_json(lua_State* L) {
+    luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lua_settop(L, 2);
+    lua_Integer bufferSize = DEFAULT_COREHTTP_BUFFER_SIZE;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "on_element"); // 3
+        lua_getfield(L, 2, "null");       // 4
+        lua_getfield(L, 2, "buffer_size");
+        if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0) {
+            bufferSize = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    } else {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+    int callbackIdx = lua_isfunction(L, 3) ? 3 : 0;
+    int nullIdx = lua_isnil(L, 4) ? 0 : 4;
+
+    lcorehttp_body_reader* reader = l_corehttp_new_body_reader(L, 1, (size_t)bufferSize);
+    lcorehttp_json_parser* parser = l_corehttp_new_json_parser(L, nullIdx, callbackIdx);
+    while (1) {
+        const uint8_t* data = NULL;
+        size_t len = 0;
+        const char* error = lcorehttp_body_reader_next(reader, &data, &len);
+        if (error != NULL) {
+            return luaL_error(L, "%s", error);
+        }
+        if (len == 0) {
+            break;
+        }
+        error = lcorehttp_json_feed(L, parser, data, len);
+        if (error != NULL) {
+            return push_error(L, error);
+        }
+    }
+    const char* error = lcorehttp_json_finish(L, parser);
+    if (error != NULL) {
+        return push_error(L, error);
+    }
+    if (callbackIdx != 0 && parser->rootIsArray) {
+        lua_pushinteger(L, parser->emitted);
+    }
+    return 1;
+}
+
+int
+l_corehttp_json_parser_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_JSON_PARSER_METATABLE);
+    lua_pushcfunction(L, l_corehttp_json_parser_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushstring(L, LCOREHTTP_JSON_PARSER_METATABLE);
+    lua_setfield(L, -2, "__type");
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef LCOREHTTP_JSON_H
+#define LCOREHTTP_JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+
+#define LCOREHTTP_JSON_MAXIMUM_DEPTH     256
+#define LCOREHTTP_JSON_PARSER_METATABLE  "COREHTTP_JSON_PARSER"
+#define LCOREHTTP_JSON_DEFAULT_TOKEN_SIZE 64
+
+typedef struct lcorehttp_json_frame {
+    int isObject;
+    lua_Integer count;
+} lcorehttp_json_frame;
+
+/*
+ * Incremental JSON parser building Lua values as bytes arrive, input may be split at any byte.
+ * Open containers (and a pending object key) live on the Lua stack above the parser userdata, so the stack
+ * must not be touched between feeds. With a callback, elements of a top-level array are handed to it one
+ * by one instead of being stored.
+ */
+typedef struct lcorehttp_json_parser {
+    int state;
+    int stringIsKey;
+    int unicodeDigits;
+    uint32_t unicode;
+    uint32_t highSurrogate; // first half of a \u surrogate pair
+    const char* literal;    // true, false or null being matched
+    size_t literalPos;
+    char* token; // string or number being read
+    size_t tokenLen;
+    size_t tokenCapacity;
+    int rootIsArray;
+    int nullIdx;     // stack index of the value used for null, 0 for corehttp.json_null
+    int callbackIdx; // stack index of the element callback, 0 without
+    lua_Integer emitted;
+    size_t offset; // bytes consumed by previous feeds, for error positions
+    size_t depth;
+    lcorehttp_json_frame frames[LCOREHTTP_JSON_MAXIMUM_DEPTH];
+    char error[96];
+} lcorehttp_json_parser;
+
+// pushes a parser userdata (token buffer freed by __gc)
+lcorehttp_json_parser* l_corehttp_new_json_parser(lua_State* L, int nullIdx, int callbackIdx);
+// forget a finished or failed document, the stack has to be back at the parser
+void lcorehttp_json_reset(lcorehttp_json_parser* parser);
+// returns NULL or an error message (valid until the next call)
+const char* lcorehttp_json_feed(lua_State* L, lcorehttp_json_parser* parser, const uint8_t* data, size_t len);
+// completes the document, its value is left on top of the stack
+const char* lcorehttp_json_finish(lua_State* L, lcorehttp_json_parser* parser);
+
+// response:read_json(options?) -> value | element count, or nil, error for malformed JSON
+int l_corehttp_response_read_json(lua_State* L);
+
+int l_corehttp_json_parser_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_JSON_H */
@@ -0,0 +1,377 @@
+#include "lcorehttp_ktls.h"
+#include <string.h>
+#include "mbedtls/md.h"
+#include "mbedtls/platform_util.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define KTLS_RECORD_ALERT                 21
+#define KTLS_RECORD_HANDSHAKE             22
+#define KTLS_RECORD_APPLICATION_DATA      23
+#define KTLS_HANDSHAKE_HELLO_REQUEST      0
+#define KTLS_HANDSHAKE_NEW_SESSION_TICKET 4
+
+typedef enum ktls_cipher {
+    KTLS_AES_128_GCM,
+    KTLS_AES_256_GCM,
+    KTLS_CHACHA20_POLY1305,
+} ktls_cipher;
+
+typedef struct ktls_suite {
+    int id;
+    ktls_cipher cipher;
+} ktls_suite;
+
+// AEAD suites the kernel implements, anything else stays with mbedTLS
+static const ktls_suite ktlsSuites[] = {
+    {0x1301, KTLS_AES_128_GCM},       // TLS1-3-AES-128-GCM-SHA256
+    {0x1302, KTLS_AES_256_GCM},       // TLS1-3-AES-256-GCM-SHA384
+    {0x1303, KTLS_CHACHA20_POLY1305}, // TLS1-3-CHACHA20-POLY1305-SHA256
+    {0xC02B, KTLS_AES_128_GCM},       // TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256
+    {0xC02C, KTLS_AES_256_GCM},       // TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384
+    {0xC02F, KTLS_AES_128_GCM},       // TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256
+    {0xC030, KTLS_AES_256_GCM},       // TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384
+    {0xCCA8, KTLS_CHACHA20_POLY1305}, // TLS-ECDHE-RSA-WITH-CHACHA20-POLY1305-SHA256
+    {0xCCA9, KTLS_CHACHA20_POLY1305}, // TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256
+    {0x009E, KTLS_AES_128_GCM},       // TLS-DHE-RSA-WITH-AES-128-GCM-SHA256
+    {0x009F, KTLS_AES_256_GCM},       // TLS-DHE-RSA-WITH-AES-256-GCM-SHA384
+    {0xCCAA, KTLS_CHACHA20_POLY1305}, // TLS-DHE-RSA-WITH-CHACHA20-POLY1305-SHA256
+    {0x009C, KTLS_AES_128_GCM},       // TLS-RSA-WITH-AES-128-GCM-SHA256
+    {0x009D, KTLS_AES_256_GCM},       // TLS-RSA-WITH-AES-256-GCM-SHA384
+    {0, KTLS_AES_128_GCM},
+};
+
+typedef struct ktls_keys {
+    unsigned char clientKey[32];
+    unsigned char serverKey[32];
+    unsigned char clientIv[12];
+    unsigned char serverIv[12];
+    size_t keyLen;
+    size_t ivLen; // 4: TLS 1.2 GCM salt, 12: full nonce base
+} ktls_keys;
+
+static void
+ktls_export_keys(void* p, mbedtls_ssl_key_export_type type, const unsigned char* secret, size_t secretLen,
+                 const unsigned char clientRandom[32], const unsigned char serverRandom[32],
+                 mbedtls_tls_prf_types prf) {
+    lcorehttp_ktls* ktls = p;
+    switch (type) {
+        case MBEDTLS_SSL_KEY_EXPORT_TLS12_MASTER_SECRET:
+            if (secretLen == 48) {
+                memcpy(ktls->master, secret, secretLen);
+                memcpy(ktls->randoms, serverRandom, 32);
+                memcpy(ktls->randoms + 32, clientRandom, 32);
+                ktls->prf = prf;
+            }
+            break;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        case MBEDTLS_SSL_KEY_EXPORT_TLS1_3_CLIENT_APPLICATION_TRAFFIC_SECRET:
+            if (secretLen <= LCOREHTTP_KTLS_MAXIMUM_SECRET) {
+                memcpy(ktls->clientSecret, secret, secretLen);
+                ktls->secretLen = secretLen;
+            }
+            break;
+        case MBEDTLS_SSL_KEY_EXPORT_TLS1_3_SERVER_APPLICATION_TRAFFIC_SECRET:
+            if (secretLen <= LCOREHTTP_KTLS_MAXIMUM_SECRET) {
+                memcpy(ktls->serverSecret, secret, secretLen);
+                ktls->secretLen = secretLen;
+            }
+            break;
+#endif
+        default: break;
+    }
+}
+
+void
+lcorehttp_ktls_attach(lcorehttp_ktls* ktls, mbedtls_ssl_context* ssl) {
+    mbedtls_ssl_set_export_keys_cb(ssl, ktls_export_keys, ktls);
+}
+
+// key block of RFC 5246 6.3, AEAD suites have no MAC keys
+static int
+ktls_tls12_keys(const lcorehttp_ktls* ktls, ktls_keys* keys) {
+    unsigned char block[2 * 32 + 2 * 12];
+    size_t len = 2 * keys->keyLen + 2 * keys->ivLen;
+    if (ktls->prf == MBEDTLS_SSL_TLS_PRF_NONE
+        || mbedtls_ssl_tls_prf(ktls->prf, ktls->master, 48, "key expansion", ktls->randoms, 64, block, len) != 0) {
+        return -1;
+    }
+    memcpy(keys->clientKey, block, keys->keyLen);
+    memcpy(keys->serverKey, block + keys->keyLen, keys->keyLen);
+    memcpy(keys->clientIv, block + 2 * keys->keyLen, keys->ivLen);
+    memcpy(keys->serverIv, block + 2 * keys->keyLen + keys->ivLen, keys->ivLen);
+    mbedtls_platform_zeroize(block, sizeof(block));
+    return 0;
+}
+
+// HKDF-Expand-Label(secret, label, "", len) of RFC 8446 7.1; keys and ivs fit into the first HMAC block
+static int
+ktls_expand_label(const mbedtls_md_info_t* md, const unsigned char* secret, size_t secretLen, const char* label,
+                  unsigned char* out, size_t len) {
+    unsigned char info[2 + 1 + 6 + 3 + 1 + 1];
+    size_t labelLen = strlen(label);
+    size_t n = 0;
+    info[n++] = 0;
+    info[n++] = (unsigned char)len;
+    info[n++] = (unsigned char)(6 + labelLen);
+    memcpy(info + n, "tls13 ", 6);
+    n += 6;
+    memcpy(info + n, label, labelLen);
+    n += labelLen;
+    info[n++] = 0; // empty context
+    info[n++] = 1; // HKDF-Expand block counter
+    unsigned char block[MBEDTLS_MD_MAX_SIZE];
+    if (mbedtls_md_hmac(md, secret, secretLen, info, n, block) != 0) {
+        return -1;
+    }
+    memcpy(out, block, len);
+    mbedtls_platform_zeroize(block, sizeof(block));
+    return 0;
+}
+
+static int
+ktls_tls13_keys(const lcorehttp_ktls* ktls, ktls_keys* keys) {
+    const mbedtls_md_info_t* md = NULL;
+    if (ktls->secretLen == 32) {
+        md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    } else if (ktls->secretLen == 48) {
+        md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA384);
+    }
+    if (md == NULL) {
+        return -1;
+    }
+    size_t len = ktls->secretLen;
+    if (ktls_expand_label(md, ktls->clientSecret, len, "key", keys->clientKey, keys->keyLen) != 0
+        || ktls_expand_label(md, ktls->serverSecret, len, "key", keys->serverKey, keys->keyLen) != 0
+        || ktls_expand_label(md, ktls->clientSecret, len, "iv", keys->clientIv, keys->ivLen) != 0
+        || ktls_expand_label(md, ktls->serverSecret, len, "iv", keys->serverIv, keys->ivLen) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ktls_install(int fd, int direction, int version, ktls_cipher cipher, const unsigned char* key,
+             const unsigned char* iv, size_t ivLen, const unsigned char seq[8]) {
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+    } info;
+    memset(&info, 0, sizeof(info));
+    size_t infoLen = 0;
+    // GCM nonce: 4 bytes of salt and the explicit part, the record sequence (TLS 1.2) or the rest of the iv
+    const unsigned char* explicitNonce = ivLen == 12 ? iv + 4 : seq;
+    switch (cipher) {
+        case KTLS_AES_128_GCM:
+            info.aes128.info.version = version;
+            info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(info.aes128.key, key, sizeof(info.aes128.key));
+            memcpy(info.aes128.salt, iv, sizeof(info.aes128.salt));
+            memcpy(info.aes128.iv, explicitNonce, sizeof(info.aes128.iv));
+            memcpy(info.aes128.rec_seq, seq, sizeof(info.aes128.rec_seq));
+            infoLen = sizeof(info.aes128);
+            break;
+        case KTLS_AES_256_GCM:
+            info.aes256.info.version = version;
+            info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(info.aes256.key, key, sizeof(info.aes256.key));
+            memcpy(info.aes256.salt, iv, sizeof(info.aes256.salt));
+            memcpy(info.aes256.iv, explicitNonce, sizeof(info.aes256.iv));
+            memcpy(info.aes256.rec_seq, seq, sizeof(info.aes256.rec_seq));
+            infoLen = sizeof(info.aes256);
+            break;
+        case KTLS_CHACHA20_POLY1305:
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+            info.chacha.info.version = version;
+            info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(info.chacha.key, key, sizeof(info.chacha.key));
+            memcpy(info.chacha.iv, iv, sizeof(info.chacha.iv));
+            memcpy(info.chacha.rec_seq, seq, sizeof(info.chacha.rec_seq));
+            infoLen = sizeof(info.chacha);
+            break;
+#else
+            return -1;
+#endif
+    }
+    int ret = setsockopt(fd, SOL_TLS, direction, &info, (socklen_t)infoLen);
+    mbedtls_platform_zeroize(&info, sizeof(info));
+    return ret;
+}
+
+void
+lcorehttp_ktls_offload(lcorehttp_ktls* ktls, mbedtls_ssl_context* ssl, lcorehttp_socket* socket) {
+    int id = mbedtls_ssl_get_ciphersuite_id_from_ssl(ssl);
+    const ktls_suite* suite = ktlsSuites;
+    while (suite->id != 0 && suite->id != id) {
+        suite++;
+    }
+    int tls13 = mbedtls_ssl_get_version_number(ssl) == MBEDTLS_SSL_VERSION_TLS1_3;
+    ktls_keys keys;
+    memset(&keys, 0, sizeof(keys));
+    keys.keyLen = suite->cipher == KTLS_AES_128_GCM ? 16 : 32;
+    keys.ivLen = (tls13 || suite->cipher == KTLS_CHACHA20_POLY1305) ? 12 : 4;
+    // mbedTLS reads exactly one record at a time, anything it holds already would be lost to the kernel
+    if (suite->id != 0 && mbedtls_ssl_check_pending(ssl) == 0
+        && (tls13 ? ktls_tls13_keys(ktls, &keys) : ktls_tls12_keys(ktls, &keys)) == 0
+        && setsockopt(socket->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+        // the Finished messages were the first records under the TLS 1.2 keys, TLS 1.3 application keys start at 0
+        unsigned char seq[8] = {0, 0, 0, 0, 0, 0, 0, tls13 ? 0 : 1};
+        int version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+        // with only receiving offloaded mbedTLS keeps encrypting, the other way round its alerts would break
+        if (ktls_install(socket->fd, TLS_RX, version, suite->cipher, keys.serverKey, keys.serverIv, keys.ivLen, seq)
+            == 0) {
+            ktls->rx = 1;
+            ktls->tx = ktls_install(socket->fd, TLS_TX, version, suite->cipher, keys.clientKey, keys.clientIv,
+                                    keys.ivLen, seq)
+                       == 0;
+        }
+    }
+    mbedtls_platform_zeroize(&keys, sizeof(keys));
+    mbedtls_platform_zeroize(ktls->master, sizeof(ktls->master));
+    mbedtls_platform_zeroize(ktls->clientSecret, sizeof(ktls->clientSecret));
+    mbedtls_platform_zeroize(ktls->serverSecret, sizeof(ktls->serverSecret));
+}
+
+// post-handshake messages: TLS 1.3 tickets (they are of no use without mbedTLS) and TLS 1.2 hello requests
+// (renegotiation is not supported) are dropped, anything else (KeyUpdate) would need new keys
+static int
+ktls_skip_handshake(lcorehttp_ktls* ktls, const unsigned char* data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        if (ktls->controlLeft > 0) {
+            size_t count = ktls->controlLeft < len - pos ? ktls->controlLeft : len - pos;
+            pos += count;
+            ktls->controlLeft -= count;
+            continue;
+        }
+        if (len - pos < 4) {
+            return -1;
+        }
+        unsigned char type = data[pos];
+        if (type != KTLS_HANDSHAKE_NEW_SESSION_TICKET && type != KTLS_HANDSHAKE_HELLO_REQUEST) {
+            return -1;
+        }
+        ktls->controlLeft = 4 + ((size_t)data[pos + 1] << 16 | (size_t)data[pos + 2] << 8 | data[pos + 3]);
+    }
+    return 0;
+}
+
+int32_t
+lcorehttp_ktls_recv(lcorehttp_ktls* ktls, lcorehttp_socket* socket, void* buffer, size_t len) {
+    while (1) {
+        struct pollfd pfd = {.fd = socket->fd, .events = POLLIN, .revents = 0};
+        int ready = poll(&pfd, 1, socket->drained ? (int)socket->ioTimeoutMs : 1);
+        if (ready < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        if (ready == 0) {
+            socket->drained = 1;
+            return 0;
+        }
+        // records other than application data come with their type and fail a plain recv
+        unsigned char control[CMSG_SPACE(sizeof(unsigned char))];
+        struct iovec iov = {.iov_base = buffer, .iov_len = len};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(socket->fd, &msg, 0);
+        if (received == 0) {
+            socket->drained = 1;
+            socket->peerClosed = 1;
+            return 0;
+        }
+        if (received < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        unsigned char recordType = KTLS_RECORD_APPLICATION_DATA;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+            recordType = *CMSG_DATA(cmsg);
+        }
+        if (recordType == KTLS_RECORD_APPLICATION_DATA) {
+            socket->drained = 0;
+            return (int32_t)received;
+        }
+        if (recordType == KTLS_RECORD_ALERT) {
+            if (received >= 2 && ((const unsigned char*)buffer)[1] == 0) { // close_notify
+                socket->drained = 1;
+                socket->peerClosed = 1;
+                return 0;
+            }
+            return -1;
+        }
+        if (recordType != KTLS_RECORD_HANDSHAKE || ktls_skip_handshake(ktls, buffer, (size_t)received) != 0) {
+            return -1;
+        }
+    }
+}
+
+void
+lcorehttp_ktls_close_notify(lcorehttp_socket* socket) {
+    unsigned char alert[2] = {1, 0}; // warning, close_notify
+    unsigned char control[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov = {.iov_base = alert, .iov_len = sizeof(alert)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = KTLS_RECORD_ALERT;
+    sendmsg(socket->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+#else
+
+void
+lcorehttp_ktls_attach(lcorehttp_ktls* ktls, mbedtls_ssl_context* ssl) {
+    (void)ktls;
+    (void)ssl;
+}
+
+void
+lcorehttp_ktls_offload(lcorehttp_ktls* ktls, mbedtls_ssl_context* ssl, lcorehttp_socket* socket) {
+    (void)ktls;
+    (void)ssl;
+    (void)socket;
+}
+
+int32_t
+lcorehttp_ktls_recv(lcorehttp_ktls* ktls, lcorehttp_socket* socket, void* buffer, size_t len) {
+    (void)ktls;
+    (void)socket;
+    (void)buffer;
+    (void)len;
+    return -1;
+}
+
+void
+lcorehttp_ktls_close_notify(lcorehttp_socket* socket) {
+    (void)socket;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LCOREHTTP_KTLS_H
+#define LCOREHTTP_KTLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lcorehttp_socket.h"
+#include "mbedtls/ssl.h"
+
+#define LCOREHTTP_KTLS_MAXIMUM_SECRET 48 /* SHA-384 */
+
+/*
+ * Kernel TLS offload of a native TLS connection (ktls option of tls_config, Linux). mbedTLS runs the handshake,
+ * the secrets it exports become the record keys installed with setsockopt(SOL_TLS); records are then encrypted
+ * and decrypted by the kernel while the socket is written and read directly.
+ */
+typedef struct lcorehttp_ktls {
+    // exported during the handshake, wiped once the keys are installed (or not)
+    unsigned char master[LCOREHTTP_KTLS_MAXIMUM_SECRET]; // TLS 1.2
+    unsigned char randoms[64];                           // server random then client random, key expansion seed
+    mbedtls_tls_prf_types prf;
+    unsigned char clientSecret[LCOREHTTP_KTLS_MAXIMUM_SECRET]; // TLS 1.3 application traffic secrets
+    unsigned char serverSecret[LCOREHTTP_KTLS_MAXIMUM_SECRET];
+    size_t secretLen;
+    int tx;             // records sent are encrypted by the kernel
+    int rx;             // records received are decrypted by the kernel
+    size_t controlLeft; // rest of a post-handshake message split across reads
+} lcorehttp_ktls;
+
+// registers the key export callback, before the handshake
+void lcorehttp_ktls_attach(lcorehttp_ktls* ktls, mbedtls_ssl_context* ssl);
+/**
+ * @brief Install the keys of the completed handshake. Receiving is offloaded first and sending only after it,
+ * any failure (no tls module, unsupported cipher suite, data still buffered by mbedTLS) leaves the rest of the
+ * connection with mbedTLS.
+ */
+void lcorehttp_ktls_offload(lcorehttp_ktls* ktls, mbedtls_ssl_context* ssl, lcorehttp_socket* socket);
+// same contract as lcorehttp_socket_recv; drops session tickets, a close_notify alert ends the stream
+int32_t lcorehttp_ktls_recv(lcorehttp_ktls* ktls, lcorehttp_socket* socket, void* buffer, size_t len);
+// best effort close_notify through the kernel, when sending is offloaded
+void lcorehttp_ktls_close_notify(lcorehttp_socket* socket);
+
+#endif /* LCOREHTTP_KTLS_H */
@@ -0,0 +1,149 @@
+#include "lcorehttp_limits.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+
+lcorehttp_memory_budget*
+lcorehttp_memory_budget_new(uint64_t capacity, int* failed) {
+    *failed = 0;
+    if (capacity == 0) {
+        return NULL;
+    }
+    lcorehttp_memory_budget* budget = calloc(1, sizeof(lcorehttp_memory_budget));
+    if (budget == NULL) {
+        *failed = 1;
+        return NULL;
+    }
+    budget->capacity = capacity;
+    budget->refs = 1;
+    return budget;
+}
+
+void
+lcorehttp_memory_budget_retain(lcorehttp_memory_budget* budget) {
+    if (budget != NULL) {
+        __atomic_add_fetch(&budget->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void
+lcorehttp_memory_budget_release(lcorehttp_memory_budget* budget) {
+    if (budget != NULL && __atomic_sub_fetch(&budget->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(budget);
+    }
+}
+
+int
+lcorehttp_body_limits_load(lua_State* L, int idx, lcorehttp_body_limits* limits) {
+    const char* names[] = {"max_body_bytes", "max_decoded_bytes", "max_inflate_ratio", "spill_threshold"};
+    uint64_t* values[] = {&limits->maxBodyBytes, &limits->maxDecodedBytes, &limits->maxInflateRatio,
+                          &limits->spillThreshold};
+    int result = 0;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        lua_getfield(L, idx, names[i]);
+        if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0) {
+            *values[i] = (uint64_t)lua_tointeger(L, -1);
+        } else if (!lua_isnil(L, -1)) {
+            result = -1;
+        }
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
+void
+lcorehttp_body_meter_init(lcorehttp_body_meter* meter, const lcorehttp_body_limits* limits,
+                          lcorehttp_memory_budget* budget) {
+    meter->limits = *limits;
+    meter->budget = budget;
+    meter->received = 0;
+    meter->decoded = 0;
+    meter->charged = 0;
+    lcorehttp_memory_budget_retain(budget);
+}
+
+// a declared Content-Length over the limit fails before anything is read
+const char*
+lcorehttp_body_meter_expect(const lcorehttp_body_meter* meter, size_t contentLength) {
+    if (contentLength != (size_t)-1 && meter->limits.maxBodyBytes != 0
+        && contentLength > meter->limits.maxBodyBytes) {
+        return "response body exceeds max_body_bytes";
+    }
+    return NULL;
+}
+
+const char*
+lcorehttp_body_meter_received(lcorehttp_body_meter* meter, size_t len) {
+    meter->received += len;
+    if (meter->limits.maxBodyBytes != 0 && meter->received > meter->limits.maxBodyBytes) {
+        return "response body exceeds max_body_bytes";
+    }
+    return NULL;
+}
+
+const char*
+lcorehttp_body_meter_decoded(lcorehttp_body_meter* meter, size_t len, int compressed) {
+    meter->decoded += len;
+    if (meter->limits.maxDecodedBytes != 0 && meter->decoded > meter->limits.maxDecodedBytes) {
+        return "decoded response body exceeds max_decoded_bytes";
+    }
+    // small bodies compress well beyond any sane ratio, only a growing output is a bomb
+    if (compressed && meter->limits.maxInflateRatio != 0 && meter->decoded > LCOREHTTP_LIMITS_RATIO_FLOOR
+        && meter->decoded / meter->limits.maxInflateRatio > meter->received) {
+        return "response body exceeds max_inflate_ratio";
+    }
+    return NULL;
+}
+
+const char*
+lcorehttp_body_meter_charge(lcorehttp_body_meter* meter, size_t len) {
+    lcorehttp_memory_budget* budget = meter->budget;
+    if (budget == NULL || len == 0) {
+        return NULL;
+    }
+    uint64_t used = __atomic_add_fetch(&budget->used, len, __ATOMIC_RELAXED);
+    if (used > budget->capacity) {
+        __atomic_sub_fetch(&budget->used, len, __ATOMIC_RELAXED);
+        return "client memory budget exceeded";
+    }
+    meter->charged += len;
+    return NULL;
+}
+
+void
+lcorehttp_body_meter_release(lcorehttp_body_meter* meter) {
+    if (meter->budget == NULL) {
+        return;
+    }
+    __atomic_sub_fetch(&meter->budget->used, meter->charged, __ATOMIC_RELAXED);
+    meter->charged = 0;
+    lcorehttp_memory_budget_release(meter->budget);
+    meter->budget = NULL;
+}
+
+lcorehttp_body_meter*
+l_corehttp_new_body_meter(lua_State* L, const lcorehttp_body_limits* limits, lcorehttp_memory_budget* budget) {
+    lcorehttp_body_meter* meter = lua_newuserdatauv(L, sizeof(lcorehttp_body_meter), 0);
+    lcorehttp_body_meter_init(meter, limits, budget);
+    luaL_getmetatable(L, LCOREHTTP_BODY_METER_METATABLE);
+    lua_setmetatable(L, -2);
+    return meter;
+}
+
+static int
+l_corehttp_body_meter_gc(lua_State* L) {
+    lcorehttp_body_meter_release(luaL_checkudata(L, 1, LCOREHTTP_BODY_METER_METATABLE));
+    return 0;
+}
+
+int
+l_corehttp_body_meter_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_BODY_METER_METATABLE);
+    lua_pushcfunction(L, l_corehttp_body_meter_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_body_meter_gc);
+    lua_setfield(L, -2, "__close");
+    lua_pushstring(L, LCOREHTTP_BODY_METER_METATABLE);
+    lua_setfield(L, -2, "__type");
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef LCOREHTTP_LIMITS_H
+#define LCOREHTTP_LIMITS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+
+#define LCOREHTTP_LIMITS_RATIO_FLOOR  65536 /* decoded bytes below which max_inflate_ratio is not checked */
+#define LCOREHTTP_BODY_METER_METATABLE "COREHTTP_BODY_METER"
+
+/*
+ * Bytes a client may hold in bodies being buffered in memory (read_content and read_chunked_content without
+ * callback, in-memory background downloads) at the same time. Shared with async jobs, hence atomic and
+ * reference counted.
+ */
+typedef struct lcorehttp_memory_budget {
+    uint64_t capacity;
+    uint64_t used;
+    int refs;
+} lcorehttp_memory_budget;
+
+// 0 disables a limit
+typedef struct lcorehttp_body_limits {
+    uint64_t maxBodyBytes;    // body bytes as received, transfer framing included
+    uint64_t maxDecodedBytes; // after removing chunked framing and Content-Encoding
+    uint64_t maxInflateRatio; // decoded bytes per received byte of a compressed body
+    uint64_t spillThreshold;  // bodies collected in memory move to a temporary file beyond it
+} lcorehttp_body_limits;
+
+// accounting of a single body read
+typedef struct lcorehttp_body_meter {
+    lcorehttp_body_limits limits;
+    lcorehttp_memory_budget* budget; // retained by the meter, NULL without budget
+    uint64_t received;
+    uint64_t decoded;
+    uint64_t charged; // bytes taken from the budget
+} lcorehttp_body_meter;
+
+// NULL when capacity is 0 or on allocation failure (*failed is set)
+lcorehttp_memory_budget* lcorehttp_memory_budget_new(uint64_t capacity, int* failed);
+void lcorehttp_memory_budget_retain(lcorehttp_memory_budget* budget);
+void lcorehttp_memory_budget_release(lcorehttp_memory_budget* budget);
+
+/**
+ * @brief Override limits with max_body_bytes, max_decoded_bytes, max_inflate_ratio and spill_threshold of the
+ * table at idx.
+ *
+ * @return 0 on success, -1 when an option is not a non-negative integer.
+ */
+int lcorehttp_body_limits_load(lua_State* L, int idx, lcorehttp_body_limits* limits);
+
+void lcorehttp_body_meter_init(lcorehttp_body_meter* meter, const lcorehttp_body_limits* limits,
+                               lcorehttp_memory_budget* budget);
+// the functions below return NULL or the static message of the exceeded limit
+const char* lcorehttp_body_meter_expect(const lcorehttp_body_meter* meter, size_t contentLength);
+const char* lcorehttp_body_meter_received(lcorehttp_body_meter* meter, size_t len);
+const char* lcorehttp_body_meter_decoded(lcorehttp_body_meter* meter, size_t len, int compressed);
+const char* lcorehttp_body_meter_charge(lcorehttp_body_meter* meter, size_t len);
+// hands the charged bytes back and drops the budget, safe to call more than once
+void lcorehttp_body_meter_release(lcorehttp_body_meter* meter);
+
+/**
+ * @brief Push a meter userdata whose charge is handed back by __gc/__close, so a read interrupted by an error
+ * does not keep its share of the budget.
+ */
+lcorehttp_body_meter* l_corehttp_new_body_meter(lua_State* L, const lcorehttp_body_limits* limits,
+                                                lcorehttp_memory_budget* budget);
+int l_corehttp_body_meter_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_LIMITS_H */
@@ -0,0 +1,434 @@
+#include "lcorehttp_metrics.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "lerror.h"
+
+#ifdef LCOREHTTP_METRICS
+
+#include <stdatomic.h>
+
+/*
+ * Log-linear histogram in microseconds: values below 16us get their own bucket, every power of two
+ * above is split into 4 linear sub-buckets (~19% relative error). 144 buckets cover ~19 hours.
+ */
+#define LCOREHTTP_HISTOGRAM_LINEAR   16
+#define LCOREHTTP_HISTOGRAM_SUB_BITS 2
+#define LCOREHTTP_HISTOGRAM_SUB      (1 << LCOREHTTP_HISTOGRAM_SUB_BITS)
+#define LCOREHTTP_HISTOGRAM_BUCKETS  (LCOREHTTP_HISTOGRAM_LINEAR + 32 * LCOREHTTP_HISTOGRAM_SUB)
+
+#define LCOREHTTP_METRICS_STATUS_CODES 600
+#define LCOREHTTP_METRICS_ERRORS       32
+#define LCOREHTTP_METRICS_HOSTS        64
+#define LCOREHTTP_METRICS_HOST_KEY     128
+#define LCOREHTTP_METRICS_OTHER_HOST   "other"
+
+typedef struct lcorehttp_histogram {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t buckets[LCOREHTTP_HISTOGRAM_BUCKETS];
+} lcorehttp_histogram;
+
+typedef struct lcorehttp_host_metrics {
+    atomic_int used;
+    char key[LCOREHTTP_METRICS_HOST_KEY];
+    lcorehttp_histogram latency;
+} lcorehttp_host_metrics;
+
+static struct {
+    atomic_uint_fast64_t statusCodes[LCOREHTTP_METRICS_STATUS_CODES];
+    atomic_uint_fast64_t errors[LCOREHTTP_METRICS_ERRORS];
+    atomic_uint_fast64_t connectErrors;
+    atomic_uint_fast64_t connectionsOpened;
+    atomic_uint_fast64_t connectionsClosed;
+    atomic_uint_fast64_t handshakes;
+    atomic_uint_fast64_t bytesSent;
+    atomic_uint_fast64_t bytesReceived;
+    atomic_uint_fast64_t bytesDecoded;
+    atomic_uint_fast64_t hedgesSent;
+    atomic_uint_fast64_t hedgesWon;
+    lcorehttp_histogram latency;
+    atomic_flag hostsLock;
+    lcorehttp_host_metrics hosts[LCOREHTTP_METRICS_HOSTS];
+    lcorehttp_host_metrics otherHosts;
+} lcorehttp_metrics = {.hostsLock = ATOMIC_FLAG_INIT};
+
+#define METRIC_ADD(counter, value) atomic_fetch_add_explicit(&(counter), (value), memory_order_relaxed)
+#define METRIC_GET(counter)        atomic_load_explicit(&(counter), memory_order_relaxed)
+
+static int
+lcorehttp_log2(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    int result = 0;
+    while (value >>= 1) {
+        result++;
+    }
+    return result;
+#endif
+}
+
+static size_t
+lcorehttp_histogram_bucket(uint64_t value) {
+    if (value < LCOREHTTP_HISTOGRAM_LINEAR) {
+        return (size_t)value;
+    }
+    int exponent = lcorehttp_log2(value);
+    size_t sub = (size_t)(value >> (exponent - LCOREHTTP_HISTOGRAM_SUB_BITS)) & (LCOREHTTP_HISTOGRAM_SUB - 1);
+    size_t idx = LCOREHTTP_HISTOGRAM_LINEAR + (size_t)(exponent - 4) * LCOREHTTP_HISTOGRAM_SUB + sub;
+    return (idx < LCOREHTTP_HISTOGRAM_BUCKETS) ? idx : LCOREHTTP_HISTOGRAM_BUCKETS - 1;
+}
+
+// inclusive upper bound of a bucket
+static uint64_t
+lcorehttp_histogram_bucket_le(size_t idx) {
+    if (idx < LCOREHTTP_HISTOGRAM_LINEAR) {
+        return (uint64_t)idx;
+    }
+    size_t exponent = (idx - LCOREHTTP_HISTOGRAM_LINEAR) / LCOREHTTP_HISTOGRAM_SUB + 4;
+    size_t sub = (idx - LCOREHTTP_HISTOGRAM_LINEAR) % LCOREHTTP_HISTOGRAM_SUB;
+    return ((uint64_t)(LCOREHTTP_HISTOGRAM_SUB + sub + 1) << (exponent - LCOREHTTP_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static void
+lcorehttp_histogram_observe(lcorehttp_histogram* histogram, uint64_t value) {
+    METRIC_ADD(histogram->count, 1);
+    METRIC_ADD(histogram->sum, value);
+    METRIC_ADD(histogram->buckets[lcorehttp_histogram_bucket(value)], 1);
+}
+
+static uint64_t
+lcorehttp_hash(const char* key) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*key) {
+        hash ^= (uint8_t)*key++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// lock-free lookup, new hosts are inserted under a spin lock (rare)
+static lcorehttp_host_metrics*
+lcorehttp_host_slot(const char* key) {
+    size_t start = (size_t)(lcorehttp_hash(key) % LCOREHTTP_METRICS_HOSTS);
+    for (size_t i = 0; i < LCOREHTTP_METRICS_HOSTS; i++) {
+        lcorehttp_host_metrics* slot = &lcorehttp_metrics.hosts[(start + i) % LCOREHTTP_METRICS_HOSTS];
+        if (atomic_load_explicit(&slot->used, memory_order_acquire)) {
+            if (strcmp(slot->key, key) == 0) {
+                return slot;
+            }
+            continue;
+        }
+
+        while (atomic_flag_test_and_set_explicit(&lcorehttp_metrics.hostsLock, memory_order_acquire)) {
+        }
+        // somebody may have claimed the slot in the meantime
+        if (!atomic_load_explicit(&slot->used, memory_order_relaxed)) {
+            strncpy(slot->key, key, LCOREHTTP_METRICS_HOST_KEY - 1);
+            atomic_store_explicit(&slot->used, 1, memory_order_release);
+        }
+        atomic_flag_clear_explicit(&lcorehttp_metrics.hostsLock, memory_order_release);
+        if (strcmp(slot->key, key) == 0) {
+            return slot;
+        }
+    }
+    return &lcorehttp_metrics.otherHosts;
+}
+
+void
+lcorehttp_metrics_request(const char* hostname, int portno, uint16_t statusCode, uint64_t latencyUs) {
+    char key[LCOREHTTP_METRICS_HOST_KEY];
+    snprintf(key, sizeof(key), "%s:%d", hostname, portno);
+
+    METRIC_ADD(lcorehttp_metrics.statusCodes[statusCode < LCOREHTTP_METRICS_STATUS_CODES ? statusCode : 0], 1);
+    lcorehttp_histogram_observe(&lcorehttp_metrics.latency, latencyUs);
+    lcorehttp_histogram_observe(&lcorehttp_host_slot(key)->latency, latencyUs);
+}
+
+void
+lcorehttp_metrics_error(HTTPStatus_t status) {
+    METRIC_ADD(lcorehttp_metrics.errors[(size_t)status < LCOREHTTP_METRICS_ERRORS ? (size_t)status : 0], 1);
+}
+
+void
+lcorehttp_metrics_connect_error(void) {
+    METRIC_ADD(lcorehttp_metrics.connectErrors, 1);
+}
+
+void
+lcorehttp_metrics_connection_opened(int tls) {
+    METRIC_ADD(lcorehttp_metrics.connectionsOpened, 1);
+    if (tls) {
+        METRIC_ADD(lcorehttp_metrics.handshakes, 1);
+    }
+}
+
+void
+lcorehttp_metrics_connection_closed(void) {
+    METRIC_ADD(lcorehttp_metrics.connectionsClosed, 1);
+}
+
+void
+lcorehttp_metrics_hedge_sent(void) {
+    METRIC_ADD(lcorehttp_metrics.hedgesSent, 1);
+}
+
+void
+lcorehttp_metrics_hedge_won(void) {
+    METRIC_ADD(lcorehttp_metrics.hedgesWon, 1);
+}
+
+void
+lcorehttp_metrics_bytes_sent(size_t bytes) {
+    METRIC_ADD(lcorehttp_metrics.bytesSent, bytes);
+}
+
+void
+lcorehttp_metrics_bytes_received(size_t bytes) {
+    METRIC_ADD(lcorehttp_metrics.bytesReceived, bytes);
+}
+
+void
+lcorehttp_metrics_bytes_decoded(size_t bytes) {
+    METRIC_ADD(lcorehttp_metrics.bytesDecoded, bytes);
+}
+
+static void
+l_corehttp_push_histogram(lua_State* L, lcorehttp_histogram* histogram) {
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(histogram->count));
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(histogram->sum));
+    lua_setfield(L, -2, "sum_us");
+
+    lua_newtable(L);
+    lua_Integer n = 0;
+    for (size_t i = 0; i < LCOREHTTP_HISTOGRAM_BUCKETS; i++) {
+        uint64_t count = METRIC_GET(histogram->buckets[i]);
+        if (count == 0) {
+            continue;
+        }
+        lua_createtable(L, 0, 2);
+        lua_pushinteger(L, (lua_Integer)lcorehttp_histogram_bucket_le(i));
+        lua_setfield(L, -2, "le_us");
+        lua_pushinteger(L, (lua_Integer)count);
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, ++n);
+    }
+    lua_setfield(L, -2, "buckets");
+}
+
+// metrics() -> table of counters and latency histograms (non-cumulative buckets, empty ones omitted)
+int
+l_corehttp_metrics(lua_State* L) {
+    lua_newtable(L);
+
+    lua_newtable(L);
+    for (int code = 0; code < LCOREHTTP_METRICS_STATUS_CODES; code++) {
+        uint64_t count = METRIC_GET(lcorehttp_metrics.statusCodes[code]);
+        if (count > 0) {
+            lua_pushinteger(L, (lua_Integer)count);
+            lua_rawseti(L, -2, code);
+        }
+    }
+    lua_setfield(L, -2, "requests");
+
+    lua_newtable(L);
+    for (int status = 0; status < LCOREHTTP_METRICS_ERRORS; status++) {
+        uint64_t count = METRIC_GET(lcorehttp_metrics.errors[status]);
+        const char* name = HTTPClient_strerror((HTTPStatus_t)status);
+        if (count > 0 && name != NULL) {
+            lua_pushinteger(L, (lua_Integer)count);
+            lua_setfield(L, -2, name);
+        }
+    }
+    lua_setfield(L, -2, "errors");
+
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.connectErrors));
+    lua_setfield(L, -2, "connect_errors");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.connectionsOpened));
+    lua_setfield(L, -2, "connections_opened");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.connectionsClosed));
+    lua_setfield(L, -2, "connections_closed");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.handshakes));
+    lua_setfield(L, -2, "tls_handshakes");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.bytesSent));
+    lua_setfield(L, -2, "bytes_sent");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.bytesReceived));
+    lua_setfield(L, -2, "bytes_received");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.bytesDecoded));
+    lua_setfield(L, -2, "bytes_decoded");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.hedgesSent));
+    lua_setfield(L, -2, "hedges_sent");
+    lua_pushinteger(L, (lua_Integer)METRIC_GET(lcorehttp_metrics.hedgesWon));
+    lua_setfield(L, -2, "hedges_won");
+
+    l_corehttp_push_histogram(L, &lcorehttp_metrics.latency);
+    lua_setfield(L, -2, "latency");
+
+    lua_newtable(L);
+    for (size_t i = 0; i < LCOREHTTP_METRICS_HOSTS; i++) {
+        lcorehttp_host_metrics* slot = &lcorehttp_metrics.hosts[i];
+        if (atomic_load_explicit(&slot->used, memory_order_acquire)) {
+            l_corehttp_push_histogram(L, &slot->latency);
+            lua_setfield(L, -2, slot->key);
+        }
+    }
+    if (METRIC_GET(lcorehttp_metrics.otherHosts.latency.count) > 0) {
+        l_corehttp_push_histogram(L, &lcorehttp_metrics.otherHosts.latency);
+        lua_setfield(L, -2, LCOREHTTP_METRICS_OTHER_HOST);
+    }
+    lua_setfield(L, -2, "hosts");
+
+    return 1;
+}
+
+static void
+l_corehttp_add_format(luaL_Buffer* b, const char* format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0) {
+        luaL_addlstring(b, line, ((size_t)len < sizeof(line)) ? (size_t)len : sizeof(line) - 1);
+    }
+}
+
+static void
+l_corehttp_escape_label(char* out, size_t outLen, const char* value) {
+    size_t n = 0;
+    for (; *value && n + 2 < outLen; value++) {
+        if (*value == '\\' || *value == '"') {
+            out[n++] = '\\';
+            out[n++] = *value;
+        } else if (*value == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else {
+            out[n++] = *value;
+        }
+    }
+    out[n] = 0;
+}
+
+// Prometheus buckets are cumulative; only the last bucket of every power of two is emitted to keep the output compact,
+// but always all of them, so that every scrape has the same set of le series
+static void
+l_corehttp_prometheus_histogram(luaL_Buffer* b, const char* labels, lcorehttp_histogram* histogram) {
+    uint64_t cumulative = 0;
+    uint64_t total = METRIC_GET(histogram->count);
+    const char* separator = (labels[0] != 0) ? "," : "";
+    for (size_t i = 0; i < LCOREHTTP_HISTOGRAM_BUCKETS; i++) {
+        cumulative += METRIC_GET(histogram->buckets[i]);
+        if (i >= LCOREHTTP_HISTOGRAM_LINEAR - 1
+            && (i - (LCOREHTTP_HISTOGRAM_LINEAR - 1)) % LCOREHTTP_HISTOGRAM_SUB == 0) {
+            double le = (double)lcorehttp_histogram_bucket_le(i) / 1e6;
+            l_corehttp_add_format(b, "lcorehttp_request_duration_seconds_bucket{%s%sle=\"%g\"} %llu\n", labels,
+                                  separator, le, (unsigned long long)cumulative);
+        }
+    }
+    if (cumulative > total) { // a request recorded while rendering, +Inf may not fall below a finite bucket
+        total = cumulative;
+    }
+    l_corehttp_add_format(b, "lcorehttp_request_duration_seconds_bucket{%s%sle=\"+Inf\"} %llu\n", labels, separator,
+                          (unsigned long long)total);
+    if (labels[0] != 0) {
+        l_corehttp_add_format(b, "lcorehttp_request_duration_seconds_sum{%s} %g\n", labels,
+                              (double)METRIC_GET(histogram->sum) / 1e6);
+        l_corehttp_add_format(b, "lcorehttp_request_duration_seconds_count{%s} %llu\n", labels,
+                              (unsigned long long)total);
+    } else {
+        l_corehttp_add_format(b, "lcorehttp_request_duration_seconds_sum %g\n", (double)METRIC_GET(histogram->sum) / 1e6);
+        l_corehttp_add_format(b, "lcorehttp_request_duration_seconds_count %llu\n", (unsigned long long)total);
+    }
+}
+
+static void
+l_corehttp_prometheus_counter(luaL_Buffer* b, const char* name, const char* help, atomic_uint_fast64_t* counter) {
+    l_corehttp_add_format(b, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+                          (unsigned long long)METRIC_GET(*counter));
+}
+
+// metrics_prometheus() -> metrics in the Prometheus text exposition format
+int
+l_corehttp_metrics_prometheus(lua_State* L) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    l_corehttp_add_format(&b, "# HELP lcorehttp_requests_total Responses received by HTTP status code.\n"
+                              "# TYPE lcorehttp_requests_total counter\n");
+    for (int code = 0; code < LCOREHTTP_METRICS_STATUS_CODES; code++) {
+        uint64_t count = METRIC_GET(lcorehttp_metrics.statusCodes[code]);
+        if (count > 0) {
+            l_corehttp_add_format(&b, "lcorehttp_requests_total{code=\"%d\"} %llu\n", code, (unsigned long long)count);
+        }
+    }
+
+    l_corehttp_add_format(&b, "# HELP lcorehttp_errors_total Failed requests by coreHTTP status.\n"
+                              "# TYPE lcorehttp_errors_total counter\n");
+    for (int status = 0; status < LCOREHTTP_METRICS_ERRORS; status++) {
+        uint64_t count = METRIC_GET(lcorehttp_metrics.errors[status]);
+        const char* name = HTTPClient_strerror((HTTPStatus_t)status);
+        if (count > 0 && name != NULL) {
+            l_corehttp_add_format(&b, "lcorehttp_errors_total{status=\"%s\"} %llu\n", name, (unsigned long long)count);
+        }
+    }
+
+    l_corehttp_prometheus_counter(&b, "lcorehttp_connect_errors_total", "Failed connection attempts.",
+                                  &lcorehttp_metrics.connectErrors);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_connections_opened_total", "Opened connections.",
+                                  &lcorehttp_metrics.connectionsOpened);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_connections_closed_total", "Closed connections.",
+                                  &lcorehttp_metrics.connectionsClosed);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_tls_handshakes_total", "Completed TLS handshakes.",
+                                  &lcorehttp_metrics.handshakes);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_bytes_sent_total", "Bytes written to connections.",
+                                  &lcorehttp_metrics.bytesSent);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_bytes_received_total", "Bytes read from connections.",
+                                  &lcorehttp_metrics.bytesReceived);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_bytes_decoded_total", "Body bytes delivered after decoding.",
+                                  &lcorehttp_metrics.bytesDecoded);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_hedges_sent_total", "Hedged duplicate requests sent.",
+                                  &lcorehttp_metrics.hedgesSent);
+    l_corehttp_prometheus_counter(&b, "lcorehttp_hedges_won_total", "Hedged duplicates that answered first.",
+                                  &lcorehttp_metrics.hedgesWon);
+
+    l_corehttp_add_format(&b, "# HELP lcorehttp_request_duration_seconds Time until response headers arrived.\n"
+                              "# TYPE lcorehttp_request_duration_seconds histogram\n");
+    l_corehttp_prometheus_histogram(&b, "", &lcorehttp_metrics.latency);
+    char labels[LCOREHTTP_METRICS_HOST_KEY * 2 + 16];
+    char escaped[LCOREHTTP_METRICS_HOST_KEY * 2];
+    for (size_t i = 0; i < LCOREHTTP_METRICS_HOSTS; i++) {
+        lcorehttp_host_metrics* slot = &lcorehttp_metrics.hosts[i];
+        if (atomic_load_explicit(&slot->used, memory_order_acquire)) {
+            l_corehttp_escape_label(escaped, sizeof(escaped), slot->key);
+            snprintf(labels, sizeof(labels), "host=\"%s\"", escaped);
+            l_corehttp_prometheus_histogram(&b, labels, &slot->latency);
+        }
+    }
+    if (METRIC_GET(lcorehttp_metrics.otherHosts.latency.count) > 0) {
+        l_corehttp_prometheus_histogram(&b, "host=\"" LCOREHTTP_METRICS_OTHER_HOST "\"",
+                                        &lcorehttp_metrics.otherHosts.latency);
+    }
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+#else
+
+int
+l_corehttp_metrics(lua_State* L) {
+    return push_error(L, "metrics are not compiled in (LCOREHTTP_METRICS)");
+}
+
+int
+l_corehttp_metrics_prometheus(lua_State* L) {
+    return push_error(L, "metrics are not compiled in (LCOREHTTP_METRICS)");
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LCOREHTTP_METRICS_H
+#define LCOREHTTP_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "core_http_client.h"
+#include "lua.h"
+
+/*
+ * Library-wide counters and latency histograms. Updates are relaxed atomic increments and
+ * compile to nothing unless LCOREHTTP_METRICS is defined.
+ */
+#ifdef LCOREHTTP_METRICS
+void lcorehttp_metrics_request(const char* hostname, int portno, uint16_t statusCode, uint64_t latencyUs);
+void lcorehttp_metrics_error(HTTPStatus_t status);
+void lcorehttp_metrics_connect_error(void);
+void lcorehttp_metrics_connection_opened(int tls);
+void lcorehttp_metrics_connection_closed(void);
+void lcorehttp_metrics_hedge_sent(void);
+void lcorehttp_metrics_hedge_won(void);
+void lcorehttp_metrics_bytes_sent(size_t bytes);
+void lcorehttp_metrics_bytes_received(size_t bytes);
+void lcorehttp_metrics_bytes_decoded(size_t bytes);
+#else
+// arguments are still "used" so that compiling metrics out does not leave unused locals behind
+#define lcorehttp_metrics_request(hostname, portno, statusCode, latencyUs)                                         \
+    ((void)(hostname), (void)(portno), (void)(statusCode), (void)(latencyUs))
+#define lcorehttp_metrics_error(status)          ((void)(status))
+#define lcorehttp_metrics_connect_error()        ((void)0)
+#define lcorehttp_metrics_connection_opened(tls) ((void)(tls))
+#define lcorehttp_metrics_connection_closed()    ((void)0)
+#define lcorehttp_metrics_hedge_sent()           ((void)0)
+#define lcorehttp_metrics_hedge_won()            ((void)0)
+#define lcorehttp_metrics_bytes_sent(bytes)      ((void)(bytes))
+#define lcorehttp_metrics_bytes_received(bytes)  ((void)(bytes))
+#define lcorehttp_metrics_bytes_decoded(bytes)   ((void)(bytes))
+#endif
+
+int l_corehttp_metrics(lua_State* L);
+int l_corehttp_metrics_prometheus(lua_State* L);
+
+#endif /* LCOREHTTP_METRICS_H */
@@ -0,0 +1,500 @@
+#include "lcorehttp_multipart.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+// the CRT names of the POSIX calls used for file parts, with 64-bit offsets and sizes
+#define open _open
+#define close _close
+#define read _read
+#define lseek _lseeki64
+#define fstat _fstat64
+#define stat _stat64
+#ifndef S_ISREG
+#define S_ISREG(mode) (((mode) & _S_IFMT) == _S_IFREG)
+#endif
+#else
+#include <unistd.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#include "extended_core_http_client.h"
+#include "lcorehttp_body.h"
+#include "lcorehttp_preresponse.h"
+#include "lcorehttp_time.h"
+
+#define MULTIPART_CLOSING_SIZE (LCOREHTTP_MULTIPART_BOUNDARY_SIZE + 8)
+
+typedef struct multipart_writer {
+    const TransportInterface_t* transport;
+    HTTPClient_GetCurrentTimeFunc_t getTime;
+    const lcorehttp_shaping* shaping;
+    int chunked;
+    uint8_t* base; // payload starts LCOREHTTP_MULTIPART_CHUNK_RESERVE bytes in
+    size_t len;
+} multipart_writer;
+
+static void
+multipart_boundary(lcorehttp_multipart* multipart) {
+    uint8_t random[12] = {0};
+    FILE* urandom = fopen("/dev/urandom", "rb");
+    if (urandom == NULL || fread(random, sizeof(random), 1, urandom) != 1) {
+        uint64_t seed = l_corehttp_get_time_us() ^ (uint64_t)(uintptr_t)multipart;
+        for (size_t i = 0; i < sizeof(random); i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            random[i] = (uint8_t)(seed >> 56);
+        }
+    }
+    if (urandom != NULL) {
+        fclose(urandom);
+    }
+    int len = snprintf(multipart->boundary, sizeof(multipart->boundary), "lcorehttp-");
+    for (size_t i = 0; i < sizeof(random); i++) {
+        len += snprintf(multipart->boundary + len, sizeof(multipart->boundary) - (size_t)len, "%02x", random[i]);
+    }
+}
+
+// quoted Content-Disposition parameters escape like browsers do
+static int
+append_escaped(lcorehttp_bytes* head, const char* value, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        const char* replacement = NULL;
+        switch (value[i]) {
+            case '"': replacement = "%22"; break;
+            case '\r': replacement = "%0D"; break;
+            case '\n': replacement = "%0A"; break;
+            default: break;
+        }
+        int status = replacement != NULL ? lcorehttp_bytes_append(head, replacement, 3)
+                                         : lcorehttp_bytes_append(head, value + i, 1);
+        if (status != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// part header fields and values end at CRLF, a line break inside them would inject headers
+static int
+has_line_break(const char* value, size_t len) {
+    return memchr(value, '\r', len) != NULL || memchr(value, '\n', len) != NULL;
+}
+
+static int
+append_string(lcorehttp_bytes* head, const char* value) {
+    return lcorehttp_bytes_append(head, value, strlen(value));
+}
+
+// part headers for the part table at partIdx, with the CRLF ending the previous part in front
+static void
+build_part_head(lua_State* L, const lcorehttp_multipart* multipart, lcorehttp_multipart_part* part, int partIdx,
+                size_t index, const char* defaultContentType) {
+    lcorehttp_bytes head = {0};
+    size_t nameLen = 0;
+    lua_getfield(L, partIdx, "name");
+    const char* name = lua_tolstring(L, -1, &nameLen);
+    if (name == NULL) {
+        luaL_error(L, "multipart part %d needs a name", (int)index + 1);
+        return;
+    }
+    lua_getfield(L, partIdx, "filename");
+    lua_getfield(L, partIdx, "content_type");
+    const char* contentType = lua_isstring(L, -1) ? lua_tostring(L, -1) : defaultContentType;
+    if (contentType != NULL && has_line_break(contentType, strlen(contentType))) {
+        luaL_error(L, "multipart part %d content_type contains CR or LF", (int)index + 1);
+        return;
+    }
+
+    int failed = (index > 0 && append_string(&head, "\r\n") != 0) || append_string(&head, "--") != 0
+                 || append_string(&head, multipart->boundary) != 0
+                 || append_string(&head, "\r\nContent-Disposition: form-data; name=\"") != 0
+                 || append_escaped(&head, name, nameLen) != 0 || append_string(&head, "\"") != 0;
+    if (!failed && lua_isstring(L, -2)) {
+        size_t filenameLen = 0;
+        const char* filename = lua_tolstring(L, -2, &filenameLen);
+        failed = append_string(&head, "; filename=\"") != 0 || append_escaped(&head, filename, filenameLen) != 0
+                 || append_string(&head, "\"") != 0;
+    }
+    failed = failed || append_string(&head, "\r\n") != 0;
+    if (!failed && contentType != NULL) {
+        failed = append_string(&head, "Content-Type: ") != 0 || append_string(&head, contentType) != 0
+                 || append_string(&head, "\r\n") != 0;
+    }
+    lua_pop(L, 3);
+
+    lua_getfield(L, partIdx, "headers");
+    if (!failed && lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while (!failed && lua_next(L, -2) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+                size_t fieldLen = 0;
+                size_t valueLen = 0;
+                const char* field = lua_tolstring(L, -2, &fieldLen);
+                const char* value = lua_tolstring(L, -1, &valueLen);
+                if (has_line_break(field, fieldLen) || has_line_break(value, valueLen)) {
+                    lcorehttp_bytes_free(&head);
+                    luaL_error(L, "multipart part %d header contains CR or LF", (int)index + 1);
+                    return;
+                }
+                failed = append_string(&head, field) != 0 || append_string(&head, ": ") != 0
+                         || append_string(&head, value) != 0 || append_string(&head, "\r\n") != 0;
+            }
+            lua_pop(L, 1);
+        }
+        if (failed) {
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    if (failed || append_string(&head, "\r\n") != 0) {
+        lcorehttp_bytes_free(&head);
+        luaL_error(L, "failed to allocate multipart headers");
+        return;
+    }
+    part->head = (char*)head.data;
+    part->headLen = head.len;
+}
+
+static int64_t
+optional_size(lua_State* L, int partIdx) {
+    lua_getfield(L, partIdx, "size");
+    int64_t size = lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0 ? (int64_t)lua_tointeger(L, -1) : -1;
+    lua_pop(L, 1);
+    return size;
+}
+
+// bytes left in a regular file from the current offset, -1 for pipes and sockets
+static int64_t
+file_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    int64_t offset = (int64_t)lseek(fd, 0, SEEK_CUR);
+    return offset >= 0 && offset <= (int64_t)st.st_size ? (int64_t)st.st_size - offset : -1;
+}
+
+// fills part from the part table at partIdx, returns -1 with an error message pushed when a file cannot be opened
+static int
+parse_part(lua_State* L, lcorehttp_multipart* multipart, int partIdx, int keepIdx, size_t index) {
+    lcorehttp_multipart_part* part = &multipart->parts[index];
+    part->fd = -1;
+    part->size = -1;
+    const char* defaultContentType = NULL;
+
+    lua_getfield(L, partIdx, "data");
+    lua_getfield(L, partIdx, "path");
+    lua_getfield(L, partIdx, "fd");
+    lua_getfield(L, partIdx, "generator");
+    int sources = lua_isstring(L, -4) + lua_isstring(L, -3) + lua_isinteger(L, -2) + lua_isfunction(L, -1);
+    if (sources != 1) {
+        return luaL_error(L, "multipart part %d needs exactly one of data, path, fd or generator", (int)index + 1);
+    }
+    if (lua_isstring(L, -4)) {
+        part->kind = MULTIPART_DATA;
+        part->data = (const uint8_t*)lua_tolstring(L, -4, &part->dataLen);
+        part->size = (int64_t)part->dataLen;
+        lua_pushvalue(L, -4);
+        lua_rawseti(L, keepIdx, (lua_Integer)index + 1);
+    } else if (lua_isfunction(L, -1)) {
+        part->kind = MULTIPART_GENERATOR;
+        part->size = optional_size(L, partIdx);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, keepIdx, (lua_Integer)index + 1);
+        defaultContentType = "application/octet-stream";
+    } else {
+        part->kind = MULTIPART_FILE;
+        defaultContentType = "application/octet-stream";
+        if (lua_isstring(L, -3)) {
+            const char* path = lua_tostring(L, -3);
+            part->fd = open(path, O_RDONLY | O_BINARY);
+            if (part->fd < 0) {
+                lua_pushfstring(L, "cannot open %s: %s", path, strerror(errno));
+                return -1;
+            }
+            part->ownsFd = 1;
+        } else {
+            part->fd = (int)lua_tointeger(L, -2);
+        }
+        part->size = optional_size(L, partIdx);
+        if (part->size < 0) {
+            part->size = file_size(part->fd);
+        }
+    }
+    lua_pop(L, 4);
+    build_part_head(L, multipart, part, partIdx, index, defaultContentType);
+    return 0;
+}
+
+static int
+writer_write(multipart_writer* writer, const uint8_t* data, size_t len) {
+    return HTTPClient_Write(writer->transport, writer->getTime, data, len, writer->shaping) == HTTPSuccess ? 0 : -1;
+}
+
+static int
+writer_flush(multipart_writer* writer) {
+    if (writer->len == 0) {
+        return 0;
+    }
+    uint8_t* data = writer->base + LCOREHTTP_MULTIPART_CHUNK_RESERVE;
+    size_t len = writer->len;
+    if (writer->chunked) { // chunk size goes into the reserve in front, the CRLF behind the payload
+        char header[LCOREHTTP_MULTIPART_CHUNK_RESERVE + 1];
+        int headerLen = snprintf(header, sizeof(header), "%zx\r\n", len);
+        data -= headerLen;
+        memcpy(data, header, (size_t)headerLen);
+        memcpy(data + headerLen + len, "\r\n", 2);
+        len += (size_t)headerLen + 2;
+    }
+    writer->len = 0;
+    return writer_write(writer, data, len);
+}
+
+static int
+writer_add(multipart_writer* writer, const uint8_t* data, size_t len) {
+    uint8_t* payload = writer->base + LCOREHTTP_MULTIPART_CHUNK_RESERVE;
+    if (writer->len + len > LCOREHTTP_MULTIPART_BUFFER_SIZE && writer_flush(writer) != 0) {
+        return -1;
+    }
+    if (writer->len + len <= LCOREHTTP_MULTIPART_BUFFER_SIZE) {
+        memcpy(payload + writer->len, data, len);
+        writer->len += len;
+        return 0;
+    }
+    // larger strings go out as they are instead of being copied through the buffer
+    if (!writer->chunked) {
+        return writer_write(writer, data, len);
+    }
+    char header[LCOREHTTP_MULTIPART_CHUNK_RESERVE + 1];
+    int headerLen = snprintf(header, sizeof(header), "%zx\r\n", len);
+    if (writer_write(writer, (const uint8_t*)header, (size_t)headerLen) != 0 || writer_write(writer, data, len) != 0) {
+        return -1;
+    }
+    return writer_write(writer, (const uint8_t*)"\r\n", 2);
+}
+
+static int
+write_file_part(lua_State* L, multipart_writer* writer, const lcorehttp_multipart_part* part, size_t index) {
+    uint8_t* payload = writer->base + LCOREHTTP_MULTIPART_CHUNK_RESERVE;
+    int64_t remaining = part->size;
+    while (remaining != 0) {
+        if (writer->len == LCOREHTTP_MULTIPART_BUFFER_SIZE && writer_flush(writer) != 0) {
+            return luaL_error(L, "failed to write multipart body");
+        }
+        size_t space = LCOREHTTP_MULTIPART_BUFFER_SIZE - writer->len;
+        if (remaining > 0 && (int64_t)space > remaining) {
+            space = (size_t)remaining;
+        }
+        int64_t bytesRead = read(part->fd, payload + writer->len, space);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return luaL_error(L, "failed to read multipart part %d: %s", (int)index + 1, strerror(errno));
+        }
+        if (bytesRead == 0) {
+            if (remaining > 0) {
+                return luaL_error(L, "multipart part %d ended %I bytes early", (int)index + 1,
+                                  (lua_Integer)remaining);
+            }
+            break;
+        }
+        writer->len += (size_t)bytesRead;
+        if (remaining > 0) {
+            remaining -= bytesRead;
+        }
+    }
+    return 0;
+}
+
+static int
+write_generator_part(lua_State* L, multipart_writer* writer, const lcorehttp_multipart_part* part, size_t index,
+                     int keepIdx) {
+    int64_t produced = 0;
+    while (1) {
+        lua_rawgeti(L, keepIdx, (lua_Integer)index + 1);
+        lua_call(L, 0, 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        size_t len = 0;
+        const char* data = lua_tolstring(L, -1, &len);
+        if (data == NULL) {
+            return luaL_error(L, "multipart generator of part %d must return strings", (int)index + 1);
+        }
+        produced += (int64_t)len;
+        if (part->size >= 0 && produced > part->size) {
+            return luaL_error(L, "multipart generator of part %d produced more than its size", (int)index + 1);
+        }
+        if (writer_add(writer, (const uint8_t*)data, len) != 0) {
+            return luaL_error(L, "failed to write multipart body");
+        }
+        lua_pop(L, 1);
+    }
+    if (part->size >= 0 && produced != part->size) {
+        return luaL_error(L, "multipart generator of part %d produced less than its size", (int)index + 1);
+    }
+    return 0;
+}
+
+// write_body_hook(preresponse), the multipart is upvalue 1
+static int
+multipart_write_body(lua_State* L) {
+    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
+    lcorehttp_multipart* multipart = lua_touserdata(L, lua_upvalueindex(1));
+    lua_getiuservalue(L, lua_upvalueindex(1), 1); // 2: strings and generators by part
+    multipart_writer writer = {.transport = preresponse->transport,
+                               .getTime = preresponse->response->getTime,
+                               .shaping = preresponse->shaping,
+                               .chunked = multipart->contentLength < 0,
+                               .base = multipart->buffer,
+                               .len = 0};
+    for (size_t i = 0; i < multipart->partCount; i++) {
+        const lcorehttp_multipart_part* part = &multipart->parts[i];
+        if (writer_add(&writer, (const uint8_t*)part->head, part->headLen) != 0) {
+            return luaL_error(L, "failed to write multipart body");
+        }
+        switch (part->kind) {
+            case MULTIPART_DATA:
+                if (writer_add(&writer, part->data, part->dataLen) != 0) {
+                    return luaL_error(L, "failed to write multipart body");
+                }
+                break;
+            case MULTIPART_FILE: write_file_part(L, &writer, part, i); break;
+            case MULTIPART_GENERATOR: write_generator_part(L, &writer, part, i, 2); break;
+        }
+    }
+    char closing[MULTIPART_CLOSING_SIZE];
+    int closingLen =
+        snprintf(closing, sizeof(closing), "%s--%s--\r\n", multipart->partCount > 0 ? "\r\n" : "", multipart->boundary);
+    if (writer_add(&writer, (const uint8_t*)closing, (size_t)closingLen) != 0 || writer_flush(&writer) != 0
+        || (writer.chunked && writer_write(&writer, (const uint8_t*)"0\r\n\r\n", 5) != 0)) {
+        return luaL_error(L, "failed to write multipart body");
+    }
+    return 0;
+}
+
+lcorehttp_multipart*
+lcorehttp_multipart_prepare(lua_State* L, int optionsIdx) {
+    optionsIdx = lua_absindex(L, optionsIdx);
+    int base = lua_gettop(L);
+    lua_getfield(L, optionsIdx, "multipart");
+    int partsIdx = lua_gettop(L);
+    size_t count = lua_rawlen(L, partsIdx);
+
+    lcorehttp_multipart* multipart = lua_newuserdatauv(L, sizeof(lcorehttp_multipart), 1);
+    memset(multipart, 0, sizeof(lcorehttp_multipart));
+    luaL_getmetatable(L, LCOREHTTP_MULTIPART_METATABLE);
+    lua_setmetatable(L, -2);
+    int multipartIdx = lua_gettop(L);
+    lua_createtable(L, (int)count, 0);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, multipartIdx, 1);
+    int keepIdx = lua_gettop(L);
+
+    multipart->buffer = malloc(LCOREHTTP_MULTIPART_CHUNK_RESERVE + LCOREHTTP_MULTIPART_BUFFER_SIZE + 2);
+    multipart->parts = count > 0 ? calloc(count, sizeof(lcorehttp_multipart_part)) : NULL;
+    if (multipart->buffer == NULL || (count > 0 && multipart->parts == NULL)) {
+        luaL_error(L, "failed to allocate multipart body");
+        return NULL;
+    }
+    multipart_boundary(multipart);
+
+    int64_t contentLength = 0;
+    for (size_t i = 0; i < count; i++) {
+        lua_rawgeti(L, partsIdx, (lua_Integer)i + 1);
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "multipart part %d must be a table", (int)i + 1);
+            return NULL;
+        }
+        multipart->partCount = i + 1; // the part is released by __gc from here on
+        if (parse_part(L, multipart, lua_gettop(L), keepIdx, i) != 0) {
+            lua_copy(L, -1, base + 1);
+            lua_settop(L, base + 1);
+            return NULL;
+        }
+        lua_pop(L, 1);
+        const lcorehttp_multipart_part* part = &multipart->parts[i];
+        if (contentLength >= 0 && part->size >= 0) {
+            contentLength += (int64_t)part->headLen + part->size;
+        } else {
+            contentLength = -1;
+        }
+    }
+    if (contentLength >= 0) {
+        contentLength += (int64_t)strlen(multipart->boundary) + (count > 0 ? 8 : 6); // [CRLF]--boundary--CRLF
+    }
+    multipart->contentLength = contentLength;
+
+    // the request streams through a copy of the options with the hook in place of multipart
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, optionsIdx) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_pushnil(L);
+    lua_setfield(L, -2, "multipart");
+    lua_pushnil(L);
+    lua_setfield(L, -2, "chunked"); // the hook frames its chunks itself
+    lua_pushvalue(L, multipartIdx);
+    lua_pushcclosure(L, multipart_write_body, 1);
+    lua_setfield(L, -2, "write_body_hook");
+    lua_replace(L, optionsIdx);
+    lua_settop(L, base);
+    return multipart;
+}
+
+HTTPStatus_t
+lcorehttp_multipart_add_headers(const lcorehttp_multipart* multipart, HTTPRequestHeaders_t* requestHeaders) {
+    char value[LCOREHTTP_MULTIPART_BOUNDARY_SIZE + 40];
+    int len = snprintf(value, sizeof(value), "multipart/form-data; boundary=%s", multipart->boundary);
+    HTTPStatus_t status =
+        HTTPClient_AddHeader(requestHeaders, "Content-Type", strlen("Content-Type"), value, (size_t)len);
+    if (status != HTTPSuccess) {
+        return status;
+    }
+    if (multipart->contentLength < 0) {
+        return HTTPClient_AddHeader(requestHeaders, "Transfer-Encoding", strlen("Transfer-Encoding"), "chunked",
+                                    strlen("chunked"));
+    }
+    len = snprintf(value, sizeof(value), "%lld", (long long)multipart->contentLength);
+    return HTTPClient_AddHeader(requestHeaders, "Content-Length", strlen("Content-Length"), value, (size_t)len);
+}
+
+static int
+l_corehttp_multipart_gc(lua_State* L) {
+    lcorehttp_multipart* multipart = luaL_checkudata(L, 1, LCOREHTTP_MULTIPART_METATABLE);
+    for (size_t i = 0; i < multipart->partCount; i++) {
+        lcorehttp_multipart_part* part = &multipart->parts[i];
+        if (part->ownsFd && part->fd >= 0) {
+            close(part->fd);
+        }
+        free(part->head);
+    }
+    free(multipart->parts);
+    multipart->parts = NULL;
+    multipart->partCount = 0;
+    free(multipart->buffer);
+    multipart->buffer = NULL;
+    return 0;
+}
+
+int
+l_corehttp_multipart_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_MULTIPART_METATABLE);
+    lua_pushcfunction(L, l_corehttp_multipart_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushstring(L, LCOREHTTP_MULTIPART_METATABLE);
+    lua_setfield(L, -2, "__type");
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef LCOREHTTP_MULTIPART_H
+#define LCOREHTTP_MULTIPART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "core_http_client.h"
+#include "lua.h"
+
+#define LCOREHTTP_MULTIPART_METATABLE      "COREHTTP_MULTIPART"
+#define LCOREHTTP_MULTIPART_BUFFER_SIZE    65536
+#define LCOREHTTP_MULTIPART_BOUNDARY_SIZE  40
+#define LCOREHTTP_MULTIPART_CHUNK_RESERVE  18 /* room for the hex size and CRLF in front of a chunk */
+
+typedef enum lcorehttp_multipart_kind {
+    MULTIPART_DATA,
+    MULTIPART_FILE,
+    MULTIPART_GENERATOR,
+} lcorehttp_multipart_kind;
+
+typedef struct lcorehttp_multipart_part {
+    lcorehttp_multipart_kind kind;
+    char* head; // boundary line and part headers
+    size_t headLen;
+    const uint8_t* data; // MULTIPART_DATA, the string is kept in the user value table
+    size_t dataLen;
+    int fd; // MULTIPART_FILE
+    int ownsFd;
+    int64_t size; // -1 when unknown (generator without size)
+} lcorehttp_multipart_part;
+
+/*
+ * multipart/form-data body streamed by a C write_body_hook. Content-Length is sent when every part size is
+ * known up front, the body is sent chunked otherwise.
+ */
+typedef struct lcorehttp_multipart {
+    char boundary[LCOREHTTP_MULTIPART_BOUNDARY_SIZE + 1];
+    lcorehttp_multipart_part* parts;
+    size_t partCount;
+    int64_t contentLength; // -1: Transfer-Encoding: chunked
+    uint8_t* buffer;       // chunk reserve, LCOREHTTP_MULTIPART_BUFFER_SIZE bytes of payload, CRLF
+} lcorehttp_multipart;
+
+/**
+ * @brief Build the multipart body of options.multipart and replace the options at optionsIdx with a copy
+ * whose write_body_hook streams it.
+ *
+ * Raises on an invalid part description.
+ *
+ * @return The multipart (alive as long as the new options table), NULL with the error message pushed when a
+ * file cannot be opened.
+ */
+lcorehttp_multipart* lcorehttp_multipart_prepare(lua_State* L, int optionsIdx);
+
+// Content-Type with the boundary and Content-Length or Transfer-Encoding
+HTTPStatus_t lcorehttp_multipart_add_headers(const lcorehttp_multipart* multipart,
+                                             HTTPRequestHeaders_t* requestHeaders);
+
+int l_corehttp_multipart_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_MULTIPART_H */
@@ -0,0 +1,93 @@
+#include "lcorehttp_pool.h"
+#include <stdlib.h>
+#include "lcorehttp_client.h"
+#include "lcorehttp_h2.h"
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_probes.h"
+#include "lcorehttp_socket.h"
+#include "lcorehttp_tls.h"
+#include "lcorehttp_time.h"
+#include "lss_transport.h"
+
+int
+lcorehttp_pool_init(lcorehttp_pool* pool, size_t maxIdle, uint32_t idleTimeoutMs) {
+    pool->idle = NULL;
+    pool->idleCount = 0;
+    pool->maxIdle = 0;
+    pool->idleTimeoutMs = idleTimeoutMs;
+    if (maxIdle == 0) {
+        return 0;
+    }
+    if (maxIdle > LCOREHTTP_POOL_MAXIMUM_IDLE) {
+        maxIdle = LCOREHTTP_POOL_MAXIMUM_IDLE;
+    }
+    pool->idle = calloc(maxIdle, sizeof(lcorehttp_pooled_connection));
+    if (pool->idle == NULL) {
+        return -1;
+    }
+    pool->maxIdle = maxIdle;
+    return 0;
+}
+
+void
+lcorehttp_connection_close(const char* host, int port, const TransportInterface_t* transport, size_t bodyBytes) {
+    if (transport->recv == lcorehttp_socket_recv) {
+        lcorehttp_socket_close(transport->pNetworkContext);
+    } else if (transport->recv == lcorehttp_tls_recv) {
+        lcorehttp_tls_close(transport->pNetworkContext);
+    } else {
+        lss_close(transport->pNetworkContext);
+    }
+    lcorehttp_metrics_connection_closed();
+    LCOREHTTP_PROBE3(close, host, port, bodyBytes);
+}
+
+void
+lcorehttp_transport_close(const lcorehttp_client* client, const TransportInterface_t* transport, size_t bodyBytes) {
+    if (transport->recv == lcorehttp_h2_stream_recv) {
+        // the connection below closes with its last stream
+        lcorehttp_h2_stream_close(transport->pNetworkContext);
+    } else {
+        lcorehttp_connection_close(client->hostname, client->portno, transport, bodyBytes);
+    }
+    free((void*)transport);
+}
+
+TransportInterface_t*
+lcorehttp_pool_acquire(lcorehttp_client* client) {
+    lcorehttp_pool* pool = &client->pool;
+    uint32_t now = l_corehttp_get_time_ms();
+    while (pool->idleCount > 0) {
+        lcorehttp_pooled_connection* connection = &pool->idle[--pool->idleCount];
+        if (now - connection->idleSince < pool->idleTimeoutMs) {
+            return connection->transport;
+        }
+        // the most recent one idled out, so did everything below it
+        lcorehttp_transport_close(client, connection->transport, 0);
+    }
+    return NULL;
+}
+
+void
+lcorehttp_pool_release(lcorehttp_client* client, const TransportInterface_t* transport, int reusable,
+                       size_t bodyBytes) {
+    lcorehttp_pool* pool = &client->pool;
+    if (!reusable || client->closed || pool->idleCount >= pool->maxIdle) {
+        lcorehttp_transport_close(client, transport, bodyBytes);
+        return;
+    }
+    pool->idle[pool->idleCount].transport = (TransportInterface_t*)transport;
+    pool->idle[pool->idleCount].idleSince = l_corehttp_get_time_ms();
+    pool->idleCount++;
+}
+
+void
+lcorehttp_pool_close(lcorehttp_client* client) {
+    lcorehttp_pool* pool = &client->pool;
+    while (pool->idleCount > 0) {
+        lcorehttp_transport_close(client, pool->idle[--pool->idleCount].transport, 0);
+    }
+    free(pool->idle);
+    pool->idle = NULL;
+    pool->maxIdle = 0;
+}
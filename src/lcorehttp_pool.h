@@ -0,0 +1,44 @@
+#ifndef LCOREHTTP_POOL_H
+#define LCOREHTTP_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "transport_interface.h"
+
+struct lcorehttp_client;
+
+#define LCOREHTTP_POOL_DEFAULT_IDLE_TIMEOUT_MS 15000
+#define LCOREHTTP_POOL_MAXIMUM_IDLE            256
+
+typedef struct lcorehttp_pooled_connection {
+    TransportInterface_t* transport;
+    uint32_t idleSince; // l_corehttp_get_time_ms()
+} lcorehttp_pooled_connection;
+
+/*
+ * Idle keep-alive connections of a single client. Responses return their connection here once the body
+ * was read to the end and neither side asked to close it; the next request on the client reuses it
+ * instead of paying for resolve, connect and TLS handshake again. Owned by the Lua thread of the client.
+ */
+typedef struct lcorehttp_pool {
+    lcorehttp_pooled_connection* idle;
+    size_t idleCount;
+    size_t maxIdle;
+    uint32_t idleTimeoutMs;
+} lcorehttp_pool;
+
+int lcorehttp_pool_init(lcorehttp_pool* pool, size_t maxIdle, uint32_t idleTimeoutMs);
+// most recently released connection that did not idle out, NULL when there is none
+TransportInterface_t* lcorehttp_pool_acquire(struct lcorehttp_client* client);
+// keeps the connection for reuse when reusable and there is room, closes it otherwise
+void lcorehttp_pool_release(struct lcorehttp_client* client, const TransportInterface_t* transport, int reusable,
+                            size_t bodyBytes);
+void lcorehttp_pool_close(struct lcorehttp_client* client);
+
+// closes the connection without freeing the transport interface itself
+void lcorehttp_connection_close(const char* host, int port, const TransportInterface_t* transport, size_t bodyBytes);
+// closes a transport opened for the client (an HTTP/2 stream closes only the stream) and frees it
+void lcorehttp_transport_close(const struct lcorehttp_client* client, const TransportInterface_t* transport,
+                               size_t bodyBytes);
+
+#endif /* LCOREHTTP_POOL_H */
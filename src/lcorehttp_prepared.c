@@ -0,0 +1,154 @@
+#include "lcorehttp_prepared.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core_http_client.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_time.h"
+#include "lerror.h"
+
+int
+l_corehttp_client_prepare(lua_State* L) {
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    if (client->closed) {
+        return push_error(L, "client is closed");
+    }
+    if (lua_istable(L, 4)) { // send performs a single exchange with the prepared block and a plain body
+        static const char* const unsupported[] = {"follow_redirects", "hedge", "multipart", NULL};
+        for (size_t i = 0; unsupported[i] != NULL; i++) {
+            lua_getfield(L, 4, unsupported[i]);
+            int present = !lua_isnil(L, -1);
+            lua_pop(L, 1);
+            if (present) {
+                return push_error(L, lua_pushfstring(L, "%s is not supported by prepared requests", unsupported[i]));
+            }
+        }
+    }
+    HTTPRequestHeaders_t requestHeaders = {0};
+    uint32_t requestFlags = 0;
+    int resultCount = initializeRequestHeaders(L, client, &requestHeaders, &requestFlags);
+    if (resultCount != 0) {
+        free(requestHeaders.pBuffer);
+        return resultCount;
+    }
+
+    int hasBodyHook = 0;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "write_body_hook");
+        hasBodyHook = lua_isfunction(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lcorehttp_prepared* prepared = lua_newuserdatauv(L, sizeof(lcorehttp_prepared), 2);
+    memset(prepared, 0, sizeof(lcorehttp_prepared));
+    luaL_getmetatable(L, LCOREHTTP_PREPARED_METATABLE);
+    lua_setmetatable(L, -2);
+
+    // keep only the serialized part, send allocates the full buffer
+    uint8_t* headerBlock = realloc(requestHeaders.pBuffer, requestHeaders.headersLen);
+    prepared->headerBlock = headerBlock != NULL ? headerBlock : requestHeaders.pBuffer;
+    prepared->headerBlockLen = requestHeaders.headersLen;
+    prepared->bufferLen = requestHeaders.bufferLen;
+    prepared->requestFlags = requestFlags;
+    prepared->hasBodyHook = hasBodyHook;
+
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    if (lua_istable(L, 4)) { // body, write_body_hook and connection options are looked up on send
+        lua_pushvalue(L, 4);
+        lua_setiuservalue(L, -2, 2);
+    }
+    return 1;
+}
+
+// send(body?, extra_headers?) -> response | nil, status_code, error
+int
+l_corehttp_prepared_send(lua_State* L) {
+    uint64_t requestStart = l_corehttp_get_time_us();
+    lcorehttp_prepared* prepared = luaL_checkudata(L, 1, LCOREHTTP_PREPARED_METATABLE);
+    if (prepared->headerBlock == NULL) {
+        return push_error(L, "prepared request is closed");
+    }
+    size_t body_len = 0;
+    const uint8_t* body = NULL;
+    if (lua_isstring(L, 2)) {
+        body = (const uint8_t*)lua_tolstring(L, 2, &body_len);
+    }
+    lua_settop(L, 3);
+
+    lua_getiuservalue(L, 1, 1);
+    int clientIdx = lua_gettop(L);
+    lcorehttp_client* client = (lcorehttp_client*)lua_touserdata(L, clientIdx);
+    if (client->closed) {
+        return push_error(L, "client is closed");
+    }
+    lua_getiuservalue(L, 1, 2);
+    int optionsIdx = lua_gettop(L);
+    int hasBodyHook = prepared->hasBodyHook && body == NULL;
+    if (body == NULL && !hasBodyHook && lua_istable(L, optionsIdx)) {
+        lua_getfield(L, optionsIdx, "body");
+        if (lua_isstring(L, -1)) {
+            body = (const uint8_t*)lua_tolstring(L, -1, &body_len);
+        }
+        lua_pop(L, 1); // still referenced by the options table
+    }
+
+    HTTPRequestHeaders_t requestHeaders = {0};
+    requestHeaders.pBuffer = malloc(prepared->bufferLen);
+    if (requestHeaders.pBuffer == NULL) {
+        return push_error(L, "failed to allocate buffer");
+    }
+    requestHeaders.bufferLen = prepared->bufferLen;
+    requestHeaders.headersLen = prepared->headerBlockLen;
+    memcpy(requestHeaders.pBuffer, prepared->headerBlock, prepared->headerBlockLen);
+
+    if (lua_istable(L, 3)) {
+        lua_pushnil(L);
+        while (lua_next(L, 3) != 0) {
+            size_t header_len = 0;
+            const char* header = lua_tolstring(L, -2, &header_len);
+            size_t value_len = 0;
+            const char* value = lua_tolstring(L, -1, &value_len);
+            if (header_len > 0) {
+                HTTPStatus_t httpStatus = HTTPClient_AddHeader(&requestHeaders, header, header_len, value, value_len);
+                if (httpStatus != HTTPSuccess) {
+                    free(requestHeaders.pBuffer);
+                    return push_error_status(L, httpStatus);
+                }
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    return corehttp_client_perform(L, client, clientIdx, optionsIdx, requestHeaders, prepared->requestFlags, body,
+                                   body_len, hasBodyHook, requestStart, NULL);
+}
+
+int
+l_corehttp_prepared_gc(lua_State* L) {
+    lcorehttp_prepared* prepared = luaL_checkudata(L, 1, LCOREHTTP_PREPARED_METATABLE);
+    free(prepared->headerBlock);
+    prepared->headerBlock = NULL;
+    return 0;
+}
+
+int
+l_corehttp_prepared_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_PREPARED_METATABLE);
+    /* Metamethods */
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_prepared_send);
+    lua_setfield(L, -2, "send");
+    lua_pushstring(L, LCOREHTTP_PREPARED_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_prepared_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_prepared_gc);
+    lua_setfield(L, -2, "__close");
+    return 0;
+}
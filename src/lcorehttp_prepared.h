@@ -0,0 +1,27 @@
+#ifndef LCOREHTTP_PREPARED_H
+#define LCOREHTTP_PREPARED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+
+/*
+ * Request template: request line, Host, static headers and range are serialized once by client:prepare;
+ * prepared:send only copies the block, appends per-call headers and lets coreHTTP add Content-Length.
+ */
+typedef struct lcorehttp_prepared {
+    uint8_t* headerBlock;
+    size_t headerBlockLen;
+    size_t bufferLen; // buffer_size of the template, the copy doubles as the response buffer
+    uint32_t requestFlags;
+    int hasBodyHook;
+} lcorehttp_prepared;
+
+#define LCOREHTTP_PREPARED_METATABLE "COREHTTP_PREPARED"
+
+// client:prepare(path, method, options?) -> prepared
+int l_corehttp_client_prepare(lua_State* L);
+
+int l_corehttp_prepared_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_PREPARED_H */
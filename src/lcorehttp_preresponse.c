@@ -1,62 +1,300 @@
-#include <lauxlib.h>
-#include <lua.h>
-#include <lualib.h>
-#include <string.h>
-#include "core_http_client.h"
-#include "extended_core_http_client.h"
-#include "lcorehttp_preresponse.h"
-#include "lerror.h"
-
-lcorehttp_preresponse*
-l_corehttp_new_preresponse(lua_State* L) {
-    lcorehttp_preresponse* preresponse = lua_newuserdatauv(L, sizeof(lcorehttp_preresponse), 0);
-    if (preresponse == NULL) {
-        return NULL;
-    }
-    luaL_getmetatable(L, LCOREHTTP_PRERESPONSE_METATABLE);
-    lua_setmetatable(L, -2);
-
-    return preresponse;
-}
-
-int
-l_corehttp_preresponse_write(lua_State* L) {
-    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
-    size_t len = 0;
-    const char* data = luaL_checklstring(L, 2, &len);
-    if (preresponse->transport == NULL) {
-        return push_error(L, "preresponse is closed");
-    }
-    HTTPStatus_t status =
-        HTTPClient_Write(preresponse->transport, preresponse->response->getTime, (const uint8_t*)data, len);
-    if (status != HTTPSuccess) {
-        return push_error(L, "failed to write to preresponse");
-    }
-    return 0;
-}
-
-int
-l_corehttp_preresponse_gc(lua_State* L) {
-    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
-
-    // noop - preresponse is closed by response
-
-    return 0;
-}
-
-int
-l_corehttp_preresponse_create_meta(lua_State* L) {
-    luaL_newmetatable(L, LCOREHTTP_PRERESPONSE_METATABLE);
-
-    lua_newtable(L);
-    lua_pushcfunction(L, l_corehttp_preresponse_write);
-    lua_setfield(L, -2, "write");
-    lua_setfield(L, -2, "__index");
-
-    lua_pushcfunction(L, l_corehttp_preresponse_gc);
-    lua_setfield(L, -2, "__gc");
-    lua_pushcfunction(L, l_corehttp_preresponse_gc);
-    lua_setfield(L, -2, "__close");
-
-    return 0;
-}
\ No newline at end of file
+#include <lauxlib.h>
+#include <limits.h>
+#include <lua.h>
+#include <lualib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core_http_client.h"
+#include "extended_core_http_client.h"
+#include "lcorehttp_body.h"
+#include "lcorehttp_preresponse.h"
+#include "lerror.h"
+
+lcorehttp_preresponse*
+l_corehttp_new_preresponse(lua_State* L) {
+    lcorehttp_preresponse* preresponse = lua_newuserdatauv(L, sizeof(lcorehttp_preresponse), 0);
+    if (preresponse == NULL) {
+        return NULL;
+    }
+    memset(preresponse, 0, sizeof(lcorehttp_preresponse));
+    luaL_getmetatable(L, LCOREHTTP_PRERESPONSE_METATABLE);
+    lua_setmetatable(L, -2);
+
+    return preresponse;
+}
+
+int
+lcorehttp_preresponse_start_chunked(lcorehttp_preresponse* preresponse, size_t chunkSize) {
+    preresponse->chunkBuffer = malloc(LCOREHTTP_PRERESPONSE_CHUNK_RESERVE + chunkSize + 2);
+    if (preresponse->chunkBuffer == NULL) {
+        return -1;
+    }
+    preresponse->chunked = 1;
+    preresponse->chunkSize = chunkSize;
+    preresponse->chunkLen = 0;
+    return 0;
+}
+
+int
+lcorehttp_preresponse_start_deflate(lcorehttp_preresponse* preresponse, int windowBits) {
+    z_stream* deflater = calloc(1, sizeof(z_stream));
+    if (deflater == NULL) {
+        return -1;
+    }
+    if (deflateInit2(deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(deflater);
+        return -1;
+    }
+    preresponse->deflater = deflater;
+    return 0;
+}
+
+static void
+preresponse_end_deflate(lcorehttp_preresponse* preresponse) {
+    if (preresponse->deflater != NULL) {
+        deflateEnd(preresponse->deflater);
+        free(preresponse->deflater);
+        preresponse->deflater = NULL;
+    }
+}
+
+// sends the buffered data as one chunk, size line and CRLF are framed around it in place
+static HTTPStatus_t
+preresponse_send_chunk(lcorehttp_preresponse* preresponse) {
+    if (preresponse->chunkLen == 0) {
+        return HTTPSuccess;
+    }
+    uint8_t* payload = preresponse->chunkBuffer + LCOREHTTP_PRERESPONSE_CHUNK_RESERVE;
+    char header[LCOREHTTP_PRERESPONSE_CHUNK_RESERVE + 1];
+    int headerLen = snprintf(header, sizeof(header), "%zx\r\n", preresponse->chunkLen);
+    memcpy(payload - headerLen, header, (size_t)headerLen);
+    memcpy(payload + preresponse->chunkLen, "\r\n", 2);
+    size_t len = (size_t)headerLen + preresponse->chunkLen + 2;
+    preresponse->chunkLen = 0;
+    return HTTPClient_Write(preresponse->transport, preresponse->response->getTime, payload - headerLen, len,
+                            preresponse->shaping);
+}
+
+static HTTPStatus_t
+preresponse_write_chunked(lcorehttp_preresponse* preresponse, const uint8_t* data, size_t len) {
+    if (preresponse->chunkLen + len > preresponse->chunkSize) {
+        HTTPStatus_t status = preresponse_send_chunk(preresponse);
+        if (status != HTTPSuccess) {
+            return status;
+        }
+    }
+    if (len <= preresponse->chunkSize) {
+        memcpy(preresponse->chunkBuffer + LCOREHTTP_PRERESPONSE_CHUNK_RESERVE + preresponse->chunkLen, data, len);
+        preresponse->chunkLen += len;
+        return HTTPSuccess;
+    }
+    // larger writes become a chunk of their own instead of being copied through the buffer
+    char header[LCOREHTTP_PRERESPONSE_CHUNK_RESERVE + 1];
+    int headerLen = snprintf(header, sizeof(header), "%zx\r\n", len);
+    HTTPClient_GetCurrentTimeFunc_t getTime = preresponse->response->getTime;
+    const lcorehttp_shaping* shaping = preresponse->shaping;
+    HTTPStatus_t status =
+        HTTPClient_Write(preresponse->transport, getTime, (const uint8_t*)header, (size_t)headerLen, shaping);
+    if (status == HTTPSuccess) {
+        status = HTTPClient_Write(preresponse->transport, getTime, data, len, shaping);
+    }
+    if (status == HTTPSuccess) {
+        status = HTTPClient_Write(preresponse->transport, getTime, (const uint8_t*)"\r\n", 2, shaping);
+    }
+    return status;
+}
+
+// deflates straight into the chunk buffer, a full buffer is sent as a chunk before the output goes on
+static HTTPStatus_t
+preresponse_deflate(lcorehttp_preresponse* preresponse, const uint8_t* data, size_t len, int flush) {
+    z_stream* deflater = preresponse->deflater;
+    uint8_t* payload = preresponse->chunkBuffer + LCOREHTTP_PRERESPONSE_CHUNK_RESERVE;
+    do {
+        uInt slice = len > UINT_MAX ? UINT_MAX : (uInt)len;
+        deflater->next_in = (Bytef*)data;
+        deflater->avail_in = slice;
+        data += slice;
+        len -= slice;
+        int mode = len > 0 ? Z_NO_FLUSH : flush;
+        int result = Z_OK;
+        do {
+            if (preresponse->chunkLen == preresponse->chunkSize) {
+                HTTPStatus_t status = preresponse_send_chunk(preresponse);
+                if (status != HTTPSuccess) {
+                    return status;
+                }
+            }
+            size_t room = preresponse->chunkSize - preresponse->chunkLen;
+            deflater->next_out = payload + preresponse->chunkLen;
+            deflater->avail_out = (uInt)room;
+            result = deflate(deflater, mode);
+            if (result == Z_STREAM_ERROR) {
+                return HTTPInvalidParameter;
+            }
+            preresponse->chunkLen += room - deflater->avail_out;
+        } while (deflater->avail_out == 0 || (mode == Z_FINISH && result != Z_STREAM_END));
+    } while (len > 0);
+    return HTTPSuccess;
+}
+
+HTTPStatus_t
+lcorehttp_preresponse_write(lcorehttp_preresponse* preresponse, const uint8_t* data, size_t len) {
+    if (preresponse->deflater != NULL) {
+        return preresponse_deflate(preresponse, data, len, Z_NO_FLUSH);
+    }
+    if (preresponse->chunked) {
+        return preresponse_write_chunked(preresponse, data, len);
+    }
+    return HTTPClient_Write(preresponse->transport, preresponse->response->getTime, data, len, preresponse->shaping);
+}
+
+// trailer fields may not contain line breaks, they would end the message
+static int
+trailer_is_valid(const char* value, size_t len) {
+    return len > 0 && memchr(value, '\r', len) == NULL && memchr(value, '\n', len) == NULL;
+}
+
+HTTPStatus_t
+lcorehttp_preresponse_finish(lua_State* L, lcorehttp_preresponse* preresponse, int trailersIdx) {
+    if (!preresponse->chunked) {
+        preresponse->finished = 1;
+        return HTTPSuccess;
+    }
+
+    // the last chunk is built first: rejected trailers leave the body open for another finish
+    lcorehttp_bytes last = {0};
+    HTTPStatus_t status = HTTPSuccess;
+    int failed = lcorehttp_bytes_append(&last, "0\r\n", 3) != 0;
+    if (!failed && trailersIdx != 0) {
+        trailersIdx = lua_absindex(L, trailersIdx);
+        lua_pushnil(L);
+        while (!failed && lua_next(L, trailersIdx) != 0) {
+            size_t nameLen = 0;
+            size_t valueLen = 0;
+            const char* name = lua_type(L, -2) == LUA_TSTRING ? lua_tolstring(L, -2, &nameLen) : NULL;
+            const char* value = lua_isstring(L, -1) ? lua_tolstring(L, -1, &valueLen) : NULL;
+            if (name == NULL || value == NULL || !trailer_is_valid(name, nameLen)
+                || (valueLen > 0 && !trailer_is_valid(value, valueLen))) {
+                status = HTTPInvalidParameter;
+                failed = 1;
+            } else {
+                failed = lcorehttp_bytes_append(&last, name, nameLen) != 0
+                         || lcorehttp_bytes_append(&last, ": ", 2) != 0
+                         || lcorehttp_bytes_append(&last, value, valueLen) != 0
+                         || lcorehttp_bytes_append(&last, "\r\n", 2) != 0;
+            }
+            lua_pop(L, 1);
+        }
+        if (failed) {
+            lua_pop(L, 1);
+        }
+    }
+    failed = failed || lcorehttp_bytes_append(&last, "\r\n", 2) != 0;
+    if (failed) {
+        lcorehttp_bytes_free(&last);
+        return status != HTTPSuccess ? status : HTTPInsufficientMemory;
+    }
+
+    preresponse->finished = 1;
+    status = preresponse->deflater != NULL ? preresponse_deflate(preresponse, NULL, 0, Z_FINISH) : HTTPSuccess;
+    preresponse_end_deflate(preresponse);
+    if (status == HTTPSuccess) {
+        status = preresponse_send_chunk(preresponse);
+    }
+    free(preresponse->chunkBuffer);
+    preresponse->chunkBuffer = NULL;
+    if (status == HTTPSuccess) {
+        status = HTTPClient_Write(preresponse->transport, preresponse->response->getTime, last.data, last.len,
+                                  preresponse->shaping);
+    }
+    lcorehttp_bytes_free(&last);
+    return status;
+}
+
+int
+l_corehttp_preresponse_write(lua_State* L) {
+    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
+    size_t len = 0;
+    const char* data = luaL_checklstring(L, 2, &len);
+    if (preresponse->transport == NULL || preresponse->finished) {
+        return push_error(L, "preresponse is closed");
+    }
+    if (lcorehttp_preresponse_write(preresponse, (const uint8_t*)data, len) != HTTPSuccess) {
+        return push_error(L, "failed to write to preresponse");
+    }
+    return 0;
+}
+
+// flush() - sends the buffered data as a chunk now instead of when the chunk is full
+int
+l_corehttp_preresponse_flush(lua_State* L) {
+    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
+    if (preresponse->transport == NULL || preresponse->finished) {
+        return push_error(L, "preresponse is closed");
+    }
+    // a compressed body is flushed to a byte boundary so that the receiver can decode what was sent so far
+    if (preresponse->deflater != NULL && preresponse_deflate(preresponse, NULL, 0, Z_SYNC_FLUSH) != HTTPSuccess) {
+        return push_error(L, "failed to write to preresponse");
+    }
+    if (preresponse->chunked && preresponse_send_chunk(preresponse) != HTTPSuccess) {
+        return push_error(L, "failed to write to preresponse");
+    }
+    return 0;
+}
+
+// finish(trailers?) - ends a chunked body, with trailer fields from the table
+int
+l_corehttp_preresponse_finish(lua_State* L) {
+    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
+    int hasTrailers = !lua_isnoneornil(L, 2);
+    if (hasTrailers) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+    if (preresponse->transport == NULL || preresponse->finished) {
+        return push_error(L, "preresponse is closed");
+    }
+    if (hasTrailers && !preresponse->chunked) {
+        return push_error(L, "trailers require a chunked request");
+    }
+    HTTPStatus_t status = lcorehttp_preresponse_finish(L, preresponse, hasTrailers ? 2 : 0);
+    if (status != HTTPSuccess) {
+        return push_error_status(L, status);
+    }
+    return 0;
+}
+
+int
+l_corehttp_preresponse_gc(lua_State* L) {
+    lcorehttp_preresponse* preresponse = luaL_checkudata(L, 1, LCOREHTTP_PRERESPONSE_METATABLE);
+
+    // the transport is closed by response, only the chunk buffer and deflate stream belong to the preresponse
+    preresponse_end_deflate(preresponse);
+    free(preresponse->chunkBuffer);
+    preresponse->chunkBuffer = NULL;
+    preresponse->chunkLen = 0;
+    preresponse->finished = 1;
+
+    return 0;
+}
+
+int
+l_corehttp_preresponse_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_PRERESPONSE_METATABLE);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_preresponse_write);
+    lua_setfield(L, -2, "write");
+    lua_pushcfunction(L, l_corehttp_preresponse_flush);
+    lua_setfield(L, -2, "flush");
+    lua_pushcfunction(L, l_corehttp_preresponse_finish);
+    lua_setfield(L, -2, "finish");
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_preresponse_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_preresponse_gc);
+    lua_setfield(L, -2, "__close");
+
+    return 0;
+}
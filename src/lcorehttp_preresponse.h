@@ -1,20 +1,47 @@
-
-#ifndef LCOREHTTP_CLIENT_PRERESPONSE_H
-#define LCOREHTTP_CLIENT_PRERESPONSE_H
-
-#include "core_http_client.h"
-#include "extended_core_http_client.h"
-#include "lcorehttp_client.h"
-#include "lua.h"
-
-typedef struct lcorehttp_preresponse {
-    HTTPResponse_t* response;
-    const TransportInterface_t* transport;
-} lcorehttp_preresponse;
-
-#define LCOREHTTP_PRERESPONSE_METATABLE "COREHTTP_PRERESPONSE"
-
-int l_corehttp_preresponse_create_meta(lua_State* L);
-lcorehttp_preresponse* l_corehttp_new_preresponse(lua_State* L);
-
+
+#ifndef LCOREHTTP_CLIENT_PRERESPONSE_H
+#define LCOREHTTP_CLIENT_PRERESPONSE_H
+
+#include <zlib.h>
+#include "core_http_client.h"
+#include "extended_core_http_client.h"
+#include "lcorehttp_client.h"
+#include "lua.h"
+
+typedef struct lcorehttp_preresponse {
+    HTTPResponse_t* response;
+    const TransportInterface_t* transport; // NULL once the request body is complete
+    const lcorehttp_shaping* shaping;      // rate limits of the client
+    int chunked;                           // writes are framed as chunks of Transfer-Encoding: chunked
+    int finished;
+    uint8_t* chunkBuffer; // chunk reserve, chunkSize bytes of payload, CRLF
+    size_t chunkSize;
+    size_t chunkLen;
+    z_stream* deflater; // compress_body: writes are deflated into the chunk buffer
+} lcorehttp_preresponse;
+
+#define LCOREHTTP_PRERESPONSE_METATABLE     "COREHTTP_PRERESPONSE"
+#define LCOREHTTP_PRERESPONSE_CHUNK_SIZE    16384
+#define LCOREHTTP_PRERESPONSE_CHUNK_RESERVE 18 /* room for the hex size and CRLF in front of a chunk */
+
+int l_corehttp_preresponse_create_meta(lua_State* L);
+lcorehttp_preresponse* l_corehttp_new_preresponse(lua_State* L);
+
+// switch to chunked writes buffered in chunkSize blocks, returns -1 when the buffer cannot be allocated
+int lcorehttp_preresponse_start_chunked(lcorehttp_preresponse* preresponse, size_t chunkSize);
+// compress the chunked writes, windowBits selects the zlib (15) or gzip (31) format, returns -1 on failure
+int lcorehttp_preresponse_start_deflate(lcorehttp_preresponse* preresponse, int windowBits);
+// writes data as the body, chunked and compressed according to the mode of the preresponse
+HTTPStatus_t lcorehttp_preresponse_write(lcorehttp_preresponse* preresponse, const uint8_t* data, size_t len);
+
+/**
+ * @brief Complete the request body: flush the buffered chunk and send the last chunk with the trailers of the
+ * table at trailersIdx (0 for none).
+ *
+ * A compressed body ends its stream first. Without chunked mode this only marks the preresponse finished.
+ * Invalid trailers are reported before anything is sent, the body stays open and is still ended by a later
+ * finish.
+ */
+HTTPStatus_t lcorehttp_preresponse_finish(lua_State* L, lcorehttp_preresponse* preresponse, int trailersIdx);
+
 #endif /* LCOREHTTP_CLIENT_PRERESPONSE_H */
\ No newline at end of file
@@ -0,0 +1,40 @@
+#ifndef LCOREHTTP_PROBES_H
+#define LCOREHTTP_PROBES_H
+
+/*
+ * USDT (SystemTap/DTrace compatible) probes on the request lifecycle, provider "lcorehttp".
+ * Compiled in only with LCOREHTTP_USDT and <sys/sdt.h>; an unattached probe is a single nop.
+ *
+ *   connect-start   (host, port, tls)
+ *   connect-end     (host, port, error, duration_us)
+ *   handshake-end   (host, port, error, duration_us)     lss handshakes inside the connect call
+ *   headers-sent    (host, port, header_bytes, body_bytes)
+ *   first-byte      (host, port, ttfb_us)
+ *   headers-parsed  (host, port, http_status, corehttp_status, content_length)
+ *   recv            (host, port, bytes, total_bytes, corehttp_status)
+ *                                                         every transport read of a body, bytes < 0 on failure
+ *   body-read       (host, port, bytes, total_bytes)
+ *   close           (host, port, body_bytes)
+ *
+ * e.g. bpftrace -e 'usdt:./liblcorehttp.so:lcorehttp:first-byte { @[str(arg0)] = hist(arg2); }'
+ */
+#if defined(LCOREHTTP_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LCOREHTTP_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef LCOREHTTP_PROBES_ENABLED
+#define LCOREHTTP_PROBE2(name, a, b)             DTRACE_PROBE2(lcorehttp, name, a, b)
+#define LCOREHTTP_PROBE3(name, a, b, c)          DTRACE_PROBE3(lcorehttp, name, a, b, c)
+#define LCOREHTTP_PROBE4(name, a, b, c, d)       DTRACE_PROBE4(lcorehttp, name, a, b, c, d)
+#define LCOREHTTP_PROBE5(name, a, b, c, d, e)    DTRACE_PROBE5(lcorehttp, name, a, b, c, d, e)
+#else
+#define LCOREHTTP_PROBE2(name, a, b)             ((void)0)
+#define LCOREHTTP_PROBE3(name, a, b, c)          ((void)0)
+#define LCOREHTTP_PROBE4(name, a, b, c, d)       ((void)0)
+#define LCOREHTTP_PROBE5(name, a, b, c, d, e)    ((void)0)
+#endif
+
+#endif /* LCOREHTTP_PROBES_H */
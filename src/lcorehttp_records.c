@@ -0,0 +1,327 @@
+#include "lcorehttp_records.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lcorehttp_body.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_json.h"
+#include "lcorehttp_response.h"
+
+/*
+ * Next line without its terminator. Lines end at LF, with crTerminates also at CR and CRLF (event streams).
+ * A last line without terminator is returned as well, *found is 0 once the body is exhausted.
+ */
+static const char*
+record_next_line(lcorehttp_record_reader* reader, int crTerminates, const uint8_t** line, size_t* len, int* found) {
+    int partial = 0;
+    reader->line.len = 0;
+    *found = 0;
+    while (1) {
+        if (reader->blockPos == reader->blockLen) {
+            if (reader->eof) {
+                if (partial) {
+                    *line = reader->line.data;
+                    *len = reader->line.len;
+                    *found = 1;
+                }
+                return NULL;
+            }
+            const char* error = lcorehttp_body_reader_next(reader->body, &reader->block, &reader->blockLen);
+            if (error != NULL) {
+                return error;
+            }
+            reader->blockPos = 0;
+            reader->eof = reader->blockLen == 0;
+            continue;
+        }
+
+        const uint8_t* start = reader->block + reader->blockPos;
+        size_t available = reader->blockLen - reader->blockPos;
+        if (reader->skipLF) {
+            reader->skipLF = 0;
+            if (start[0] == '\n') {
+                reader->blockPos++;
+                continue;
+            }
+        }
+        const uint8_t* newline = memchr(start, '\n', available);
+        size_t end = newline != NULL ? (size_t)(newline - start) : available;
+        size_t terminator = newline != NULL ? 1 : 0;
+        if (crTerminates) {
+            const uint8_t* cr = memchr(start, '\r', end);
+            if (cr != NULL) {
+                end = (size_t)(cr - start);
+                terminator = 1;
+                if (end + 1 == available) {
+                    reader->skipLF = 1; // the LF of a CRLF may start the next block
+                } else if (start[end + 1] == '\n') {
+                    terminator = 2;
+                }
+            }
+        }
+        if (reader->maxLine != 0 && reader->line.len + end > reader->maxLine) {
+            return "line too long";
+        }
+        if (terminator == 0) {
+            if (lcorehttp_bytes_append(&reader->line, start, available) != 0) {
+                return "out of memory";
+            }
+            partial = 1;
+            reader->blockPos = reader->blockLen;
+            continue;
+        }
+        reader->blockPos += end + terminator;
+        if (!partial) {
+            *line = start; // no copy when the line lies within the block
+            *len = end;
+        } else {
+            if (lcorehttp_bytes_append(&reader->line, start, end) != 0) {
+                return "out of memory";
+            }
+            *line = reader->line.data;
+            *len = reader->line.len;
+        }
+        *found = 1;
+        return NULL;
+    }
+}
+
+static int
+lines_iterator(lua_State* L) {
+    lcorehttp_record_reader* reader = lua_touserdata(L, lua_upvalueindex(3));
+    lua_settop(L, 0);
+    while (1) {
+        const uint8_t* line = NULL;
+        size_t len = 0;
+        int found = 0;
+        const char* error = record_next_line(reader, 0, &line, &len, &found);
+        if (error != NULL) {
+            return luaL_error(L, "%s", error);
+        }
+        if (!found) {
+            lua_pushnil(L);
+            return 1;
+        }
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
+        if (!reader->json) {
+            lua_pushlstring(L, (const char*)line, len);
+            return 1;
+        }
+
+        size_t i = 0;
+        while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+            i++;
+        }
+        if (i == len) {
+            continue; // blank lines between NDJSON records
+        }
+        lcorehttp_json_parser* parser = lua_touserdata(L, lua_upvalueindex(4));
+        lua_pushvalue(L, lua_upvalueindex(5)); // 1: null
+        lcorehttp_json_reset(parser);
+        parser->nullIdx = lua_isnil(L, 1) ? 0 : 1;
+        error = lcorehttp_json_feed(L, parser, line, len);
+        if (error == NULL) {
+            error = lcorehttp_json_finish(L, parser);
+        }
+        if (error != NULL) {
+            return luaL_error(L, "%s", error);
+        }
+        return 1;
+    }
+}
+
+static int
+line_is(const uint8_t* name, size_t nameLen, const char* field) {
+    size_t fieldLen = strlen(field);
+    return nameLen == fieldLen && memcmp(name, field, fieldLen) == 0;
+}
+
+// one `field: value` line of an event stream
+static const char*
+event_field(lcorehttp_record_reader* reader, const uint8_t* line, size_t len) {
+    if (line[0] == ':') {
+        return NULL; // comment
+    }
+    const uint8_t* colon = memchr(line, ':', len);
+    size_t nameLen = colon != NULL ? (size_t)(colon - line) : len;
+    const uint8_t* value = line + len;
+    size_t valueLen = 0;
+    if (colon != NULL) {
+        value = colon + 1;
+        valueLen = len - nameLen - 1;
+        if (valueLen > 0 && value[0] == ' ') {
+            value++;
+            valueLen--;
+        }
+    }
+
+    if (line_is(line, nameLen, "data")) {
+        if (lcorehttp_bytes_append(&reader->data, value, valueLen) != 0
+            || lcorehttp_bytes_append(&reader->data, "\n", 1) != 0) {
+            return "out of memory";
+        }
+    } else if (line_is(line, nameLen, "event")) {
+        reader->eventType.len = 0;
+        if (lcorehttp_bytes_append(&reader->eventType, value, valueLen) != 0) {
+            return "out of memory";
+        }
+    } else if (line_is(line, nameLen, "id")) {
+        if (memchr(value, '\0', valueLen) == NULL) {
+            reader->lastEventId.len = 0;
+            if (lcorehttp_bytes_append(&reader->lastEventId, value, valueLen) != 0) {
+                return "out of memory";
+            }
+            reader->hasLastEventId = 1;
+        }
+    } else if (line_is(line, nameLen, "retry") && valueLen > 0) {
+        lua_Integer retry = 0;
+        for (size_t i = 0; i < valueLen; i++) {
+            if (value[i] < '0' || value[i] > '9' || retry > (LUA_MAXINTEGER - 9) / 10) {
+                return NULL; // ignored as the spec requires
+            }
+            retry = retry * 10 + (value[i] - '0');
+        }
+        reader->retry = retry;
+    }
+    return NULL;
+}
+
+static int
+events_iterator(lua_State* L) {
+    lcorehttp_record_reader* reader = lua_touserdata(L, lua_upvalueindex(3));
+    lua_settop(L, 0);
+    while (1) {
+        const uint8_t* line = NULL;
+        size_t len = 0;
+        int found = 0;
+        const char* error = record_next_line(reader, 1, &line, &len, &found);
+        if (error != NULL) {
+            return luaL_error(L, "%s", error);
+        }
+        if (!found) {
+            lua_pushnil(L); // an event not terminated by an empty line is dropped
+            return 1;
+        }
+        if (len > 0) {
+            error = event_field(reader, line, len);
+            if (error != NULL) {
+                return luaL_error(L, "%s", error);
+            }
+            continue;
+        }
+        if (reader->data.len == 0) {
+            reader->eventType.len = 0;
+            continue;
+        }
+
+        lua_createtable(L, 0, 4);
+        if (reader->eventType.len > 0) {
+            lua_pushlstring(L, (const char*)reader->eventType.data, reader->eventType.len);
+        } else {
+            lua_pushliteral(L, "message");
+        }
+        lua_setfield(L, -2, "event");
+        lua_pushlstring(L, (const char*)reader->data.data, reader->data.len - 1); // without the last LF
+        lua_setfield(L, -2, "data");
+        if (reader->hasLastEventId) {
+            lua_pushlstring(L, (const char*)reader->lastEventId.data, reader->lastEventId.len);
+            lua_setfield(L, -2, "id");
+        }
+        if (reader->retry >= 0) {
+            lua_pushinteger(L, reader->retry);
+            lua_setfield(L, -2, "retry");
+        }
+        reader->data.len = 0;
+        reader->eventType.len = 0;
+        return 1;
+    }
+}
+
+static int
+l_corehttp_record_reader_gc(lua_State* L) {
+    lcorehttp_record_reader* reader = luaL_checkudata(L, 1, LCOREHTTP_RECORD_READER_METATABLE);
+    lcorehttp_bytes_free(&reader->line);
+    lcorehttp_bytes_free(&reader->data);
+    lcorehttp_bytes_free(&reader->eventType);
+    lcorehttp_bytes_free(&reader->lastEventId);
+    return 0;
+}
+
+static lua_Integer
+option_integer(lua_State* L, int optionsIdx, const char* name, lua_Integer defaultValue) {
+    lua_getfield(L, optionsIdx, name);
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0) {
+        defaultValue = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return defaultValue;
+}
+
+/*
+ * Pushes the iterator closure, upvalues: response, body reader, record reader, JSON parser (or nil) and the
+ * value used for JSON null.
+ */
+static int
+push_record_iterator(lua_State* L, lua_CFunction iterator, int allowJson) {
+    luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lua_settop(L, 2);
+    lua_Integer bufferSize = DEFAULT_COREHTTP_BUFFER_SIZE;
+    lua_Integer maxLine = 0;
+    int json = 0;
+    if (lua_istable(L, 2)) {
+        bufferSize = option_integer(L, 2, "buffer_size", bufferSize);
+        maxLine = option_integer(L, 2, "max_line_length", maxLine);
+        if (allowJson) {
+            lua_getfield(L, 2, "json");
+            json = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+        }
+        lua_getfield(L, 2, "null"); // 3
+    } else {
+        lua_pushnil(L);
+    }
+
+    lua_pushvalue(L, 1);
+    lcorehttp_body_reader* body = l_corehttp_new_body_reader(L, 1, (size_t)bufferSize);
+    lcorehttp_record_reader* reader = lua_newuserdatauv(L, sizeof(lcorehttp_record_reader), 0);
+    memset(reader, 0, sizeof(lcorehttp_record_reader));
+    luaL_getmetatable(L, LCOREHTTP_RECORD_READER_METATABLE);
+    lua_setmetatable(L, -2);
+    reader->body = body;
+    reader->json = json;
+    reader->maxLine = (size_t)maxLine;
+    reader->retry = -1;
+    if (json) {
+        l_corehttp_new_json_parser(L, 0, 0);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_pushvalue(L, 3);
+    lua_pushcclosure(L, iterator, 5);
+    return 1;
+}
+
+// lines(options?) - options: json, null, max_line_length, buffer_size
+int
+l_corehttp_response_lines(lua_State* L) {
+    return push_record_iterator(L, lines_iterator, 1);
+}
+
+// events(options?) - options: max_line_length, buffer_size
+int
+l_corehttp_response_events(lua_State* L) {
+    return push_record_iterator(L, events_iterator, 0);
+}
+
+int
+l_corehttp_record_reader_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_RECORD_READER_METATABLE);
+    lua_pushcfunction(L, l_corehttp_record_reader_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushstring(L, LCOREHTTP_RECORD_READER_METATABLE);
+    lua_setfield(L, -2, "__type");
+    return 0;
+}
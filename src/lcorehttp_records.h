@@ -0,0 +1,40 @@
+#ifndef LCOREHTTP_RECORDS_H
+#define LCOREHTTP_RECORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lcorehttp_body.h"
+#include "lua.h"
+
+#define LCOREHTTP_RECORD_READER_METATABLE "COREHTTP_RECORD_READER"
+
+/*
+ * Splits the decoded body into lines. Lines are handed out straight from the body reader's block when they
+ * fit in it, only a line crossing a block boundary is assembled in `line`.
+ */
+typedef struct lcorehttp_record_reader {
+    lcorehttp_body_reader* body;
+    const uint8_t* block;
+    size_t blockLen;
+    size_t blockPos;
+    int eof;
+    int skipLF;     // previous line ended with a CR at the end of a block (events)
+    int json;       // lines are NDJSON records
+    size_t maxLine; // 0 for unlimited
+    lcorehttp_bytes line;
+    // server-sent event fields
+    lcorehttp_bytes data;
+    lcorehttp_bytes eventType;
+    lcorehttp_bytes lastEventId;
+    int hasLastEventId;
+    lua_Integer retry; // last reconnection time announced by the server, -1 if none
+} lcorehttp_record_reader;
+
+// response:lines(options?) -> iterator
+int l_corehttp_response_lines(lua_State* L);
+// response:events(options?) -> iterator
+int l_corehttp_response_events(lua_State* L);
+
+int l_corehttp_record_reader_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_RECORDS_H */
@@ -0,0 +1,352 @@
+#include "lcorehttp_redirect.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "lcorehttp_body.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_limits.h"
+#include "lcorehttp_response.h"
+#include "lcorehttp_shaping.h"
+#include "lcorehttp_tls.h"
+#include "lerror.h"
+
+#define DRAIN_BUFFER_SIZE 4096
+
+typedef struct redirect_target {
+    lss_connection_kind kind;
+    int port;
+    int sameOrigin;
+} redirect_target;
+
+static int
+is_redirect(uint16_t statusCode) {
+    return statusCode == 301 || statusCode == 302 || statusCode == 303 || statusCode == 307 || statusCode == 308;
+}
+
+// parses scheme-less authority "host[:port]" or "[v6]:port" up to the path, pushes host
+static int
+push_authority(lua_State* L, const char* authority, size_t len, redirect_target* target) {
+    const char* at = memchr(authority, '@', len); // userinfo is never forwarded
+    if (at != NULL) {
+        len -= (size_t)(at + 1 - authority);
+        authority = at + 1;
+    }
+    const char* host = authority;
+    size_t hostLen = len;
+    const char* port = NULL;
+    if (len > 0 && authority[0] == '[') {
+        const char* close = memchr(authority, ']', len);
+        if (close == NULL) {
+            return -1;
+        }
+        host = authority + 1;
+        hostLen = (size_t)(close - host);
+        if (close + 1 < authority + len && close[1] == ':') {
+            port = close + 2;
+        }
+    } else {
+        const char* colon = memchr(authority, ':', len);
+        if (colon != NULL) {
+            hostLen = (size_t)(colon - authority);
+            port = colon + 1;
+        }
+    }
+    if (hostLen == 0) {
+        return -1;
+    }
+    if (port != NULL && port < authority + len) {
+        int value = 0;
+        for (const char* p = port; p < authority + len; p++) {
+            if (*p < '0' || *p > '9' || (value = value * 10 + (*p - '0')) > 65535) {
+                return -1;
+            }
+        }
+        target->port = value;
+    }
+    lua_pushlstring(L, host, hostLen);
+    return 0;
+}
+
+/*
+ * Resolves Location against the current request, pushes host and path.
+ * Absolute and scheme-relative URLs carry their own authority, "/path" and relative references stay on the
+ * current origin (dot segments are left to the server).
+ */
+static int
+push_location(lua_State* L, const lcorehttp_client* client, const char* currentPath, const char* location,
+              size_t len, redirect_target* target) {
+    const char* fragment = memchr(location, '#', len);
+    if (fragment != NULL) {
+        len = (size_t)(fragment - location);
+    }
+    target->kind = client->kind;
+    target->port = client->portno;
+
+    const char* authority = NULL;
+    if (len >= 7 && strncasecmp(location, "http://", 7) == 0) {
+        target->kind = LSS_CONNECTION_KIND_PLAINTEXT;
+        target->port = HTTP_PORT;
+        authority = location + 7;
+    } else if (len >= 8 && strncasecmp(location, "https://", 8) == 0) {
+        target->kind = LSS_CONNECTION_KIND_TLS;
+        target->port = HTTPS_PORT;
+        authority = location + 8;
+    } else if (len >= 2 && location[0] == '/' && location[1] == '/') {
+        authority = location + 2;
+    }
+
+    if (authority != NULL) {
+        const char* end = location + len;
+        const char* path = authority;
+        while (path < end && *path != '/' && *path != '?') {
+            path++;
+        }
+        if (push_authority(L, authority, (size_t)(path - authority), target) != 0) {
+            return -1;
+        }
+        luaL_Buffer buffer;
+        luaL_buffinit(L, &buffer);
+        if (path == end || *path == '?') {
+            luaL_addchar(&buffer, '/');
+        }
+        luaL_addlstring(&buffer, path, (size_t)(end - path));
+        luaL_pushresult(&buffer);
+        target->sameOrigin = target->kind == client->kind && target->port == client->portno
+                             && strcasecmp(lua_tostring(L, -2), client->hostname) == 0;
+        return 0;
+    }
+
+    lua_pushstring(L, client->hostname);
+    target->sameOrigin = 1;
+    if (len > 0 && location[0] == '/') {
+        lua_pushlstring(L, location, len);
+        return 0;
+    }
+    // relative reference, replaces the last segment of the current path
+    size_t baseLen = strcspn(currentPath, "?");
+    while (baseLen > 0 && currentPath[baseLen - 1] != '/') {
+        baseLen--;
+    }
+    luaL_Buffer buffer;
+    luaL_buffinit(L, &buffer);
+    if (baseLen == 0) {
+        luaL_addchar(&buffer, '/');
+    } else {
+        luaL_addlstring(&buffer, currentPath, baseLen);
+    }
+    luaL_addlstring(&buffer, location, len);
+    luaL_pushresult(&buffer);
+    return 0;
+}
+
+static int
+is_dropped_header(const char* name, int dropBody, int crossOrigin) {
+    if (dropBody
+        && (strcasecmp(name, "content-length") == 0 || strcasecmp(name, "content-type") == 0
+            || strcasecmp(name, "transfer-encoding") == 0)) {
+        return 1;
+    }
+    return crossOrigin
+           && (strcasecmp(name, "authorization") == 0 || strcasecmp(name, "proxy-authorization") == 0
+               || strcasecmp(name, "cookie") == 0 || strcasecmp(name, "host") == 0);
+}
+
+// pushes a copy of the request options for the next hop (nil without options)
+static void
+push_hop_options(lua_State* L, int optionsIdx, int dropBody, int crossOrigin) {
+    if (!lua_istable(L, optionsIdx)) {
+        lua_pushnil(L);
+        return;
+    }
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, optionsIdx) != 0) {
+        const char* key = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "";
+        if (dropBody && (strcmp(key, "body") == 0 || strcmp(key, "write_body_hook") == 0)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if (strcmp(key, "headers") == 0 && lua_istable(L, -1)) {
+            int headersIdx = lua_gettop(L);
+            lua_newtable(L);
+            lua_pushnil(L);
+            while (lua_next(L, headersIdx) != 0) {
+                const char* name = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "";
+                if (!is_dropped_header(name, dropBody, crossOrigin)) {
+                    lua_pushvalue(L, -2);
+                    lua_insert(L, -2);
+                    lua_rawset(L, -4);
+                } else {
+                    lua_pop(L, 1);
+                }
+            }
+            lua_remove(L, headersIdx);
+        }
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+}
+
+// reads what is left of a small redirect body, returns the connection when it can carry the next request
+static TransportInterface_t*
+take_connection(lcorehttp_response* response, int isHead) {
+    if (response->transport == NULL) {
+        return NULL;
+    }
+    if (isHead) {
+        response->bodyComplete = 1; // no body follows a HEAD response
+    } else {
+        uint8_t buffer[DRAIN_BUFFER_SIZE];
+        lcorehttp_dechunker dechunker = LCOREHTTP_DECHUNKER_INIT;
+        while (!response->bodyComplete && response->bodyBytesRead < LCOREHTTP_REDIRECT_MAXIMUM_DRAIN) {
+            size_t bytesRead = 0;
+            if (l_corehttp_response_read_internal(response, buffer, sizeof(buffer), &bytesRead) != 0
+                || bytesRead == 0) {
+                break;
+            }
+            if (response->isChunked) {
+                if (lcorehttp_dechunk(&dechunker, buffer, bytesRead) == (size_t)-1) {
+                    break;
+                }
+                if (dechunker.state == DECHUNK_DONE) {
+                    response->bodyComplete =
+                        dechunker.excess == 0 && response->cachedBodyRead >= response->response.bodyLen;
+                    break;
+                }
+            }
+        }
+    }
+    if (!l_corehttp_response_reusable(response)) {
+        return NULL;
+    }
+    TransportInterface_t* transport = (TransportInterface_t*)response->transport;
+    response->transport = NULL;
+    return transport;
+}
+
+/*
+ * Replaces the client at index 1 with a new one for the target origin. It shares the body limits, memory budget
+ * and rate limits of the current client, and its tls_config (early data included) when both origins are https,
+ * so that a cross-origin hop runs under the same safety limits.
+ */
+static int
+replace_client(lua_State* L, const lcorehttp_client* client, const redirect_target* target, int hostIdx) {
+    lua_pushcfunction(L, l_corehttp_newclient);
+    lua_pushstring(L, target->kind == LSS_CONNECTION_KIND_TLS ? "https" : "http");
+    lua_pushvalue(L, hostIdx);
+    lua_pushinteger(L, target->port);
+    if (lua_pcall(L, 3, 1, 0) != LUA_OK) {
+        return -1;
+    }
+    lcorehttp_client* redirectClient = (lcorehttp_client*)lua_touserdata(L, -1);
+    redirectClient->limits = client->limits;
+    lcorehttp_memory_budget_retain(client->budget);
+    redirectClient->budget = client->budget;
+    lcorehttp_shaping_retain(&client->shaping);
+    redirectClient->shaping = client->shaping;
+    if (target->kind == LSS_CONNECTION_KIND_TLS && client->tls != NULL) {
+        lcorehttp_tls_config_retain(client->tls);
+        redirectClient->tls = client->tls;
+    }
+    // socket options need a native connector: plaintext, or TLS through the tls_config carried over
+    if (target->kind == LSS_CONNECTION_KIND_PLAINTEXT || redirectClient->tls != NULL) {
+        redirectClient->socketOptions = client->socketOptions;
+        redirectClient->socketOptions.ioUring = client->socketOptions.ioUring
+                                                && target->kind == LSS_CONNECTION_KIND_PLAINTEXT;
+    }
+    lua_replace(L, 1);
+    return 0;
+}
+
+int
+corehttp_client_follow_redirects(lua_State* L, int maxRedirects, uint64_t requestStart) {
+    for (int hop = 0; hop < maxRedirects; hop++) {
+        int responseIdx = lua_gettop(L);
+        lcorehttp_response* response = (lcorehttp_response*)luaL_checkudata(L, responseIdx,
+                                                                            LCOREHTTP_RESPONSE_METATABLE);
+        if (!is_redirect(response->response.statusCode)) {
+            return 1;
+        }
+        lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+        lua_getiuservalue(L, responseIdx, 1);
+        lua_getfield(L, -1, "Location"); // headers lookup is case-insensitive
+        size_t locationLen = 0;
+        const char* location = lua_tolstring(L, -1, &locationLen);
+        if (location == NULL || locationLen == 0) {
+            lua_settop(L, responseIdx);
+            return 1; // nothing to follow, hand the 3xx to the caller
+        }
+
+        const char* method = lua_tostring(L, 3);
+        uint16_t statusCode = response->response.statusCode;
+        int isHead = strcmp(method, "HEAD") == 0;
+        int dropBody = (statusCode == 303 && !isHead)
+                       || ((statusCode == 301 || statusCode == 302) && strcmp(method, "POST") == 0);
+        int hasBodyHook = 0;
+        if (lua_istable(L, 4)) {
+            lua_getfield(L, 4, "write_body_hook");
+            hasBodyHook = lua_isfunction(L, -1);
+            lua_pop(L, 1);
+        }
+        if (hasBodyHook && !dropBody) {
+            lua_settop(L, responseIdx);
+            return 1; // a streamed body can not be sent again
+        }
+
+        redirect_target target = {0};
+        if (push_location(L, client, lua_tostring(L, 2), location, locationLen, &target) != 0) {
+            lua_settop(L, responseIdx);
+            return push_error(L, "invalid redirect location");
+        }
+        int hostIdx = lua_gettop(L) - 1;
+        int pathIdx = hostIdx + 1;
+
+        TransportInterface_t* transport = target.sameOrigin ? take_connection(response, isHead) : NULL;
+        if (luaL_callmeta(L, responseIdx, "__close")) {
+            lua_pop(L, 1);
+        }
+
+        if (!target.sameOrigin && replace_client(L, client, &target, hostIdx) != 0) {
+            return push_error(L, lua_tostring(L, -1));
+        }
+        push_hop_options(L, 4, dropBody, !target.sameOrigin);
+        lua_replace(L, 4);
+        lua_pushvalue(L, pathIdx);
+        lua_replace(L, 2);
+        if (dropBody) {
+            lua_pushliteral(L, "GET");
+            lua_replace(L, 3);
+        }
+        lua_settop(L, 4);
+
+        client = (lcorehttp_client*)lua_touserdata(L, 1);
+        HTTPRequestHeaders_t requestHeaders = {0};
+        uint32_t requestFlags = 0;
+        int resultCount = initializeRequestHeaders(L, client, &requestHeaders, &requestFlags);
+        if (resultCount != 0) {
+            if (transport != NULL) {
+                lcorehttp_pool_release(client, transport, 1, 0);
+            }
+            free(requestHeaders.pBuffer);
+            return resultCount;
+        }
+        size_t bodyLen = 0;
+        const uint8_t* body = NULL;
+        if (lua_istable(L, 4)) {
+            lua_getfield(L, 4, "body");
+            if (lua_isstring(L, -1)) {
+                body = (const uint8_t*)lua_tolstring(L, -1, &bodyLen);
+            }
+            lua_pop(L, 1); // still referenced by the options table
+        }
+        resultCount = corehttp_client_perform(L, client, 1, 4, requestHeaders, requestFlags, body, bodyLen, 0,
+                                              requestStart, transport);
+        if (resultCount != 1) {
+            return resultCount;
+        }
+    }
+    return 1;
+}
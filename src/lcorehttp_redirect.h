@@ -0,0 +1,22 @@
+#ifndef LCOREHTTP_REDIRECT_H
+#define LCOREHTTP_REDIRECT_H
+
+#include <stdint.h>
+#include "lua.h"
+
+#define LCOREHTTP_REDIRECT_MAXIMUM       20
+#define LCOREHTTP_REDIRECT_MAXIMUM_DRAIN 65536 /* larger redirect bodies are not worth keeping the connection */
+
+/**
+ * @brief Follow up to maxRedirects 301/302/303/307/308 responses of client:request.
+ *
+ * Expects the request arguments (client, path, method, options) at stack indices 1..4 and the response on top;
+ * they are replaced by those of every hop. 303 (and 301/302 after POST) continue as GET without body, 307/308
+ * repeat method and body. A same-origin hop drains the redirect body and keeps using its connection, a
+ * cross-origin hop opens a new client sharing the limits of the current one and drops credentials.
+ *
+ * @return Number of values pushed on the stack: the final response or error values.
+ */
+int corehttp_client_follow_redirects(lua_State* L, int maxRedirects, uint64_t requestStart);
+
+#endif /* LCOREHTTP_REDIRECT_H */
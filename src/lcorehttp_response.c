@@ -1,640 +1,888 @@
-#include "lcorehttp_response.h"
-#include <assert.h>
-#include <lauxlib.h>
-#include <lua.h>
-#include <lualib.h>
-#include <stdlib.h>
-#include <string.h>
-#include <zlib.h>
-#include "lcorehttp_time.h"
-#include "lerror.h"
-#include "llhttp.h"
-#include "lss_transport.h"
-
-#define MINIMUM_CHUNK_BUFFER_SIZE 512
-
-lcorehttp_response*
-l_corehttp_new_response(lua_State* L) {
-    lcorehttp_response* response = lua_newuserdatauv(L, sizeof(lcorehttp_response), 1);
-    if (response == NULL) {
-        return NULL;
-    }
-    luaL_getmetatable(L, LCOREHTTP_RESPONSE_METATABLE);
-    lua_setmetatable(L, -2);
-    memset(response, 0, sizeof(lcorehttp_response));
-    response->response.getTime = l_corehttp_get_time_ms;
-    response->contentLength = -1;
-    response->cachedBodyRead = 0;
-    return response;
-}
-
-static void
-l_corehttp_get_headers_table(lua_State* L, int idx) {
-    lua_getiuservalue(L, idx, 1);
-    if (lua_istable(L, -1)) {
-        return;
-    }
-    lua_pop(L, 1);
-    lua_newtable(L);
-    lua_pushvalue(L, -1);
-    lua_setiuservalue(L, idx, 1);
-}
-
-int
-l_corehttp_response_headers(lua_State* L) {
-    luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    l_corehttp_get_headers_table(L, 1);
-    return 1;
-}
-
-int
-l_corehttp_response_gc(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    if (response->transport != NULL) {
-        lss_close(response->transport->pNetworkContext);
-        free((void*)response->transport);
-        response->transport = NULL;
-    }
-
-    return 0;
-}
-
-int
-l_corehttp_response_tostring(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    if (response->isChunked) {
-        lua_pushfstring(L, "%p (chunked)", LCOREHTTP_RESPONSE_METATABLE);
-        return 1;
-    }
-    lua_pushfstring(L, "%p (%d bytes)", LCOREHTTP_RESPONSE_METATABLE, response->contentLength);
-    return 1;
-}
-
-int
-l_corehttp_response_status(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    lua_pushstring(L, response->strStatus);
-    return 1;
-}
-
-int
-l_corehttp_response_status_code(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    lua_pushinteger(L, response->status);
-    return 1;
-}
-
-int
-l_corehttp_response_http_status_code(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    lua_pushinteger(L, response->response.statusCode);
-    return 1;
-}
-
-typedef struct {
-    z_stream strm;
-    int initialized;
-} l_zstream_ud;
-
-static int
-l_zstream_gc(lua_State* L) {
-    l_zstream_ud* ud = (l_zstream_ud*)lua_touserdata(L, 1);
-    if (ud->initialized) {
-        inflateEnd(&ud->strm);
-        ud->initialized = 0;
-    }
-    return 0;
-}
-
-static z_stream*
-create_auto_zstream(lua_State* L, int windowBits) {
-    l_zstream_ud* ud = (l_zstream_ud*)lua_newuserdatauv(L, sizeof(l_zstream_ud), 0);
-    memset(ud, 0, sizeof(l_zstream_ud));
-
-    if (luaL_newmetatable(L, "l_corehttp_zstream_mt")) {
-        lua_pushcfunction(L, l_zstream_gc);
-        lua_setfield(L, -2, "__gc");
-    }
-    lua_setmetatable(L, -2);
-
-    if (inflateInit2(&ud->strm, windowBits) != Z_OK) {
-        lua_pop(L, 1);
-        return NULL;
-    }
-    ud->initialized = 1;
-    return &ud->strm;
-}
-
-// Helper to detect Content-Encoding from response headers
-static int
-l_corehttp_get_encoding_mode(lua_State* L, int respIdx) {
-    int mode = 0; // 0: none, 1: gzip, 2: deflate
-
-    l_corehttp_get_headers_table(L, respIdx);
-
-    lua_pushstring(L, "Content-Encoding");
-    lua_gettable(L, -2);
-    if (lua_isstring(L, -1)) {
-        const char* enc = lua_tostring(L, -1);
-        if (strcmp(enc, "gzip") == 0) {
-            mode = 1;
-        } else if (strcmp(enc, "deflate") == 0) {
-            mode = 2;
-        }
-    }
-    lua_pop(L, 2); // pop value and headers table
-    return mode;
-}
-
-// --- Internal Reader ---
-// Handles reading from internal cache and network transport
-static int
-l_corehttp_response_read_internal(lcorehttp_response* response, uint8_t* buffer, size_t bufferLen,
-                                  size_t* outBytesRead) {
-    *outBytesRead = 0;
-
-    // No Content
-    if (response->contentLength == 0 && !response->isChunked) {
-        return 0;
-    }
-
-    // Read from Cache (pre-fetched body during header parsing)
-    if (response->cachedBodyRead < response->response.bodyLen) {
-        const uint8_t* pBody = (const uint8_t*)response->response.pBody;
-        size_t available = response->response.bodyLen - response->cachedBodyRead;
-
-        size_t toCopy = (available > bufferLen) ? bufferLen : available;
-        memcpy(buffer, pBody + response->cachedBodyRead, toCopy);
-
-        response->cachedBodyRead += toCopy;
-        *outBytesRead = toCopy;
-        return 0;
-    }
-
-    // Read from Network
-    HTTPStatus_t status = HTTPClient_Read(response->transport, &response->response, buffer, bufferLen, outBytesRead);
-    if (status != HTTPSuccess) {
-        return -1;
-    }
-    return 0;
-}
-
-// Raw Read
-// read(buffer_size?)
-int
-l_corehttp_response_read(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-
-    lua_Integer reqLen = luaL_optinteger(L, 2, DEFAULT_COREHTTP_BUFFER_SIZE);
-    if (reqLen <= 0) {
-        return 0;
-    }
-
-    luaL_Buffer b;
-    luaL_buffinit(L, &b);
-
-    // Prep buffer directly in Lua string builder
-    uint8_t* buffer = (uint8_t*)luaL_prepbuffsize(&b, (size_t)reqLen);
-    size_t bytesRead = 0;
-
-    if (l_corehttp_response_read_internal(response, buffer, (size_t)reqLen, &bytesRead) != 0) {
-        return push_error(L, "failed to read response body");
-    }
-
-    luaL_addsize(&b, bytesRead);
-    luaL_pushresult(&b);           // Return string
-    lua_pushinteger(L, bytesRead); // Return count
-    return 2;
-}
-
-// Content Read
-// read_content(write_cb?, progress_cb?, buffer_size?)
-int
-l_corehttp_response_read_content(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-
-    int hasWriteFunc = lua_isfunction(L, 2);
-    int hasProgressFunc = lua_isfunction(L, 3);
-
-    lua_Integer cap = luaL_optinteger(L, 4, DEFAULT_COREHTTP_BUFFER_SIZE);
-    size_t bufferCapacity = (cap > 0) ? (size_t)cap : DEFAULT_COREHTTP_BUFFER_SIZE;
-
-    int inflateMode = l_corehttp_get_encoding_mode(L, 1);
-    size_t contentLength = response->contentLength;
-    size_t totalBytesRead = 0;
-
-    // Buffer Allocation (GC managed)
-    uint8_t* buffer = (uint8_t*)lua_newuserdatauv(L, bufferCapacity, 0);
-    uint8_t* outBuffer = NULL;
-
-    z_stream* strm = NULL;
-    if (inflateMode) {
-        int windowBits = (inflateMode == 1) ? 31 : 15;
-        strm = create_auto_zstream(L, windowBits); // Pushes userdata on stack
-        if (!strm) {
-            return luaL_error(L, "failed to initialize zlib");
-        }
-        outBuffer = (uint8_t*)lua_newuserdatauv(L, bufferCapacity, 0);
-    }
-
-    luaL_Buffer b;
-    if (!hasWriteFunc) {
-        luaL_buffinit(L, &b);
-    }
-
-    int status = 0;
-
-    while (1) {
-        // Calculate read size
-        size_t toRead = bufferCapacity;
-        if (contentLength != (size_t)-1) {
-            size_t remaining = contentLength - totalBytesRead;
-            if (remaining == 0) {
-                break;
-            }
-            if (remaining < toRead) {
-                toRead = remaining;
-            }
-        }
-
-        size_t bytesRead = 0;
-        int ret = l_corehttp_response_read_internal(response, buffer, toRead, &bytesRead);
-
-        if (ret != 0) {
-            status = -1;
-            break;
-        }
-        if (bytesRead == 0) {
-            break; // EOF
-        }
-
-        totalBytesRead += bytesRead;
-
-        // Progress Callback
-        if (hasProgressFunc) {
-            lua_pushvalue(L, 3);
-            lua_pushinteger(L, (contentLength != (size_t)-1) ? (lua_Integer)contentLength : -1);
-            lua_pushinteger(L, totalBytesRead);
-            lua_call(L, 2, 0);
-        }
-
-        // Process Data
-        if (inflateMode) {
-            strm->next_in = (Bytef*)buffer;
-            strm->avail_in = bytesRead;
-            while (strm->avail_in > 0) {
-                strm->next_out = outBuffer;
-                strm->avail_out = bufferCapacity;
-                int zRet = inflate(strm, Z_NO_FLUSH);
-
-                if (zRet != Z_OK && zRet != Z_STREAM_END) {
-                    status = -2;
-                    break;
-                }
-
-                size_t have = bufferCapacity - strm->avail_out;
-                if (have > 0) {
-                    if (hasWriteFunc) {
-                        lua_pushvalue(L, 2);
-                        lua_pushlstring(L, (const char*)outBuffer, have);
-                        lua_call(L, 1, 0);
-                    } else {
-                        luaL_addlstring(&b, (const char*)outBuffer, have);
-                    }
-                }
-                if (status == -2 || zRet == Z_STREAM_END) {
-                    break;
-                }
-            }
-            if (status != 0) {
-                break;
-            }
-        } else {
-            if (hasWriteFunc) {
-                lua_pushvalue(L, 2);
-                lua_pushlstring(L, (const char*)buffer, bytesRead);
-                lua_call(L, 1, 0);
-            } else {
-                luaL_addlstring(&b, (const char*)buffer, bytesRead);
-            }
-        }
-
-        if (contentLength != (size_t)-1 && totalBytesRead >= contentLength) {
-            break;
-        }
-    }
-
-    if (status == -2) {
-        return luaL_error(L, "inflate error");
-    }
-    if (status == -1) {
-        return luaL_error(L, "network error");
-    }
-
-    if (contentLength != (size_t)-1 && contentLength > 0 && totalBytesRead < contentLength) {
-        return luaL_error(L, "incomplete read: expected %I bytes, got %I", (lua_Integer)contentLength,
-                          (lua_Integer)totalBytesRead);
-    }
-
-    if (!hasWriteFunc) {
-        luaL_pushresult(&b);
-    } else {
-        lua_pushinteger(L, totalBytesRead);
-    }
-
-    return 1;
-}
-
-// Chunked Read
-// read_chunked_content(write_cb?, progress_cb?, buffer_size?)
-
-int
-l_corehttp_response_read_chunked_content(lua_State* L) {
-    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
-    int hasWriteFunc = lua_isfunction(L, 2);
-    int hasProgressFunc = lua_isfunction(L, 3);
-
-    lua_Integer cap = luaL_optinteger(L, 4, DEFAULT_COREHTTP_BUFFER_SIZE);
-    size_t bufferCapacity = (cap >= MINIMUM_CHUNK_BUFFER_SIZE) ? (size_t)cap : MINIMUM_CHUNK_BUFFER_SIZE;
-
-    int inflateMode = l_corehttp_get_encoding_mode(L, 1);
-    uint8_t* buffer = (uint8_t*)lua_newuserdatauv(L, bufferCapacity, 0);
-    uint8_t* outBuffer = NULL;
-
-    z_stream* strm = NULL;
-    if (inflateMode) {
-        int windowBits = (inflateMode == 1) ? 31 : 15;
-        strm = create_auto_zstream(L, windowBits);
-        if (!strm) {
-            return luaL_error(L, "failed to initialize zlib");
-        }
-        outBuffer = (uint8_t*)lua_newuserdatauv(L, bufferCapacity, 0);
-    }
-
-    luaL_Buffer b;
-    if (!hasWriteFunc) {
-        luaL_buffinit(L, &b);
-    }
-
-    // State Machine: 0=Header, 1=Data, 2=Trailing CRLF
-    int state = 0;
-    size_t chunkBytesRemaining = 0;
-    size_t totalBytesRead = 0;
-    size_t cacheLen = 0;
-    size_t cacheOff = 0;
-    int zlibStreamEnded = 0;
-    int done = 0;
-
-    while (!done) {
-        size_t available = cacheLen - cacheOff;
-        uint8_t* p = buffer + cacheOff;
-        int madeProgress = 0;
-
-        // ATTEMPT TO PARSE
-        if (state == 0) { // Chunk Header
-            uint8_t* lf = memchr(p, '\n', available);
-            if (lf) {
-                size_t lineLen = lf - p + 1;
-
-                char lenStr[32];
-                size_t hexLen = 0;
-                for (size_t i = 0; i < lineLen; i++) {
-                    if (p[i] == ';' || p[i] == '\r' || p[i] == '\n') {
-                        break;
-                    }
-                    if (hexLen < 31) {
-                        lenStr[hexLen++] = p[i];
-                    }
-                }
-                lenStr[hexLen] = 0;
-
-                if (hexLen == 0) {
-                    return luaL_error(L, "invalid chunk header");
-                }
-
-                char* endPtr;
-                unsigned long sz = strtoul(lenStr, &endPtr, 16);
-                if (*endPtr != 0) {
-                    return push_error(L, "invalid chunk size syntax");
-                }
-
-                chunkBytesRemaining = sz;
-                cacheOff += lineLen;
-
-                if (sz == 0) {
-                    done = 1;
-                } else {
-                    state = 1;
-                }
-                madeProgress = 1;
-            } else {
-                if (available == bufferCapacity) {
-                    return luaL_error(L, "chunk header too long");
-                }
-            }
-
-        } else if (state == 1) { // Chunk Data
-            size_t toProcess = (available < chunkBytesRemaining) ? available : chunkBytesRemaining;
-
-            if (toProcess > 0) {
-                if (inflateMode && !zlibStreamEnded) {
-                    strm->next_in = (Bytef*)p;
-                    strm->avail_in = toProcess;
-                    while (strm->avail_in > 0) {
-                        strm->next_out = outBuffer;
-                        strm->avail_out = bufferCapacity;
-                        int zRet = inflate(strm, Z_NO_FLUSH);
-
-                        if (zRet != Z_OK && zRet != Z_STREAM_END) {
-                            return luaL_error(L, "inflate error: %d", zRet);
-                        }
-
-                        // Write output FIRST, before any break conditions
-                        size_t have = bufferCapacity - strm->avail_out;
-                        if (have > 0) {
-                            if (hasWriteFunc) {
-                                lua_pushvalue(L, 2);
-                                lua_pushlstring(L, (const char*)outBuffer, have);
-                                lua_call(L, 1, 0);
-                            } else {
-                                luaL_addlstring(&b, (const char*)outBuffer, have);
-                            }
-                        }
-
-                        // Now check break conditions
-                        if (zRet == Z_STREAM_END) {
-                            zlibStreamEnded = 1;
-                            toProcess -= strm->avail_in;
-                            break;
-                        }
-
-                        if (have == 0 && zRet == Z_OK) {
-                            toProcess -= strm->avail_in;
-                            break;
-                        }
-                    }
-                } else {
-                    if (hasWriteFunc) {
-                        lua_pushvalue(L, 2);
-                        lua_pushlstring(L, (const char*)p, toProcess);
-                        lua_call(L, 1, 0);
-                    } else {
-                        luaL_addlstring(&b, (const char*)p, toProcess);
-                    }
-                }
-
-                totalBytesRead += toProcess;
-                chunkBytesRemaining -= toProcess;
-                cacheOff += toProcess;
-
-                if (hasProgressFunc) {
-                    lua_pushvalue(L, 3);
-                    lua_pushinteger(L, -1); // Unknown total for chunked
-                    lua_pushinteger(L, totalBytesRead);
-                    lua_call(L, 2, 0);
-                }
-
-                if (chunkBytesRemaining == 0) {
-                    state = 2;
-                }
-                madeProgress = 1;
-            }
-
-        } else if (state == 2) { // Trailing CRLF
-            if (available >= 2) {
-                if (p[0] != '\r' || p[1] != '\n') {
-                    return luaL_error(L, "expected CRLF after chunk");
-                }
-                cacheOff += 2;
-                state = 0;
-                madeProgress = 1;
-            }
-        }
-
-        if (madeProgress) {
-            continue;
-        }
-
-        if (done) {
-            break;
-        }
-
-        // --- NETWORK READ ---
-        // Compact buffer first
-        if (cacheOff > 0) {
-            size_t remaining = cacheLen - cacheOff;
-            if (remaining > 0) {
-                memmove(buffer, buffer + cacheOff, remaining);
-            }
-            cacheLen = remaining;
-            cacheOff = 0;
-        }
-
-        // Calculate how much we NEED to read (not the whole buffer!)
-        size_t bytesNeeded = 0;
-        if (state == 0) {
-            // Header: Minimum is "0\r\n" = 3 bytes
-            bytesNeeded = 3;
-        } else if (state == 1) {
-            // Data: We need the remaining chunk bytes + 2 for CRLF + 5 for next header ("0\r\n" = 3, typical = 5)
-            bytesNeeded = chunkBytesRemaining + 5;
-        } else if (state == 2) {
-            // CRLF: We need exactly 2 bytes
-            bytesNeeded = 2;
-        }
-
-        // Don't read more than we have space for
-        size_t spaceAvailable = bufferCapacity - cacheLen;
-        size_t toRead = (bytesNeeded < spaceAvailable) ? bytesNeeded : spaceAvailable;
-
-        // Ensure we read at least 1 byte
-        if (toRead == 0) {
-            toRead = 1;
-        }
-
-        size_t readAmt = 0;
-        int ret = l_corehttp_response_read_internal(response, buffer + cacheLen, toRead, &readAmt);
-        if (ret != 0) {
-            return luaL_error(L, "network error: %d", ret);
-        }
-
-        if (readAmt == 0) {
-            return luaL_error(L, "unexpected EOF");
-        }
-
-        cacheLen += readAmt;
-    }
-
-    if (!hasWriteFunc) {
-        luaL_pushresult(&b);
-    } else {
-        lua_pushinteger(L, totalBytesRead);
-    }
-
-    return 1;
-}
-
-int
-l_corehttp_response_create_meta(lua_State* L) {
-    luaL_newmetatable(L, LCOREHTTP_RESPONSE_METATABLE);
-    /* Metamethods */
-    lua_newtable(L);
-    lua_pushcfunction(L, l_corehttp_response_tostring);
-    lua_setfield(L, -2, "__tostring");
-    lua_pushcfunction(L, l_corehttp_response_headers);
-    lua_setfield(L, -2, "headers");
-    lua_pushcfunction(L, l_corehttp_response_status);
-    lua_setfield(L, -2, "status");
-    lua_pushcfunction(L, l_corehttp_response_status_code);
-    lua_setfield(L, -2, "status_code");
-    lua_pushcfunction(L, l_corehttp_response_http_status_code);
-    lua_setfield(L, -2, "http_status_code");
-    lua_pushcfunction(L, l_corehttp_response_read);
-    lua_setfield(L, -2, "read");
-    lua_pushcfunction(L, l_corehttp_response_read_content);
-    lua_setfield(L, -2, "read_content");
-    lua_pushcfunction(L, l_corehttp_response_read_chunked_content);
-    lua_setfield(L, -2, "read_chunked_content");
-    lua_pushstring(L, LCOREHTTP_RESPONSE_METATABLE);
-    lua_setfield(L, -2, "__type");
-    /* Metamethods */
-    lua_setfield(L, -2, "__index");
-
-    lua_pushcfunction(L, l_corehttp_response_gc);
-    lua_setfield(L, -2, "__gc");
-    lua_pushcfunction(L, l_corehttp_response_gc);
-    lua_setfield(L, -2, "__close");
-
-    return 0;
-}
-
-int
-l_corehttp_response_headers_get(lua_State* L) {
-    if (!lua_istable(L, 1)) {
-        return 0;
-    }
-    const char* headerName = luaL_checkstring(L, 2);
-
-    lua_pushnil(L);
-    while (lua_next(L, 1) != 0) {
-        const char* key = lua_tostring(L, -2);
-        if (strcasecmp(key, headerName) == 0) {
-            return 1;
-        }
-        lua_pop(L, 1); // pop value
-    }
-    return 0;
-}
-
-int
-l_corehttp_response_headers_create_meta(lua_State* L) {
-    luaL_newmetatable(L, LCOREHTTP_HEADERS_METATABLE);
-
-    lua_pushcfunction(L, l_corehttp_response_headers_get);
-    lua_setfield(L, -2, "__index");
-
-    lua_pushstring(L, LCOREHTTP_HEADERS_METATABLE);
-    lua_setfield(L, -2, "__type");
-
-    return 0;
-}
+#include "lcorehttp_response.h"
+#include <assert.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "lcorehttp_h2.h"
+#include "lcorehttp_json.h"
+#include "lcorehttp_limits.h"
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_pool.h"
+#include "lcorehttp_records.h"
+#include "lcorehttp_spill.h"
+#include "lcorehttp_probes.h"
+#include "lcorehttp_time.h"
+#include "lerror.h"
+#include "llhttp.h"
+#include "lss_transport.h"
+
+#define MINIMUM_CHUNK_BUFFER_SIZE 512
+
+void
+l_corehttp_timings_init(lcorehttp_timings* timings) {
+    memset(timings, 0, sizeof(lcorehttp_timings));
+    timings->dns = LCOREHTTP_TIMING_UNSET;
+    timings->connect = LCOREHTTP_TIMING_UNSET;
+    timings->tlsHandshake = LCOREHTTP_TIMING_UNSET;
+    timings->send = LCOREHTTP_TIMING_UNSET;
+    timings->firstByte = LCOREHTTP_TIMING_UNSET;
+    timings->headerParse = LCOREHTTP_TIMING_UNSET;
+    timings->bodyTransfer = LCOREHTTP_TIMING_UNSET;
+}
+
+lcorehttp_response*
+l_corehttp_new_response(lua_State* L) {
+    lcorehttp_response* response = lua_newuserdatauv(L, sizeof(lcorehttp_response), 2);
+    if (response == NULL) {
+        return NULL;
+    }
+    luaL_getmetatable(L, LCOREHTTP_RESPONSE_METATABLE);
+    lua_setmetatable(L, -2);
+    memset(response, 0, sizeof(lcorehttp_response));
+    response->response.getTime = l_corehttp_get_time_ms;
+    response->contentLength = -1;
+    response->cachedBodyRead = 0;
+    l_corehttp_timings_init(&response->timings);
+    return response;
+}
+
+static void
+l_corehttp_get_headers_table(lua_State* L, int idx) {
+    lua_getiuservalue(L, idx, 1);
+    if (lua_istable(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, idx, 1);
+}
+
+int
+l_corehttp_response_headers(lua_State* L) {
+    luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    l_corehttp_get_headers_table(L, 1);
+    return 1;
+}
+
+static void
+l_corehttp_push_timing(lua_State* L, const char* name, int64_t value) {
+    if (value == LCOREHTTP_TIMING_UNSET) {
+        return;
+    }
+    lua_pushinteger(L, (lua_Integer)value);
+    lua_setfield(L, -2, name);
+}
+
+// timings() -> { dns?, connect?, tls_handshake?, send?, ttfb?, header_parse?, body_transfer? } in microseconds
+int
+l_corehttp_response_timings(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lcorehttp_timings* timings = &response->timings;
+    lua_createtable(L, 0, 7);
+    l_corehttp_push_timing(L, "dns", timings->dns);
+    l_corehttp_push_timing(L, "connect", timings->connect);
+    l_corehttp_push_timing(L, "tls_handshake", timings->tlsHandshake);
+    l_corehttp_push_timing(L, "send", timings->send);
+    l_corehttp_push_timing(L, "ttfb", timings->firstByte);
+    l_corehttp_push_timing(L, "header_parse", timings->headerParse);
+    l_corehttp_push_timing(L, "body_transfer", timings->bodyTransfer);
+    return 1;
+}
+
+int
+l_corehttp_response_connection_reused(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lua_pushboolean(L, response->reused);
+    return 1;
+}
+
+int
+l_corehttp_response_reusable(const lcorehttp_response* response) {
+    // only a fully consumed body leaves the connection at the start of the next response; an HTTP/2 stream carries
+    // a single exchange, its connection is shared through the client instead
+    return response->keepAlive && response->bodyComplete && response->status == HTTPSuccess
+           && (response->response.respFlags & HTTP_RESPONSE_CONNECTION_CLOSE_FLAG) == 0
+           && response->response.bodyLen <= response->contentLength && lcorehttp_h2_of(response->transport) == NULL;
+}
+
+int
+l_corehttp_response_gc(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    if (response->transport != NULL) {
+        lcorehttp_pool_release(response->client, response->transport, l_corehttp_response_reusable(response),
+                               response->bodyBytesRead);
+        response->transport = NULL;
+    }
+    free(response->ownedBuffer);
+    response->ownedBuffer = NULL;
+    free(response->ownedBody);
+    response->ownedBody = NULL;
+
+    return 0;
+}
+
+int
+l_corehttp_response_tostring(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    if (response->isChunked) {
+        lua_pushfstring(L, "%p (chunked)", LCOREHTTP_RESPONSE_METATABLE);
+        return 1;
+    }
+    lua_pushfstring(L, "%p (%d bytes)", LCOREHTTP_RESPONSE_METATABLE, response->contentLength);
+    return 1;
+}
+
+int
+l_corehttp_response_status(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lua_pushstring(L, response->strStatus);
+    return 1;
+}
+
+int
+l_corehttp_response_status_code(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lua_pushinteger(L, response->status);
+    return 1;
+}
+
+int
+l_corehttp_response_http_status_code(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    lua_pushinteger(L, response->response.statusCode);
+    return 1;
+}
+
+typedef struct {
+    z_stream strm;
+    int initialized;
+} l_zstream_ud;
+
+static int
+l_zstream_gc(lua_State* L) {
+    l_zstream_ud* ud = (l_zstream_ud*)lua_touserdata(L, 1);
+    if (ud->initialized) {
+        inflateEnd(&ud->strm);
+        ud->initialized = 0;
+    }
+    return 0;
+}
+
+static z_stream*
+create_auto_zstream(lua_State* L, int windowBits) {
+    l_zstream_ud* ud = (l_zstream_ud*)lua_newuserdatauv(L, sizeof(l_zstream_ud), 0);
+    memset(ud, 0, sizeof(l_zstream_ud));
+
+    if (luaL_newmetatable(L, "l_corehttp_zstream_mt")) {
+        lua_pushcfunction(L, l_zstream_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    if (inflateInit2(&ud->strm, windowBits) != Z_OK) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    ud->initialized = 1;
+    return &ud->strm;
+}
+
+// Helper to detect Content-Encoding from response headers
+int
+l_corehttp_get_encoding_mode(lua_State* L, int respIdx) {
+    int mode = 0; // 0: none, 1: gzip, 2: deflate
+
+    l_corehttp_get_headers_table(L, respIdx);
+
+    lua_pushstring(L, "Content-Encoding");
+    lua_gettable(L, -2);
+    if (lua_isstring(L, -1)) {
+        const char* enc = lua_tostring(L, -1);
+        if (strcmp(enc, "gzip") == 0) {
+            mode = 1;
+        } else if (strcmp(enc, "deflate") == 0) {
+            mode = 2;
+        }
+    }
+    lua_pop(L, 2); // pop value and headers table
+    return mode;
+}
+
+// --- Internal Reader ---
+// Handles reading from internal cache and network transport
+int
+l_corehttp_response_read_internal(lcorehttp_response* response, uint8_t* buffer, size_t bufferLen,
+                                  size_t* outBytesRead) {
+    *outBytesRead = 0;
+
+    // No Content
+    if (response->contentLength == 0 && !response->isChunked) {
+        return 0;
+    }
+
+    if (response->timings.bodyStartedAt == 0) {
+        response->timings.bodyStartedAt = l_corehttp_get_time_us();
+    }
+
+    // Read from Cache (pre-fetched body during header parsing)
+    if (response->cachedBodyRead < response->response.bodyLen) {
+        const uint8_t* pBody = (const uint8_t*)response->response.pBody;
+        size_t available = response->response.bodyLen - response->cachedBodyRead;
+
+        size_t toCopy = (available > bufferLen) ? bufferLen : available;
+        // memmove: the body readers reuse the response buffer, the destination then lies before the source
+        memmove(buffer, pBody + response->cachedBodyRead, toCopy);
+
+        response->cachedBodyRead += toCopy;
+        *outBytesRead = toCopy;
+        response->bodyBytesRead += toCopy;
+        if (!response->isChunked && response->bodyBytesRead >= response->contentLength) {
+            response->bodyComplete = 1;
+        }
+        LCOREHTTP_PROBE4(body__read, response->client->hostname, response->client->portno, toCopy,
+                         response->bodyBytesRead);
+        if (response->transport != NULL) { // background responses were timed by the worker
+            response->timings.bodyTransfer = (int64_t)(l_corehttp_get_time_us() - response->timings.bodyStartedAt);
+        }
+        return 0;
+    }
+
+    // Read from Network
+    HTTPStatus_t status = HTTPClient_Read(response->transport, &response->response, buffer, bufferLen, outBytesRead,
+                                          &response->client->shaping, response->client->hostname,
+                                          response->client->portno);
+    if (status != HTTPSuccess) {
+        lcorehttp_metrics_error(status);
+        return -1;
+    }
+    lcorehttp_metrics_bytes_received(*outBytesRead);
+    response->bodyBytesRead += *outBytesRead;
+    if (!response->isChunked && response->bodyBytesRead >= response->contentLength) {
+        response->bodyComplete = 1;
+    }
+    LCOREHTTP_PROBE4(body__read, response->client->hostname, response->client->portno, *outBytesRead,
+                     response->bodyBytesRead);
+    response->timings.bodyTransfer = (int64_t)(l_corehttp_get_time_us() - response->timings.bodyStartedAt);
+    return 0;
+}
+
+// Raw Read
+// read(buffer_size?)
+int
+l_corehttp_response_read(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+
+    lua_Integer reqLen = luaL_optinteger(L, 2, DEFAULT_COREHTTP_BUFFER_SIZE);
+    if (reqLen <= 0) {
+        return 0;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    // Prep buffer directly in Lua string builder
+    uint8_t* buffer = (uint8_t*)luaL_prepbuffsize(&b, (size_t)reqLen);
+    size_t bytesRead = 0;
+
+    if (l_corehttp_response_read_internal(response, buffer, (size_t)reqLen, &bytesRead) != 0) {
+        return push_error(L, "failed to read response body");
+    }
+
+    lcorehttp_metrics_bytes_decoded(bytesRead);
+    luaL_addsize(&b, bytesRead);
+    luaL_pushresult(&b);           // Return string
+    lua_pushinteger(L, bytesRead); // Return count
+    return 2;
+}
+
+/*
+ * Read buffer of read_content and read_chunked_content. The response buffer held the request and then the
+ * response headers, which are parsed by now, so it is reused unless a larger buffer was asked for. Pushes one
+ * value either way (nil or the new userdata).
+ */
+static uint8_t*
+response_body_buffer(lua_State* L, lcorehttp_response* response, size_t capacity) {
+    if (response->transport != NULL && response->ownedBuffer == response->response.pBuffer
+        && capacity <= response->response.bufferLen) {
+        lua_pushnil(L);
+        return response->response.pBuffer;
+    }
+    return (uint8_t*)lua_newuserdatauv(L, capacity, 0);
+}
+
+/*
+ * Body collected for the caller: a luaL_Buffer up to spill_threshold, the temporary file of a mapped body
+ * beyond it. The mapped body is pushed before the buffer, buffer operations need the top of the stack.
+ */
+typedef struct body_collector {
+    luaL_Buffer b;
+    lcorehttp_mapped_body* spill; // NULL without spill_threshold
+    int spillIdx;
+    int spilled;
+    uint64_t threshold;
+} body_collector;
+
+static void
+body_collector_init(lua_State* L, body_collector* collector, const lcorehttp_response* response) {
+    collector->spill = NULL;
+    collector->spillIdx = 0;
+    collector->spilled = 0;
+#ifdef _WIN32
+    collector->threshold = 0; // no mapped bodies on Windows, everything stays in memory
+#else
+    collector->threshold = response->limits.spillThreshold;
+#endif
+    if (collector->threshold != 0) {
+        collector->spill = l_corehttp_new_mapped_body(L);
+        collector->spillIdx = lua_gettop(L);
+    }
+    luaL_buffinit(L, &collector->b);
+}
+
+static const char*
+body_collector_add(body_collector* collector, lcorehttp_body_meter* meter, const uint8_t* data, size_t len) {
+    if (!collector->spilled && collector->spill != NULL && luaL_bufflen(&collector->b) + len > collector->threshold) {
+        const char* error =
+            lcorehttp_mapped_body_write(collector->spill, luaL_buffaddr(&collector->b), luaL_bufflen(&collector->b));
+        if (error != NULL) {
+            return error;
+        }
+        luaL_buffsub(&collector->b, luaL_bufflen(&collector->b));
+        lcorehttp_body_meter_release(meter); // the body no longer grows in memory
+        collector->spilled = 1;
+    }
+    if (collector->spilled) {
+        return lcorehttp_mapped_body_write(collector->spill, data, len);
+    }
+    const char* error = lcorehttp_body_meter_charge(meter, len);
+    if (error != NULL) {
+        return error;
+    }
+    luaL_addlstring(&collector->b, (const char*)data, len);
+    return NULL;
+}
+
+// pushes the collected body, a string or the mapped body
+static const char*
+body_collector_push(lua_State* L, body_collector* collector) {
+    luaL_pushresult(&collector->b);
+    if (!collector->spilled) {
+        return NULL;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, collector->spillIdx);
+    return lcorehttp_mapped_body_finish(collector->spill);
+}
+
+// Content Read
+// read_content(write_cb?, progress_cb?, buffer_size?)
+int
+l_corehttp_response_read_content(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+
+    int hasWriteFunc = lua_isfunction(L, 2);
+    int hasProgressFunc = lua_isfunction(L, 3);
+
+    lua_Integer cap = luaL_optinteger(L, 4, DEFAULT_COREHTTP_BUFFER_SIZE);
+    size_t bufferCapacity = (cap > 0) ? (size_t)cap : DEFAULT_COREHTTP_BUFFER_SIZE;
+    lua_settop(L, 4);
+
+    int inflateMode = l_corehttp_get_encoding_mode(L, 1);
+    size_t contentLength = response->contentLength;
+    size_t totalBytesRead = 0;
+
+    // only a body collected in memory counts against the client's budget
+    lcorehttp_body_meter* meter =
+        l_corehttp_new_body_meter(L, &response->limits, hasWriteFunc ? NULL : response->client->budget);
+    const char* limitError = lcorehttp_body_meter_expect(meter, contentLength);
+    if (limitError != NULL) {
+        return luaL_error(L, "%s", limitError);
+    }
+
+    uint8_t* buffer = response_body_buffer(L, response, bufferCapacity);
+    uint8_t* outBuffer = NULL;
+
+    z_stream* strm = NULL;
+    if (inflateMode) {
+        int windowBits = (inflateMode == 1) ? 31 : 15;
+        strm = create_auto_zstream(L, windowBits); // Pushes userdata on stack
+        if (!strm) {
+            return luaL_error(L, "failed to initialize zlib");
+        }
+        outBuffer = (uint8_t*)lua_newuserdatauv(L, bufferCapacity, 0);
+    }
+
+    body_collector collector;
+    if (!hasWriteFunc) {
+        body_collector_init(L, &collector, response);
+    }
+
+    int status = 0;
+
+    while (1) {
+        // Calculate read size
+        size_t toRead = bufferCapacity;
+        if (contentLength != (size_t)-1) {
+            size_t remaining = contentLength - totalBytesRead;
+            if (remaining == 0) {
+                break;
+            }
+            if (remaining < toRead) {
+                toRead = remaining;
+            }
+        }
+
+        size_t bytesRead = 0;
+        int ret = l_corehttp_response_read_internal(response, buffer, toRead, &bytesRead);
+
+        if (ret != 0) {
+            status = -1;
+            break;
+        }
+        if (bytesRead == 0) {
+            break; // EOF
+        }
+
+        totalBytesRead += bytesRead;
+        limitError = lcorehttp_body_meter_received(meter, bytesRead);
+        if (limitError != NULL) {
+            break;
+        }
+
+        // Progress Callback
+        if (hasProgressFunc) {
+            lua_pushvalue(L, 3);
+            lua_pushinteger(L, (contentLength != (size_t)-1) ? (lua_Integer)contentLength : -1);
+            lua_pushinteger(L, totalBytesRead);
+            lua_call(L, 2, 0);
+        }
+
+        // Process Data
+        if (inflateMode) {
+            strm->next_in = (Bytef*)buffer;
+            strm->avail_in = bytesRead;
+            while (strm->avail_in > 0) {
+                strm->next_out = outBuffer;
+                strm->avail_out = bufferCapacity;
+                int zRet = inflate(strm, Z_NO_FLUSH);
+
+                if (zRet != Z_OK && zRet != Z_STREAM_END) {
+                    status = -2;
+                    break;
+                }
+
+                size_t have = bufferCapacity - strm->avail_out;
+                if (have > 0) {
+                    limitError = lcorehttp_body_meter_decoded(meter, have, 1);
+                    if (limitError != NULL) {
+                        break;
+                    }
+                    lcorehttp_metrics_bytes_decoded(have);
+                    if (hasWriteFunc) {
+                        lua_pushvalue(L, 2);
+                        lua_pushlstring(L, (const char*)outBuffer, have);
+                        lua_call(L, 1, 0);
+                    } else if ((limitError = body_collector_add(&collector, meter, outBuffer, have)) != NULL) {
+                        break;
+                    }
+                }
+                if (status == -2 || zRet == Z_STREAM_END) {
+                    break;
+                }
+            }
+            if (status != 0 || limitError != NULL) {
+                break;
+            }
+        } else {
+            limitError = lcorehttp_body_meter_decoded(meter, bytesRead, 0);
+            if (limitError != NULL) {
+                break;
+            }
+            lcorehttp_metrics_bytes_decoded(bytesRead);
+            if (hasWriteFunc) {
+                lua_pushvalue(L, 2);
+                lua_pushlstring(L, (const char*)buffer, bytesRead);
+                lua_call(L, 1, 0);
+            } else if ((limitError = body_collector_add(&collector, meter, buffer, bytesRead)) != NULL) {
+                break;
+            }
+        }
+
+        if (contentLength != (size_t)-1 && totalBytesRead >= contentLength) {
+            break;
+        }
+    }
+
+    if (limitError != NULL) {
+        return luaL_error(L, "%s", limitError);
+    }
+    if (status == -2) {
+        return luaL_error(L, "inflate error");
+    }
+    if (status == -1) {
+        return luaL_error(L, "network error");
+    }
+
+    if (contentLength != (size_t)-1 && contentLength > 0 && totalBytesRead < contentLength) {
+        return luaL_error(L, "incomplete read: expected %I bytes, got %I", (lua_Integer)contentLength,
+                          (lua_Integer)totalBytesRead);
+    }
+
+    if (!hasWriteFunc) {
+        const char* error = body_collector_push(L, &collector);
+        if (error != NULL) {
+            return luaL_error(L, "%s", error);
+        }
+    } else {
+        lua_pushinteger(L, totalBytesRead);
+    }
+    lcorehttp_body_meter_release(meter); // the result is owned by Lua now
+
+    return 1;
+}
+
+// Chunked Read
+// read_chunked_content(write_cb?, progress_cb?, buffer_size?)
+
+int
+l_corehttp_response_read_chunked_content(lua_State* L) {
+    lcorehttp_response* response = luaL_checkudata(L, 1, LCOREHTTP_RESPONSE_METATABLE);
+    int hasWriteFunc = lua_isfunction(L, 2);
+    int hasProgressFunc = lua_isfunction(L, 3);
+
+    lua_Integer cap = luaL_optinteger(L, 4, DEFAULT_COREHTTP_BUFFER_SIZE);
+    size_t bufferCapacity = (cap >= MINIMUM_CHUNK_BUFFER_SIZE) ? (size_t)cap : MINIMUM_CHUNK_BUFFER_SIZE;
+
+    lua_settop(L, 4);
+
+    int inflateMode = l_corehttp_get_encoding_mode(L, 1);
+    lcorehttp_body_meter* meter =
+        l_corehttp_new_body_meter(L, &response->limits, hasWriteFunc ? NULL : response->client->budget);
+    uint8_t* buffer = response_body_buffer(L, response, bufferCapacity);
+    uint8_t* outBuffer = NULL;
+
+    z_stream* strm = NULL;
+    if (inflateMode) {
+        int windowBits = (inflateMode == 1) ? 31 : 15;
+        strm = create_auto_zstream(L, windowBits);
+        if (!strm) {
+            return luaL_error(L, "failed to initialize zlib");
+        }
+        outBuffer = (uint8_t*)lua_newuserdatauv(L, bufferCapacity, 0);
+    }
+
+    body_collector collector;
+    if (!hasWriteFunc) {
+        body_collector_init(L, &collector, response);
+    }
+
+    // State Machine: 0=Header, 1=Data, 2=Trailing CRLF, 3=Trailer
+    int state = 0;
+    size_t chunkBytesRemaining = 0;
+    size_t totalBytesRead = 0;
+    size_t cacheLen = 0;
+    size_t cacheOff = 0;
+    int zlibStreamEnded = 0;
+    int done = 0;
+
+    while (!done) {
+        size_t available = cacheLen - cacheOff;
+        uint8_t* p = buffer + cacheOff;
+        int madeProgress = 0;
+
+        // ATTEMPT TO PARSE
+        if (state == 0) { // Chunk Header
+            uint8_t* lf = memchr(p, '\n', available);
+            if (lf) {
+                size_t lineLen = lf - p + 1;
+
+                char lenStr[32];
+                size_t hexLen = 0;
+                for (size_t i = 0; i < lineLen; i++) {
+                    if (p[i] == ';' || p[i] == '\r' || p[i] == '\n') {
+                        break;
+                    }
+                    if (hexLen < 31) {
+                        lenStr[hexLen++] = p[i];
+                    }
+                }
+                lenStr[hexLen] = 0;
+
+                if (hexLen == 0) {
+                    return luaL_error(L, "invalid chunk header");
+                }
+
+                char* endPtr;
+                unsigned long sz = strtoul(lenStr, &endPtr, 16);
+                if (*endPtr != 0) {
+                    return push_error(L, "invalid chunk size syntax");
+                }
+
+                chunkBytesRemaining = sz;
+                cacheOff += lineLen;
+
+                if (sz == 0) {
+                    state = 3;
+                } else {
+                    state = 1;
+                }
+                madeProgress = 1;
+            } else {
+                if (available == bufferCapacity) {
+                    return luaL_error(L, "chunk header too long");
+                }
+            }
+
+        } else if (state == 1) { // Chunk Data
+            size_t toProcess = (available < chunkBytesRemaining) ? available : chunkBytesRemaining;
+
+            if (toProcess > 0) {
+                if (inflateMode && !zlibStreamEnded) {
+                    strm->next_in = (Bytef*)p;
+                    strm->avail_in = toProcess;
+                    while (strm->avail_in > 0) {
+                        strm->next_out = outBuffer;
+                        strm->avail_out = bufferCapacity;
+                        int zRet = inflate(strm, Z_NO_FLUSH);
+
+                        if (zRet != Z_OK && zRet != Z_STREAM_END) {
+                            return luaL_error(L, "inflate error: %d", zRet);
+                        }
+
+                        // Write output FIRST, before any break conditions
+                        size_t have = bufferCapacity - strm->avail_out;
+                        if (have > 0) {
+                            const char* limitError = lcorehttp_body_meter_decoded(meter, have, 1);
+                            if (limitError != NULL) {
+                                return luaL_error(L, "%s", limitError);
+                            }
+                            lcorehttp_metrics_bytes_decoded(have);
+                            if (hasWriteFunc) {
+                                lua_pushvalue(L, 2);
+                                lua_pushlstring(L, (const char*)outBuffer, have);
+                                lua_call(L, 1, 0);
+                            } else if ((limitError = body_collector_add(&collector, meter, outBuffer, have)) != NULL) {
+                                return luaL_error(L, "%s", limitError);
+                            }
+                        }
+
+                        // Now check break conditions
+                        if (zRet == Z_STREAM_END) {
+                            zlibStreamEnded = 1;
+                            toProcess -= strm->avail_in;
+                            break;
+                        }
+
+                        if (have == 0 && zRet == Z_OK) {
+                            toProcess -= strm->avail_in;
+                            break;
+                        }
+                    }
+                } else {
+                    const char* limitError = lcorehttp_body_meter_decoded(meter, toProcess, 0);
+                    if (limitError != NULL) {
+                        return luaL_error(L, "%s", limitError);
+                    }
+                    lcorehttp_metrics_bytes_decoded(toProcess);
+                    if (hasWriteFunc) {
+                        lua_pushvalue(L, 2);
+                        lua_pushlstring(L, (const char*)p, toProcess);
+                        lua_call(L, 1, 0);
+                    } else if ((limitError = body_collector_add(&collector, meter, p, toProcess)) != NULL) {
+                        return luaL_error(L, "%s", limitError);
+                    }
+                }
+
+                totalBytesRead += toProcess;
+                chunkBytesRemaining -= toProcess;
+                cacheOff += toProcess;
+
+                if (hasProgressFunc) {
+                    lua_pushvalue(L, 3);
+                    lua_pushinteger(L, -1); // Unknown total for chunked
+                    lua_pushinteger(L, totalBytesRead);
+                    lua_call(L, 2, 0);
+                }
+
+                if (chunkBytesRemaining == 0) {
+                    state = 2;
+                }
+                madeProgress = 1;
+            }
+
+        } else if (state == 2) { // Trailing CRLF
+            if (available >= 2) {
+                if (p[0] != '\r' || p[1] != '\n') {
+                    return luaL_error(L, "expected CRLF after chunk");
+                }
+                cacheOff += 2;
+                state = 0;
+                madeProgress = 1;
+            }
+
+        } else if (state == 3) { // Trailer section, ends with an empty line
+            uint8_t* lf = memchr(p, '\n', available);
+            if (lf) {
+                size_t lineLen = lf - p + 1;
+                cacheOff += lineLen;
+                if (lineLen == 1 || (lineLen == 2 && p[0] == '\r')) {
+                    done = 1;
+                    // nothing was read past the message, the connection can carry the next request
+                    response->bodyComplete =
+                        cacheOff == cacheLen && response->cachedBodyRead >= response->response.bodyLen;
+                }
+                madeProgress = 1;
+            } else if (available == bufferCapacity) {
+                return luaL_error(L, "chunk trailer too long");
+            }
+        }
+
+        if (madeProgress) {
+            continue;
+        }
+
+        if (done) {
+            break;
+        }
+
+        // --- NETWORK READ ---
+        // Compact buffer first
+        if (cacheOff > 0) {
+            size_t remaining = cacheLen - cacheOff;
+            if (remaining > 0) {
+                memmove(buffer, buffer + cacheOff, remaining);
+            }
+            cacheLen = remaining;
+            cacheOff = 0;
+        }
+
+        // Calculate how much we NEED to read (not the whole buffer!)
+        size_t bytesNeeded = 0;
+        if (state == 0) {
+            // Header: Minimum is "0\r\n" = 3 bytes
+            bytesNeeded = 3;
+        } else if (state == 1) {
+            // Data: We need the remaining chunk bytes + 2 for CRLF + 5 for next header ("0\r\n" = 3, typical = 5)
+            bytesNeeded = chunkBytesRemaining + 5;
+        } else if (state == 2 || state == 3) {
+            // CRLF, or the empty line ending the trailer section: 2 bytes
+            bytesNeeded = 2;
+        }
+
+        // Don't read more than we have space for
+        size_t spaceAvailable = bufferCapacity - cacheLen;
+        size_t toRead = (bytesNeeded < spaceAvailable) ? bytesNeeded : spaceAvailable;
+
+        // Ensure we read at least 1 byte
+        if (toRead == 0) {
+            toRead = 1;
+        }
+
+        size_t readAmt = 0;
+        int ret = l_corehttp_response_read_internal(response, buffer + cacheLen, toRead, &readAmt);
+        if (ret != 0) {
+            return luaL_error(L, "network error: %d", ret);
+        }
+
+        if (readAmt == 0) {
+            return luaL_error(L, "unexpected EOF");
+        }
+        const char* limitError = lcorehttp_body_meter_received(meter, readAmt);
+        if (limitError != NULL) {
+            return luaL_error(L, "%s", limitError);
+        }
+
+        cacheLen += readAmt;
+    }
+
+    if (!hasWriteFunc) {
+        const char* error = body_collector_push(L, &collector);
+        if (error != NULL) {
+            return luaL_error(L, "%s", error);
+        }
+    } else {
+        lua_pushinteger(L, totalBytesRead);
+    }
+    lcorehttp_body_meter_release(meter);
+
+    return 1;
+}
+
+int
+l_corehttp_response_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_RESPONSE_METATABLE);
+    /* Metamethods */
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_response_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, l_corehttp_response_headers);
+    lua_setfield(L, -2, "headers");
+    lua_pushcfunction(L, l_corehttp_response_status);
+    lua_setfield(L, -2, "status");
+    lua_pushcfunction(L, l_corehttp_response_status_code);
+    lua_setfield(L, -2, "status_code");
+    lua_pushcfunction(L, l_corehttp_response_http_status_code);
+    lua_setfield(L, -2, "http_status_code");
+    lua_pushcfunction(L, l_corehttp_response_read);
+    lua_setfield(L, -2, "read");
+    lua_pushcfunction(L, l_corehttp_response_read_content);
+    lua_setfield(L, -2, "read_content");
+    lua_pushcfunction(L, l_corehttp_response_read_json);
+    lua_setfield(L, -2, "read_json");
+    lua_pushcfunction(L, l_corehttp_response_lines);
+    lua_setfield(L, -2, "lines");
+    lua_pushcfunction(L, l_corehttp_response_events);
+    lua_setfield(L, -2, "events");
+    lua_pushcfunction(L, l_corehttp_response_read_chunked_content);
+    lua_setfield(L, -2, "read_chunked_content");
+    lua_pushcfunction(L, l_corehttp_response_timings);
+    lua_setfield(L, -2, "timings");
+    lua_pushcfunction(L, l_corehttp_response_connection_reused);
+    lua_setfield(L, -2, "connection_reused");
+    lua_pushstring(L, LCOREHTTP_RESPONSE_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_response_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_response_gc);
+    lua_setfield(L, -2, "__close");
+
+    return 0;
+}
+
+int
+l_corehttp_response_headers_get(lua_State* L) {
+    if (!lua_istable(L, 1)) {
+        return 0;
+    }
+    const char* headerName = luaL_checkstring(L, 2);
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        const char* key = lua_tostring(L, -2);
+        if (strcasecmp(key, headerName) == 0) {
+            return 1;
+        }
+        lua_pop(L, 1); // pop value
+    }
+    return 0;
+}
+
+int
+l_corehttp_response_headers_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_HEADERS_METATABLE);
+
+    lua_pushcfunction(L, l_corehttp_response_headers_get);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushstring(L, LCOREHTTP_HEADERS_METATABLE);
+    lua_setfield(L, -2, "__type");
+
+    return 0;
+}
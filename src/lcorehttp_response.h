@@ -1,26 +1,63 @@
-#ifndef LCOREHTTP_CLIENT_RESPONSE_H
-#define LCOREHTTP_CLIENT_RESPONSE_H
-
-#include "core_http_client.h"
-#include "extended_core_http_client.h"
-#include "lcorehttp_client.h"
-#include "lua.h"
-
-typedef struct lcorehttp_response {
-    HTTPResponse_t response;
-    HTTPStatus_t status;
-    const char* strStatus;
-    const TransportInterface_t* transport;
-    size_t contentLength;
-    size_t cachedBodyRead;
-    int isChunked;
-} lcorehttp_response;
-
-#define LCOREHTTP_RESPONSE_METATABLE "COREHTTP_RESPONSE"
-#define LCOREHTTP_HEADERS_METATABLE  "COREHTTP_HEADERS"
-
-int l_corehttp_response_create_meta(lua_State* L);
-int l_corehttp_response_headers_create_meta(lua_State* L);
-lcorehttp_response* l_corehttp_new_response(lua_State* L);
-
+#ifndef LCOREHTTP_CLIENT_RESPONSE_H
+#define LCOREHTTP_CLIENT_RESPONSE_H
+
+#include "core_http_client.h"
+#include "extended_core_http_client.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_limits.h"
+#include "lua.h"
+
+#define LCOREHTTP_TIMING_UNSET -1
+
+/**
+ * Phase durations of a single request in microseconds (monotonic clock).
+ * Phases that were not measured separately stay LCOREHTTP_TIMING_UNSET, e.g. lss opens the socket
+ * (and performs the TLS handshake) in one call, so dns and tlsHandshake are folded into connect.
+ */
+typedef struct lcorehttp_timings {
+    int64_t dns;
+    int64_t connect;
+    int64_t tlsHandshake;
+    int64_t send;
+    int64_t firstByte;
+    int64_t headerParse;
+    int64_t bodyTransfer;
+    uint64_t firstByteAt;
+    uint64_t bodyStartedAt;
+} lcorehttp_timings;
+
+void l_corehttp_timings_init(lcorehttp_timings* timings);
+
+typedef struct lcorehttp_response {
+    HTTPResponse_t response;
+    HTTPStatus_t status;
+    const char* strStatus;
+    const TransportInterface_t* transport;
+    size_t contentLength;
+    size_t cachedBodyRead;
+    int isChunked;
+    int reused;       // connection came from the client's keep-alive pool
+    int keepAlive;    // request asked for a persistent connection
+    int bodyComplete; // the whole body was consumed, the connection is at a message boundary
+    size_t bodyBytesRead;
+    struct lcorehttp_client* client; // kept alive by the response (user value 2)
+    void* ownedBuffer;               // freed with the response (background requests)
+    void* ownedBody;
+    lcorehttp_timings timings;
+    lcorehttp_body_limits limits;
+} lcorehttp_response;
+
+#define LCOREHTTP_RESPONSE_METATABLE "COREHTTP_RESPONSE"
+#define LCOREHTTP_HEADERS_METATABLE  "COREHTTP_HEADERS"
+
+int l_corehttp_response_create_meta(lua_State* L);
+int l_corehttp_response_headers_create_meta(lua_State* L);
+lcorehttp_response* l_corehttp_new_response(lua_State* L);
+// Content-Encoding of the response at respIdx, 0: none, 1: gzip, 2: deflate
+int l_corehttp_get_encoding_mode(lua_State* L, int respIdx);
+// the connection can carry the next request once the response is released
+int l_corehttp_response_reusable(const lcorehttp_response* response);
+int l_corehttp_response_read_internal(lcorehttp_response* response, uint8_t* buffer, size_t bufferLen,
+                                      size_t* outBytesRead);
+
 #endif /* LCOREHTTP_CLIENT_RESPONSE_H */
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "lcorehttp_shaping.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "lcorehttp_time.h"
+
+#ifdef _WIN32
+#define RATE_LIMIT_INITIALIZER {0, 0, 0, 0, 0}
+#define rate_limit_lock(limit)   ((void)(limit))
+#define rate_limit_unlock(limit) ((void)(limit))
+#else
+#define RATE_LIMIT_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0}
+#define rate_limit_lock(limit)   pthread_mutex_lock(&(limit)->lock)
+#define rate_limit_unlock(limit) pthread_mutex_unlock(&(limit)->lock)
+#endif
+
+static lcorehttp_rate_limit processDownload = RATE_LIMIT_INITIALIZER;
+static lcorehttp_rate_limit processUpload = RATE_LIMIT_INITIALIZER;
+
+// expects the lock to be held
+static void
+rate_limit_configure(lcorehttp_rate_limit* limit, uint64_t rate, uint64_t burst) {
+    if (burst == 0) {
+        burst = rate / 10 > LCOREHTTP_SHAPING_MINIMUM_BURST ? rate / 10 : LCOREHTTP_SHAPING_MINIMUM_BURST;
+    }
+    uint64_t quantum = rate * LCOREHTTP_SHAPING_QUANTUM_MS / 1000;
+    if (quantum < LCOREHTTP_SHAPING_MINIMUM_QUANTUM) {
+        quantum = LCOREHTTP_SHAPING_MINIMUM_QUANTUM;
+    }
+    if (quantum > burst) {
+        quantum = burst;
+    }
+    limit->burstUs = rate > 0 ? burst * 1000000ULL / rate : 0;
+    limit->quantum = (size_t)quantum;
+    limit->theoretical = 0; // starts with a full bucket
+    __atomic_store_n(&limit->rate, rate, __ATOMIC_RELEASE);
+}
+
+static int
+rate_limit_active(lcorehttp_rate_limit* limit) {
+    return limit != NULL && __atomic_load_n(&limit->rate, __ATOMIC_ACQUIRE) != 0;
+}
+
+lcorehttp_rate_limit*
+lcorehttp_rate_limit_new(uint64_t rate, uint64_t burst, int* failed) {
+    *failed = 0;
+    if (rate == 0) {
+        return NULL;
+    }
+    lcorehttp_rate_limit* limit = calloc(1, sizeof(lcorehttp_rate_limit));
+    if (limit == NULL) {
+        *failed = 1;
+        return NULL;
+    }
+#ifndef _WIN32
+    pthread_mutex_init(&limit->lock, NULL);
+#endif
+    rate_limit_configure(limit, rate, burst);
+    limit->refs = 1;
+    return limit;
+}
+
+static void
+rate_limit_retain(lcorehttp_rate_limit* limit) {
+    if (limit != NULL) {
+        rate_limit_lock(limit);
+        limit->refs++;
+        rate_limit_unlock(limit);
+    }
+}
+
+static void
+rate_limit_release(lcorehttp_rate_limit* limit) {
+    if (limit == NULL) {
+        return;
+    }
+    rate_limit_lock(limit);
+    int refs = --limit->refs;
+    rate_limit_unlock(limit);
+    if (refs == 0) {
+#ifndef _WIN32
+        pthread_mutex_destroy(&limit->lock);
+#endif
+        free(limit);
+    }
+}
+
+void
+lcorehttp_shaping_retain(const lcorehttp_shaping* shaping) {
+    rate_limit_retain(shaping->download);
+    rate_limit_retain(shaping->upload);
+}
+
+void
+lcorehttp_shaping_release(lcorehttp_shaping* shaping) {
+    rate_limit_release(shaping->download);
+    rate_limit_release(shaping->upload);
+    shaping->download = NULL;
+    shaping->upload = NULL;
+}
+
+static uint64_t
+rate_limit_cost_us(const lcorehttp_rate_limit* limit, size_t bytes) {
+    return ((uint64_t)bytes * 1000000ULL + limit->rate - 1) / limit->rate;
+}
+
+// reserves up to want bytes (at most one quantum), *readyAt is raised to the time they are paid for
+static size_t
+rate_limit_reserve(lcorehttp_rate_limit* limit, size_t want, uint64_t now, uint64_t* readyAt) {
+    rate_limit_lock(limit);
+    if (limit->rate == 0) {
+        rate_limit_unlock(limit);
+        return want;
+    }
+    size_t granted = want < limit->quantum ? want : limit->quantum;
+    uint64_t start = limit->theoretical > now ? limit->theoretical : now;
+    limit->theoretical = start + rate_limit_cost_us(limit, granted);
+    if (limit->theoretical > now + limit->burstUs && limit->theoretical - limit->burstUs > *readyAt) {
+        *readyAt = limit->theoretical - limit->burstUs;
+    }
+    rate_limit_unlock(limit);
+    return granted;
+}
+
+static void
+rate_limit_refund(lcorehttp_rate_limit* limit, size_t unused) {
+    rate_limit_lock(limit);
+    if (limit->rate != 0) {
+        uint64_t cost = (uint64_t)unused * 1000000ULL / limit->rate;
+        limit->theoretical = limit->theoretical > cost ? limit->theoretical - cost : 0;
+    }
+    rate_limit_unlock(limit);
+}
+
+static void
+shaping_sleep_until(uint64_t readyAt) {
+    uint64_t now = 0;
+    while ((now = l_corehttp_get_time_us()) < readyAt) {
+        uint64_t waitUs = readyAt - now;
+#ifdef _WIN32
+        Sleep((DWORD)((waitUs + 999) / 1000));
+#else
+        struct timespec ts = {.tv_sec = (time_t)(waitUs / 1000000), .tv_nsec = (long)(waitUs % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+#endif
+    }
+}
+
+size_t
+lcorehttp_shaping_acquire(const lcorehttp_shaping* shaping, int upload, size_t want) {
+    lcorehttp_rate_limit* client = shaping == NULL ? NULL : upload ? shaping->upload : shaping->download;
+    lcorehttp_rate_limit* process = upload ? &processUpload : &processDownload;
+    int clientActive = rate_limit_active(client);
+    int processActive = rate_limit_active(process);
+    if (!clientActive && !processActive) {
+        return want;
+    }
+
+    uint64_t now = l_corehttp_get_time_us();
+    uint64_t readyAt = now;
+    size_t granted = want;
+    if (clientActive) {
+        granted = rate_limit_reserve(client, granted, now, &readyAt);
+    }
+    if (processActive) {
+        size_t processGranted = rate_limit_reserve(process, granted, now, &readyAt);
+        if (clientActive && processGranted < granted) {
+            rate_limit_refund(client, granted - processGranted);
+        }
+        granted = processGranted;
+    }
+    shaping_sleep_until(readyAt);
+    return granted;
+}
+
+void
+lcorehttp_shaping_refund(const lcorehttp_shaping* shaping, int upload, size_t unused) {
+    if (unused == 0) {
+        return;
+    }
+    lcorehttp_rate_limit* client = shaping == NULL ? NULL : upload ? shaping->upload : shaping->download;
+    lcorehttp_rate_limit* process = upload ? &processUpload : &processDownload;
+    if (rate_limit_active(client)) {
+        rate_limit_refund(client, unused);
+    }
+    if (rate_limit_active(process)) {
+        rate_limit_refund(process, unused);
+    }
+}
+
+static uint64_t
+rate_option(lua_State* L, int idx, const char* name) {
+    lua_getfield(L, idx, name);
+    lua_Integer value = lua_isnil(L, -1) ? 0 : lua_tointeger(L, -1);
+    if (value < 0 || (!lua_isnil(L, -1) && !lua_isinteger(L, -1))) {
+        luaL_error(L, "%s must be a non-negative integer", name);
+    }
+    lua_pop(L, 1);
+    return (uint64_t)value;
+}
+
+int
+l_corehttp_set_rate_limit(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint64_t download = rate_option(L, 1, "download");
+    uint64_t upload = rate_option(L, 1, "upload");
+    uint64_t burst = rate_option(L, 1, "burst");
+    rate_limit_lock(&processDownload);
+    rate_limit_configure(&processDownload, download, burst);
+    rate_limit_unlock(&processDownload);
+    rate_limit_lock(&processUpload);
+    rate_limit_configure(&processUpload, upload, burst);
+    rate_limit_unlock(&processUpload);
+    lua_pushboolean(L, 1);
+    return 1;
+}
@@ -0,0 +1,55 @@
+#ifndef LCOREHTTP_SHAPING_H
+#define LCOREHTTP_SHAPING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define LCOREHTTP_SHAPING_MINIMUM_BURST   4096 /* bytes, default burst is a tenth of a second worth of rate */
+#define LCOREHTTP_SHAPING_QUANTUM_MS      20   /* largest single grant, in time at the configured rate */
+#define LCOREHTTP_SHAPING_MINIMUM_QUANTUM 1024
+
+/*
+ * Token bucket in its GCRA form: instead of a token count the limit keeps the time at which the bucket will
+ * be full again. A transfer reserves at most one quantum at a time and sleeps until its reservation is
+ * covered, so concurrent transfers (Lua coroutines as well as async workers) are served in turn instead of
+ * the first one draining the whole burst.
+ */
+typedef struct lcorehttp_rate_limit {
+#ifndef _WIN32
+    pthread_mutex_t lock; // async workers share the limits, there are no workers on Windows
+#endif
+    uint64_t rate;        // bytes per second, 0 disables the limit
+    uint64_t burstUs;     // burst size as time at rate
+    size_t quantum;       // bytes
+    uint64_t theoretical; // l_corehttp_get_time_us() at which all reserved bytes are paid for
+    int refs;             // per client limits are shared with async jobs, the process-wide ones are static
+} lcorehttp_rate_limit;
+
+// limits of one client, NULL when the client has none; the process-wide limits apply on top
+typedef struct lcorehttp_shaping {
+    lcorehttp_rate_limit* download;
+    lcorehttp_rate_limit* upload;
+} lcorehttp_shaping;
+
+// NULL when rate is 0 or on allocation failure (*failed is set)
+lcorehttp_rate_limit* lcorehttp_rate_limit_new(uint64_t rate, uint64_t burst, int* failed);
+void lcorehttp_shaping_retain(const lcorehttp_shaping* shaping);
+void lcorehttp_shaping_release(lcorehttp_shaping* shaping);
+
+/**
+ * @brief Wait until up to want bytes may be received (upload: sent) under the client and process-wide limits.
+ *
+ * @return The granted byte count, want without any limit. Bytes not used must be handed back with
+ * lcorehttp_shaping_refund.
+ */
+size_t lcorehttp_shaping_acquire(const lcorehttp_shaping* shaping, int upload, size_t want);
+void lcorehttp_shaping_refund(const lcorehttp_shaping* shaping, int upload, size_t unused);
+
+// corehttp.set_rate_limit({ download?, upload?, burst? }) -> true
+int l_corehttp_set_rate_limit(lua_State* L);
+
+#endif /* LCOREHTTP_SHAPING_H */
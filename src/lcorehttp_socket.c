@@ -0,0 +1,430 @@
+#include "lcorehttp_socket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lcorehttp_response.h"
+#include "lcorehttp_time.h"
+
+void
+lcorehttp_socket_options_init(lcorehttp_socket_options* options) {
+    memset(options, 0, sizeof(lcorehttp_socket_options));
+    options->connectTimeoutMs = LCOREHTTP_SOCKET_DEFAULT_CONNECT_TIMEOUT_MS;
+    options->attemptDelayMs = LCOREHTTP_SOCKET_DEFAULT_ATTEMPT_DELAY_MS;
+    options->ioTimeoutMs = LCOREHTTP_SOCKET_DEFAULT_IO_TIMEOUT_MS;
+}
+
+int
+lcorehttp_socket_options_tuned(const lcorehttp_socket_options* options) {
+    return options->noDelay || options->recvBuffer > 0 || options->sendBuffer > 0 || options->keepAlive
+           || options->quickAck || options->fastOpen || options->ioUring;
+}
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAXIMUM_CONNECT_ADDRESSES 16
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// RFC 8305 section 4: alternate address families, starting with the family of the first (preferred) address
+static size_t
+order_addresses(struct addrinfo* addresses, struct addrinfo** ordered) {
+    struct addrinfo* preferred[MAXIMUM_CONNECT_ADDRESSES];
+    struct addrinfo* other[MAXIMUM_CONNECT_ADDRESSES];
+    size_t preferredCount = 0;
+    size_t otherCount = 0;
+    int preferredFamily = addresses->ai_family;
+    for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+        if (address->ai_family == preferredFamily) {
+            if (preferredCount < MAXIMUM_CONNECT_ADDRESSES) {
+                preferred[preferredCount++] = address;
+            }
+        } else if (otherCount < MAXIMUM_CONNECT_ADDRESSES) {
+            other[otherCount++] = address;
+        }
+    }
+    size_t count = 0;
+    for (size_t i = 0; count < MAXIMUM_CONNECT_ADDRESSES && (i < preferredCount || i < otherCount); i++) {
+        if (i < preferredCount) {
+            ordered[count++] = preferred[i];
+        }
+        if (i < otherCount && count < MAXIMUM_CONNECT_ADDRESSES) {
+            ordered[count++] = other[i];
+        }
+    }
+    return count;
+}
+
+static void
+apply_tuning(int fd, const lcorehttp_socket_options* options, int fastOpen) {
+    int one = 1;
+    if (options->noDelay) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    // buffer sizes have to be set before connect, the window scale is negotiated in the handshake
+    if (options->recvBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options->recvBuffer, sizeof(options->recvBuffer));
+    }
+    if (options->sendBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->sendBuffer, sizeof(options->sendBuffer));
+    }
+    if (options->keepAlive) {
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#if defined(TCP_KEEPIDLE)
+        if (options->keepAliveIdle > 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &options->keepAliveIdle, sizeof(options->keepAliveIdle));
+        }
+#elif defined(TCP_KEEPALIVE)
+        if (options->keepAliveIdle > 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &options->keepAliveIdle, sizeof(options->keepAliveIdle));
+        }
+#endif
+#ifdef TCP_KEEPINTVL
+        if (options->keepAliveInterval > 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &options->keepAliveInterval,
+                       sizeof(options->keepAliveInterval));
+        }
+#endif
+#ifdef TCP_KEEPCNT
+        if (options->keepAliveCount > 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &options->keepAliveCount, sizeof(options->keepAliveCount));
+        }
+#endif
+    }
+#ifdef TCP_FASTOPEN_CONNECT
+    // connect returns right away when a cookie is cached and the first send carries the request in the SYN
+    if (fastOpen) {
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+    }
+#endif
+}
+
+// returns the fd with a connect in progress (or already established), -1 when the attempt failed right away
+static int
+start_attempt(const struct addrinfo* address, const lcorehttp_socket_options* options, int fastOpen,
+              int* established) {
+    *established = 0;
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        close(fd);
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    apply_tuning(fd, options, fastOpen);
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+        *established = 1;
+        return fd;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static const char*
+socket_new(int fd, const lcorehttp_socket_options* options, int quickAck, lcorehttp_socket** outSocket) {
+    lcorehttp_socket* socket = malloc(sizeof(lcorehttp_socket));
+    if (socket == NULL) {
+        close(fd);
+        return "failed to allocate socket";
+    }
+    socket->fd = fd;
+    socket->ioTimeoutMs = options->ioTimeoutMs;
+    socket->drained = 1;
+    socket->quickAck = quickAck;
+    socket->peerClosed = 0;
+    socket->ring = options->ioUring ? lcorehttp_uring_new(fd) : NULL;
+    *outSocket = socket;
+    return NULL;
+}
+
+const char*
+lcorehttp_socket_connect(const char* host, int port, const lcorehttp_socket_options* options,
+                         lcorehttp_timings* timings, lcorehttp_socket** outSocket) {
+    *outSocket = NULL;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+
+    uint64_t dnsStart = l_corehttp_get_time_us();
+    struct addrinfo* addresses = NULL;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0 || addresses == NULL) {
+        return "failed to resolve host";
+    }
+    uint64_t connectStart = l_corehttp_get_time_us();
+    timings->dns = (int64_t)(connectStart - dnsStart);
+
+    struct addrinfo* ordered[MAXIMUM_CONNECT_ADDRESSES];
+    size_t addressCount = order_addresses(addresses, ordered);
+    struct pollfd attempts[MAXIMUM_CONNECT_ADDRESSES];
+    size_t attemptCount = 0;
+    size_t nextAddress = 0;
+    int winner = -1;
+
+    // with a cached cookie a fast open connect "succeeds" before any packet was sent, so it would win every race:
+    // racing attempts complete the handshake first and only a single address keeps fast open
+    int fastOpen = options->fastOpen && (!options->happyEyeballs || addressCount == 1);
+    uint32_t attemptDelayMs = options->attemptDelayMs;
+    if (!options->happyEyeballs) {
+        attemptDelayMs = options->connectTimeoutMs; // addresses are tried one after another
+    } else if (attemptDelayMs < LCOREHTTP_SOCKET_MINIMUM_ATTEMPT_DELAY_MS) {
+        attemptDelayMs = LCOREHTTP_SOCKET_MINIMUM_ATTEMPT_DELAY_MS;
+    }
+    uint64_t deadline = connectStart + (uint64_t)options->connectTimeoutMs * 1000ULL;
+    uint64_t nextAttemptAt = connectStart;
+    while (winner < 0) {
+        uint64_t now = l_corehttp_get_time_us();
+        // start the next attempt when its delay elapsed or nothing is in flight anymore
+        while (nextAddress < addressCount && (now >= nextAttemptAt || attemptCount == 0)) {
+            int established = 0;
+            int fd = start_attempt(ordered[nextAddress++], options, fastOpen, &established);
+            if (fd < 0) {
+                continue;
+            }
+            if (established) {
+                winner = fd;
+                break;
+            }
+            attempts[attemptCount].fd = fd;
+            attempts[attemptCount].events = POLLOUT;
+            attempts[attemptCount].revents = 0;
+            attemptCount++;
+            nextAttemptAt = now + (uint64_t)attemptDelayMs * 1000ULL;
+            break;
+        }
+        if (winner >= 0) {
+            break;
+        }
+        if (attemptCount == 0 || now >= deadline) {
+            break; // every address failed or time is up
+        }
+
+        uint64_t waitUntil = (nextAddress < addressCount && nextAttemptAt < deadline) ? nextAttemptAt : deadline;
+        int waitMs = waitUntil > now ? (int)((waitUntil - now + 999) / 1000) : 0;
+        int ready = poll(attempts, attemptCount, waitMs);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        for (size_t i = 0; ready > 0 && i < attemptCount;) {
+            if (attempts[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int error = 0;
+            socklen_t errorLen = sizeof(error);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) == 0 && error == 0) {
+                winner = attempts[i].fd;
+                attempts[i] = attempts[--attemptCount];
+                break;
+            }
+            // failed attempt, the next address may start immediately
+            close(attempts[i].fd);
+            attempts[i] = attempts[--attemptCount];
+            nextAttemptAt = 0;
+        }
+    }
+
+    for (size_t i = 0; i < attemptCount; i++) {
+        close(attempts[i].fd);
+    }
+    freeaddrinfo(addresses);
+    if (winner < 0) {
+        return l_corehttp_get_time_us() >= deadline ? "connect timed out" : "failed to connect";
+    }
+
+    timings->connect = (int64_t)(l_corehttp_get_time_us() - connectStart);
+    return socket_new(winner, options, options->quickAck, outSocket);
+}
+
+const char*
+lcorehttp_socket_connect_unix(const char* path, const lcorehttp_socket_options* options,
+                              lcorehttp_timings* timings, lcorehttp_socket** outSocket) {
+    *outSocket = NULL;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t pathLen = strlen(path);
+    if (pathLen >= sizeof(address.sun_path)) {
+        return "unix socket path too long";
+    }
+    memcpy(address.sun_path, path, pathLen);
+
+    uint64_t connectStart = l_corehttp_get_time_us();
+    timings->dns = 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return "failed to connect";
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        close(fd);
+        return "failed to connect";
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    // the TCP options have no meaning here, only the buffer sizes apply
+    if (options->recvBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options->recvBuffer, sizeof(options->recvBuffer));
+    }
+    if (options->sendBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->sendBuffer, sizeof(options->sendBuffer));
+    }
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        // a full listen backlog reports EAGAIN instead of EINPROGRESS
+        if (errno != EINPROGRESS && errno != EAGAIN) {
+            close(fd);
+            return "failed to connect";
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT, .revents = 0};
+        int ready = 0;
+        do {
+            ready = poll(&pfd, 1, (int)options->connectTimeoutMs);
+        } while (ready < 0 && errno == EINTR);
+        int error = 0;
+        socklen_t errorLen = sizeof(error);
+        if (ready <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) != 0 || error != 0) {
+            close(fd);
+            return ready == 0 ? "connect timed out" : "failed to connect";
+        }
+    }
+    timings->connect = (int64_t)(l_corehttp_get_time_us() - connectStart);
+    return socket_new(fd, options, 0, outSocket);
+}
+
+// the kernel lacks multishot recv, the rest of the connection runs on plain syscalls
+static void
+socket_drop_ring(lcorehttp_socket* socket) {
+    lcorehttp_uring_free(socket->ring);
+    socket->ring = NULL;
+}
+
+int32_t
+lcorehttp_socket_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv) {
+    lcorehttp_socket* socket = (lcorehttp_socket*)pNetworkContext;
+    if (socket->ring != NULL) {
+        int32_t received = lcorehttp_uring_recv(socket->ring, pBuffer, bytesToRecv,
+                                                socket->drained ? socket->ioTimeoutMs : 1, &socket->peerClosed);
+        if (received != LCOREHTTP_URING_UNSUPPORTED) {
+            socket->drained = received <= 0;
+            return received;
+        }
+        socket_drop_ring(socket);
+    }
+#ifdef TCP_QUICKACK
+    if (socket->quickAck) {
+        int one = 1;
+        setsockopt(socket->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+#endif
+    // coreHTTP keeps calling recv until it stops getting data; only block when the previous call came back empty
+    struct pollfd pfd = {.fd = socket->fd, .events = POLLIN, .revents = 0};
+    int ready = poll(&pfd, 1, socket->drained ? (int)socket->ioTimeoutMs : 1);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (ready == 0) {
+        socket->drained = 1;
+        return 0;
+    }
+    ssize_t received = recv(socket->fd, pBuffer, bytesToRecv, 0);
+    if (received > 0) {
+        socket->drained = 0;
+        return (int32_t)received;
+    }
+    if (received == 0) { // orderly shutdown, reported as "no more data"
+        socket->drained = 1;
+        socket->peerClosed = 1;
+        return 0;
+    }
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+int32_t
+lcorehttp_socket_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend) {
+    lcorehttp_socket* socket = (lcorehttp_socket*)pNetworkContext;
+    if (socket->ring != NULL) {
+        int32_t sent = lcorehttp_uring_send(socket->ring, pBuffer, bytesToSend, socket->ioTimeoutMs);
+        if (sent != LCOREHTTP_URING_UNSUPPORTED) {
+            return sent;
+        }
+        socket_drop_ring(socket);
+    }
+    struct pollfd pfd = {.fd = socket->fd, .events = POLLOUT, .revents = 0};
+    int ready = poll(&pfd, 1, (int)socket->ioTimeoutMs);
+    if (ready <= 0) {
+        return (ready == 0 || errno == EINTR) ? 0 : -1;
+    }
+    ssize_t sent = send(socket->fd, pBuffer, bytesToSend, MSG_NOSIGNAL);
+    if (sent >= 0) {
+        return (int32_t)sent;
+    }
+    // EINPROGRESS: fast open connect without a cookie, the handshake is still running
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == EINPROGRESS) ? 0 : -1;
+}
+
+void
+lcorehttp_socket_close(NetworkContext_t* pNetworkContext) {
+    lcorehttp_socket* socket = (lcorehttp_socket*)pNetworkContext;
+    if (socket == NULL) {
+        return;
+    }
+    lcorehttp_uring_free(socket->ring);
+    close(socket->fd);
+    free(socket);
+}
+
+#else
+
+const char*
+lcorehttp_socket_connect(const char* host, int port, const lcorehttp_socket_options* options,
+                         lcorehttp_timings* timings, lcorehttp_socket** outSocket) {
+    *outSocket = NULL;
+    return "native connector is not supported on this platform";
+}
+
+const char*
+lcorehttp_socket_connect_unix(const char* path, const lcorehttp_socket_options* options,
+                              lcorehttp_timings* timings, lcorehttp_socket** outSocket) {
+    *outSocket = NULL;
+    return "unix sockets are not supported on this platform";
+}
+
+int32_t
+lcorehttp_socket_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv) {
+    return -1;
+}
+
+int32_t
+lcorehttp_socket_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend) {
+    return -1;
+}
+
+void
+lcorehttp_socket_close(NetworkContext_t* pNetworkContext) {}
+
+#endif
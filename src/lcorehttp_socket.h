@@ -0,0 +1,75 @@
+#ifndef LCOREHTTP_SOCKET_H
+#define LCOREHTTP_SOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lcorehttp_uring.h"
+#include "transport_interface.h"
+
+struct lcorehttp_timings;
+
+#define LCOREHTTP_SOCKET_DEFAULT_CONNECT_TIMEOUT_MS 30000
+#define LCOREHTTP_SOCKET_DEFAULT_ATTEMPT_DELAY_MS   250 /* RFC 8305 "Connection Attempt Delay" */
+#define LCOREHTTP_SOCKET_MINIMUM_ATTEMPT_DELAY_MS   10
+#define LCOREHTTP_SOCKET_DEFAULT_IO_TIMEOUT_MS      30000
+
+typedef struct lcorehttp_socket_options {
+    int happyEyeballs; // race the resolved addresses instead of trying them one after another
+    uint32_t connectTimeoutMs;
+    uint32_t attemptDelayMs;
+    uint32_t ioTimeoutMs;
+    // tuning applied to every attempt before connect, 0 keeps the kernel default
+    int noDelay;
+    int recvBuffer;
+    int sendBuffer;
+    int keepAlive;
+    int keepAliveIdle;     // seconds
+    int keepAliveInterval; // seconds
+    int keepAliveCount;
+    int quickAck;
+    int fastOpen;
+    int ioUring; // io_uring backend (Linux), plain syscalls when the kernel or the build lacks it
+} lcorehttp_socket_options;
+
+/*
+ * Native TCP or Unix domain connection. It is handed to coreHTTP as an opaque NetworkContext_t, the transport is
+ * recognized by its recv function (see lcorehttp_transport_close).
+ */
+typedef struct lcorehttp_socket {
+    int fd;
+    uint32_t ioTimeoutMs;
+    int drained;  // last recv returned no data, the next one waits up to ioTimeoutMs
+    int quickAck; // TCP_QUICKACK is not sticky, re-armed before every recv
+    int peerClosed; // orderly shutdown received, recv keeps returning 0
+    lcorehttp_uring* ring; // NULL: plain syscalls
+} lcorehttp_socket;
+
+void lcorehttp_socket_options_init(lcorehttp_socket_options* options);
+// any tuning option set, those need the native connector
+int lcorehttp_socket_options_tuned(const lcorehttp_socket_options* options);
+
+/**
+ * @brief Resolve host and race non-blocking connects to its addresses (RFC 8305): address families are
+ * interleaved, a new attempt starts every attemptDelayMs or as soon as the previous one fails, the first
+ * established connection wins and the remaining attempts are closed. Without happyEyeballs the next address
+ * is only tried after the previous attempt failed.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* lcorehttp_socket_connect(const char* host, int port, const lcorehttp_socket_options* options,
+                                     struct lcorehttp_timings* timings, lcorehttp_socket** outSocket);
+
+/**
+ * @brief Connect to the Unix domain socket at path (http+unix clients), within connectTimeoutMs. Only the buffer
+ * sizes of options apply.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* lcorehttp_socket_connect_unix(const char* path, const lcorehttp_socket_options* options,
+                                          struct lcorehttp_timings* timings, lcorehttp_socket** outSocket);
+
+int32_t lcorehttp_socket_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv);
+int32_t lcorehttp_socket_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend);
+void lcorehttp_socket_close(NetworkContext_t* pNetworkContext);
+
+#endif /* LCOREHTTP_SOCKET_H */
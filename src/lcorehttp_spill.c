@@ -0,0 +1,238 @@
+#include "lcorehttp_spill.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+const char*
+lcorehttp_mapped_body_write(lcorehttp_mapped_body* body, const void* data, size_t len) {
+    (void)body;
+    (void)data;
+    (void)len;
+    return "spill_threshold is not supported on this platform";
+}
+
+const char*
+lcorehttp_mapped_body_finish(lcorehttp_mapped_body* body) {
+    (void)body;
+    return "spill_threshold is not supported on this platform";
+}
+
+static void
+mapped_body_close(lcorehttp_mapped_body* body) {
+    body->data = NULL;
+    body->len = 0;
+}
+
+#else
+
+// unlinked right away, the file lives as long as the descriptor and the mapping
+static int
+spill_file_open(void) {
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/lcorehttp-body-XXXXXX", dir) >= (int)sizeof(path)) {
+        return -1;
+    }
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+const char*
+lcorehttp_mapped_body_write(lcorehttp_mapped_body* body, const void* data, size_t len) {
+    if (body->fd < 0) {
+        body->fd = spill_file_open();
+        if (body->fd < 0) {
+            return "failed to create spill file";
+        }
+    }
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t written = write(body->fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return "failed to write spill file";
+        }
+        p += written;
+        len -= (size_t)written;
+        body->len += (size_t)written;
+    }
+    return NULL;
+}
+
+const char*
+lcorehttp_mapped_body_finish(lcorehttp_mapped_body* body) {
+    if (body->fd >= 0 && body->len > 0) {
+        void* base = mmap(NULL, body->len, PROT_READ, MAP_SHARED, body->fd, 0);
+        if (base == MAP_FAILED) {
+            return "failed to map spill file";
+        }
+        body->base = base;
+        body->mapLen = body->len;
+        body->data = base;
+    }
+    if (body->fd >= 0) {
+        close(body->fd);
+        body->fd = -1;
+    }
+    return NULL;
+}
+
+static void
+mapped_body_close(lcorehttp_mapped_body* body) {
+    if (body->fd >= 0) {
+        close(body->fd);
+        body->fd = -1;
+    }
+    if (body->base != NULL) {
+        munmap(body->base, body->mapLen);
+        body->base = NULL;
+    }
+    body->data = NULL;
+    body->len = 0;
+}
+
+#endif
+
+lcorehttp_mapped_body*
+l_corehttp_new_mapped_body(lua_State* L) {
+    lcorehttp_mapped_body* body = lua_newuserdatauv(L, sizeof(lcorehttp_mapped_body), 1);
+    memset(body, 0, sizeof(lcorehttp_mapped_body));
+    body->fd = -1;
+    luaL_getmetatable(L, LCOREHTTP_MAPPED_BODY_METATABLE);
+    lua_setmetatable(L, -2);
+    return body;
+}
+
+// string.sub rules: 1-based, negative positions count from the end, j defaults to -1
+static void
+mapped_body_range(lua_State* L, const lcorehttp_mapped_body* body, size_t* start, size_t* count) {
+    lua_Integer len = (lua_Integer)body->len;
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    if (i < 0) {
+        i = i < -len ? 1 : len + i + 1;
+    } else if (i == 0) {
+        i = 1;
+    }
+    if (j < 0) {
+        j = len + j + 1;
+    } else if (j > len) {
+        j = len;
+    }
+    *start = (size_t)(i - 1);
+    *count = i <= j ? (size_t)(j - i + 1) : 0;
+}
+
+static lcorehttp_mapped_body*
+check_mapped_body(lua_State* L) {
+    lcorehttp_mapped_body* body = luaL_checkudata(L, 1, LCOREHTTP_MAPPED_BODY_METATABLE);
+    if (body->fd >= 0) {
+        luaL_error(L, "body is still being written");
+    }
+    return body;
+}
+
+// sub(i?, j?) -> string
+static int
+l_corehttp_mapped_body_sub(lua_State* L) {
+    lcorehttp_mapped_body* body = check_mapped_body(L);
+    size_t start = 0;
+    size_t count = 0;
+    mapped_body_range(L, body, &start, &count);
+    lua_pushlstring(L, count > 0 ? (const char*)body->data + start : "", count);
+    return 1;
+}
+
+// slice(i?, j?) -> mapped body sharing the mapping, no copy
+static int
+l_corehttp_mapped_body_slice(lua_State* L) {
+    lcorehttp_mapped_body* body = check_mapped_body(L);
+    size_t start = 0;
+    size_t count = 0;
+    mapped_body_range(L, body, &start, &count);
+    lcorehttp_mapped_body* slice = l_corehttp_new_mapped_body(L);
+    slice->data = count > 0 ? body->data + start : NULL;
+    slice->len = count;
+    if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) { // the root, slices of slices keep the root alive
+        lua_pop(L, 1);
+        lua_pushvalue(L, 1);
+    }
+    lua_setiuservalue(L, -2, 1);
+    return 1;
+}
+
+static int
+l_corehttp_mapped_body_len(lua_State* L) {
+    lua_pushinteger(L, (lua_Integer)check_mapped_body(L)->len);
+    return 1;
+}
+
+static int
+l_corehttp_mapped_body_tostring(lua_State* L) {
+    lcorehttp_mapped_body* body = check_mapped_body(L);
+    lua_pushlstring(L, body->len > 0 ? (const char*)body->data : "", body->len);
+    return 1;
+}
+
+static int
+l_corehttp_mapped_body_gc(lua_State* L) {
+    lcorehttp_mapped_body* body = luaL_checkudata(L, 1, LCOREHTTP_MAPPED_BODY_METATABLE);
+    if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+        mapped_body_close(body); // slices only drop their reference to the root
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+int
+l_corehttp_mapped_body_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_MAPPED_BODY_METATABLE);
+    /* Metamethods */
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_mapped_body_sub);
+    lua_setfield(L, -2, "sub");
+    lua_pushcfunction(L, l_corehttp_mapped_body_slice);
+    lua_setfield(L, -2, "slice");
+    lua_pushcfunction(L, l_corehttp_mapped_body_len);
+    lua_setfield(L, -2, "len");
+    lua_pushcfunction(L, l_corehttp_mapped_body_tostring);
+    lua_setfield(L, -2, "tostring");
+    lua_pushstring(L, LCOREHTTP_MAPPED_BODY_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_mapped_body_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, l_corehttp_mapped_body_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, l_corehttp_mapped_body_gc);
+    lua_setfield(L, -2, "__gc");
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LCOREHTTP_SPILL_H
+#define LCOREHTTP_SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+
+#define LCOREHTTP_MAPPED_BODY_METATABLE "COREHTTP_MAPPED_BODY"
+
+/*
+ * Body collected past spill_threshold: written to an unlinked temporary file while it is read, then mapped
+ * read-only. Slices share the mapping of their root (user value 1), only the root unmaps it.
+ */
+typedef struct lcorehttp_mapped_body {
+    int fd;        // temporary file while the body is written, -1 once mapped
+    uint8_t* base; // mapping, NULL for slices and empty bodies
+    size_t mapLen;
+    const uint8_t* data;
+    size_t len;
+} lcorehttp_mapped_body;
+
+/**
+ * @brief Push an empty mapped body; its temporary file is created by the first write.
+ *
+ * The userdata also owns the file while the body is written, so a read interrupted by an error leaks nothing.
+ */
+lcorehttp_mapped_body* l_corehttp_new_mapped_body(lua_State* L);
+
+// appends to the temporary file, NULL or a static error message
+const char* lcorehttp_mapped_body_write(lcorehttp_mapped_body* body, const void* data, size_t len);
+// maps the written file and closes it, NULL or a static error message
+const char* lcorehttp_mapped_body_finish(lcorehttp_mapped_body* body);
+
+int l_corehttp_mapped_body_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_SPILL_H */
@@ -1,33 +1,58 @@
-#ifndef LCOREHTTP_TIME_H
-#define LCOREHTTP_TIME_H
-
-#include <stdint.h>
-
-#ifdef _WIN32
-#include <sysinfoapi.h>
-#else
-#include <sys/time.h>
-#endif
-
-/**
- * @brief Get the current time in milliseconds.
- *
- * @return The current time in milliseconds.
- */
-uint32_t
-l_corehttp_get_time_ms(void) {
-#ifdef _WIN32
-    FILETIME ft;
-    ULARGE_INTEGER uli;
-    GetSystemTimeAsFileTime(&ft);
-    uli.LowPart = ft.dwLowDateTime;
-    uli.HighPart = ft.dwHighDateTime;
-    return (uint32_t)((uli.QuadPart / 10000ULL) - (11644473600000ULL * 10000ULL));
-#else
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-#endif
-}
-
-#endif /* LCOREHTTP_TIME_H */
\ No newline at end of file
+#ifndef LCOREHTTP_TIME_H
+#define LCOREHTTP_TIME_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <profileapi.h>
+#include <sysinfoapi.h>
+#else
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+/**
+ * @brief Get the current time in milliseconds.
+ *
+ * @return The current time in milliseconds.
+ */
+static inline uint32_t
+l_corehttp_get_time_ms(void) {
+#ifdef _WIN32
+    FILETIME ft;
+    ULARGE_INTEGER uli;
+    GetSystemTimeAsFileTime(&ft);
+    uli.LowPart = ft.dwLowDateTime;
+    uli.HighPart = ft.dwHighDateTime;
+    return (uint32_t)((uli.QuadPart / 10000ULL) - (11644473600000ULL * 10000ULL));
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+#endif
+}
+
+/**
+ * @brief Get monotonic time in microseconds. Only meaningful as a difference of two calls.
+ *
+ * @return The current monotonic time in microseconds.
+ */
+static inline uint64_t
+l_corehttp_get_time_us(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000ULL
+                      + ((counter.QuadPart % frequency.QuadPart) * 1000000ULL) / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL);
+#endif
+}
+
+#endif /* LCOREHTTP_TIME_H */
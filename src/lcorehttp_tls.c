@@ -0,0 +1,650 @@
+#include "lcorehttp_tls.h"
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lcorehttp_response.h"
+#include "lcorehttp_time.h"
+#include "lerror.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/platform_util.h"
+#include "psa/crypto.h"
+
+#ifdef _WIN32
+#define tls_config_lock(config)   ((void)(config))
+#define tls_config_unlock(config) ((void)(config))
+#else
+#define tls_config_lock(config)   pthread_mutex_lock(&(config)->lock)
+#define tls_config_unlock(config) pthread_mutex_unlock(&(config)->lock)
+#endif
+
+static const char* const systemBundles[] = {
+    "/etc/ssl/certs/ca-certificates.crt", // Debian, Ubuntu, Alpine
+    "/etc/pki/tls/certs/ca-bundle.crt",   // Fedora, RHEL
+    "/etc/ssl/ca-bundle.pem",             // openSUSE
+    "/etc/ssl/cert.pem",                  // macOS, BSD
+    NULL,
+};
+
+// ctr_drbg is not thread safe without MBEDTLS_THREADING_C, async workers handshake concurrently
+static int
+tls_config_random(void* pConfig, unsigned char* output, size_t len) {
+    lcorehttp_tls_config* config = pConfig;
+    tls_config_lock(config);
+    int ret = mbedtls_ctr_drbg_random(&config->drbg, output, len);
+    tls_config_unlock(config);
+    return ret;
+}
+
+static void
+tls_config_free(lcorehttp_tls_config* config) {
+    for (size_t i = 0; i < config->sessionCount; i++) {
+        mbedtls_ssl_session_free(&config->sessions[i].session);
+    }
+    mbedtls_ssl_config_free(&config->conf);
+    mbedtls_x509_crt_free(&config->ca);
+    mbedtls_x509_crt_free(&config->cert);
+    mbedtls_pk_free(&config->key);
+    free(config->ciphersuites);
+    mbedtls_ctr_drbg_free(&config->drbg);
+    mbedtls_entropy_free(&config->entropy);
+#ifndef _WIN32
+    pthread_mutex_destroy(&config->lock);
+#endif
+    free(config);
+}
+
+static int
+tls_config_load_ca(lcorehttp_tls_config* config, const lcorehttp_tls_options* options) {
+    if (options->caFile != NULL) {
+        return mbedtls_x509_crt_parse_file(&config->ca, options->caFile) >= 0 ? 0 : -1;
+    }
+    if (options->ca != NULL) {
+        return mbedtls_x509_crt_parse(&config->ca, (const unsigned char*)options->ca, options->caLen) >= 0 ? 0 : -1;
+    }
+    for (size_t i = 0; systemBundles[i] != NULL; i++) {
+        // a bundle with a few unparsable certificates is still usable, a positive result counts those
+        if (mbedtls_x509_crt_parse_file(&config->ca, systemBundles[i]) >= 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// client certificate and key, both or neither
+static const char*
+tls_config_load_own_cert(lcorehttp_tls_config* config, const lcorehttp_tls_options* options) {
+    int hasCert = options->certFile != NULL || options->cert != NULL;
+    int hasKey = options->keyFile != NULL || options->key != NULL;
+    if (!hasCert && !hasKey) {
+        return NULL;
+    }
+    if (!hasCert || !hasKey) {
+        return "tls client certificate and key have to be given together";
+    }
+    int ret = options->certFile != NULL
+                  ? mbedtls_x509_crt_parse_file(&config->cert, options->certFile)
+                  : mbedtls_x509_crt_parse(&config->cert, (const unsigned char*)options->cert, options->certLen);
+    if (ret != 0) {
+        return "failed to load tls client certificate";
+    }
+    const char* password = options->keyPassword;
+    if (options->keyFile != NULL) {
+        ret = mbedtls_pk_parse_keyfile(&config->key, options->keyFile, password, tls_config_random, config);
+    } else {
+        ret = mbedtls_pk_parse_key(&config->key, (const unsigned char*)options->key, options->keyLen,
+                                   (const unsigned char*)password, password != NULL ? strlen(password) : 0,
+                                   tls_config_random, config);
+    }
+    if (ret != 0) {
+        return "failed to load tls client key";
+    }
+    if (mbedtls_ssl_conf_own_cert(&config->conf, &config->cert, &config->key) != 0) {
+        return "failed to set tls client certificate";
+    }
+    return NULL;
+}
+
+static const char*
+tls_config_set_ciphersuites(lcorehttp_tls_config* config, const int* ciphersuites) {
+    if (ciphersuites == NULL) {
+        return NULL;
+    }
+    size_t count = 0;
+    while (ciphersuites[count] != 0) {
+        count++;
+    }
+    config->ciphersuites = malloc((count + 1) * sizeof(int));
+    if (config->ciphersuites == NULL) {
+        return "failed to allocate tls configuration";
+    }
+    memcpy(config->ciphersuites, ciphersuites, (count + 1) * sizeof(int));
+    mbedtls_ssl_conf_ciphersuites(&config->conf, config->ciphersuites);
+    return NULL;
+}
+
+const char*
+lcorehttp_tls_config_new(const lcorehttp_tls_options* options, lcorehttp_tls_config** outConfig) {
+    *outConfig = NULL;
+    if (psa_crypto_init() != PSA_SUCCESS) {
+        return "failed to initialize PSA crypto";
+    }
+    lcorehttp_tls_config* config = calloc(1, sizeof(lcorehttp_tls_config));
+    if (config == NULL) {
+        return "failed to allocate tls configuration";
+    }
+#ifndef _WIN32
+    pthread_mutex_init(&config->lock, NULL);
+#endif
+    config->refs = 1;
+    config->earlyData = options->earlyData;
+    config->ktls = options->ktls;
+    config->http2 = options->http2;
+    mbedtls_ssl_config_init(&config->conf);
+    mbedtls_x509_crt_init(&config->ca);
+    mbedtls_x509_crt_init(&config->cert);
+    mbedtls_pk_init(&config->key);
+    mbedtls_entropy_init(&config->entropy);
+    mbedtls_ctr_drbg_init(&config->drbg);
+
+    static const unsigned char personalization[] = "lcorehttp";
+    if (mbedtls_ctr_drbg_seed(&config->drbg, mbedtls_entropy_func, &config->entropy, personalization,
+                              sizeof(personalization) - 1)
+        != 0) {
+        tls_config_free(config);
+        return "failed to seed tls random generator";
+    }
+    if (options->verify && tls_config_load_ca(config, options) != 0) {
+        tls_config_free(config);
+        return "failed to load tls ca bundle";
+    }
+    if (mbedtls_ssl_config_defaults(&config->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT)
+        != 0) {
+        tls_config_free(config);
+        return "failed to set up tls configuration";
+    }
+    mbedtls_ssl_conf_rng(&config->conf, tls_config_random, config);
+    if (options->verify) {
+        mbedtls_ssl_conf_authmode(&config->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&config->conf, &config->ca, NULL);
+    } else {
+        mbedtls_ssl_conf_authmode(&config->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    const char* error = tls_config_load_own_cert(config, options);
+    if (error == NULL) {
+        error = tls_config_set_ciphersuites(config, options->ciphersuites);
+    }
+    if (error != NULL) {
+        tls_config_free(config);
+        return error;
+    }
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&config->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED)
+    // since 3.6.1 TLS 1.3 tickets are only handed to the application on request
+    mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(&config->conf,
+                                                             MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+    if (options->earlyData) {
+        mbedtls_ssl_conf_early_data(&config->conf, MBEDTLS_SSL_EARLY_DATA_ENABLED);
+    }
+#else
+    config->earlyData = 0;
+#endif
+#if defined(MBEDTLS_SSL_ALPN)
+    static const char* protocols[] = {"h2", "http/1.1", NULL};
+    if (options->http2 && mbedtls_ssl_conf_alpn_protocols(&config->conf, protocols) != 0) {
+        tls_config_free(config);
+        return "failed to set up tls alpn";
+    }
+#else
+    config->http2 = 0;
+#endif
+    *outConfig = config;
+    return NULL;
+}
+
+void
+lcorehttp_tls_config_retain(lcorehttp_tls_config* config) {
+    if (config != NULL) {
+        tls_config_lock(config);
+        config->refs++;
+        tls_config_unlock(config);
+    }
+}
+
+void
+lcorehttp_tls_config_release(lcorehttp_tls_config* config) {
+    if (config == NULL) {
+        return;
+    }
+    tls_config_lock(config);
+    int refs = --config->refs;
+    tls_config_unlock(config);
+    if (refs == 0) {
+        tls_config_free(config);
+    }
+}
+
+// moves the cached session of host:port into *session, tickets are used once (early data anti-replay)
+static int
+tls_config_take_session(lcorehttp_tls_config* config, const char* host, int port, mbedtls_ssl_session* session) {
+    int found = 0;
+    tls_config_lock(config);
+    for (size_t i = 0; i < config->sessionCount; i++) {
+        lcorehttp_tls_cached_session* cached = &config->sessions[i];
+        if (cached->port == port && strcmp(cached->host, host) == 0) {
+            *session = cached->session;
+            config->sessions[i] = config->sessions[--config->sessionCount];
+            if (config->sessionNext > config->sessionCount) {
+                config->sessionNext = 0;
+            }
+            found = 1;
+            break;
+        }
+    }
+    tls_config_unlock(config);
+    return found;
+}
+
+// takes ownership of session, replacing the entry of host:port or the oldest one
+static void
+tls_config_put_session(lcorehttp_tls_config* config, const char* host, int port, mbedtls_ssl_session* session) {
+    tls_config_lock(config);
+    lcorehttp_tls_cached_session* slot = NULL;
+    for (size_t i = 0; i < config->sessionCount && slot == NULL; i++) {
+        if (config->sessions[i].port == port && strcmp(config->sessions[i].host, host) == 0) {
+            slot = &config->sessions[i];
+        }
+    }
+    if (slot == NULL && config->sessionCount < LCOREHTTP_TLS_SESSION_CACHE_SIZE) {
+        slot = &config->sessions[config->sessionCount++];
+    } else {
+        if (slot == NULL) {
+            slot = &config->sessions[config->sessionNext];
+            config->sessionNext = (config->sessionNext + 1) % LCOREHTTP_TLS_SESSION_CACHE_SIZE;
+        }
+        mbedtls_ssl_session_free(&slot->session);
+    }
+    snprintf(slot->host, sizeof(slot->host), "%s", host);
+    slot->port = port;
+    slot->session = *session;
+    tls_config_unlock(config);
+}
+
+static int
+tls_bio_send(void* ctx, const unsigned char* buf, size_t len) {
+    int32_t sent = lcorehttp_socket_send((NetworkContext_t*)ctx, buf, len);
+    if (sent > 0) {
+        return (int)sent;
+    }
+    return sent == 0 ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+static int
+tls_bio_recv(void* ctx, unsigned char* buf, size_t len) {
+    lcorehttp_socket* socket = ctx;
+    int32_t received = lcorehttp_socket_recv((NetworkContext_t*)socket, buf, len);
+    if (received > 0) {
+        return (int)received;
+    }
+    if (received < 0) {
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    return socket->peerClosed ? 0 : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+static void
+tls_store_session(lcorehttp_tls* tls) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_get_session(&tls->ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+    tls_config_put_session(tls->config, tls->host, tls->port, &session);
+}
+
+static int
+tls_want_io(int ret) {
+    return ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+static const char*
+tls_handshake(lcorehttp_tls* tls) {
+    uint64_t deadline = l_corehttp_get_time_us() + (uint64_t)tls->handshakeTimeoutMs * 1000;
+    int ret = 0;
+    while ((ret = mbedtls_ssl_handshake(&tls->ssl)) != 0) {
+        if (!tls_want_io(ret)) {
+            return "tls handshake failed";
+        }
+        if (l_corehttp_get_time_us() >= deadline) {
+            return "tls handshake timed out";
+        }
+    }
+    tls->handshakeDone = 1;
+    if (tls->ktls != NULL) {
+        lcorehttp_ktls_offload(tls->ktls, &tls->ssl, tls->socket);
+    }
+    // TLS 1.2 sessions are resumable right away, TLS 1.3 tickets arrive after the handshake (see recv)
+    if (mbedtls_ssl_get_version_number(&tls->ssl) == MBEDTLS_SSL_VERSION_TLS1_2) {
+        tls_store_session(tls);
+    }
+    return NULL;
+}
+
+const char*
+lcorehttp_tls_connect(const char* host, int port, const lcorehttp_socket_options* options,
+                      lcorehttp_tls_config* config, lcorehttp_timings* timings, lcorehttp_tls** outTls) {
+    *outTls = NULL;
+    if (strlen(host) > LCOREHTTP_TLS_MAXIMUM_HOST) {
+        return "invalid hostname";
+    }
+    lcorehttp_socket* socket = NULL;
+    const char* error = lcorehttp_socket_connect(host, port, options, timings, &socket);
+    if (error != NULL) {
+        return error;
+    }
+    lcorehttp_tls* tls = calloc(1, sizeof(lcorehttp_tls));
+    if (tls == NULL) {
+        lcorehttp_socket_close((NetworkContext_t*)socket);
+        return "failed to allocate tls connection";
+    }
+    tls->socket = socket;
+    tls->config = config;
+    lcorehttp_tls_config_retain(config);
+    snprintf(tls->host, sizeof(tls->host), "%s", host);
+    tls->port = port;
+    tls->handshakeTimeoutMs = options->connectTimeoutMs;
+    mbedtls_ssl_init(&tls->ssl);
+    if (mbedtls_ssl_setup(&tls->ssl, &config->conf) != 0 || mbedtls_ssl_set_hostname(&tls->ssl, host) != 0) {
+        lcorehttp_tls_close((NetworkContext_t*)tls);
+        return "failed to set up tls connection";
+    }
+    mbedtls_ssl_set_bio(&tls->ssl, socket, tls_bio_send, tls_bio_recv, NULL);
+    if (config->ktls) {
+        tls->ktls = calloc(1, sizeof(lcorehttp_ktls)); // without it the connection simply stays in userspace
+        if (tls->ktls != NULL) {
+            lcorehttp_ktls_attach(tls->ktls, &tls->ssl);
+        }
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int resumed = tls_config_take_session(config, host, port, &session)
+                  && mbedtls_ssl_set_session(&tls->ssl, &session) == 0;
+    mbedtls_ssl_session_free(&session);
+    if (resumed && config->earlyData) {
+        *outTls = tls; // the handshake starts with the first send, which may carry early data
+        return NULL;
+    }
+
+    uint64_t handshakeStart = l_corehttp_get_time_us();
+    error = tls_handshake(tls);
+    if (error != NULL) {
+        lcorehttp_tls_close((NetworkContext_t*)tls);
+        return error;
+    }
+    timings->tlsHandshake = (int64_t)(l_corehttp_get_time_us() - handshakeStart);
+    *outTls = tls;
+    return NULL;
+}
+
+// writes as much of the data as the ticket allows as early data, 0 when early data cannot be used
+static int
+tls_write_early_data(lcorehttp_tls* tls, const void* pBuffer, size_t bytesToSend) {
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+    uint64_t deadline = l_corehttp_get_time_us() + (uint64_t)tls->handshakeTimeoutMs * 1000;
+    int ret = 0;
+    while ((ret = mbedtls_ssl_write_early_data(&tls->ssl, pBuffer, bytesToSend)) < 0) {
+        if (!tls_want_io(ret) || l_corehttp_get_time_us() >= deadline) {
+            return 0; // MBEDTLS_ERR_SSL_CANNOT_WRITE_EARLY_DATA: the ticket does not allow it
+        }
+    }
+    return ret;
+#else
+    (void)tls;
+    (void)pBuffer;
+    (void)bytesToSend;
+    return 0;
+#endif
+}
+
+int32_t
+lcorehttp_tls_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend) {
+    lcorehttp_tls* tls = (lcorehttp_tls*)pNetworkContext;
+    if (!tls->handshakeDone) {
+        int early = tls->earlyDataAllowed ? tls_write_early_data(tls, pBuffer, bytesToSend) : 0;
+        if (tls_handshake(tls) != NULL) {
+            return -1;
+        }
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+        if (early > 0 && mbedtls_ssl_get_early_data_status(&tls->ssl) == MBEDTLS_SSL_EARLY_DATA_STATUS_ACCEPTED) {
+            tls->earlyDataAccepted = 1;
+            return early;
+        }
+#else
+        (void)early;
+#endif
+        // rejected early data was discarded by the server, it goes out again as application data
+    }
+    if (tls->ktls != NULL && tls->ktls->tx) {
+        return lcorehttp_socket_send((NetworkContext_t*)tls->socket, pBuffer, bytesToSend);
+    }
+    int ret = mbedtls_ssl_write(&tls->ssl, pBuffer, bytesToSend);
+    if (ret >= 0) {
+        return ret;
+    }
+    return tls_want_io(ret) ? 0 : -1;
+}
+
+int32_t
+lcorehttp_tls_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv) {
+    lcorehttp_tls* tls = (lcorehttp_tls*)pNetworkContext;
+    if (!tls->handshakeDone && tls_handshake(tls) != NULL) {
+        return -1;
+    }
+    if (tls->ktls != NULL && tls->ktls->rx) {
+        return lcorehttp_ktls_recv(tls->ktls, tls->socket, pBuffer, bytesToRecv);
+    }
+    while (1) {
+        int ret = mbedtls_ssl_read(&tls->ssl, pBuffer, bytesToRecv);
+        if (ret > 0) {
+            return ret;
+        }
+        if (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) {
+            tls_store_session(tls);
+            continue;
+        }
+        if (tls_want_io(ret)) {
+            return 0;
+        }
+        if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF) {
+            tls->socket->peerClosed = 1; // reported as "no more data" like the plain socket does
+            tls->socket->drained = 1;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+void
+lcorehttp_tls_close(NetworkContext_t* pNetworkContext) {
+    lcorehttp_tls* tls = (lcorehttp_tls*)pNetworkContext;
+    if (tls == NULL) {
+        return;
+    }
+    if (tls->handshakeDone && !tls->socket->peerClosed) {
+        // best effort, the socket is closed right after
+        if (tls->ktls != NULL && tls->ktls->tx) {
+            lcorehttp_ktls_close_notify(tls->socket);
+        } else {
+            mbedtls_ssl_close_notify(&tls->ssl);
+        }
+    }
+    mbedtls_ssl_free(&tls->ssl);
+    if (tls->ktls != NULL) {
+        mbedtls_platform_zeroize(tls->ktls, sizeof(lcorehttp_ktls));
+        free(tls->ktls);
+    }
+    lcorehttp_socket_close((NetworkContext_t*)tls->socket);
+    lcorehttp_tls_config_release(tls->config);
+    free(tls);
+}
+
+lcorehttp_socket*
+lcorehttp_transport_socket(const TransportInterface_t* transport) {
+    if (transport->recv == lcorehttp_socket_recv) {
+        return (lcorehttp_socket*)transport->pNetworkContext;
+    }
+    if (transport->recv == lcorehttp_tls_recv) {
+        return ((lcorehttp_tls*)transport->pNetworkContext)->socket;
+    }
+    return NULL;
+}
+
+int
+lcorehttp_tls_allow_early_data(const TransportInterface_t* transport) {
+    if (transport->recv != lcorehttp_tls_recv) {
+        return 0;
+    }
+    lcorehttp_tls* tls = (lcorehttp_tls*)transport->pNetworkContext;
+    tls->earlyDataAllowed = tls->config->earlyData && !tls->handshakeDone;
+    return tls->earlyDataAllowed;
+}
+
+int
+lcorehttp_tls_early_data_accepted(const TransportInterface_t* transport) {
+    return transport->recv == lcorehttp_tls_recv && ((lcorehttp_tls*)transport->pNetworkContext)->earlyDataAccepted;
+}
+
+int
+lcorehttp_tls_http2(const lcorehttp_tls* tls) {
+#if defined(MBEDTLS_SSL_ALPN)
+    const char* protocol = tls->config->http2 ? mbedtls_ssl_get_alpn_protocol(&tls->ssl) : NULL;
+    return protocol != NULL && strcmp(protocol, "h2") == 0;
+#else
+    (void)tls;
+    return 0;
+#endif
+}
+
+int
+lcorehttp_tls_config_option(lua_State* L, int optionsIdx, lcorehttp_tls_config** outConfig) {
+    *outConfig = NULL;
+    lua_getfield(L, optionsIdx, "tls_config");
+    int result = 0;
+    if (!lua_isnil(L, -1)) {
+        lcorehttp_tls_config** box = luaL_testudata(L, -1, LCOREHTTP_TLS_CONFIG_METATABLE);
+        if (box != NULL) {
+            *outConfig = *box;
+        } else {
+            result = -1;
+        }
+    }
+    lua_pop(L, 1);
+    return result;
+}
+
+// string option, NULL when absent, the value stays referenced by the options table
+static const char*
+tls_string_option(lua_State* L, int optionsIdx, const char* name, size_t* len) {
+    lua_getfield(L, optionsIdx, name);
+    const char* value = NULL;
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        value = lua_tolstring(L, -1, len);
+    } else if (!lua_isnil(L, -1)) {
+        luaL_error(L, "invalid %s", name);
+    }
+    lua_pop(L, 1);
+    return value;
+}
+
+// tls_config(options?) - options: ca_file, ca, cert_file, cert, key_file, key, key_password, ciphers, verify,
+// early_data, ktls, http2
+int
+l_corehttp_tls_config(lua_State* L) {
+    lua_settop(L, 1);
+    lcorehttp_tls_options options = {.verify = 1};
+    if (lua_istable(L, 1)) {
+        size_t len = 0;
+        options.caFile = tls_string_option(L, 1, "ca_file", &len);
+        options.ca = tls_string_option(L, 1, "ca", &options.caLen);
+        options.certFile = tls_string_option(L, 1, "cert_file", &len);
+        options.cert = tls_string_option(L, 1, "cert", &options.certLen);
+        options.keyFile = tls_string_option(L, 1, "key_file", &len);
+        options.key = tls_string_option(L, 1, "key", &options.keyLen);
+        options.keyPassword = tls_string_option(L, 1, "key_password", &len);
+        // PEM data is parsed including its NUL terminator
+        options.caLen += options.ca != NULL ? 1 : 0;
+        options.certLen += options.cert != NULL ? 1 : 0;
+        options.keyLen += options.key != NULL ? 1 : 0;
+        lua_getfield(L, 1, "verify");
+        options.verify = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_getfield(L, 1, "early_data");
+        options.earlyData = lua_toboolean(L, -1);
+        lua_getfield(L, 1, "ktls");
+        options.ktls = lua_toboolean(L, -1);
+        lua_getfield(L, 1, "http2");
+        options.http2 = lua_toboolean(L, -1);
+        lua_pop(L, 4);
+        if (options.earlyData && options.ktls) {
+            // the kernel receive path drops NewSessionTicket, there would never be a session to send early data on
+            return luaL_error(L, "early_data cannot be combined with ktls");
+        }
+        if (options.earlyData && options.http2) {
+            // early data is written before the server picked the protocol
+            return luaL_error(L, "early_data cannot be combined with http2");
+        }
+
+        lua_getfield(L, 1, "ciphers"); // 2
+        if (lua_istable(L, 2)) {
+            size_t count = lua_rawlen(L, 2);
+            int* ciphersuites = lua_newuserdatauv(L, (count + 1) * sizeof(int), 0); // freed with the stack
+            for (size_t i = 0; i < count; i++) {
+                lua_rawgeti(L, 2, (lua_Integer)i + 1);
+                const char* name = lua_tostring(L, -1);
+                ciphersuites[i] = name != NULL ? mbedtls_ssl_get_ciphersuite_id(name) : 0;
+                if (ciphersuites[i] == 0) {
+                    return luaL_error(L, "unknown cipher suite %s", name != NULL ? name : "?");
+                }
+                lua_pop(L, 1);
+            }
+            ciphersuites[count] = 0;
+            options.ciphersuites = count > 0 ? ciphersuites : NULL;
+        } else if (!lua_isnil(L, 2)) {
+            return luaL_error(L, "invalid ciphers");
+        }
+    }
+
+    lcorehttp_tls_config** box = lua_newuserdatauv(L, sizeof(lcorehttp_tls_config*), 0);
+    *box = NULL;
+    luaL_getmetatable(L, LCOREHTTP_TLS_CONFIG_METATABLE);
+    lua_setmetatable(L, -2);
+    const char* error = lcorehttp_tls_config_new(&options, box);
+    if (error != NULL) {
+        return push_error(L, error);
+    }
+    return 1;
+}
+
+static int
+l_corehttp_tls_config_gc(lua_State* L) {
+    lcorehttp_tls_config** box = luaL_checkudata(L, 1, LCOREHTTP_TLS_CONFIG_METATABLE);
+    lcorehttp_tls_config_release(*box); // clients and connections using it keep their own reference
+    *box = NULL;
+    return 0;
+}
+
+int
+l_corehttp_tls_config_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_TLS_CONFIG_METATABLE);
+    lua_pushcfunction(L, l_corehttp_tls_config_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushstring(L, LCOREHTTP_TLS_CONFIG_METATABLE);
+    lua_setfield(L, -2, "__type");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef LCOREHTTP_TLS_H
+#define LCOREHTTP_TLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lcorehttp_ktls.h"
+#include "lcorehttp_socket.h"
+#include "lua.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include "transport_interface.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+struct lcorehttp_timings;
+
+#define LCOREHTTP_TLS_SESSION_CACHE_SIZE 16
+#define LCOREHTTP_TLS_MAXIMUM_HOST       255
+
+typedef struct lcorehttp_tls_options {
+    const char* caFile; // PEM bundle, NULL: ca or the first system bundle found
+    const char* ca;     // PEM (NUL terminated) or DER certificates in memory
+    size_t caLen;
+    const char* certFile; // client certificate chain, file or memory
+    const char* cert;
+    size_t certLen;
+    const char* keyFile; // client private key, file or memory
+    const char* key;
+    size_t keyLen;
+    const char* keyPassword;
+    const int* ciphersuites; // 0 terminated mbedTLS ids, NULL: library defaults
+    int verify;              // 0 skips certificate verification
+    int earlyData;           // send idempotent requests as TLS 1.3 early data on resumed sessions
+    int ktls;                // hand record encryption to the kernel after the handshake (Linux), session tickets
+                             // are then dropped by the receive path: no resumption, excludes earlyData
+    int http2;               // offer h2 with ALPN, excludes earlyData (the protocol is known after the handshake)
+} lcorehttp_tls_options;
+
+typedef struct lcorehttp_tls_cached_session {
+    char host[LCOREHTTP_TLS_MAXIMUM_HOST + 1];
+    int port;
+    mbedtls_ssl_session session;
+} lcorehttp_tls_cached_session;
+
+#define LCOREHTTP_TLS_CONFIG_METATABLE "COREHTTP_TLS_CONFIG"
+
+/*
+ * Parsed mbedTLS client configuration of the native TLS connector, with the session tickets it was issued.
+ * Shared by corehttp.tls_config objects, clients and the async jobs copied from them, hence reference counted
+ * and locked.
+ */
+typedef struct lcorehttp_tls_config {
+#ifndef _WIN32
+    pthread_mutex_t lock; // refs, session cache and the DRBG
+#endif
+    int refs;
+    int earlyData;
+    int ktls;
+    int http2; // h2 is offered, 0 when mbedTLS was built without ALPN
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt ca;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+    int* ciphersuites; // referenced by conf
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    lcorehttp_tls_cached_session sessions[LCOREHTTP_TLS_SESSION_CACHE_SIZE];
+    size_t sessionCount;
+    size_t sessionNext; // slot replaced when the cache is full
+} lcorehttp_tls_config;
+
+/*
+ * TLS connection over a native socket. With early data enabled and a resumable session the handshake is
+ * deferred to the first send, which may then carry the request as 0-RTT data.
+ */
+typedef struct lcorehttp_tls {
+    lcorehttp_socket* socket;
+    mbedtls_ssl_context ssl;
+    lcorehttp_tls_config* config; // retained by the connection
+    char host[LCOREHTTP_TLS_MAXIMUM_HOST + 1];
+    int port;
+    uint32_t handshakeTimeoutMs;
+    int handshakeDone;
+    int earlyDataAllowed;  // the request about to be sent is idempotent
+    int earlyDataAccepted; // the server processed the first send as early data
+    lcorehttp_ktls* ktls;  // NULL without the ktls option
+} lcorehttp_tls;
+
+/**
+ * @brief Parse certificates, key and cipher list and seed the DRBG once into a client configuration.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* lcorehttp_tls_config_new(const lcorehttp_tls_options* options, lcorehttp_tls_config** outConfig);
+void lcorehttp_tls_config_retain(lcorehttp_tls_config* config);
+void lcorehttp_tls_config_release(lcorehttp_tls_config* config);
+
+/**
+ * @brief Connect with the native connector and set up TLS, resuming a cached session for host and port.
+ *
+ * @return NULL on success, static error message otherwise.
+ */
+const char* lcorehttp_tls_connect(const char* host, int port, const lcorehttp_socket_options* options,
+                                  lcorehttp_tls_config* config, struct lcorehttp_timings* timings,
+                                  lcorehttp_tls** outTls);
+
+int32_t lcorehttp_tls_recv(NetworkContext_t* pNetworkContext, void* pBuffer, size_t bytesToRecv);
+int32_t lcorehttp_tls_send(NetworkContext_t* pNetworkContext, const void* pBuffer, size_t bytesToSend);
+void lcorehttp_tls_close(NetworkContext_t* pNetworkContext);
+
+// native socket below a native transport (plain or TLS), NULL for lua-simple-socket connections
+lcorehttp_socket* lcorehttp_transport_socket(const TransportInterface_t* transport);
+// lets the first send of a fresh native TLS connection go out as early data, 0 when it cannot
+int lcorehttp_tls_allow_early_data(const TransportInterface_t* transport);
+// the server accepted the request as early data (it may still answer 425 Too Early)
+int lcorehttp_tls_early_data_accepted(const TransportInterface_t* transport);
+// the handshake negotiated h2 with ALPN
+int lcorehttp_tls_http2(const lcorehttp_tls* tls);
+
+/**
+ * @brief Configuration of the tls_config option of the table at optionsIdx.
+ *
+ * @return 0 with *outConfig set (NULL when absent, not retained), -1 when the value is not a tls_config object.
+ */
+int lcorehttp_tls_config_option(lua_State* L, int optionsIdx, lcorehttp_tls_config** outConfig);
+
+int l_corehttp_tls_config(lua_State* L);
+int l_corehttp_tls_config_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_TLS_H */
@@ -0,0 +1,412 @@
+#include "lcorehttp_uring.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(LCOREHTTP_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(LCOREHTTP_IO_URING) && defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "lcorehttp_time.h"
+
+#define URING_ENTRIES           8
+#define URING_RECV_BUFFERS      8 /* power of two, size of the provided buffer ring */
+#define URING_RECV_BUFFER_SIZE  16384
+#define URING_BUFFER_GROUP      0
+#define URING_RECV_TAG          1
+#define URING_SEND_TAG          2
+#define URING_CANCEL_TAG        3
+#define URING_CANCEL_TIMEOUT_MS 1000
+
+// a completed receive still holding its provided buffer
+typedef struct uring_segment {
+    uint16_t bid;
+    uint32_t offset;
+    uint32_t len;
+} uring_segment;
+
+struct lcorehttp_uring {
+    int ringFd;
+    int fd;
+    // submission queue, the tail is only written by us
+    void* sqMap;
+    size_t sqMapLen;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe* sqes;
+    size_t sqesLen;
+    unsigned toSubmit;
+    // completion queue, the head is only written by us
+    void* cqMap;
+    size_t cqMapLen;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    // provided buffers of the multishot recv
+    struct io_uring_buf_ring* bufRing;
+    size_t bufRingLen;
+    uint8_t* buffers;
+    uint16_t bufTail;
+    int recvArmed;
+    int peerClosed; // reported once the segments before it were handed out
+    int recvError;
+    int recvUnsupported; // multishot recv rejected by the kernel
+    uring_segment segments[URING_RECV_BUFFERS]; // FIFO, each holds one distinct buffer
+    unsigned segmentHead;
+    unsigned segmentCount;
+    int sendDone;
+    int32_t sendResult;
+};
+
+static int
+uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_register(int ringFd, unsigned opcode, void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, count);
+}
+
+// submits the queued entries and waits up to timeoutMs for one completion when wait is set
+static int
+uring_enter(lcorehttp_uring* ring, int wait, uint32_t timeoutMs) {
+    struct __kernel_timespec ts = {.tv_sec = timeoutMs / 1000, .tv_nsec = (long long)(timeoutMs % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {.sigmask = 0, .sigmask_sz = _NSIG / 8, .pad = 0, .ts = (uint64_t)&ts};
+    unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+    int submitted = (int)syscall(__NR_io_uring_enter, ring->ringFd, ring->toSubmit, wait ? 1 : 0, flags, &arg,
+                                 sizeof(arg));
+    if (submitted < 0) {
+        // ETIME: nothing completed in time, EINTR/EAGAIN/EBUSY: the caller polls again
+        return (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) ? 0 : -1;
+    }
+    ring->toSubmit -= (unsigned)submitted < ring->toSubmit ? (unsigned)submitted : ring->toSubmit;
+    return 0;
+}
+
+static struct io_uring_sqe*
+uring_sqe(lcorehttp_uring* ring) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sqTail;
+    if (tail - head >= ring->sqEntries) {
+        return NULL;
+    }
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+    return sqe;
+}
+
+static void
+uring_provide_buffer(lcorehttp_uring* ring, uint16_t bid) {
+    struct io_uring_buf* buf = &ring->bufRing->bufs[ring->bufTail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+static int
+uring_arm_recv(lcorehttp_uring* ring) {
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ring->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECV_TAG;
+    ring->recvArmed = 1;
+    return 0;
+}
+
+static void
+uring_reap(lcorehttp_uring* ring) {
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+        if (cqe->user_data == URING_SEND_TAG) {
+            ring->sendDone = 1;
+            ring->sendResult = cqe->res;
+            continue;
+        }
+        if (cqe->user_data != URING_RECV_TAG) {
+            continue; // cancel requests
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring->recvArmed = 0;
+        }
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            uring_segment* segment =
+                &ring->segments[(ring->segmentHead + ring->segmentCount) & (URING_RECV_BUFFERS - 1)];
+            segment->bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            segment->offset = 0;
+            segment->len = (uint32_t)cqe->res;
+            ring->segmentCount++;
+        } else if (cqe->res == 0) {
+            ring->peerClosed = 1;
+        } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+            ring->recvUnsupported = 1;
+        } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            ring->recvError = 1; // ENOBUFS: every buffer is queued, re-armed once they were handed out
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static void
+uring_unmap(lcorehttp_uring* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesLen);
+    }
+    if (ring->cqMap != NULL && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapLen);
+    }
+    if (ring->sqMap != NULL) {
+        munmap(ring->sqMap, ring->sqMapLen);
+    }
+    if (ring->ringFd >= 0) {
+        close(ring->ringFd);
+    }
+    if (ring->bufRing != NULL) {
+        munmap(ring->bufRing, ring->bufRingLen);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+lcorehttp_uring*
+lcorehttp_uring_new(int fd) {
+    lcorehttp_uring* ring = calloc(1, sizeof(lcorehttp_uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->fd = fd;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ringFd = uring_setup(URING_ENTRIES, &params);
+    if (ring->ringFd < 0 || !(params.features & IORING_FEAT_EXT_ARG)) {
+        uring_unmap(ring); // ENOSYS, or disabled by seccomp / kernel.io_uring_disabled
+        return NULL;
+    }
+
+    ring->sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        ring->sqMapLen = ring->cqMapLen = ring->sqMapLen > ring->cqMapLen ? ring->sqMapLen : ring->cqMapLen;
+    }
+    void* map = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+                     IORING_OFF_SQ_RING);
+    ring->sqMap = map == MAP_FAILED ? NULL : map;
+    if (ring->sqMap != NULL && singleMap) {
+        ring->cqMap = ring->sqMap;
+    } else if (ring->sqMap != NULL) {
+        map = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+                   IORING_OFF_CQ_RING);
+        ring->cqMap = map == MAP_FAILED ? NULL : map;
+    }
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+               IORING_OFF_SQES);
+    ring->sqes = map == MAP_FAILED ? NULL : map;
+    if (ring->sqMap == NULL || ring->cqMap == NULL || ring->sqes == NULL) {
+        uring_unmap(ring);
+        return NULL;
+    }
+    uint8_t* sq = ring->sqMap;
+    uint8_t* cq = ring->cqMap;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // provided buffer ring (5.19+), the ring memory has to be page aligned
+    ring->bufRingLen = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    map = mmap(NULL, ring->bufRingLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufRing = map == MAP_FAILED ? NULL : map;
+    ring->buffers = malloc((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    if (ring->bufRing == NULL || ring->buffers == NULL) {
+        uring_unmap(ring);
+        return NULL;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(ring->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        uring_unmap(ring);
+        return NULL;
+    }
+    for (uint16_t bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+        uring_provide_buffer(ring, bid);
+    }
+    return ring;
+}
+
+void
+lcorehttp_uring_free(lcorehttp_uring* ring) {
+    if (ring == NULL) {
+        return;
+    }
+    // the kernel must be done with the provided buffers before they are freed
+    if (ring->recvArmed) {
+        struct io_uring_sqe* sqe = uring_sqe(ring);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_RECV_TAG;
+            sqe->user_data = URING_CANCEL_TAG;
+        }
+        uint64_t deadline = l_corehttp_get_time_us() + URING_CANCEL_TIMEOUT_MS * 1000ULL;
+        while (ring->recvArmed && l_corehttp_get_time_us() < deadline) {
+            if (uring_enter(ring, 1, URING_CANCEL_TIMEOUT_MS) != 0) {
+                break;
+            }
+            uring_reap(ring);
+        }
+    }
+    uring_unmap(ring);
+}
+
+int32_t
+lcorehttp_uring_recv(lcorehttp_uring* ring, void* buffer, size_t len, uint32_t timeoutMs, int* peerClosed) {
+    uring_reap(ring);
+    if (ring->segmentCount == 0 && !ring->peerClosed && !ring->recvError && !ring->recvUnsupported) {
+        if (!ring->recvArmed && uring_arm_recv(ring) != 0) {
+            return -1;
+        }
+        if (uring_enter(ring, 1, timeoutMs) != 0) {
+            return -1;
+        }
+        uring_reap(ring);
+    }
+    if (ring->segmentCount > 0) {
+        uring_segment* segment = &ring->segments[ring->segmentHead];
+        size_t count = len < segment->len ? len : segment->len;
+        memcpy(buffer, ring->buffers + (size_t)segment->bid * URING_RECV_BUFFER_SIZE + segment->offset, count);
+        segment->offset += (uint32_t)count;
+        segment->len -= (uint32_t)count;
+        if (segment->len == 0) {
+            uring_provide_buffer(ring, segment->bid);
+            ring->segmentHead = (ring->segmentHead + 1) & (URING_RECV_BUFFERS - 1);
+            ring->segmentCount--;
+        }
+        return (int32_t)count;
+    }
+    if (ring->recvUnsupported) {
+        return LCOREHTTP_URING_UNSUPPORTED;
+    }
+    if (ring->peerClosed) {
+        *peerClosed = 1;
+        return 0;
+    }
+    return ring->recvError ? -1 : 0;
+}
+
+int32_t
+lcorehttp_uring_send(lcorehttp_uring* ring, const void* buffer, size_t len, uint32_t timeoutMs) {
+    // a recv re-armed here starts collecting the response without a syscall of its own
+    if (!ring->recvArmed && ring->segmentCount == 0 && !ring->peerClosed && !ring->recvError
+        && !ring->recvUnsupported) {
+        uring_arm_recv(ring);
+    }
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = ring->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = len > INT32_MAX ? INT32_MAX : (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_SEND_TAG;
+    ring->sendDone = 0;
+
+    uint64_t deadline = l_corehttp_get_time_us() + (uint64_t)timeoutMs * 1000ULL;
+    int cancelled = 0;
+    while (!ring->sendDone) {
+        uint64_t now = l_corehttp_get_time_us();
+        if (now >= deadline && !cancelled) {
+            // the send still points into the caller's buffer, it has to complete before we return
+            sqe = uring_sqe(ring);
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = URING_SEND_TAG;
+                sqe->user_data = URING_CANCEL_TAG;
+            }
+            cancelled = 1;
+        }
+        uint32_t waitMs = now < deadline ? (uint32_t)((deadline - now + 999) / 1000) : URING_CANCEL_TIMEOUT_MS;
+        if (uring_enter(ring, 1, waitMs) != 0) {
+            return -1;
+        }
+        uring_reap(ring);
+    }
+    if (ring->sendResult >= 0) {
+        return ring->sendResult;
+    }
+    // ECANCELED: timed out like a poll without POLLOUT, coreHTTP decides whether to retry
+    int error = -ring->sendResult;
+    if (error == EINVAL || error == EOPNOTSUPP) {
+        return LCOREHTTP_URING_UNSUPPORTED;
+    }
+    return (error == ECANCELED || error == EAGAIN || error == EINTR) ? 0 : -1;
+}
+
+#else
+
+lcorehttp_uring*
+lcorehttp_uring_new(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+void
+lcorehttp_uring_free(lcorehttp_uring* ring) {
+    (void)ring;
+}
+
+int32_t
+lcorehttp_uring_recv(lcorehttp_uring* ring, void* buffer, size_t len, uint32_t timeoutMs, int* peerClosed) {
+    (void)ring;
+    (void)buffer;
+    (void)len;
+    (void)timeoutMs;
+    (void)peerClosed;
+    return -1;
+}
+
+int32_t
+lcorehttp_uring_send(lcorehttp_uring* ring, const void* buffer, size_t len, uint32_t timeoutMs) {
+    (void)ring;
+    (void)buffer;
+    (void)len;
+    (void)timeoutMs;
+    return -1;
+}
+
+#endif
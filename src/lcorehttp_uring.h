@@ -0,0 +1,36 @@
+#ifndef LCOREHTTP_URING_H
+#define LCOREHTTP_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * io_uring backend of a native plaintext connection (io_uring option, Linux, LCOREHTTP_IO_URING builds).
+ * Receives run as one multishot recv into a ring of kernel-provided buffers: once armed, data that arrived
+ * meanwhile is handed out without a syscall. Sends are submitted together with a pending re-arm of the recv
+ * and reaped in the same io_uring_enter.
+ */
+typedef struct lcorehttp_uring lcorehttp_uring;
+
+/**
+ * @brief Set up a ring for the connected socket fd.
+ *
+ * @return NULL when io_uring is not compiled in or the kernel lacks provided buffer rings or timed waits; the
+ * connection then keeps using plain syscalls. Multishot recv is only known to be missing once the first recv
+ * completes, see LCOREHTTP_URING_UNSUPPORTED.
+ */
+lcorehttp_uring* lcorehttp_uring_new(int fd);
+// cancels the armed recv and releases the ring, the socket itself stays open
+void lcorehttp_uring_free(lcorehttp_uring* ring);
+
+/*
+ * Returned by recv and send when the kernel rejected the multishot recv (EINVAL, EOPNOTSUPP on kernels before
+ * 6.0): nothing was transferred, the caller frees the ring and repeats the call with plain syscalls.
+ */
+#define LCOREHTTP_URING_UNSUPPORTED (-2)
+
+// same contract as lcorehttp_socket_recv: 0 when nothing arrived within timeoutMs, *peerClosed set on EOF
+int32_t lcorehttp_uring_recv(lcorehttp_uring* ring, void* buffer, size_t len, uint32_t timeoutMs, int* peerClosed);
+int32_t lcorehttp_uring_send(lcorehttp_uring* ring, const void* buffer, size_t len, uint32_t timeoutMs);
+
+#endif /* LCOREHTTP_URING_H */
@@ -0,0 +1,1068 @@
+#include "lcorehttp_websocket.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "extended_core_http_client.h"
+#include "lcorehttp_client.h"
+#include "lcorehttp_metrics.h"
+#include "lcorehttp_pool.h"
+#include "lcorehttp_response.h"
+#include "lcorehttp_socket.h"
+#include "lcorehttp_tls.h"
+#include "lcorehttp_time.h"
+#include "lerror.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+
+#define WEBSOCKET_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_KEY_LENGTH       24 /* base64 of 16 random bytes */
+#define WEBSOCKET_ACCEPT_LENGTH    28 /* base64 of a SHA-1 digest */
+#define WEBSOCKET_INFLATE_CHUNK    4096
+#define WEBSOCKET_PROTOCOL_ERROR   1002
+#define WEBSOCKET_INVALID_PAYLOAD  1007
+#define WEBSOCKET_MESSAGE_TOO_BIG  1009
+#define WEBSOCKET_NORMAL_CLOSURE   1000
+#define WEBSOCKET_DEFLATE_EXTENSION "permessage-deflate"
+
+static const uint8_t deflateTail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+typedef enum ws_result {
+    WS_RESULT_CONTINUE, // control frame handled, keep reading
+    WS_RESULT_MESSAGE,
+    WS_RESULT_CLOSED,
+    WS_RESULT_TIMEOUT,
+    WS_RESULT_ERROR,
+} ws_result;
+
+void
+lcorehttp_websocket_mask(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t key[4], size_t phase) {
+    uint8_t rotated[8];
+    for (size_t i = 0; i < sizeof(rotated); i++) {
+        rotated[i] = key[(phase + i) & 3];
+    }
+    uint64_t key64 = 0;
+    memcpy(&key64, rotated, sizeof(key64));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, src + i, sizeof(word));
+        word ^= key64;
+        memcpy(dst + i, &word, sizeof(word));
+    }
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ rotated[i & 7];
+    }
+}
+
+// codes a close frame may carry (RFC 6455 7.4): 1004-1006 and 1015 are reserved, 1016-2999 are not assigned
+static int
+ws_close_code_valid(lua_Integer code) {
+    return (code >= 1000 && code <= 1014 && code != 1004 && code != 1005 && code != 1006)
+           || (code >= 3000 && code <= 4999);
+}
+
+// RFC 3629: no overlong forms, no surrogates, nothing past U+10FFFF
+static int
+ws_utf8_valid(const uint8_t* data, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (i + 8 <= len) {
+            uint64_t word = 0;
+            memcpy(&word, data + i, sizeof(word));
+            if ((word & 0x8080808080808080ULL) == 0) { // ASCII runs are checked 8 bytes at a time
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = data[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t continuation = 0;
+        uint32_t codepoint = 0;
+        uint32_t minimum = 0;
+        if ((c & 0xE0) == 0xC0) {
+            continuation = 1;
+            codepoint = c & 0x1F;
+            minimum = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            continuation = 2;
+            codepoint = c & 0x0F;
+            minimum = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            continuation = 3;
+            codepoint = c & 0x07;
+            minimum = 0x10000;
+        } else {
+            return 0;
+        }
+        if (len - i <= continuation) {
+            return 0;
+        }
+        for (size_t k = 1; k <= continuation; k++) {
+            if ((data[i + k] & 0xC0) != 0x80) {
+                return 0;
+            }
+            codepoint = (codepoint << 6) | (data[i + k] & 0x3F);
+        }
+        if (codepoint < minimum || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+            return 0;
+        }
+        i += continuation + 1;
+    }
+    return 1;
+}
+
+static void
+ws_random_seed(lcorehttp_websocket* ws) {
+    uint64_t seed = 0;
+    FILE* urandom = fopen("/dev/urandom", "rb");
+    if (urandom != NULL) {
+        if (fread(&seed, sizeof(seed), 1, urandom) != 1) {
+            seed = 0;
+        }
+        fclose(urandom);
+    }
+    seed ^= l_corehttp_get_time_us() ^ (uint64_t)(uintptr_t)ws;
+    ws->maskState = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// xorshift64*, masking keys only have to be unpredictable for intermediaries
+static uint32_t
+ws_random(lcorehttp_websocket* ws) {
+    uint64_t x = ws->maskState;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    ws->maskState = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void
+ws_shutdown(lcorehttp_websocket* ws) {
+    if (ws->transport != NULL) {
+        lcorehttp_transport_close(ws->client, ws->transport, 0);
+        ws->transport = NULL;
+    }
+}
+
+static void
+ws_release(lcorehttp_websocket* ws) {
+    ws_shutdown(ws);
+    if (ws->inflateReady) {
+        inflateEnd(&ws->inflater);
+        ws->inflateReady = 0;
+    }
+    if (ws->deflateReady) {
+        deflateEnd(&ws->deflater);
+        ws->deflateReady = 0;
+    }
+    free(ws->recvBuffer);
+    ws->recvBuffer = NULL;
+    free(ws->sendBuffer);
+    ws->sendBuffer = NULL;
+    lcorehttp_bytes_free(&ws->message);
+    lcorehttp_bytes_free(&ws->compressed);
+}
+
+static int
+ws_send_frame(lcorehttp_websocket* ws, int opcode, int fin, int rsv1, const uint8_t* payload, size_t len) {
+    if (ws->transport == NULL) {
+        return -1;
+    }
+    uint8_t* out = ws->sendBuffer;
+    size_t headerLen = 2;
+    out[0] = (uint8_t)((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+    if (len < 126) {
+        out[1] = (uint8_t)(0x80 | len);
+    } else if (len <= 0xFFFF) {
+        out[1] = 0x80 | 126;
+        out[2] = (uint8_t)(len >> 8);
+        out[3] = (uint8_t)len;
+        headerLen = 4;
+    } else {
+        out[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            out[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+        }
+        headerLen = 10;
+    }
+    uint32_t maskKey = ws_random(ws);
+    uint8_t key[4];
+    memcpy(key, &maskKey, sizeof(key));
+    memcpy(out + headerLen, key, sizeof(key));
+    headerLen += sizeof(key);
+
+    // the payload is masked into the send buffer piece by piece, the first piece goes out with the header
+    size_t sent = 0;
+    do {
+        size_t chunk = len - sent;
+        if (chunk > ws->sendCapacity - headerLen) {
+            chunk = ws->sendCapacity - headerLen;
+        }
+        if (chunk > 0) {
+            lcorehttp_websocket_mask(out + headerLen, payload + sent, chunk, key, sent);
+        }
+        if (HTTPClient_Write(ws->transport, l_corehttp_get_time_ms, out, headerLen + chunk, &ws->client->shaping)
+            != HTTPSuccess) {
+            return -1;
+        }
+        sent += chunk;
+        headerLen = 0;
+    } while (sent < len);
+    return 0;
+}
+
+static int
+ws_send_close(lcorehttp_websocket* ws, int code, const char* reason, size_t reasonLen) {
+    uint8_t payload[LCOREHTTP_WEBSOCKET_MAXIMUM_CONTROL_LENGTH];
+    size_t len = 0;
+    if (code > 0) {
+        payload[0] = (uint8_t)(code >> 8);
+        payload[1] = (uint8_t)code;
+        if (reasonLen > sizeof(payload) - 2) {
+            reasonLen = sizeof(payload) - 2;
+        }
+        if (reasonLen > 0) {
+            memcpy(payload + 2, reason, reasonLen);
+        }
+        len = 2 + reasonLen;
+    }
+    ws->closeSent = 1;
+    return ws_send_frame(ws, WS_OPCODE_CLOSE, 1, 0, payload, len);
+}
+
+// protocol violation by the server: close with code and drop the connection
+static ws_result
+ws_fail(lcorehttp_websocket* ws, int code, const char* message) {
+    if (message != NULL) {
+        snprintf(ws->error, sizeof(ws->error), "%s", message);
+    }
+    if (!ws->closeSent) {
+        ws_send_close(ws, code, NULL, 0);
+    }
+    ws_shutdown(ws);
+    return WS_RESULT_ERROR;
+}
+
+static ws_result
+ws_connection_lost(lcorehttp_websocket* ws) {
+    snprintf(ws->error, sizeof(ws->error), "connection closed without close frame");
+    ws_shutdown(ws);
+    return WS_RESULT_ERROR;
+}
+
+// 1: more bytes buffered, 0: deadline passed, -1: the connection is gone
+static int
+ws_fill(lcorehttp_websocket* ws, int64_t deadline) {
+    if (ws->recvStart > 0) {
+        memmove(ws->recvBuffer, ws->recvBuffer + ws->recvStart, ws->recvEnd - ws->recvStart);
+        ws->recvEnd -= ws->recvStart;
+        ws->recvStart = 0;
+    }
+    if (ws->recvEnd == ws->recvCapacity) {
+        return -1; // cannot happen, a frame header or control frame always fits
+    }
+    lcorehttp_socket* socket = lcorehttp_transport_socket(ws->transport);
+    while (1) {
+        uint32_t ioTimeoutMs = 0;
+        if (socket != NULL && deadline >= 0) { // do not block in poll beyond the caller's deadline
+            ioTimeoutMs = socket->ioTimeoutMs;
+            int64_t remainingMs = (deadline - (int64_t)l_corehttp_get_time_us()) / 1000 + 1;
+            if (remainingMs < (int64_t)ioTimeoutMs) {
+                socket->ioTimeoutMs = remainingMs > 0 ? (uint32_t)remainingMs : 1;
+            }
+        }
+        size_t granted = lcorehttp_shaping_acquire(&ws->client->shaping, 0, ws->recvCapacity - ws->recvEnd);
+        int32_t received = ws->transport->recv(ws->transport->pNetworkContext, ws->recvBuffer + ws->recvEnd, granted);
+        lcorehttp_shaping_refund(&ws->client->shaping, 0, received > 0 ? granted - (size_t)received : granted);
+        if (socket != NULL && deadline >= 0) {
+            socket->ioTimeoutMs = ioTimeoutMs;
+        }
+        if (received > 0) {
+            ws->recvEnd += (size_t)received;
+            lcorehttp_metrics_bytes_received((size_t)received);
+            return 1;
+        }
+        if (received < 0 || (socket != NULL && socket->peerClosed)) {
+            return -1;
+        }
+        if (deadline >= 0 && (int64_t)l_corehttp_get_time_us() >= deadline) {
+            return 0;
+        }
+    }
+}
+
+static int
+ws_inflate(lcorehttp_websocket* ws, const uint8_t* data, size_t len) {
+    z_stream* strm = &ws->inflater;
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = (uInt)len;
+    do {
+        if (lcorehttp_bytes_reserve(&ws->message, WEBSOCKET_INFLATE_CHUNK) != 0) {
+            snprintf(ws->error, sizeof(ws->error), "out of memory");
+            return -1;
+        }
+        size_t room = ws->message.capacity - ws->message.len;
+        strm->next_out = ws->message.data + ws->message.len;
+        strm->avail_out = (uInt)room;
+        int zRet = inflate(strm, Z_SYNC_FLUSH);
+        ws->message.len += room - strm->avail_out;
+        if (zRet != Z_OK && zRet != Z_BUF_ERROR && zRet != Z_STREAM_END) {
+            snprintf(ws->error, sizeof(ws->error), "inflate error");
+            return -1;
+        }
+        if (ws->message.len > ws->maxMessage) {
+            snprintf(ws->error, sizeof(ws->error), "message too large");
+            return -1;
+        }
+        if (zRet == Z_BUF_ERROR && strm->avail_out != 0) {
+            break;
+        }
+    } while (strm->avail_in > 0 || strm->avail_out == 0);
+    return 0;
+}
+
+static int
+ws_header_length(const uint8_t* frame) {
+    int length = 2 + ((frame[1] & 0x80) ? 4 : 0);
+    switch (frame[1] & 0x7F) {
+        case 126: return length + 2;
+        case 127: return length + 8;
+        default: return length;
+    }
+}
+
+// control frame with its payload fully buffered
+static ws_result
+ws_control_frame(lcorehttp_websocket* ws, int opcode, const uint8_t* payload, size_t len) {
+    switch (opcode) {
+        case WS_OPCODE_PING:
+            if (!ws->closeSent && ws_send_frame(ws, WS_OPCODE_PONG, 1, 0, payload, len) != 0) {
+                return ws_connection_lost(ws);
+            }
+            return WS_RESULT_CONTINUE;
+        case WS_OPCODE_PONG: return WS_RESULT_CONTINUE;
+        case WS_OPCODE_CLOSE:
+            if (len == 1) {
+                return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "invalid close frame");
+            }
+            // 1005 and 1006 stand for "no status" and "connection lost", they are never sent and never echoed
+            if (len >= 2 && !ws_close_code_valid((payload[0] << 8) | payload[1])) {
+                return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "invalid close code");
+            }
+            if (len > 2 && !ws_utf8_valid(payload + 2, len - 2)) {
+                return ws_fail(ws, WEBSOCKET_INVALID_PAYLOAD, "invalid UTF-8 in close reason");
+            }
+            ws->closeReceived = 1;
+            ws->closeCode = len >= 2 ? (payload[0] << 8) | payload[1] : -1;
+            ws->message.len = 0; // the close reason is kept in the message buffer
+            if (len > 2 && lcorehttp_bytes_append(&ws->message, payload + 2, len - 2) != 0) {
+                ws->message.len = 0;
+            }
+            if (!ws->closeSent) {
+                ws_send_close(ws, ws->closeCode > 0 ? ws->closeCode : 0, NULL, 0);
+            }
+            ws_shutdown(ws);
+            return WS_RESULT_CLOSED;
+        default: return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "unknown opcode");
+    }
+}
+
+/*
+ * Reads until a complete data message is in ws->message, answering pings on the way.
+ * deadline is in microseconds on the l_corehttp_get_time_us clock, negative to wait indefinitely.
+ */
+static ws_result
+ws_receive(lcorehttp_websocket* ws, int64_t deadline, int* messageOpcode) {
+    while (1) {
+        if (ws->transport == NULL) {
+            if (ws->closeReceived) {
+                return WS_RESULT_CLOSED;
+            }
+            snprintf(ws->error, sizeof(ws->error), "websocket is closed");
+            return WS_RESULT_ERROR;
+        }
+        size_t buffered = ws->recvEnd - ws->recvStart;
+        if (!ws->frameActive) {
+            const uint8_t* frame = ws->recvBuffer + ws->recvStart;
+            if (buffered < 2 || buffered < (size_t)ws_header_length(frame)) {
+                int filled = ws_fill(ws, deadline);
+                if (filled == 0) {
+                    return WS_RESULT_TIMEOUT;
+                }
+                if (filled < 0) {
+                    return ws_connection_lost(ws);
+                }
+                continue;
+            }
+            int fin = (frame[0] & 0x80) != 0;
+            int rsv1 = (frame[0] & 0x40) != 0;
+            int opcode = frame[0] & 0x0F;
+            if ((frame[0] & 0x30) != 0) {
+                return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "reserved bits set");
+            }
+            if ((frame[1] & 0x80) != 0) {
+                return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "masked frame from server");
+            }
+            size_t headerLen = 2;
+            uint64_t length = frame[1] & 0x7F;
+            if (length == 126) {
+                length = ((uint64_t)frame[2] << 8) | frame[3];
+                headerLen = 4;
+            } else if (length == 127) {
+                length = 0;
+                for (int i = 0; i < 8; i++) {
+                    length = (length << 8) | frame[2 + i];
+                }
+                headerLen = 10;
+                if ((length >> 63) != 0) {
+                    return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "invalid frame length");
+                }
+            }
+
+            if (opcode >= WS_OPCODE_CLOSE) {
+                if (!fin || rsv1 || length > LCOREHTTP_WEBSOCKET_MAXIMUM_CONTROL_LENGTH) {
+                    return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "invalid control frame");
+                }
+                if (buffered < headerLen + length) {
+                    int filled = ws_fill(ws, deadline);
+                    if (filled == 0) {
+                        return WS_RESULT_TIMEOUT;
+                    }
+                    if (filled < 0) {
+                        return ws_connection_lost(ws);
+                    }
+                    continue;
+                }
+                ws->recvStart += headerLen + length;
+                ws_result result = ws_control_frame(ws, opcode, frame + headerLen, (size_t)length);
+                if (result != WS_RESULT_CONTINUE) {
+                    return result;
+                }
+                continue;
+            }
+
+            if (opcode == WS_OPCODE_CONTINUATION) {
+                if (ws->messageOpcode == 0 || rsv1) {
+                    return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "unexpected continuation frame");
+                }
+            } else if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) {
+                if (ws->messageOpcode != 0) {
+                    return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "expected continuation frame");
+                }
+                if (rsv1 && !ws->deflate) {
+                    return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "compressed frame without permessage-deflate");
+                }
+                ws->messageOpcode = opcode;
+                ws->messageCompressed = rsv1;
+                ws->message.len = 0;
+            } else {
+                return ws_fail(ws, WEBSOCKET_PROTOCOL_ERROR, "unknown opcode");
+            }
+            if (!ws->messageCompressed && ws->message.len + length > ws->maxMessage) {
+                return ws_fail(ws, WEBSOCKET_MESSAGE_TOO_BIG, "message too large");
+            }
+            ws->recvStart += headerLen;
+            ws->frameActive = 1;
+            ws->frameFin = fin;
+            ws->frameRemaining = length;
+        }
+
+        while (ws->frameRemaining > 0) {
+            buffered = ws->recvEnd - ws->recvStart;
+            if (buffered == 0) {
+                int filled = ws_fill(ws, deadline);
+                if (filled == 0) {
+                    return WS_RESULT_TIMEOUT;
+                }
+                if (filled < 0) {
+                    return ws_connection_lost(ws);
+                }
+                continue;
+            }
+            size_t take = buffered < ws->frameRemaining ? buffered : (size_t)ws->frameRemaining;
+            const uint8_t* payload = ws->recvBuffer + ws->recvStart;
+            if (ws->messageCompressed) {
+                if (ws_inflate(ws, payload, take) != 0) {
+                    return ws_fail(ws, WEBSOCKET_MESSAGE_TOO_BIG, NULL);
+                }
+            } else if (lcorehttp_bytes_append(&ws->message, payload, take) != 0) {
+                return ws_fail(ws, WEBSOCKET_MESSAGE_TOO_BIG, "out of memory");
+            }
+            ws->recvStart += take;
+            ws->frameRemaining -= take;
+        }
+        ws->frameActive = 0;
+        if (!ws->frameFin) {
+            continue;
+        }
+        if (ws->messageCompressed) {
+            if (ws_inflate(ws, deflateTail, sizeof(deflateTail)) != 0) {
+                return ws_fail(ws, WEBSOCKET_MESSAGE_TOO_BIG, NULL);
+            }
+            if (ws->serverNoContextTakeover) {
+                inflateReset(&ws->inflater);
+            }
+        }
+        if (ws->messageOpcode == WS_OPCODE_TEXT && !ws_utf8_valid(ws->message.data, ws->message.len)) {
+            return ws_fail(ws, WEBSOCKET_INVALID_PAYLOAD, "invalid UTF-8 in text message");
+        }
+        *messageOpcode = ws->messageOpcode;
+        ws->messageOpcode = 0;
+        return WS_RESULT_MESSAGE;
+    }
+}
+
+// sends our close frame and waits briefly for the server's before dropping the connection
+static void
+ws_close(lcorehttp_websocket* ws, int code, const char* reason, size_t reasonLen) {
+    if (ws->transport == NULL) {
+        return;
+    }
+    if (!ws->closeSent && ws_send_close(ws, code, reason, reasonLen) != 0) {
+        ws_shutdown(ws);
+        return;
+    }
+    int64_t deadline = (int64_t)l_corehttp_get_time_us() + LCOREHTTP_WEBSOCKET_CLOSE_TIMEOUT_MS * 1000LL;
+    int opcode = 0;
+    while (ws->transport != NULL && ws_receive(ws, deadline, &opcode) == WS_RESULT_MESSAGE) {
+        // data still in flight after our close frame is discarded
+    }
+    ws_shutdown(ws);
+}
+
+static int
+ws_compress(lcorehttp_websocket* ws, const uint8_t* data, size_t len) {
+    z_stream* strm = &ws->deflater;
+    ws->compressed.len = 0;
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = (uInt)len;
+    do {
+        if (lcorehttp_bytes_reserve(&ws->compressed, deflateBound(strm, strm->avail_in) + 16) != 0) {
+            return -1;
+        }
+        size_t room = ws->compressed.capacity - ws->compressed.len;
+        strm->next_out = ws->compressed.data + ws->compressed.len;
+        strm->avail_out = (uInt)room;
+        if (deflate(strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+            return -1;
+        }
+        ws->compressed.len += room - strm->avail_out;
+    } while (strm->avail_out == 0);
+    // the sync flush ends with an empty stored block, the receiver appends it again
+    if (ws->compressed.len >= sizeof(deflateTail)) {
+        ws->compressed.len -= sizeof(deflateTail);
+    }
+    if (ws->clientNoContextTakeover) {
+        deflateReset(strm);
+    }
+    return 0;
+}
+
+// send(data, kind?) - kind: "text" (default) or "binary"
+static int
+l_corehttp_websocket_send(lua_State* L) {
+    static const char* const kinds[] = {"text", "binary", NULL};
+    lcorehttp_websocket* ws = luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    size_t len = 0;
+    const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 2, &len);
+    int opcode = luaL_checkoption(L, 3, "text", kinds) == 0 ? WS_OPCODE_TEXT : WS_OPCODE_BINARY;
+    if (ws->transport == NULL || ws->closeSent) {
+        return push_error(L, "websocket is closed");
+    }
+
+    int rsv1 = 0;
+    if (ws->compressOutgoing && len >= LCOREHTTP_WEBSOCKET_MINIMUM_COMPRESS_SIZE) {
+        if (ws_compress(ws, data, len) != 0) {
+            return push_error(L, "deflate error");
+        }
+        data = ws->compressed.data;
+        len = ws->compressed.len;
+        rsv1 = 1;
+    }
+    size_t offset = 0;
+    do {
+        size_t frameLen = len - offset;
+        if (ws->fragmentSize > 0 && frameLen > ws->fragmentSize) {
+            frameLen = ws->fragmentSize;
+        }
+        int fin = offset + frameLen == len;
+        if (ws_send_frame(ws, offset == 0 ? opcode : WS_OPCODE_CONTINUATION, fin, offset == 0 && rsv1,
+                          data + offset, frameLen)
+            != 0) {
+            ws_shutdown(ws);
+            return push_error(L, "network error");
+        }
+        offset += frameLen;
+    } while (offset < len);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// ping(data?)
+static int
+l_corehttp_websocket_ping(lua_State* L) {
+    lcorehttp_websocket* ws = luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    size_t len = 0;
+    const char* data = luaL_optlstring(L, 2, "", &len);
+    luaL_argcheck(L, len <= LCOREHTTP_WEBSOCKET_MAXIMUM_CONTROL_LENGTH, 2, "ping payload longer than 125 bytes");
+    if (ws->transport == NULL || ws->closeSent) {
+        return push_error(L, "websocket is closed");
+    }
+    if (ws_send_frame(ws, WS_OPCODE_PING, 1, 0, (const uint8_t*)data, len) != 0) {
+        ws_shutdown(ws);
+        return push_error(L, "network error");
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// receive(timeout_ms?) -> data, kind | nil, "timeout" | nil, "closed", code, reason | nil, error
+static int
+l_corehttp_websocket_receive(lua_State* L) {
+    lcorehttp_websocket* ws = luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    lua_Integer timeoutMs = luaL_optinteger(L, 2, -1);
+    int64_t deadline = timeoutMs >= 0 ? (int64_t)l_corehttp_get_time_us() + timeoutMs * 1000 : -1;
+    int opcode = 0;
+    switch (ws_receive(ws, deadline, &opcode)) {
+        case WS_RESULT_MESSAGE:
+            lua_pushlstring(L, (const char*)ws->message.data, ws->message.len);
+            lua_pushstring(L, opcode == WS_OPCODE_TEXT ? "text" : "binary");
+            ws->message.len = 0;
+            return 2;
+        case WS_RESULT_TIMEOUT:
+            lua_pushnil(L);
+            lua_pushliteral(L, "timeout");
+            return 2;
+        case WS_RESULT_CLOSED:
+            lua_pushnil(L);
+            lua_pushliteral(L, "closed");
+            if (ws->closeCode >= 0) {
+                lua_pushinteger(L, ws->closeCode);
+            } else {
+                lua_pushnil(L);
+            }
+            lua_pushlstring(L, (const char*)ws->message.data, ws->message.len);
+            return 4;
+        default: return push_error(L, ws->error);
+    }
+}
+
+// close(code?, reason?)
+static int
+l_corehttp_websocket_close(lua_State* L) {
+    lcorehttp_websocket* ws = luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    lua_Integer code = luaL_optinteger(L, 2, WEBSOCKET_NORMAL_CLOSURE);
+    size_t reasonLen = 0;
+    const char* reason = luaL_optlstring(L, 3, "", &reasonLen);
+    luaL_argcheck(L, ws_close_code_valid(code), 2, "close code must be 1000-1003, 1007-1014 or 3000-4999");
+    ws_close(ws, (int)code, reason, reasonLen);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+l_corehttp_websocket_protocol(lua_State* L) {
+    luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    lua_getiuservalue(L, 1, 2);
+    return 1;
+}
+
+static int
+l_corehttp_websocket_gc(lua_State* L) {
+    lcorehttp_websocket* ws = luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    ws_release(ws);
+    return 0;
+}
+
+static int
+l_corehttp_websocket_close_meta(lua_State* L) {
+    lcorehttp_websocket* ws = luaL_checkudata(L, 1, LCOREHTTP_WEBSOCKET_METATABLE);
+    ws_close(ws, WEBSOCKET_NORMAL_CLOSURE, NULL, 0);
+    ws_release(ws);
+    return 0;
+}
+
+static int
+token_is(const char* token, size_t len, const char* expected) {
+    return len == strlen(expected) && strncasecmp(token, expected, len) == 0;
+}
+
+static void
+trim(const char** value, size_t* len) {
+    while (*len > 0 && (**value == ' ' || **value == '\t')) {
+        (*value)++;
+        (*len)--;
+    }
+    while (*len > 0 && ((*value)[*len - 1] == ' ' || (*value)[*len - 1] == '\t')) {
+        (*len)--;
+    }
+}
+
+// Sec-WebSocket-Extensions of the handshake response, we only offer permessage-deflate
+static const char*
+ws_negotiate_deflate(lcorehttp_websocket* ws, const char* value, size_t len) {
+    if (memchr(value, ',', len) != NULL) {
+        return "server accepted more than one extension";
+    }
+    int windowBits = 15;
+    int first = 1;
+    while (len > 0) {
+        const char* semicolon = memchr(value, ';', len);
+        size_t tokenLen = semicolon != NULL ? (size_t)(semicolon - value) : len;
+        const char* token = value;
+        value += tokenLen;
+        len -= tokenLen;
+        if (semicolon != NULL) {
+            value++;
+            len--;
+        }
+        trim(&token, &tokenLen);
+        if (first) {
+            if (!token_is(token, tokenLen, WEBSOCKET_DEFLATE_EXTENSION)) {
+                return "server accepted an extension that was not offered";
+            }
+            first = 0;
+            continue;
+        }
+        const char* equals = memchr(token, '=', tokenLen);
+        size_t nameLen = equals != NULL ? (size_t)(equals - token) : tokenLen;
+        const char* name = token;
+        trim(&name, &nameLen);
+        if (token_is(name, nameLen, "server_no_context_takeover")) {
+            ws->serverNoContextTakeover = 1;
+        } else if (token_is(name, nameLen, "client_no_context_takeover")) {
+            ws->clientNoContextTakeover = 1;
+        } else if (token_is(name, nameLen, "client_max_window_bits")) {
+            if (equals != NULL) {
+                windowBits = 0;
+                for (const char* c = equals + 1; c < token + tokenLen; c++) {
+                    if (*c >= '0' && *c <= '9') {
+                        windowBits = windowBits * 10 + (*c - '0');
+                    }
+                }
+                if (windowBits < 8 || windowBits > 15) {
+                    return "invalid client_max_window_bits";
+                }
+            }
+        } else if (!token_is(name, nameLen, "server_max_window_bits")) { // inflating with 15 bits reads any window
+            return "unknown permessage-deflate parameter";
+        }
+    }
+
+    if (inflateInit2(&ws->inflater, -15) != Z_OK) {
+        return "failed to initialize zlib";
+    }
+    ws->inflateReady = 1;
+    ws->deflate = 1;
+    // zlib cannot produce 8 bit windows for raw deflate, such a peer only gets uncompressed messages
+    if (windowBits > 8) {
+        if (deflateInit2(&ws->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY)
+            != Z_OK) {
+            return "failed to initialize zlib";
+        }
+        ws->deflateReady = 1;
+        ws->compressOutgoing = 1;
+    }
+    return NULL;
+}
+
+/*
+ * Drops the Connection field initializeRequestHeaders wrote for the keep-alive flag, the handshake sends
+ * Connection: Upgrade alone.
+ */
+static void
+remove_connection_header(HTTPRequestHeaders_t* requestHeaders) {
+    uint8_t* buffer = requestHeaders->pBuffer;
+    size_t len = requestHeaders->headersLen;
+    const uint8_t* requestLineEnd = memchr(buffer, '\n', len);
+    size_t pos = requestLineEnd != NULL ? (size_t)(requestLineEnd - buffer) + 1 : len;
+    while (pos < len) {
+        const uint8_t* lineEnd = memchr(buffer + pos, '\n', len - pos);
+        size_t lineLen = lineEnd != NULL ? (size_t)(lineEnd - (buffer + pos)) + 1 : len - pos;
+        if (lineLen > strlen("Connection:") && strncasecmp((const char*)buffer + pos, "Connection:", 11) == 0) {
+            memmove(buffer + pos, buffer + pos + lineLen, len - pos - lineLen);
+            len -= lineLen;
+        } else {
+            pos += lineLen;
+        }
+    }
+    requestHeaders->headersLen = len;
+}
+
+static const char*
+ws_check_handshake(lcorehttp_websocket* ws, const lcorehttp_response* response, const char* key, int offeredDeflate) {
+    if (!response->response.areHeadersComplete || response->response.statusCode != 101) {
+        snprintf(ws->error, sizeof(ws->error), "websocket handshake failed with status %u",
+                 (unsigned)response->response.statusCode);
+        return ws->error;
+    }
+    const char* value = NULL;
+    size_t valueLen = 0;
+    if (HTTPClient_ReadHeader(&response->response, "upgrade", strlen("upgrade"), &value, &valueLen) != HTTPSuccess
+        || !token_is(value, valueLen, "websocket")) {
+        return "server did not upgrade to websocket";
+    }
+
+    uint8_t digest[20];
+    char expected[WEBSOCKET_ACCEPT_LENGTH + 1];
+    char keyed[WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID)];
+    size_t encodedLen = 0;
+    memcpy(keyed, key, WEBSOCKET_KEY_LENGTH);
+    memcpy(keyed + WEBSOCKET_KEY_LENGTH, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    mbedtls_sha1((const unsigned char*)keyed, WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID) - 1, digest);
+    if (mbedtls_base64_encode((unsigned char*)expected, sizeof(expected), &encodedLen, digest, sizeof(digest)) != 0
+        || HTTPClient_ReadHeader(&response->response, "sec-websocket-accept", strlen("sec-websocket-accept"),
+                                 &value, &valueLen)
+               != HTTPSuccess) {
+        return "missing Sec-WebSocket-Accept";
+    }
+    trim(&value, &valueLen);
+    if (valueLen != encodedLen || memcmp(value, expected, encodedLen) != 0) {
+        return "invalid Sec-WebSocket-Accept";
+    }
+
+    if (HTTPClient_ReadHeader(&response->response, "sec-websocket-extensions", strlen("sec-websocket-extensions"),
+                              &value, &valueLen)
+        == HTTPSuccess) {
+        if (!offeredDeflate) {
+            return "server accepted an extension that was not offered";
+        }
+        return ws_negotiate_deflate(ws, value, valueLen);
+    }
+    return NULL;
+}
+
+// pushes the Sec-WebSocket-Protocol value for options.protocols (string or list), nil without
+static void
+push_protocols(lua_State* L, int optionsIdx) {
+    if (!lua_istable(L, optionsIdx)) {
+        lua_pushnil(L);
+        return;
+    }
+    lua_getfield(L, optionsIdx, "protocols");
+    if (!lua_istable(L, -1)) {
+        if (!lua_isstring(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+        return;
+    }
+    luaL_Buffer buffer;
+    int listIdx = lua_gettop(L);
+    luaL_buffinit(L, &buffer);
+    lua_Integer count = (lua_Integer)lua_rawlen(L, listIdx);
+    for (lua_Integer i = 1; i <= count; i++) {
+        if (i > 1) {
+            luaL_addstring(&buffer, ", ");
+        }
+        lua_rawgeti(L, listIdx, i);
+        luaL_addvalue(&buffer);
+    }
+    luaL_pushresult(&buffer);
+    lua_remove(L, listIdx);
+}
+
+static lua_Integer
+option_integer(lua_State* L, int optionsIdx, const char* name, lua_Integer defaultValue) {
+    if (!lua_istable(L, optionsIdx)) {
+        return defaultValue;
+    }
+    lua_getfield(L, optionsIdx, name);
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0) {
+        defaultValue = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return defaultValue;
+}
+
+// websocket(path, options?) - options: protocols, compress, max_message_size, fragment_size, buffer_size, headers
+// and the connection options of request
+int
+l_corehttp_client_websocket(lua_State* L) {
+    static const char* const strippedOptions[] = {"body", "write_body_hook", "follow_redirects", "hedge", NULL};
+    uint64_t requestStart = l_corehttp_get_time_us();
+    lcorehttp_client* client = (lcorehttp_client*)luaL_checkudata(L, 1, LCOREHTTP_CLIENT_METATABLE);
+    luaL_checkstring(L, 2);
+    if (client->closed) {
+        return push_error(L, "client is closed");
+    }
+    if (client->tls != NULL && client->tls->http2) {
+        return push_error(L, "websocket is not supported on http2 clients"); // no Upgrade in HTTP/2
+    }
+    lua_settop(L, 3);
+    lua_pushliteral(L, "GET");
+    lua_insert(L, 3); // 1: client, 2: path, 3: method, 4: options
+
+    // handshake options: the caller's, but for a bodiless keep-alive request (its Connection field becomes Upgrade)
+    lua_newtable(L);
+    if (lua_istable(L, 4)) {
+        lua_pushnil(L);
+        while (lua_next(L, 4) != 0) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+    }
+    for (int i = 0; strippedOptions[i] != NULL; i++) {
+        lua_pushnil(L);
+        lua_setfield(L, -2, strippedOptions[i]);
+    }
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "keepAlive");
+    lua_insert(L, 4); // 4: handshake options, 5: caller's options
+
+    int compress = 0;
+    if (lua_istable(L, 5)) {
+        lua_getfield(L, 5, "compress");
+        compress = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    lua_Integer bufferSize = option_integer(L, 5, "buffer_size", DEFAULT_COREHTTP_BUFFER_SIZE);
+    if (bufferSize < MINIMUM_COREHTTP_BUFFER_SIZE) {
+        bufferSize = MINIMUM_COREHTTP_BUFFER_SIZE;
+    } else if (bufferSize > MAXIMUM_COREHTTP_BUFFER_SIZE) {
+        bufferSize = MAXIMUM_COREHTTP_BUFFER_SIZE;
+    }
+    push_protocols(L, 5); // 6
+
+    lcorehttp_websocket* ws = lua_newuserdatauv(L, sizeof(lcorehttp_websocket), 2); // 7
+    memset(ws, 0, sizeof(lcorehttp_websocket));
+    luaL_getmetatable(L, LCOREHTTP_WEBSOCKET_METATABLE);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, 7, 1);
+    ws->client = client;
+    ws->closeCode = -1;
+    ws->maxMessage = (size_t)option_integer(L, 5, "max_message_size", LCOREHTTP_WEBSOCKET_DEFAULT_MAX_MESSAGE);
+    ws->fragmentSize = (size_t)option_integer(L, 5, "fragment_size", 0);
+    ws->recvCapacity = (size_t)bufferSize;
+    ws->sendCapacity = (size_t)bufferSize;
+    ws->recvBuffer = malloc(ws->recvCapacity);
+    ws->sendBuffer = malloc(ws->sendCapacity);
+    if (ws->recvBuffer == NULL || ws->sendBuffer == NULL) {
+        return push_error(L, "failed to allocate websocket buffers");
+    }
+    ws_random_seed(ws);
+
+    uint32_t nonce[4];
+    for (int i = 0; i < 4; i++) {
+        nonce[i] = ws_random(ws);
+    }
+    char key[WEBSOCKET_KEY_LENGTH + 1];
+    size_t keyLen = 0;
+    if (mbedtls_base64_encode((unsigned char*)key, sizeof(key), &keyLen, (const unsigned char*)nonce, sizeof(nonce))
+        != 0) {
+        return push_error(L, "failed to create Sec-WebSocket-Key");
+    }
+
+    HTTPRequestHeaders_t requestHeaders = {0};
+    uint32_t requestFlags = 0;
+    int resultCount = initializeRequestHeaders(L, client, &requestHeaders, &requestFlags);
+    if (resultCount != 0) {
+        free(requestHeaders.pBuffer);
+        return resultCount;
+    }
+    remove_connection_header(&requestHeaders);
+    const char* headers[][2] = {
+        {"Upgrade", "websocket"},
+        {"Connection", "Upgrade"},
+        {"Sec-WebSocket-Version", "13"},
+        {"Sec-WebSocket-Key", key},
+        {"Sec-WebSocket-Protocol", lua_tostring(L, 6)},
+        {"Sec-WebSocket-Extensions", compress ? WEBSOCKET_DEFLATE_EXTENSION "; client_max_window_bits" : NULL},
+    };
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        if (headers[i][1] == NULL) {
+            continue;
+        }
+        HTTPStatus_t status = HTTPClient_AddHeader(&requestHeaders, headers[i][0], strlen(headers[i][0]),
+                                                   headers[i][1], strlen(headers[i][1]));
+        if (status != HTTPSuccess) {
+            free(requestHeaders.pBuffer);
+            return push_error_status(L, status);
+        }
+    }
+
+    resultCount = corehttp_client_perform(L, client, 1, 4, requestHeaders, requestFlags, NULL, 0, 0, requestStart,
+                                          NULL);
+    if (resultCount != 1) {
+        return resultCount;
+    }
+    lcorehttp_response* response = (lcorehttp_response*)lua_touserdata(L, 8);
+    const char* failure = ws_check_handshake(ws, response, key, compress);
+    if (failure == NULL && response->transport == NULL) {
+        failure = "connection lost during handshake";
+    }
+    // frames the server sent right behind the 101 arrived together with the headers, none of them may be dropped
+    size_t leftover = response->response.pBody != NULL ? response->response.bodyLen : 0;
+    if (failure == NULL && leftover > ws->recvCapacity) {
+        uint8_t* grown = realloc(ws->recvBuffer, leftover);
+        if (grown == NULL) {
+            failure = "failed to allocate websocket buffers";
+        } else {
+            ws->recvBuffer = grown;
+            ws->recvCapacity = leftover;
+        }
+    }
+    if (failure == NULL) {
+        ws->transport = (TransportInterface_t*)response->transport;
+        response->transport = NULL;
+        if (leftover > 0) {
+            memcpy(ws->recvBuffer, response->response.pBody, leftover);
+            ws->recvEnd = leftover;
+        }
+        const char* protocol = NULL;
+        size_t protocolLen = 0;
+        if (HTTPClient_ReadHeader(&response->response, "sec-websocket-protocol", strlen("sec-websocket-protocol"),
+                                  &protocol, &protocolLen)
+            == HTTPSuccess) {
+            lua_pushlstring(L, protocol, protocolLen);
+            lua_setiuservalue(L, 7, 2);
+        }
+    } else {
+        lua_pushstring(L, failure); // ws->error dies with the websocket
+        lua_replace(L, 6);
+        response->keepAlive = 0; // the server may already have switched protocols
+    }
+    if (luaL_callmeta(L, 8, "__close")) {
+        lua_pop(L, 1);
+    }
+    if (failure != NULL) {
+        return push_error(L, lua_tostring(L, 6));
+    }
+    lua_settop(L, 7);
+    return 1;
+}
+
+int
+l_corehttp_websocket_create_meta(lua_State* L) {
+    luaL_newmetatable(L, LCOREHTTP_WEBSOCKET_METATABLE);
+    /* Metamethods */
+    lua_newtable(L);
+    lua_pushcfunction(L, l_corehttp_websocket_send);
+    lua_setfield(L, -2, "send");
+    lua_pushcfunction(L, l_corehttp_websocket_receive);
+    lua_setfield(L, -2, "receive");
+    lua_pushcfunction(L, l_corehttp_websocket_ping);
+    lua_setfield(L, -2, "ping");
+    lua_pushcfunction(L, l_corehttp_websocket_close);
+    lua_setfield(L, -2, "close");
+    lua_pushcfunction(L, l_corehttp_websocket_protocol);
+    lua_setfield(L, -2, "protocol");
+    lua_pushstring(L, LCOREHTTP_WEBSOCKET_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, l_corehttp_websocket_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_corehttp_websocket_close_meta);
+    lua_setfield(L, -2, "__close");
+    return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef LCOREHTTP_WEBSOCKET_H
+#define LCOREHTTP_WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "lcorehttp_body.h"
+#include "lua.h"
+#include "transport_interface.h"
+
+struct lcorehttp_client;
+
+#define LCOREHTTP_WEBSOCKET_METATABLE              "COREHTTP_WEBSOCKET"
+#define LCOREHTTP_WEBSOCKET_DEFAULT_MAX_MESSAGE    16777216 /* 16MB, after decompression */
+#define LCOREHTTP_WEBSOCKET_CLOSE_TIMEOUT_MS       1000     /* wait for the server's close frame */
+#define LCOREHTTP_WEBSOCKET_MINIMUM_COMPRESS_SIZE  32       /* smaller messages are sent uncompressed */
+#define LCOREHTTP_WEBSOCKET_MAXIMUM_CONTROL_LENGTH 125
+
+typedef enum lcorehttp_websocket_opcode {
+    WS_OPCODE_CONTINUATION = 0x0,
+    WS_OPCODE_TEXT = 0x1,
+    WS_OPCODE_BINARY = 0x2,
+    WS_OPCODE_CLOSE = 0x8,
+    WS_OPCODE_PING = 0x9,
+    WS_OPCODE_PONG = 0xA,
+} lcorehttp_websocket_opcode;
+
+/*
+ * Client side of an upgraded connection (RFC 6455), optionally with permessage-deflate (RFC 7692).
+ * Frames are parsed incrementally from recvBuffer, a receive interrupted by its timeout resumes where it stopped.
+ */
+typedef struct lcorehttp_websocket {
+    struct lcorehttp_client* client; // kept alive by the websocket (user value 1)
+    TransportInterface_t* transport; // NULL once closed
+    int closeSent;
+    int closeReceived;
+    uint8_t* recvBuffer;
+    size_t recvCapacity;
+    size_t recvStart;
+    size_t recvEnd;
+    // frame being received
+    int frameActive;
+    int frameFin;
+    uint64_t frameRemaining;
+    // message being received
+    int messageOpcode; // 0 between messages
+    int messageCompressed;
+    lcorehttp_bytes message;
+    size_t maxMessage;
+    size_t fragmentSize; // 0 sends every message as a single frame
+    // permessage-deflate
+    int deflate;
+    int compressOutgoing;
+    int inflateReady;
+    int deflateReady;
+    int serverNoContextTakeover;
+    int clientNoContextTakeover;
+    z_stream inflater;
+    z_stream deflater;
+    lcorehttp_bytes compressed;
+    uint64_t maskState;
+    uint8_t* sendBuffer;
+    size_t sendCapacity; // recvBuffer may grow past it to hold what followed the 101
+    int closeCode; // close frame of the server, -1 if it had no status
+    char error[96];
+} lcorehttp_websocket;
+
+/**
+ * @brief XOR data with the 4 byte masking key, phase is the key offset of the first byte.
+ *
+ * Works on 8 bytes at a time so the compiler can vectorize the loop; src and dst may be the same.
+ */
+void lcorehttp_websocket_mask(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t key[4], size_t phase);
+
+// client:websocket(path, options?) -> websocket | nil, error
+int l_corehttp_client_websocket(lua_State* L);
+
+int l_corehttp_websocket_create_meta(lua_State* L);
+
+#endif /* LCOREHTTP_WEBSOCKET_H */
@@ -0,0 +1,674 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "lcorehttp_h2.h"
+#include "lcorehttp_hpack.h"
+#include "lcorehttp_response.h"
+#include "lcorehttp_socket.h"
+#include "lcorehttp_time.h"
+
+// HPACK and HTTP/2 tests; the connection tests run against a scripted peer on a loopback socket
+
+#define PEER_TIMEOUT_MS 5000
+
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_SETTINGS      0x4
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_END_HEADERS 0x4
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE   0x1
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+
+static int failures = 0; // the peer threads count their failed checks as well
+
+#define CHECK(condition)                                                                                     \
+    do {                                                                                                     \
+        if (!(condition)) {                                                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                    \
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);                                              \
+        }                                                                                                    \
+    } while (0)
+
+static size_t
+unhex(const char* hex, uint8_t* out, size_t capacity) {
+    size_t len = 0;
+    for (; hex[0] != '\0' && hex[1] != '\0' && len < capacity; hex += 2) {
+        unsigned int byte = 0;
+        sscanf(hex, "%2x", &byte);
+        out[len++] = (uint8_t)byte;
+    }
+    return len;
+}
+
+// decoded fields as "name: value\n" lines
+typedef struct hpack_fields {
+    char text[2048];
+    size_t len;
+} hpack_fields;
+
+static void
+hpack_collect(void* context, const char* name, size_t nameLen, const char* value, size_t valueLen) {
+    hpack_fields* fields = context;
+    int len = snprintf(fields->text + fields->len, sizeof(fields->text) - fields->len, "%.*s: %.*s\n",
+                       (int)nameLen, name, (int)valueLen, value);
+    if (len > 0) {
+        fields->len += (size_t)len;
+    }
+}
+
+// decodes the block, checks the fields and the dynamic table size after it
+static void
+hpack_check_block(lcorehttp_hpack* decoder, const char* hex, const char* expected, size_t tableSize) {
+    uint8_t block[512];
+    size_t len = unhex(hex, block, sizeof(block));
+    hpack_fields fields = {0};
+    CHECK(lcorehttp_hpack_decode(decoder, block, len, hpack_collect, &fields) == 0);
+    CHECK(strcmp(fields.text, expected) == 0);
+    CHECK(decoder->table.size == tableSize);
+}
+
+static int
+hpack_decode_hex(lcorehttp_hpack* decoder, const char* hex) {
+    uint8_t block[64];
+    size_t len = unhex(hex, block, sizeof(block));
+    hpack_fields fields = {0};
+    return lcorehttp_hpack_decode(decoder, block, len, hpack_collect, &fields);
+}
+
+// RFC 7541 C.4: requests with Huffman coded strings sharing the dynamic table
+static void
+test_hpack_huffman_requests(void) {
+    lcorehttp_hpack decoder;
+    CHECK(lcorehttp_hpack_init(&decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    hpack_check_block(&decoder, "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+                      ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57);
+    hpack_check_block(&decoder, "828684be5886a8eb10649cbf",
+                      ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+                      110);
+    hpack_check_block(&decoder, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+                      ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n"
+                      "custom-key: custom-value\n",
+                      164);
+    lcorehttp_hpack_free(&decoder);
+}
+
+// RFC 7541 C.6: Huffman coded responses in a 256 byte table, the later ones evict the oldest entries
+static void
+test_hpack_huffman_eviction(void) {
+    lcorehttp_hpack decoder;
+    CHECK(lcorehttp_hpack_init(&decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    hpack_check_block(&decoder, "3fe101", "", 0); // dynamic table size update to 256
+    CHECK(decoder.table.maxSize == 256);
+    hpack_check_block(&decoder,
+                      "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff"
+                      "6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+                      ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                      "location: https://www.example.com\n",
+                      222);
+    CHECK(decoder.table.count == 4);
+    hpack_check_block(&decoder, "4883640effc1c0bf",
+                      ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                      "location: https://www.example.com\n",
+                      222);
+    CHECK(decoder.table.count == 4); // ":status: 302" made room for ":status: 307"
+    hpack_check_block(&decoder,
+                      "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335"
+                      "dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+                      ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+                      "location: https://www.example.com\ncontent-encoding: gzip\n"
+                      "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n",
+                      215);
+    CHECK(decoder.table.count == 3);
+    lcorehttp_hpack_free(&decoder);
+}
+
+static void
+test_hpack_size_update_limits(void) {
+    lcorehttp_hpack decoder;
+    CHECK(lcorehttp_hpack_init(&decoder, 256) == 0);
+    CHECK(hpack_decode_hex(&decoder, "3fe11f") == -1); // 4096 is above what SETTINGS allowed
+    lcorehttp_hpack_free(&decoder);
+    CHECK(lcorehttp_hpack_init(&decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    CHECK(hpack_decode_hex(&decoder, "823fe101") == -1); // only allowed at the start of a block
+    lcorehttp_hpack_free(&decoder);
+
+    // the encoder owes the smallest size set since its last block, then the final one
+    lcorehttp_hpack encoder;
+    CHECK(lcorehttp_hpack_init(&encoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    CHECK(lcorehttp_hpack_init(&decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    lcorehttp_bytes block = {0};
+    hpack_fields fields = {0};
+    CHECK(lcorehttp_hpack_begin_block(&encoder, &block) == 0);
+    CHECK(lcorehttp_hpack_encode(&encoder, &block, "x-a", 3, "1", 1) == 0);
+    CHECK(lcorehttp_hpack_decode(&decoder, block.data, block.len, hpack_collect, &fields) == 0);
+    CHECK(decoder.table.count == 1);
+    lcorehttp_hpack_set_limit(&encoder, 0);
+    lcorehttp_hpack_set_limit(&encoder, 256);
+    block.len = 0;
+    CHECK(lcorehttp_hpack_begin_block(&encoder, &block) == 0);
+    CHECK(block.len == 4); // 0, which empties the table, then 256
+    CHECK(lcorehttp_hpack_decode(&decoder, block.data, block.len, hpack_collect, &fields) == 0);
+    CHECK(decoder.table.count == 0 && decoder.table.maxSize == 256);
+    lcorehttp_bytes_free(&block);
+    lcorehttp_hpack_free(&encoder);
+    lcorehttp_hpack_free(&decoder);
+}
+
+// fields of random blocks survive encode and decode while the table is resized and evicts entries
+static void
+test_hpack_round_trip(void) {
+    lcorehttp_hpack encoder;
+    lcorehttp_hpack decoder;
+    CHECK(lcorehttp_hpack_init(&encoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    CHECK(lcorehttp_hpack_init(&decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) == 0);
+    unsigned int seed = 1;
+    int failed = 0;
+    for (int round = 0; round < 5000 && !failed; round++) {
+        if (round % 97 == 0) {
+            lcorehttp_hpack_set_limit(&encoder, (size_t)(rand_r(&seed) % 5000));
+        }
+        lcorehttp_bytes block = {0};
+        hpack_fields expected = {0};
+        failed = lcorehttp_hpack_begin_block(&encoder, &block) != 0;
+        int count = rand_r(&seed) % 6;
+        for (int i = 0; i < count && !failed; i++) {
+            char name[32];
+            char value[200];
+            int kind = rand_r(&seed) % 4;
+            const char* format = kind == 0 ? "authorization" : kind == 1 ? "x-h%d" : kind == 2 ? ":path" : "x-long%d";
+            snprintf(name, sizeof(name), format, rand_r(&seed) % 20);
+            int valueLen = rand_r(&seed) % (kind == 3 ? 190 : 10);
+            for (int j = 0; j < valueLen; j++) {
+                value[j] = (char)('a' + rand_r(&seed) % 26);
+            }
+            failed = lcorehttp_hpack_encode(&encoder, &block, name, strlen(name), value, (size_t)valueLen) != 0;
+            hpack_collect(&expected, name, strlen(name), value, (size_t)valueLen);
+        }
+        hpack_fields fields = {0};
+        failed = failed || lcorehttp_hpack_decode(&decoder, block.data, block.len, hpack_collect, &fields) != 0
+                 || strcmp(fields.text, expected.text) != 0 || decoder.table.size != encoder.table.size;
+        lcorehttp_bytes_free(&block);
+    }
+    CHECK(!failed);
+    lcorehttp_hpack_free(&encoder);
+    lcorehttp_hpack_free(&decoder);
+}
+
+typedef struct h2_peer h2_peer;
+
+typedef struct h2_frame {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+    uint8_t payload[LCOREHTTP_H2_FRAME_SIZE];
+    size_t len;
+    hpack_fields fields; // decoded request fields of HEADERS
+} h2_frame;
+
+/*
+ * Server side of one HTTP/2 connection, run on its own thread: sends its SETTINGS after the client preface, then
+ * follows the script. Request header blocks are always decoded so the table stays in sync with the client.
+ */
+struct h2_peer {
+    int listenFd;
+    int fd;
+    int port;
+    uint32_t initialWindow; // SETTINGS_INITIAL_WINDOW_SIZE sent to the client, 0 keeps the default
+    uint32_t headerTableSize; // SETTINGS_HEADER_TABLE_SIZE sent to the client, 0 keeps the default
+    void (*script)(h2_peer* peer);
+    lcorehttp_hpack decoder;
+    lcorehttp_hpack encoder;
+    h2_frame frame;
+    pthread_t thread;
+};
+
+static int
+peer_read(h2_peer* peer, void* buffer, size_t len) {
+    uint8_t* p = buffer;
+    while (len > 0) {
+        struct pollfd pfd = {.fd = peer->fd, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, PEER_TIMEOUT_MS) <= 0) {
+            return -1;
+        }
+        ssize_t received = recv(peer->fd, p, len, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        p += received;
+        len -= (size_t)received;
+    }
+    return 0;
+}
+
+static int
+peer_write(h2_peer* peer, const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t sent = send(peer->fd, p, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        p += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+static int
+peer_send_frame(h2_peer* peer, uint8_t type, uint8_t flags, uint32_t id, const void* payload, size_t len) {
+    uint8_t header[9] = {(uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len, type, flags,
+                         (uint8_t)(id >> 24), (uint8_t)(id >> 16), (uint8_t)(id >> 8), (uint8_t)id};
+    return peer_write(peer, header, sizeof(header)) != 0 || peer_write(peer, payload, len) != 0 ? -1 : 0;
+}
+
+static int
+peer_send_u32(h2_peer* peer, uint8_t type, uint32_t id, uint32_t value) {
+    uint8_t payload[4] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+    return peer_send_frame(peer, type, 0, id, payload, sizeof(payload));
+}
+
+// response HEADERS from name/value pairs, ending with NULL
+static int
+peer_send_headers(h2_peer* peer, uint32_t id, int endStream, const char* const* fields) {
+    lcorehttp_bytes block = {0};
+    int failed = lcorehttp_hpack_begin_block(&peer->encoder, &block) != 0;
+    for (size_t i = 0; fields[i] != NULL && !failed; i += 2) {
+        failed = lcorehttp_hpack_encode(&peer->encoder, &block, fields[i], strlen(fields[i]), fields[i + 1],
+                                        strlen(fields[i + 1]))
+                 != 0;
+    }
+    uint8_t flags = (uint8_t)(H2_FLAG_END_HEADERS | (endStream ? H2_FLAG_END_STREAM : 0));
+    failed = failed || peer_send_frame(peer, H2_HEADERS, flags, id, block.data, block.len) != 0;
+    lcorehttp_bytes_free(&block);
+    return failed ? -1 : 0;
+}
+
+// reads the next frame into peer->frame, decoding request header blocks
+static int
+peer_next_frame(h2_peer* peer) {
+    h2_frame* frame = &peer->frame;
+    uint8_t header[9];
+    if (peer_read(peer, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    frame->len = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+    frame->type = header[3];
+    frame->flags = header[4];
+    frame->id = (((uint32_t)header[5] << 24) | ((uint32_t)header[6] << 16) | ((uint32_t)header[7] << 8) | header[8])
+                & 0x7fffffff;
+    if (frame->len > sizeof(frame->payload) || peer_read(peer, frame->payload, frame->len) != 0) {
+        return -1;
+    }
+    frame->fields.len = 0;
+    frame->fields.text[0] = '\0';
+    if (frame->type == H2_HEADERS) { // the client sends neither padding, priorities nor CONTINUATION here
+        CHECK(frame->flags & H2_FLAG_END_HEADERS);
+        CHECK(lcorehttp_hpack_decode(&peer->decoder, frame->payload, frame->len, hpack_collect, &frame->fields) == 0);
+    }
+    return 0;
+}
+
+// skips frames until one of type on stream id (any stream for 0) arrived
+static int
+peer_expect(h2_peer* peer, uint8_t type, uint32_t id) {
+    while (peer_next_frame(peer) == 0) {
+        if (peer->frame.type == type && (id == 0 || peer->frame.id == id)) {
+            return 0;
+        }
+    }
+    CHECK(!"expected frame did not arrive");
+    return -1;
+}
+
+static uint32_t
+peer_frame_u32(const h2_peer* peer) {
+    const uint8_t* p = peer->frame.payload;
+    return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]) & 0x7fffffff;
+}
+
+static void*
+peer_run(void* argument) {
+    h2_peer* peer = argument;
+    peer->fd = accept(peer->listenFd, NULL, NULL);
+    char preface[24];
+    if (peer->fd < 0 || peer_read(peer, preface, sizeof(preface)) != 0
+        || memcmp(preface, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", sizeof(preface)) != 0) {
+        CHECK(!"no client connection preface");
+        return NULL;
+    }
+    uint8_t settings[12];
+    size_t len = 0;
+    if (peer->initialWindow != 0) {
+        uint8_t setting[6] = {0, H2_SETTINGS_INITIAL_WINDOW_SIZE, (uint8_t)(peer->initialWindow >> 24),
+                              (uint8_t)(peer->initialWindow >> 16), (uint8_t)(peer->initialWindow >> 8),
+                              (uint8_t)peer->initialWindow};
+        memcpy(settings + len, setting, sizeof(setting));
+        len += sizeof(setting);
+    }
+    if (peer->headerTableSize != 0) {
+        uint8_t setting[6] = {0, H2_SETTINGS_HEADER_TABLE_SIZE, (uint8_t)(peer->headerTableSize >> 24),
+                              (uint8_t)(peer->headerTableSize >> 16), (uint8_t)(peer->headerTableSize >> 8),
+                              (uint8_t)peer->headerTableSize};
+        memcpy(settings + len, setting, sizeof(setting));
+        len += sizeof(setting);
+    }
+    CHECK(peer_send_frame(peer, H2_SETTINGS, 0, 0, settings, len) == 0);
+    peer->script(peer);
+    // wait for the client to go away
+    while (peer_next_frame(peer) == 0) {
+    }
+    close(peer->fd);
+    return NULL;
+}
+
+static int
+peer_start(h2_peer* peer, void (*script)(h2_peer* peer)) {
+    peer->script = script;
+    peer->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = 0};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLen = sizeof(address);
+    if (peer->listenFd < 0 || bind(peer->listenFd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(peer->listenFd, 1) != 0 || getsockname(peer->listenFd, (struct sockaddr*)&address, &addressLen) != 0
+        || lcorehttp_hpack_init(&peer->decoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) != 0
+        || lcorehttp_hpack_init(&peer->encoder, LCOREHTTP_HPACK_DEFAULT_TABLE_SIZE) != 0) {
+        return -1;
+    }
+    peer->port = ntohs(address.sin_port);
+    return pthread_create(&peer->thread, NULL, peer_run, peer) != 0 ? -1 : 0;
+}
+
+static void
+peer_join(h2_peer* peer) {
+    pthread_join(peer->thread, NULL);
+    close(peer->listenFd);
+    lcorehttp_hpack_free(&peer->decoder);
+    lcorehttp_hpack_free(&peer->encoder);
+}
+
+// connects to the peer and starts HTTP/2 with the first stream in *transport, retaining the connection
+static lcorehttp_h2*
+client_connect(const h2_peer* peer, TransportInterface_t* transport) {
+    lcorehttp_socket_options options;
+    lcorehttp_socket_options_init(&options);
+    options.ioTimeoutMs = PEER_TIMEOUT_MS;
+    lcorehttp_timings timings;
+    l_corehttp_timings_init(&timings);
+    lcorehttp_socket* socket = NULL;
+    if (lcorehttp_socket_connect("127.0.0.1", peer->port, &options, &timings, &socket) != NULL) {
+        return NULL;
+    }
+    TransportInterface_t connection = {0};
+    connection.recv = lcorehttp_socket_recv;
+    connection.send = lcorehttp_socket_send;
+    connection.pNetworkContext = (NetworkContext_t*)socket;
+    if (lcorehttp_h2_connect("127.0.0.1", peer->port, PEER_TIMEOUT_MS, &connection, transport) != NULL) {
+        return NULL;
+    }
+    lcorehttp_h2* conn = lcorehttp_h2_of(transport);
+    lcorehttp_h2_retain(conn);
+    return conn;
+}
+
+static int
+client_send(TransportInterface_t* transport, const char* data, size_t len) {
+    return transport->send(transport->pNetworkContext, data, len) == (int32_t)len ? 0 : -1;
+}
+
+// reads the HTTP/1.1 form of the response until the stream ended, -1 when it failed or timed out
+static int
+client_read(TransportInterface_t* transport, lcorehttp_bytes* out) {
+    const lcorehttp_h2_stream* stream = (const lcorehttp_h2_stream*)transport->pNetworkContext;
+    uint32_t deadline = l_corehttp_get_time_ms() + PEER_TIMEOUT_MS;
+    char buffer[4096];
+    for (;;) {
+        int32_t received = transport->recv(transport->pNetworkContext, buffer, sizeof(buffer));
+        if (received < 0) {
+            return -1;
+        }
+        if (received > 0) {
+            lcorehttp_bytes_append(out, buffer, (size_t)received);
+        } else if (stream->remoteEnded) {
+            return 0;
+        } else if ((int32_t)(l_corehttp_get_time_ms() - deadline) >= 0) {
+            return -1;
+        }
+    }
+}
+
+static int
+response_is(const lcorehttp_bytes* response, const char* expected) {
+    return response->len == strlen(expected) && memcmp(response->data, expected, response->len) == 0;
+}
+
+// answers two requests interleaved and in reverse order
+static void
+script_multiplex(h2_peer* peer) {
+    uint32_t one = 0;
+    uint32_t three = 0;
+    for (int i = 0; i < 2 && peer_expect(peer, H2_HEADERS, 0) == 0; i++) {
+        if (strstr(peer->frame.fields.text, ":path: /one\n") != NULL) {
+            one = peer->frame.id;
+        } else if (strstr(peer->frame.fields.text, ":path: /three\n") != NULL) {
+            three = peer->frame.id;
+        }
+        CHECK(strstr(peer->frame.fields.text, ":authority: peer.test\n") != NULL);
+    }
+    CHECK(one != 0 && three != 0 && one != three);
+    const char* const threeFields[] = {":status", "200", "content-type", "text/plain", "x-stream", "three",
+                                       "content-length", "5", NULL};
+    const char* const oneFields[] = {":status", "200", "content-type", "text/plain", "x-stream", "one", NULL};
+    CHECK(peer_send_headers(peer, three, 0, threeFields) == 0);
+    CHECK(peer_send_headers(peer, one, 0, oneFields) == 0);
+    CHECK(peer_send_frame(peer, H2_DATA, 0, one, "on", 2) == 0);
+    CHECK(peer_send_frame(peer, H2_DATA, H2_FLAG_END_STREAM, three, "three", 5) == 0);
+    CHECK(peer_send_frame(peer, H2_DATA, H2_FLAG_END_STREAM, one, "e", 1) == 0);
+}
+
+static void
+test_h2_multiplexed_streams(void) {
+    h2_peer peer = {0};
+    CHECK(peer_start(&peer, script_multiplex) == 0);
+    TransportInterface_t one;
+    TransportInterface_t three;
+    lcorehttp_h2* conn = client_connect(&peer, &one);
+    CHECK(conn != NULL);
+    if (conn != NULL) {
+        CHECK(lcorehttp_h2_open_stream(conn, &three) == 0);
+        // with a content-length the request goes out with send, without one it only ends with the first recv
+        const char* requestOne = "GET /one HTTP/1.1\r\nHost: peer.test\r\nContent-Length: 0\r\n\r\n";
+        const char* requestThree = "GET /three HTTP/1.1\r\nHost: peer.test\r\nConnection: keep-alive\r\n"
+                                   "Content-Length: 0\r\n\r\n";
+        CHECK(client_send(&one, requestOne, strlen(requestOne)) == 0);
+        CHECK(client_send(&three, requestThree, strlen(requestThree)) == 0);
+        // the second stream completes first, DATA of the first one stays buffered meanwhile
+        lcorehttp_bytes responseThree = {0};
+        lcorehttp_bytes responseOne = {0};
+        CHECK(client_read(&three, &responseThree) == 0);
+        CHECK(client_read(&one, &responseOne) == 0);
+        CHECK(response_is(&responseThree, "HTTP/1.1 200 \r\ncontent-type: text/plain\r\nx-stream: three\r\n"
+                                          "content-length: 5\r\n\r\nthree"));
+        CHECK(response_is(&responseOne, "HTTP/1.1 200 \r\ncontent-type: text/plain\r\nx-stream: one\r\n"
+                                        "transfer-encoding: chunked\r\n\r\n2\r\non\r\n1\r\ne\r\n0\r\n\r\n"));
+        lcorehttp_bytes_free(&responseOne);
+        lcorehttp_bytes_free(&responseThree);
+        lcorehttp_h2_stream_close(one.pNetworkContext);
+        lcorehttp_h2_stream_close(three.pNetworkContext);
+        CHECK(lcorehttp_h2_alive(conn, PEER_TIMEOUT_MS));
+        lcorehttp_h2_release(conn);
+    }
+    peer_join(&peer);
+}
+
+#define FLOW_DOWNLOAD_SIZE (LCOREHTTP_H2_STREAM_WINDOW + 4)
+#define FLOW_UPLOAD_SIZE   100
+#define FLOW_PEER_WINDOW   16
+
+/*
+ * Download: the peer fills the stream window the client announced and only sends the rest once the client
+ * returned it. Upload: the peer announced a 16 byte window and a header table of 256 bytes, DATA must never
+ * exceed what WINDOW_UPDATE granted and the next request block starts with a table size update.
+ */
+static void
+script_flow_control(h2_peer* peer) {
+    if (peer_expect(peer, H2_HEADERS, 0) != 0) {
+        return;
+    }
+    uint32_t download = peer->frame.id;
+    const char* const downloadFields[] = {":status", "200", NULL};
+    CHECK(peer_send_headers(peer, download, 0, downloadFields) == 0);
+    static uint8_t payload[LCOREHTTP_H2_FRAME_SIZE];
+    memset(payload, 'd', sizeof(payload));
+    for (size_t sent = 0; sent < LCOREHTTP_H2_STREAM_WINDOW; sent += sizeof(payload)) {
+        CHECK(peer_send_frame(peer, H2_DATA, 0, download, payload, sizeof(payload)) == 0);
+    }
+    if (peer_expect(peer, H2_WINDOW_UPDATE, download) != 0) {
+        return;
+    }
+    CHECK(peer_frame_u32(peer) >= LCOREHTTP_H2_STREAM_WINDOW / 2);
+    CHECK(peer_send_frame(peer, H2_DATA, H2_FLAG_END_STREAM, download, "tail", 4) == 0);
+
+    if (peer_expect(peer, H2_HEADERS, 0) != 0) {
+        return;
+    }
+    uint32_t upload = peer->frame.id;
+    CHECK(strstr(peer->frame.fields.text, ":path: /upload\n") != NULL);
+    CHECK(peer->decoder.table.maxSize == 256);
+    size_t received = 0;
+    size_t granted = FLOW_PEER_WINDOW;
+    int ended = 0;
+    while (!ended && peer_expect(peer, H2_DATA, upload) == 0) {
+        received += peer->frame.len;
+        ended = peer->frame.flags & H2_FLAG_END_STREAM;
+        CHECK(received <= granted);
+        if (received == granted && !ended) {
+            CHECK(peer_send_u32(peer, H2_WINDOW_UPDATE, upload, FLOW_PEER_WINDOW) == 0);
+            granted += FLOW_PEER_WINDOW;
+        }
+    }
+    CHECK(ended && received == FLOW_UPLOAD_SIZE);
+    const char* const uploadFields[] = {":status", "200", "content-length", "3", NULL};
+    CHECK(peer_send_headers(peer, upload, 0, uploadFields) == 0);
+    CHECK(peer_send_frame(peer, H2_DATA, H2_FLAG_END_STREAM, upload, "100", 3) == 0);
+}
+
+static void
+test_h2_flow_control(void) {
+    h2_peer peer = {.initialWindow = FLOW_PEER_WINDOW, .headerTableSize = 256};
+    CHECK(peer_start(&peer, script_flow_control) == 0);
+    TransportInterface_t download;
+    lcorehttp_h2* conn = client_connect(&peer, &download);
+    CHECK(conn != NULL);
+    if (conn != NULL) {
+        const char* request = "GET /download HTTP/1.1\r\nHost: peer.test\r\n\r\n";
+        CHECK(client_send(&download, request, strlen(request)) == 0);
+        lcorehttp_bytes response = {0};
+        CHECK(client_read(&download, &response) == 0);
+        const char* head = "HTTP/1.1 200 \r\ntransfer-encoding: chunked\r\n\r\n";
+        CHECK(response.len > strlen(head) && memcmp(response.data, head, strlen(head)) == 0);
+        lcorehttp_dechunker dechunker = LCOREHTTP_DECHUNKER_INIT;
+        size_t bodyLen = lcorehttp_dechunk(&dechunker, response.data + strlen(head), response.len - strlen(head));
+        CHECK(dechunker.state == DECHUNK_DONE && bodyLen == FLOW_DOWNLOAD_SIZE);
+        lcorehttp_h2_stream_close(download.pNetworkContext);
+
+        // send only returns once the peer opened its window far enough for the whole body
+        TransportInterface_t upload;
+        CHECK(lcorehttp_h2_open_stream(conn, &upload) == 0);
+        char body[FLOW_UPLOAD_SIZE];
+        memset(body, 'u', sizeof(body));
+        char uploadHead[128];
+        int headLen = snprintf(uploadHead, sizeof(uploadHead),
+                               "POST /upload HTTP/1.1\r\nHost: peer.test\r\nContent-Length: %d\r\n\r\n",
+                               FLOW_UPLOAD_SIZE);
+        CHECK(client_send(&upload, uploadHead, (size_t)headLen) == 0);
+        CHECK(client_send(&upload, body, sizeof(body)) == 0);
+        response.len = 0;
+        CHECK(client_read(&upload, &response) == 0);
+        CHECK(response_is(&response, "HTTP/1.1 200 \r\ncontent-length: 3\r\n\r\n100"));
+        lcorehttp_bytes_free(&response);
+        lcorehttp_h2_stream_close(upload.pNetworkContext);
+        lcorehttp_h2_release(conn);
+    }
+    peer_join(&peer);
+}
+
+// RFC 7541 C.6.1, a Huffman coded header block straight from another encoder
+#define GOAWAY_RESPONSE_BLOCK                                                                                \
+    "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43" \
+    "d3"
+
+// refuses the second stream with GOAWAY and still answers the first one
+static void
+script_goaway(h2_peer* peer) {
+    uint32_t ids[2] = {0, 0};
+    for (int i = 0; i < 2 && peer_expect(peer, H2_HEADERS, 0) == 0; i++) {
+        ids[i] = peer->frame.id;
+    }
+    uint32_t first = ids[0] < ids[1] ? ids[0] : ids[1];
+    uint8_t goaway[8] = {(uint8_t)(first >> 24), (uint8_t)(first >> 16), (uint8_t)(first >> 8), (uint8_t)first,
+                         0, 0, 0, 0};
+    CHECK(peer_send_frame(peer, H2_GOAWAY, 0, 0, goaway, sizeof(goaway)) == 0);
+    uint8_t block[128];
+    size_t len = unhex(GOAWAY_RESPONSE_BLOCK, block, sizeof(block));
+    CHECK(peer_send_frame(peer, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, first, block, len) == 0);
+}
+
+static void
+test_h2_goaway(void) {
+    h2_peer peer = {0};
+    CHECK(peer_start(&peer, script_goaway) == 0);
+    TransportInterface_t kept;
+    TransportInterface_t refused;
+    lcorehttp_h2* conn = client_connect(&peer, &kept);
+    CHECK(conn != NULL);
+    if (conn != NULL) {
+        CHECK(lcorehttp_h2_open_stream(conn, &refused) == 0);
+        const char* request = "GET / HTTP/1.1\r\nHost: peer.test\r\nContent-Length: 0\r\n\r\n";
+        CHECK(client_send(&kept, request, strlen(request)) == 0);
+        CHECK(client_send(&refused, request, strlen(request)) == 0);
+        lcorehttp_bytes response = {0};
+        CHECK(client_read(&kept, &response) == 0);
+        CHECK(response_is(&response, "HTTP/1.1 302 \r\ncache-control: private\r\n"
+                                     "date: Mon, 21 Oct 2013 20:13:21 GMT\r\nlocation: https://www.example.com\r\n"
+                                     "content-length: 0\r\n\r\n"));
+        // above the last stream id, not processed by the peer and may be retried on another connection
+        CHECK(((const lcorehttp_h2_stream*)refused.pNetworkContext)->reset);
+        response.len = 0;
+        CHECK(client_read(&refused, &response) == -1);
+        lcorehttp_bytes_free(&response);
+        CHECK(!lcorehttp_h2_alive(conn, PEER_TIMEOUT_MS));
+        TransportInterface_t late;
+        CHECK(lcorehttp_h2_open_stream(conn, &late) == -1);
+        lcorehttp_h2_stream_close(kept.pNetworkContext);
+        lcorehttp_h2_stream_close(refused.pNetworkContext);
+        lcorehttp_h2_release(conn);
+    }
+    peer_join(&peer);
+}
+
+int
+main(void) {
+    test_hpack_huffman_requests();
+    test_hpack_huffman_eviction();
+    test_hpack_size_update_limits();
+    test_hpack_round_trip();
+    test_h2_multiplexed_streams();
+    test_h2_flow_control();
+    test_h2_goaway();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
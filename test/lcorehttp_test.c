@@ -0,0 +1,141 @@
+#include <arpa/inet.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bench_server.h"
+#include "lcorehttp.h"
+
+#ifndef LCOREHTTP_TEST_SCRIPT
+#define LCOREHTTP_TEST_SCRIPT "test/test.lua"
+#endif
+
+// listener on the loopback address of family whose accept queue is full, so the kernel drops further SYNs as if the
+// address was unroutable; the queued connection is returned in *fillerFd
+static int
+blackhole_listen(int family, int port, int* fillerFd) {
+    struct sockaddr_storage addr = {0};
+    socklen_t addrLen = sizeof(struct sockaddr_in);
+    if (family == AF_INET6) {
+        struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_loopback;
+        addr6->sin6_port = htons((uint16_t)port);
+        addrLen = sizeof(struct sockaddr_in6);
+    } else {
+        struct sockaddr_in* addr4 = (struct sockaddr_in*)&addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr4->sin_port = htons((uint16_t)port);
+    }
+    int one = 1;
+    int fd = socket(family, SOCK_STREAM, 0);
+    *fillerFd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0 || *fillerFd < 0 || (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) != 0)
+        || bind(fd, (struct sockaddr*)&addr, addrLen) != 0 || listen(fd, 0) != 0
+        || connect(*fillerFd, (struct sockaddr*)&addr, addrLen) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (*fillerFd >= 0) {
+            close(*fillerFd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Happy Eyeballs setup: when localhost resolves to both ::1 and 127.0.0.1, the address tried first is blackholed
+ * and the other one is served on the same port. Returns that port, 0 when localhost is single-stack here.
+ */
+static int
+happy_eyeballs_start(bench_server* server, int* blackholeFd, int* fillerFd) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG; // as the connector resolves
+    struct addrinfo* addresses = NULL;
+    if (getaddrinfo("localhost", NULL, &hints, &addresses) != 0 || addresses == NULL) {
+        return 0;
+    }
+    int first = addresses->ai_family;
+    int second = AF_UNSPEC;
+    for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+        if (address->ai_family != first && (address->ai_family == AF_INET || address->ai_family == AF_INET6)) {
+            second = address->ai_family;
+        }
+    }
+    freeaddrinfo(addresses);
+    if ((first != AF_INET && first != AF_INET6) || second == AF_UNSPEC
+        || bench_server_start_on(server, 0, second, 0) != 0) {
+        return 0;
+    }
+    *blackholeFd = blackhole_listen(first, server->port, fillerFd);
+    if (*blackholeFd < 0) {
+        bench_server_stop(server);
+        return 0;
+    }
+    return server->port;
+}
+
+// runs the test script against two loopback HTTP servers, a hop between them is a cross-origin redirect
+int
+main(int argc, char** argv) {
+    bench_server server;
+    bench_server otherServer;
+    if (bench_server_start(&server, 0) != 0 || bench_server_start(&otherServer, 0) != 0) {
+        fprintf(stderr, "failed to start loopback servers\n");
+        return 1;
+    }
+
+    bench_server dualStackServer;
+    int blackholeFd = -1;
+    int fillerFd = -1;
+    int happyEyeballsPort = happy_eyeballs_start(&dualStackServer, &blackholeFd, &fillerFd);
+
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_requiref(L, "corehttp", luaopen_lua_corehttp, 0);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushinteger(L, server.port);
+    lua_setfield(L, -2, "http_port");
+    lua_pushinteger(L, otherServer.port);
+    lua_setfield(L, -2, "other_http_port");
+    if (happyEyeballsPort != 0) {
+        lua_pushinteger(L, happyEyeballsPort);
+        lua_setfield(L, -2, "happy_eyeballs_port");
+    }
+    lua_setglobal(L, "test");
+
+    lua_newtable(L);
+    for (int i = 1; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setglobal(L, "arg");
+
+    int result = 0;
+    if (luaL_dofile(L, LCOREHTTP_TEST_SCRIPT) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        result = 1;
+    }
+
+    lua_close(L);
+    bench_server_stop(&server);
+    bench_server_stop(&otherServer);
+    if (happyEyeballsPort != 0) {
+        close(fillerFd);
+        close(blackholeFd);
+        bench_server_stop(&dualStackServer);
+    }
+    return result;
+}
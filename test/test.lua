@@ -0,0 +1,709 @@
+-- lcorehttp_test cases, run against the loopback servers of bench_server.c
+--
+-- usage: lcorehttp_test [filter]
+--   filter - only run cases whose name contains this string
+--
+-- a case returns a reason string when it cannot run in this environment, it is reported as skipped
+
+local corehttp = require "corehttp"
+
+local filter = arg[1]
+
+local function redirect_path(port, path)
+    return "/redirect/" .. port .. path
+end
+
+-- POSTs body to the echo route, which sends it back in pieces of at most piece bytes, and decodes the reply
+local function echo_json(client, body, piece, options)
+    local response <close>, _, err = client:request("/echo/body/" .. piece, "POST", { body = body })
+    assert(response, err)
+    return response:read_json(options)
+end
+
+-- same through an iterator of the response (lines or events), returns the collected records
+local function echo_records(client, body, piece, iterator, options)
+    local response <close>, _, err = client:request("/echo/body/" .. piece, "POST", { body = body })
+    assert(response, err)
+    local records = {}
+    for record in response[iterator](response, options) do
+        records[#records + 1] = record
+    end
+    return records
+end
+
+local cases = {
+    {
+        name = "redirect-cross-origin-keeps-max-body-bytes",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port, { max_body_bytes = 1024 })
+            local path = redirect_path(test.other_http_port, "/bytes/65536")
+            local response <close>, _, err = client:request(path, "GET", { follow_redirects = 2 })
+            assert(response, err)
+            assert(response:http_status_code() == 200, "redirect was not followed")
+            local ok, readErr = pcall(response.read_content, response)
+            assert(not ok, "body over max_body_bytes was read after a cross-origin redirect")
+            assert(tostring(readErr):find("max_body_bytes", 1, true), readErr)
+        end,
+    },
+    {
+        name = "redirect-cross-origin-within-limit",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port, { max_body_bytes = 1024 })
+            local path = redirect_path(test.other_http_port, "/bytes/512")
+            local response <close>, _, err = client:request(path, "GET", { follow_redirects = 2 })
+            assert(response, err)
+            assert(response:http_status_code() == 200, "redirect was not followed")
+            assert(#response:read_content() == 512)
+        end,
+    },
+    {
+        name = "multipart-rejects-line-breaks-in-part-headers",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local parts = {
+                { name = "a", data = "x", headers = { ["X-Part"] = "1\r\nX-Injected: yes" } },
+                { name = "b", data = "x", headers = { ["X-Part\r\nX-Injected"] = "yes" } },
+                { name = "c", data = "x", content_type = "text/plain\r\nX-Injected: yes" },
+            }
+            for _, part in ipairs(parts) do
+                local ok, response = pcall(client.request, client, "/bytes/0", "POST", { multipart = { part } })
+                assert(not ok or response == nil, "part " .. part.name .. " was sent with a line break")
+            end
+        end,
+    },
+    {
+        name = "preresponse-invalid-trailers-still-end-the-body",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local finishErr
+            local response <close>, _, err = client:request("/upload", "POST", {
+                chunked = true,
+                write_body_hook = function(preresponse)
+                    preresponse:write("hello")
+                    _, finishErr = preresponse:finish({ ["X-Checksum"] = "1\r\nX-Injected: yes" })
+                end,
+            })
+            assert(response, err)
+            assert(finishErr ~= nil, "trailer with a line break was accepted")
+            assert(response:read_content() == "5")
+        end,
+    },
+    {
+        name = "tls-config-rejects-ktls-with-early-data",
+        run = function()
+            local ok, err = pcall(corehttp.tls_config, { ktls = true, early_data = true })
+            assert(not ok, "ktls and early_data were combined")
+            assert(tostring(err):find("ktls", 1, true), err)
+        end,
+    },
+    {
+        name = "http2-option-validation",
+        run = function()
+            local ok, err = pcall(corehttp.tls_config, { http2 = true, early_data = true })
+            assert(not ok, "http2 and early_data were combined")
+            assert(tostring(err):find("http2", 1, true), err)
+            ok, err = pcall(corehttp.new_client, "http", "127.0.0.1", test.http_port, { http2 = true })
+            assert(not ok and tostring(err):find("https", 1, true), err)
+            ok, err = pcall(corehttp.new_client, "https", "127.0.0.1", 443, { http2 = true, tls_early_data = true })
+            assert(not ok and tostring(err):find("tls_early_data", 1, true), err)
+            local tls = corehttp.tls_config({ http2 = true, verify = false })
+            ok, err = pcall(corehttp.new_client, "https", "127.0.0.1", 443, { http2 = true, tls_config = tls })
+            assert(not ok and tostring(err):find("tls_config", 1, true), err)
+            local client = corehttp.new_client("https", "127.0.0.1", 443, { tls_config = tls })
+            local ws, wsErr = client:websocket("/ws")
+            assert(ws == nil and wsErr:find("http2", 1, true), wsErr)
+        end,
+    },
+    {
+        name = "async-future-resolved-via-wait",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local future = client:request_async("/bytes/65536", "GET")
+            assert(future:wait(10000), "future did not resolve")
+            assert(future:ready())
+            local response <close>, _, err = future:result()
+            assert(response, err)
+            assert(response:http_status_code() == 200)
+            assert(#response:read_content() == 65536)
+        end,
+    },
+    {
+        name = "async-abandoned-future-is-reaped",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local watched = setmetatable({}, { __mode = "k" })
+            do
+                local options = {}
+                watched[options] = true
+                client:request_async("/bytes/4194304", "GET", options) -- the future is dropped right away
+            end
+            collectgarbage()
+            -- every request_async reaps the abandoned jobs its workers finished, which releases their options
+            for _ = 1, 100 do
+                local future = client:request_async("/small", "GET")
+                assert(future:wait(10000), "future did not resolve")
+                collectgarbage()
+                if next(watched) == nil then
+                    return
+                end
+            end
+            error("abandoned future still references its options")
+        end,
+    },
+    {
+        name = "async-future-propagates-errors",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local future = client:request_async("/bytes/65536", "GET", { max_body_bytes = 1024 })
+            local response, first, second = future:result()
+            assert(response == nil, "body over max_body_bytes was downloaded")
+            local err = tostring(second or first)
+            assert(err:find("max_body_bytes", 1, true), err)
+            local again, againFirst, againSecond = future:result()
+            assert(again == nil and againFirst == first and againSecond == second, "result() did not replay the error")
+            local watched = setmetatable({}, { __mode = "k" })
+            do
+                local options = { max_body_bytes = -1 }
+                watched[options] = true
+                local rejected, optionsErr = client:request_async("/small", "GET", options)
+                assert(rejected == nil and optionsErr, "invalid body limit options were accepted")
+            end
+            collectgarbage()
+            assert(next(watched) == nil, "rejected options are still referenced")
+        end,
+    },
+    {
+        name = "prepared-send-twice-reuses-the-header-block",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local prepared = client:prepare("/echo/head", "GET", { headers = { ["X-Static"] = "1" } })
+            local first <close>, _, err = prepared:send(nil, { ["X-Call"] = "1" })
+            assert(first, err)
+            local firstHead = first:read_content()
+            local second <close>, _, secondErr = prepared:send(nil, { ["X-Call"] = "2" })
+            assert(second, secondErr)
+            local secondHead = second:read_content()
+            -- the serialized block goes out unchanged, per-call headers are appended to a copy of it
+            local callAt = firstHead:find("X-Call: 1\r\n", 1, true)
+            assert(callAt, firstHead)
+            local block = firstHead:sub(1, callAt - 1)
+            assert(block:find("^GET /echo/head HTTP/1.1\r\n") and block:find("X-Static: 1\r\n", 1, true), block)
+            assert(secondHead:sub(1, #block) == block, secondHead)
+            assert(secondHead:find("X-Call: 2\r\n", #block + 1, true), secondHead)
+            assert(not secondHead:find("X-Call: 1", 1, true), "headers of the first send leaked into the second")
+        end,
+    },
+    {
+        name = "prepare-rejects-unsupported-options",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local options = {
+                follow_redirects = { follow_redirects = 2 },
+                hedge = { hedge = { after_ms = 10 } },
+                multipart = { multipart = { { name = "a", data = "x" } } },
+            }
+            for name, option in pairs(options) do
+                local prepared, err = client:prepare("/small", "GET", option)
+                assert(prepared == nil, name .. " was accepted by prepare")
+                assert(tostring(err):find(name, 1, true), err)
+            end
+        end,
+    },
+    {
+        name = "chunked-body-read-to-the-end-returns-the-connection",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port, { max_idle_connections = 1 })
+            local readers = {
+                read_chunked_content = function(response) return #response:read_chunked_content() end,
+                lines = function(response)
+                    local size = 0
+                    for line in response:lines() do
+                        size = size + #line
+                    end
+                    return size
+                end,
+            }
+            for name, read in pairs(readers) do
+                do
+                    local first <close>, _, err = client:request("/chunked/5000", "GET")
+                    assert(first, err)
+                    assert(read(first) == 5000, name)
+                end -- closing the response hands its connection to the pool
+                local second <close>, _, secondErr = client:request("/small", "GET")
+                assert(second, secondErr)
+                assert(second:connection_reused(), "connection of a chunked body read with " .. name .. " was closed")
+                assert(#second:read_content() == 64)
+            end
+        end,
+    },
+    {
+        name = "json-nested-values-escapes-and-null",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local body = [[{"list": [1, [2, [3, {}]], []], "object": {"inner": {"deep": true, "no": false}},]]
+                .. [[ "escaped": "q\"b\\s\/n\n t\tx\u00e9\u20AC", "pair": "\ud83d\ude00", "lone": "\ud800x",]]
+                .. [[ "nothing": null}]]
+            for _, piece in ipairs({ 0, 1, 3 }) do
+                local value, err = echo_json(client, body, piece)
+                local where = "pieces of " .. piece .. " bytes"
+                assert(value, err)
+                assert(#value.list == 3 and value.list[1] == 1, where)
+                assert(value.list[2][1] == 2 and value.list[2][2][1] == 3, where)
+                assert(next(value.list[2][2][2]) == nil and next(value.list[3]) == nil, where)
+                assert(value.object.inner.deep == true and value.object.inner.no == false, where)
+                assert(value.escaped == 'q"b\\s/n\n t\tx\u{e9}\u{20AC}', where)
+                assert(value.pair == "\u{1F600}", where) -- surrogate pair, split between reads with small pieces
+                assert(value.lone == "\u{FFFD}x", where)
+                assert(value.nothing == corehttp.json_null, where)
+            end
+            local sentinel = {}
+            local value, err = echo_json(client, body, 0, { null = sentinel })
+            assert(value, err)
+            assert(value.nothing == sentinel, "options.null was not used for null")
+        end,
+    },
+    {
+        name = "json-numbers-split-across-reads",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local body = "[12345678, -0.25, 6.02e23, 0, -7, 1E-2, 9007199254740993]"
+            for _, piece in ipairs({ 1, 2, 5 }) do
+                local value, err = echo_json(client, body, piece)
+                assert(value, err)
+                assert(#value == 7, "pieces of " .. piece .. " bytes")
+                assert(math.type(value[1]) == "integer" and value[1] == 12345678, value[1])
+                assert(value[2] == -0.25 and value[3] == 6.02e23, value[3])
+                assert(math.type(value[4]) == "integer" and value[4] == 0 and value[5] == -7, value[5])
+                assert(value[6] == 1E-2, value[6])
+                assert(value[7] == 9007199254740993, value[7]) -- integers keep their precision
+            end
+            local number, err = echo_json(client, "-4.5e1", 1) -- a top-level number ends with the body
+            assert(number == -45.0, err)
+        end,
+    },
+    {
+        name = "json-truncated-and-malformed-input",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local inputs = {
+                { '{"a": [1, 2', 1, "unexpected end of JSON at byte 11" },
+                { '{"a": "unterminated', 4, "unexpected end of JSON at byte 19" },
+                { '{"a" 1}', 0, "expected ':' at byte 5" },
+                { '[1, 2}', 0, "mismatched bracket at byte 5" },
+                { '{"a": "\x"}', 0, "invalid escape at byte 8" },
+                { '[tru]', 0, "invalid literal at byte 4" },
+                { "[1] [2]", 0, "trailing characters after JSON value at byte 4" },
+            }
+            for _, input in ipairs(inputs) do
+                local value, err = echo_json(client, input[1], input[2])
+                assert(value == nil, input[1] .. " was decoded")
+                assert(err == input[3], err)
+            end
+        end,
+    },
+    {
+        name = "lines-split-across-reads",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local body = "first\r\nsecond\n\r\nfourth\r\n" .. string.rep("x", 40) .. "\nlast"
+            local expected = { "first", "second", "", "fourth", string.rep("x", 40), "last" }
+            for _, piece in ipairs({ 0, 1, 2, 5 }) do
+                local lines = echo_records(client, body, piece, "lines")
+                assert(#lines == #expected, "pieces of " .. piece .. " bytes: " .. #lines .. " lines")
+                for i, line in ipairs(expected) do
+                    assert(lines[i] == line, "pieces of " .. piece .. " bytes: line " .. i .. " is " .. lines[i])
+                end
+            end
+
+            local ndjson = '{"a": 1}\r\n\r\n  \n{"b": [true, null]}'
+            for _, piece in ipairs({ 0, 1, 3 }) do
+                local records = echo_records(client, ndjson, piece, "lines", { json = true })
+                assert(#records == 2 and records[1].a == 1, "blank lines were not skipped")
+                assert(records[2].b[1] == true and records[2].b[2] == corehttp.json_null)
+            end
+        end,
+    },
+    {
+        name = "events-fields-comments-and-line-endings",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local body = ": stream opened\r\n"
+                .. "event: update\r\ndata: first\r\ndata:second\r\ndata\r\nid: 7\r\nretry: 1500\r\n\r\n"
+                .. "data: plain\n: comment inside an event\n\n"
+                .. ": keep-alive\n\n"
+                .. "data: carriage returns only\r\r"
+                .. "data: no blank line follows"
+            for _, piece in ipairs({ 0, 1, 2, 5 }) do
+                local where = "pieces of " .. piece .. " bytes"
+                local events = echo_records(client, body, piece, "events")
+                assert(#events == 3, where .. ": " .. #events .. " events")
+                local update = events[1]
+                assert(update.event == "update" and update.data == "first\nsecond\n", where)
+                assert(update.id == "7" and update.retry == 1500, where)
+                assert(events[2].event == "message" and events[2].data == "plain", where)
+                assert(events[2].id == "7", where) -- the last event id stays until the stream sets another one
+                assert(events[3].data == "carriage returns only", where)
+            end
+        end,
+    },
+    {
+        name = "websocket-echo-round-trips",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local ws <close> = assert(client:websocket("/ws/echo/0", { protocols = { "chat", "superchat" } }))
+            assert(ws:protocol() == "chat", ws:protocol())
+            local binary = string.rep("\0\1\255", 27000)
+            local messages = {
+                { "hello", "text" }, { "", "text" }, { binary, "binary" }, { "grüße \u{1F600}", "text" },
+            }
+            for _, message in ipairs(messages) do
+                assert(ws:send(message[1], message[2]))
+                local data, kind = ws:receive(5000)
+                assert(data == message[1] and kind == message[2], "echo of " .. #message[1] .. " bytes differs")
+            end
+            assert(ws:ping("are you there"))
+            assert(ws:send("after the ping"))
+            assert(ws:receive(5000) == "after the ping") -- the pong is consumed while receiving
+            assert(ws:send("!ping 42", "binary")) -- the server pings, the client answers while receiving
+            local data, kind = ws:receive(5000)
+            assert(data == "pong 42" and kind == "text", data)
+        end,
+    },
+    {
+        name = "websocket-fragmented-messages",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local ws <close> = assert(client:websocket("/ws/echo/7", { fragment_size = 5 }))
+            -- frames of 5 and 7 bytes split the two-byte characters, the server pings after its first frame
+            local text = string.rep("aé", 20)
+            assert(ws:send(text))
+            local data, kind = ws:receive(5000)
+            assert(data == text and kind == "text", data)
+            assert(ws:send(string.rep("b", 5), "binary")) -- exactly one frame
+            assert(ws:receive(5000) == string.rep("b", 5))
+        end,
+    },
+    {
+        name = "websocket-permessage-deflate",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local ws <close> = assert(client:websocket("/ws/echo/0", { compress = true }))
+            local message = string.rep('{"build": 42, "state": "running"}', 50)
+            for i = 1, 3 do -- no context takeover: every message is compressed from scratch
+                assert(ws:send(message))
+                local data = ws:receive(5000)
+                assert(data == message, "compressed echo " .. i .. " differs")
+            end
+            assert(ws:send("short")) -- below the threshold, sent and echoed uncompressed
+            assert(ws:receive(5000) == "short")
+            ws:close()
+
+            local fragmented <close> = assert(client:websocket("/ws/echo/16", { compress = true, fragment_size = 8 }))
+            assert(fragmented:send(message))
+            assert(fragmented:receive(5000) == message, "fragmented compressed echo differs")
+        end,
+    },
+    {
+        name = "websocket-close-codes",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local ws = assert(client:websocket("/ws/echo/0"))
+            assert(ws:send("!close 4001 going away", "binary"))
+            local data, status, code, reason = ws:receive(5000)
+            assert(data == nil and status == "closed" and code == 4001 and reason == "going away", status)
+
+            ws = assert(client:websocket("/ws/echo/0"))
+            assert(ws:close(4002, "bye"))
+            data, status, code = ws:receive(5000)
+            assert(data == nil and status == "closed" and code == 4002, status) -- the server echoes the code
+
+            for _, invalid in ipairs({ 1005, 1006, 999, 2000 }) do
+                ws = assert(client:websocket("/ws/echo/0"))
+                assert(ws:send("!close " .. invalid, "binary"))
+                local err
+                data, err = ws:receive(5000)
+                assert(data == nil and err == "invalid close code", invalid .. " was accepted: " .. tostring(err))
+                ws:close()
+            end
+
+            ws = assert(client:websocket("/ws/echo/0"))
+            local ok, err = pcall(ws.close, ws, 1005)
+            assert(not ok and tostring(err):find("close code", 1, true), err)
+            ok, err = pcall(ws.close, ws, 5000)
+            assert(not ok, "close code 5000 was sent")
+            ws:close()
+        end,
+    },
+    {
+        name = "websocket-rejects-invalid-utf8-text",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            -- truncated sequence, overlong slash, surrogate, above U+10FFFF, byte never valid
+            for _, invalid in ipairs({ "\xC3", "\xC0\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "ok\xFF" }) do
+                local ws <close> = assert(client:websocket("/ws/echo/0"))
+                assert(ws:send("!text " .. invalid, "binary"))
+                local data, err = ws:receive(5000)
+                assert(data == nil and err == "invalid UTF-8 in text message", tostring(err))
+            end
+
+            local ws <close> = assert(client:websocket("/ws/echo/0"))
+            local valid = string.rep("ascii only ", 3) .. "\u{10FFFF}\u{800}"
+            assert(ws:send("!text " .. valid, "binary"))
+            local data, kind = ws:receive(5000)
+            assert(data == valid and kind == "text", kind)
+        end,
+    },
+    {
+        name = "rate-limited-transfers-take-their-time",
+        run = function()
+            -- 256KB/s with a 16KB burst: everything but the burst and one 20 ms quantum is paced
+            local rate, burst, size = 262144, 16384, 262144
+            local minimumUs = (size - burst - rate // 50) * 1000000 // rate
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port,
+                { max_download_rate = rate, max_upload_rate = rate, rate_burst = burst })
+            local response <close> = assert(client:request("/bytes/" .. size, "GET"))
+            assert(#response:read_content() == size)
+            local elapsed = response:timings().body_transfer
+            assert(elapsed >= minimumUs, "download took " .. elapsed .. " us, expected at least " .. minimumUs)
+
+            local upload <close> = assert(client:request("/upload", "POST", { body = string.rep("u", size) }))
+            assert(upload:read_content() == tostring(size))
+            elapsed = upload:timings().send
+            assert(elapsed >= minimumUs, "upload took " .. elapsed .. " us, expected at least " .. minimumUs)
+
+            -- the process-wide limit applies to clients without limits of their own
+            assert(corehttp.set_rate_limit({ download = rate, burst = burst }))
+            local unlimited = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local ok, shaped = pcall(function()
+                local limited <close> = assert(unlimited:request("/bytes/" .. size, "GET"))
+                assert(#limited:read_content() == size)
+                return limited:timings().body_transfer
+            end)
+            corehttp.set_rate_limit({}) -- removed before asserting, the remaining cases run unlimited
+            assert(ok, shaped)
+            assert(shaped >= minimumUs, "process-wide limit: " .. shaped .. " us, expected at least " .. minimumUs)
+        end,
+    },
+    {
+        name = "rate-limit-option-validation",
+        run = function()
+            for _, option in ipairs({ "max_download_rate", "max_upload_rate", "rate_burst" }) do
+                for _, invalid in ipairs({ -1, 1.5, "fast" }) do
+                    local ok, err = pcall(corehttp.new_client, "http", "127.0.0.1", test.http_port,
+                        { [option] = invalid })
+                    assert(not ok, option .. " = " .. tostring(invalid) .. " was accepted")
+                    assert(tostring(err):find(option .. " must be a non-negative integer", 1, true), err)
+                end
+            end
+            assert(corehttp.new_client("http", "127.0.0.1", test.http_port, { max_download_rate = 0 }))
+
+            for _, option in ipairs({ "download", "upload", "burst" }) do
+                local ok, err = pcall(corehttp.set_rate_limit, { [option] = -5 })
+                assert(not ok and tostring(err):find(option .. " must be a non-negative integer", 1, true), err)
+            end
+            local ok = pcall(corehttp.set_rate_limit, "unlimited")
+            assert(not ok, "set_rate_limit accepted a string")
+            assert(corehttp.set_rate_limit({}))
+        end,
+    },
+    {
+        name = "spilled-body-is-mapped",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local size = 300000
+            local plain <close> = assert(client:request("/bytes/" .. size, "GET"))
+            local expected = plain:read_content()
+
+            local response <close> = assert(client:request("/bytes/" .. size, "GET", { spill_threshold = 65536 }))
+            local body = response:read_content()
+            assert(type(body) == "userdata", "a body over spill_threshold was not mapped")
+            assert(#body == size and body:len() == size, #body)
+            assert(tostring(body) == expected and body:tostring() == expected, "mapped body differs")
+
+            local plainChunked <close> = assert(client:request("/chunked/" .. size, "GET"))
+            expected = plainChunked:read_chunked_content()
+            local chunked <close> = assert(client:request("/chunked/" .. size, "GET", { spill_threshold = 65536 }))
+            body = chunked:read_chunked_content()
+            assert(type(body) == "userdata", "a chunked body over spill_threshold was not mapped")
+            assert(#expected == size and tostring(body) == expected, "mapped chunked body differs")
+
+            local small <close> = assert(client:request("/bytes/1000", "GET", { spill_threshold = 65536 }))
+            assert(type(small:read_content()) == "string", "a body under spill_threshold was mapped")
+        end,
+    },
+    {
+        name = "mapped-body-sub-and-slice-positions",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port, { spill_threshold = 1024 })
+            local size = 5000
+            local response <close> = assert(client:request("/bytes/" .. size, "GET"))
+            local body = response:read_content()
+            assert(type(body) == "userdata")
+            local expected = tostring(body)
+            -- positions as string.sub takes them: negative from the end, clamped, empty when crossed
+            local ranges = {
+                { 1, 10 }, { 100 }, { -10 }, { -10, -5 }, { 0, 3 }, { -size - 100, 4 }, { size - 2, size + 100 },
+                { size + 1 }, { 10, 5 }, { 3, -size - 1 }, { 1, -1 }, { -1, -1 },
+            }
+            for _, range in ipairs(ranges) do
+                local i, j = range[1], range[2]
+                local where = "(" .. i .. ", " .. tostring(j) .. ")"
+                local want = expected:sub(i, j)
+                assert(body:sub(i, j) == want, "sub" .. where)
+                local slice = body:slice(i, j)
+                assert(#slice == #want and tostring(slice) == want, "slice" .. where)
+                assert(slice:sub(-3) == want:sub(-3), "slice" .. where .. ":sub(-3)")
+            end
+            assert(body:sub() == expected and #body:slice() == size)
+            local nested = body:slice(11, -11):slice(-20, -11)
+            assert(tostring(nested) == expected:sub(11, -11):sub(-20, -11), "slice of a slice")
+        end,
+    },
+    {
+        name = "mapped-body-slices-outlive-the-response",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port, { spill_threshold = 1024 })
+            local slice, nested, expected
+            do
+                local response <close> = assert(client:request("/bytes/100000", "GET"))
+                local body = response:read_content()
+                assert(type(body) == "userdata")
+                expected = tostring(body)
+                slice = body:slice(50001)
+                nested = slice:slice(1, 100)
+            end
+            -- the response and the root body are gone, the slices keep the mapping alive
+            collectgarbage()
+            collectgarbage()
+            assert(#slice == 50000 and tostring(slice) == expected:sub(50001), "slice lost its mapping")
+            assert(nested:sub() == expected:sub(50001, 50100))
+            slice = nil
+            collectgarbage()
+            collectgarbage()
+            assert(tostring(nested) == expected:sub(50001, 50100), "nested slice lost its mapping")
+        end,
+    },
+    {
+        name = "compress-body-round-trips",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local records = {}
+            for i = 1, 20000 do
+                records[i] = '{"id": ' .. i .. ', "state": "ok"}'
+            end
+            local body = table.concat(records, "\n")
+            -- the echo route undoes the Content-Encoding and reports how many bytes went over the wire
+            for _, encoding in ipairs({ "gzip", "deflate" }) do
+                for _, chunkSize in ipairs({ 1024, 16384 }) do
+                    local where = encoding .. " in chunks of " .. chunkSize
+                    local response <close>, _, err = client:request("/echo/body/0", "POST",
+                        { body = body, compress_body = encoding, chunk_size = chunkSize })
+                    assert(response, err)
+                    assert(response:http_status_code() == 200, where .. ": the server could not decode the body")
+                    assert(response:read_chunked_content() == body, where .. ": echo differs")
+                    local sent = tonumber(response:headers()["X-Received-Length"])
+                    assert(sent < #body // 4, where .. ": " .. sent .. " bytes sent")
+                end
+            end
+
+            local response, first, second = client:request("/echo/body/0", "POST", { body = "x", compress_body = "br" })
+            assert(response == nil, "compress_body = br was accepted")
+            assert(tostring(second or first):find("compress_body", 1, true), tostring(second or first))
+        end,
+    },
+    {
+        name = "compress-body-hook-writes-and-flushes",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local pieces = {}
+            for i = 1, 50 do
+                pieces[i] = string.rep(string.char(64 + i % 26), 100 + i * 37) .. "\n"
+            end
+            for _, encoding in ipairs({ "gzip", "deflate" }) do
+                local writeErr
+                local response <close>, _, err = client:request("/echo/body/0", "POST", {
+                    compress_body = encoding,
+                    chunk_size = 4096,
+                    write_body_hook = function(preresponse)
+                        for i, piece in ipairs(pieces) do
+                            local _, failure = preresponse:write(piece)
+                            writeErr = writeErr or failure
+                            if i % 10 == 0 then -- sync flushes in the middle of the stream
+                                _, failure = preresponse:flush()
+                                writeErr = writeErr or failure
+                            end
+                        end
+                    end,
+                })
+                assert(response, err)
+                assert(writeErr == nil, writeErr)
+                assert(response:http_status_code() == 200, encoding .. ": the server could not decode the body")
+                assert(response:read_chunked_content() == table.concat(pieces), encoding .. ": echo differs")
+            end
+        end,
+    },
+    {
+        name = "happy-eyeballs-races-past-a-blackholed-address",
+        run = function()
+            if not test.happy_eyeballs_port then
+                return "localhost does not resolve to both ::1 and 127.0.0.1"
+            end
+            local delay = 150
+            local client = corehttp.new_client("http", "localhost", test.happy_eyeballs_port, {
+                happy_eyeballs = true,
+                connection_attempt_delay = delay,
+                connect_timeout = 5000,
+            })
+            local response <close>, _, err = client:request("/small", "GET")
+            assert(response, err)
+            assert(#response:read_content() == 64)
+            -- the second family only starts after the attempt delay, the blackholed attempt never completes
+            local connect = response:timings().connect
+            assert(connect >= delay * 1000 * 0.9, "connected after " .. connect .. "us, before the attempt delay")
+            assert(connect < 1000 * 1000, "connected after " .. connect .. "us, the race did not start in time")
+
+            -- trying the addresses one after another waits on the blackholed one until connect_timeout
+            local sequential = corehttp.new_client("http", "localhost", test.happy_eyeballs_port, {
+                tcp_nodelay = true, -- native connector
+                connect_timeout = 300,
+            })
+            local stalled, stalledErr = sequential:request("/small", "GET")
+            assert(stalled == nil, "the blackholed address was connected")
+            assert(tostring(stalledErr):find("timed out", 1, true), stalledErr)
+        end,
+    },
+    {
+        -- last case: the background workers stay busy with the slow server after it returned
+        name = "hedge-wins-while-the-async-workers-are-busy",
+        run = function()
+            local client = corehttp.new_client("http", "127.0.0.1", test.http_port)
+            local backup = corehttp.new_client("http", "127.0.0.1", test.other_http_port)
+            local slow = "/delay/" .. test.http_port .. "/3000"
+            local busy = {}
+            for i = 1, 4 do -- every worker of the default pool waits on the slow server
+                busy[i] = assert(client:request_async(slow, "GET"))
+            end
+            local started = os.time()
+            local response <close>, _, err = client:request(slow, "GET", { hedge = { after_ms = 20, client = backup } })
+            assert(response, err)
+            assert(os.time() - started <= 1, "the hedged attempts waited for a background worker")
+            assert(response:headers()["X-Served-By"] == tostring(test.other_http_port), "the slow attempt won")
+            assert(#response:read_content() == 64)
+        end,
+    },
+}
+
+local failed = 0
+for _, case in ipairs(cases) do
+    if not filter or case.name:find(filter, 1, true) then
+        local ok, err = pcall(case.run)
+        local status = not ok and "FAIL" or err and "skip" or "ok"
+        print(string.format("%-4s %s%s", status, case.name, err and ": " .. tostring(err) or ""))
+        if not ok then
+            failed = failed + 1
+        end
+    end
+end
+if failed > 0 then
+    error(failed .. " test case(s) failed")
+end